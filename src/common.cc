@@ -71,6 +71,25 @@ uint64_t now_micros() {
   return t;
 }
 
+uint64_t now_nanos() {
+  uint64_t t;
+
+#if defined(__linux) && defined(PRELOAD_USE_CLOCK_GETTIME)
+  struct timespec tp;
+
+  clock_gettime(CLOCK_MONOTONIC, &tp);
+  t = static_cast<uint64_t>(tp.tv_sec) * 1000000000;
+  t += tp.tv_nsec;
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  t = timeval_to_micros(&tv) * 1000;
+#endif
+
+  return t;
+}
+
 uint64_t now_micros_coarse() {
   uint64_t t;
 
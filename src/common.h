@@ -54,6 +54,9 @@ int my_cpu_cores();
 /* get the current time in us. */
 uint64_t now_micros();
 
+/* get the current time in ns. */
+uint64_t now_nanos();
+
 /* get the current time in us with fast but coarse-grained timestamps. */
 uint64_t now_micros_coarse();
 
@@ -106,6 +109,13 @@ inline int getr(int min, int max) {
       min);
 }
 
+/* same as getr(), but with caller-owned state so threads may call it at once */
+inline int getr_r(unsigned int* seed, int min, int max) {
+  const double r = static_cast<double>(rand_r(seed));
+  return static_cast<int>(
+      (r / (static_cast<double>(RAND_MAX) + 1)) * (max - min + 1) + min);
+}
+
 inline int pthread_cv_notifyall(pthread_cond_t* cv) {
   errno = 0;
   int r = pthread_cond_broadcast(cv);
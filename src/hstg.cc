@@ -82,6 +82,17 @@ void hstg_add(hstg_t& h, double d) {
   h[3] += d;              /* sum */
 }
 
+void hstg_merge(const hstg_t& src, hstg_t& dst) {
+  if (src[0] < 1.0) return;
+  for (int b = 0; b < MON_NUM_BUCKETS; b++) {
+    dst[4 + b] += src[4 + b];
+  }
+  dst[0] += src[0];                     /* num */
+  if (dst[1] < src[1]) dst[1] = src[1]; /* max */
+  if (dst[2] > src[2]) dst[2] = src[2]; /* min */
+  dst[3] += src[3];                     /* sum */
+}
+
 double hstg_ptile(const hstg_t& h, double p) {
   double threshold = h[0] * (p / 100.0);
   double sum = 0;
@@ -40,6 +40,7 @@ typedef double(hstg_t)[MON_NUM_BUCKETS + 4];
 void hstg_reset_min(hstg_t& h);
 void hstg_reduce(const hstg_t& src, hstg_t& sum, MPI_Comm);
 void hstg_add(hstg_t& h, double d);
+void hstg_merge(const hstg_t& src, hstg_t& dst);
 
 double hstg_ptile(const hstg_t& h, double p);
 double hstg_num(const hstg_t& h);
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "lhstg.h"
+
+#include "common.h"
+
+#include <vector>
+
+namespace {
+/* lowest value and width of a given bucket */
+inline uint64_t bucket_low(const lhstg_t* h, int i) {
+  if (i < (1 << h->p)) return static_cast<uint64_t>(i);
+  const int shift = (i >> h->p) - 1;
+  return static_cast<uint64_t>(i - (shift << h->p)) << shift;
+}
+
+inline uint64_t bucket_width(const lhstg_t* h, int i) {
+  if (i < (1 << h->p)) return 1;
+  return uint64_t(1) << ((i >> h->p) - 1);
+}
+}  // namespace
+
+void lhstg_init(lhstg_t* h, int p) {
+  if (p < LHSTG_MIN_PRECISION) p = LHSTG_MIN_PRECISION;
+  if (p > LHSTG_MAX_PRECISION) p = LHSTG_MAX_PRECISION;
+  h->p = p;
+  h->nb = (LHSTG_MAX_BITS - p + 1) << p;
+  h->b = static_cast<uint64_t*>(calloc(h->nb, sizeof(uint64_t)));
+  if (h->b == NULL) ABORT("malloc");
+  h->num = h->sum = 0;
+}
+
+void lhstg_destroy(lhstg_t* h) {
+  free(h->b);
+  h->b = NULL;
+}
+
+void lhstg_reset(lhstg_t* h) {
+  memset(h->b, 0, h->nb * sizeof(uint64_t));
+  h->num = h->sum = 0;
+}
+
+void lhstg_merge(const lhstg_t* src, lhstg_t* dst) {
+  if (src->p != dst->p) ABORT("lhstg precision mismatch");
+  for (int i = 0; i < dst->nb; i++) {
+    dst->b[i] += src->b[i];
+  }
+  dst->num += src->num;
+  dst->sum += src->sum;
+}
+
+void lhstg_subtract(const lhstg_t* src, lhstg_t* dst) {
+  if (src->p != dst->p) ABORT("lhstg precision mismatch");
+  for (int i = 0; i < dst->nb; i++) {
+    dst->b[i] -= src->b[i];
+  }
+  dst->num -= src->num;
+  dst->sum -= src->sum;
+}
+
+void lhstg_allreduce(lhstg_t* h, int n, MPI_Comm comm) {
+  std::vector<uint64_t> tmp;
+  size_t len;
+  size_t off;
+  int i;
+
+  len = 0;
+  for (i = 0; i < n; i++) len += h[i].nb + 2;
+  tmp.resize(len);
+  off = 0;
+  for (i = 0; i < n; i++) { /* buckets, num, sum of each histogram in turn */
+    memcpy(&tmp[off], h[i].b, h[i].nb * sizeof(uint64_t));
+    off += h[i].nb;
+    tmp[off++] = h[i].num;
+    tmp[off++] = h[i].sum;
+  }
+  MPI_Allreduce(MPI_IN_PLACE, &tmp[0], int(len), MPI_UINT64_T, MPI_SUM, comm);
+  off = 0;
+  for (i = 0; i < n; i++) {
+    memcpy(h[i].b, &tmp[off], h[i].nb * sizeof(uint64_t));
+    off += h[i].nb;
+    h[i].num = tmp[off++];
+    h[i].sum = tmp[off++];
+  }
+}
+
+uint64_t lhstg_ptile(const lhstg_t* h, double p) {
+  const double threshold = h->num * (p / 100.0);
+  double sum = 0;
+  if (h->num == 0) return 0;
+  for (int i = 0; i < h->nb; i++) {
+    sum += h->b[i];
+    if (sum >= threshold && h->b[i] != 0) {
+      return bucket_low(h, i) + bucket_width(h, i) / 2;
+    }
+  }
+
+  return lhstg_max(h);
+}
+
+uint64_t lhstg_max(const lhstg_t* h) {
+  for (int i = h->nb - 1; i >= 0; i--) {
+    if (h->b[i] != 0) {
+      return bucket_low(h, i) + bucket_width(h, i) - 1;
+    }
+  }
+
+  return 0;
+}
+
+double lhstg_avg(const lhstg_t* h) {
+  if (h->num == 0) return 0;
+  return double(h->sum) / h->num;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <mpi.h>
+#include <stdint.h>
+
+/*
+ * log-linear histogram (in the style of hdr histograms): each value below
+ * 2^p gets its own bucket, and each power-of-2 range above that is split
+ * into 2^p equal-width buckets, where p is the precision in bits. the
+ * relative error of a recorded value is therefore at most 2^-p. buckets
+ * are plain counters: a histogram written by a single thread needs no
+ * synchronization, and histograms are merged and reduced bucket by bucket.
+ */
+#define LHSTG_MAX_BITS 48 /* larger values are clamped to 2^48-1 */
+#define LHSTG_MIN_PRECISION 1
+#define LHSTG_MAX_PRECISION 10
+
+typedef struct lhstg {
+  uint64_t* b;  /* buckets */
+  uint64_t num; /* num of values */
+  uint64_t sum; /* sum of values */
+  int nb;       /* num of buckets */
+  int p;        /* precision bits */
+} lhstg_t;
+
+/* histogram api */
+void lhstg_init(lhstg_t* h, int p);
+void lhstg_destroy(lhstg_t* h);
+void lhstg_reset(lhstg_t* h);
+
+inline int lhstg_index(const lhstg_t* h, uint64_t v) {
+  const uint64_t lim = (uint64_t(1) << LHSTG_MAX_BITS) - 1;
+  if (v > lim) v = lim;
+  const int msb = 63 - __builtin_clzll(v | 1);
+  const int shift = (msb > h->p) ? msb - h->p : 0;
+  return (shift << h->p) + static_cast<int>(v >> shift);
+}
+
+inline void lhstg_add(lhstg_t* h, uint64_t v) {
+  h->b[lhstg_index(h, v)]++;
+  h->num++;
+  h->sum += v;
+}
+
+/* same as lhstg_add() but safe to call from multiple threads */
+inline void lhstg_add_atomic(lhstg_t* h, uint64_t v) {
+  __sync_fetch_and_add(&h->b[lhstg_index(h, v)], 1);
+  __sync_fetch_and_add(&h->num, 1);
+  __sync_fetch_and_add(&h->sum, v);
+}
+
+/* dst += src, or dst -= src. both must have the same precision. */
+void lhstg_merge(const lhstg_t* src, lhstg_t* dst);
+void lhstg_subtract(const lhstg_t* src, lhstg_t* dst);
+/* sum n histograms over all ranks of a communicator in place using a single
+ * MPI_Allreduce */
+void lhstg_allreduce(lhstg_t* h, int n, MPI_Comm comm);
+
+/* value at a given percentile (0 to 100), at bucket precision */
+uint64_t lhstg_ptile(const lhstg_t* h, double p);
+/* max value, at bucket precision */
+uint64_t lhstg_max(const lhstg_t* h);
+double lhstg_avg(const lhstg_t* h);
@@ -0,0 +1,170 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "membudget.h"
+
+#include "common.h"
+#include "nn_shuffler.h"
+#include "preload.h"
+
+#include <ctype.h>
+
+#include <algorithm>
+
+size_t membudget_parse(const char* str) {
+  char* end;
+  double v;
+
+  v = strtod(str, &end);
+  if (end == str || v < 0) return 0;
+  switch (toupper(*end)) {
+    case 'T':
+      v *= 1024.0;
+      /* fall through */
+    case 'G':
+      v *= 1024.0;
+      /* fall through */
+    case 'M':
+      v *= 1024.0;
+      /* fall through */
+    case 'K':
+      v *= 1024.0;
+      end++;
+      break;
+    case 0:
+      return size_t(v);
+    default:
+      return 0;
+  }
+  if (*end == 'i') end++;
+  if (*end == 'B') end++;
+  if (*end != 0) return 0;
+
+  return size_t(v);
+}
+
+namespace {
+size_t env_size(const char* key, const char* def) {
+  const char* env = maybe_getenv(key);
+  size_t rv = (env != NULL) ? membudget_parse(env) : 0;
+  return rv != 0 ? rv : membudget_parse(def);
+}
+}  // namespace
+
+void membudget_init(membudget_t* mb, size_t total, int world_sz, int nrecvs,
+                    int is_receiver) {
+  size_t demand[MB_NPARTS];
+  int fixed[MB_NPARTS];
+  const char* env;
+  size_t left;
+  double sum;
+  int parts;
+
+  memset(mb, 0, sizeof(membudget_t));
+  mb->total = total;
+  if (total == 0) return;
+
+  /* two buffers per send queue (one per receiver), and about one rpc of
+   * incoming data in flight from each peer */
+  env = maybe_getenv("SHUFFLE_Buffer_per_queue");
+  fixed[MB_QUEUES] = env != NULL;
+  demand[MB_QUEUES] = size_t(nrecvs) * 2 *
+                      (env != NULL ? atoi(env) : DEFAULT_BUFFER_PER_QUEUE);
+  fixed[MB_DELIVERY] = 0;
+  demand[MB_DELIVERY] =
+      is_receiver ? size_t(world_sz) * DEFAULT_BUFFER_PER_QUEUE : 0;
+  env = maybe_getenv("PLFSDIR_Memtable_size");
+  fixed[MB_MEMTABLES] = env != NULL;
+  demand[MB_MEMTABLES] =
+      is_receiver ? env_size("PLFSDIR_Memtable_size", DEFAULT_MEMTABLE_SIZE)
+                  : 0;
+  /* dir buffers are sized for the storage rather than for the memory */
+  fixed[MB_DIRBUFS] = 1;
+  demand[MB_DIRBUFS] = 0;
+  if (is_receiver) {
+    env = maybe_getenv("PLFSDIR_Lg_parts");
+    parts = 1 << atoi(env != NULL ? env : DEFAULT_LG_PARTS);
+    demand[MB_DIRBUFS] =
+        parts * (env_size("PLFSDIR_Compaction_buf_size",
+                          DEFAULT_COMPACTION_BUF) +
+                 env_size("PLFSDIR_Index_buf_size", DEFAULT_INDEX_BUF)) +
+        env_size("PLFSDIR_Data_buf_size", DEFAULT_DATA_BUF);
+  }
+
+  /* writes held back while an epoch is flushed in the background */
+  env = maybe_getenv("PRELOAD_Async_defer_size");
+  fixed[MB_DEFERRED] = env != NULL;
+  demand[MB_DEFERRED] = 0;
+  env = maybe_getenv("PRELOAD_Async_epochs");
+  if (is_receiver && env != NULL && atoi(env) > 0) {
+    demand[MB_DEFERRED] =
+        env_size("PRELOAD_Async_defer_size", DEFAULT_DEFER_BUF);
+  }
+
+  /* consumers sized by their own knobs are granted what they ask for, and
+   * the rest is split among the others */
+  mb->slack = total >> MB_SLACK_SHIFT;
+  left = total - mb->slack;
+  sum = 0;
+  for (int i = 0; i < MB_NPARTS; i++) {
+    if (fixed[i]) {
+      mb->share[i] = std::min(demand[i], left);
+      left -= mb->share[i];
+    } else {
+      sum += demand[i];
+    }
+  }
+  for (int i = 0; i < MB_NPARTS; i++) {
+    if (!fixed[i] && sum != 0) {
+      mb->share[i] = size_t(left * (demand[i] / sum));
+    }
+  }
+}
+
+size_t membudget_lend(membudget_t* mb, size_t sz) {
+  sz = std::min(sz, mb->slack - mb->lent);
+  mb->lent += sz;
+  mb->share[MB_QUEUES] += sz;
+  return sz;
+}
+
+size_t membudget_reclaim(membudget_t* mb, size_t sz) {
+  sz = std::min(sz, mb->lent);
+  mb->lent -= sz;
+  mb->share[MB_QUEUES] -= sz;
+  return sz;
+}
+
+const char* membudget_name(int part) {
+  static const char* const names[MB_NPARTS] = {
+      "send queues", "delivery", "memtables", "dir buffers", "deferred writes"};
+  return (part >= 0 && part < MB_NPARTS) ? names[part] : "other";
+}
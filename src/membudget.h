@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * membudget: a single per-rank memory budget split among the main memory
+ * consumers of the preload lib. at init, each consumer is given a demand
+ * based on what it would use by default, which depends on the world size
+ * (the num of peers we send to and receive from) and on whether we are a
+ * receiver (only receivers have memtables). after keeping back some slack,
+ * the budget is split in proportion to these demands. consumers whose own
+ * sizing knobs are set keep their settings and only report what they use.
+ *
+ * between epochs, the slack may be lent to the shuffle send queues when
+ * senders stall on them, and is taken back when receivers stall on full
+ * memtables instead. memtables cannot be resized once the plfsdir is
+ * opened, so they keep their init share.
+ */
+enum mb_part {
+  MB_QUEUES = 0, /* shuffle send queues */
+  MB_DELIVERY,   /* shuffle receive buffers and delivery queues */
+  MB_MEMTABLES,  /* plfsdir memtables */
+  MB_DIRBUFS,    /* plfsdir compaction, index, and data buffers */
+  MB_DEFERRED,   /* writes deferred by async epoch flushing */
+  MB_NPARTS
+};
+
+/* fraction of the budget kept back as slack at init (1/8) */
+#define MB_SLACK_SHIFT 3
+
+typedef struct membudget {
+  size_t total;            /* per-rank budget (0 if off) */
+  size_t slack;            /* not granted to any consumer */
+  size_t lent;             /* slack lent to the send queues */
+  size_t share[MB_NPARTS]; /* memory granted to each consumer */
+  size_t used[MB_NPARTS];  /* memory reserved by each consumer */
+} membudget_t;
+
+/* parse a size such as "512MiB", "2G", or "65536". return 0 if the size
+ * is malformed */
+size_t membudget_parse(const char* str);
+
+/* split a budget of total bytes for a rank in a world of a given size
+ * with nrecvs receivers */
+void membudget_init(membudget_t* mb, size_t total, int world_sz, int nrecvs,
+                    int is_receiver);
+
+/* move up to sz bytes of the slack to the send queues, or back. return the
+ * num of bytes moved */
+size_t membudget_lend(membudget_t* mb, size_t sz);
+size_t membudget_reclaim(membudget_t* mb, size_t sz);
+
+/* name of a consumer */
+const char* membudget_name(int part);
@@ -39,21 +39,22 @@
 #include "common.h"
 #include "nn_shuffler.h"
 #include "nn_shuffler_internal.h"
+#include "threadplace.h"
 
+#include <algorithm>
+#include <deque>
 #include <vector>
 
 /*
  * a set of mutex shared among the main thread and the bg shuffle threads.
  */
-static pthread_mutex_t mtx[5] = {
+static pthread_mutex_t mtx[4] = {
     PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
-    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
-    PTHREAD_MUTEX_INITIALIZER};
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER};
 
-static pthread_cond_t cv[5] = {
-    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
+static pthread_cond_t cv[4] = {
     PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER,
-    PTHREAD_COND_INITIALIZER};
+    PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER};
 
 /* used when waiting for all bg threads to terminate */
 static const int bg_cv = 0;
@@ -64,11 +65,8 @@ static const int rpc_cv = 1;
 /* used when waiting for the next available rpc callback slot */
 static const int cb_cv = 2;
 
-/* used when waiting for a busy rpc queue */
-static const int qu_cv = 3;
-
 /* used when waiting for work items */
-static const int wk_cv = 4;
+static const int wk_cv = 3;
 
 /* true iff in shutdown seq */
 static int shutting_down = 0; /* XXX: better if this is atomic */
@@ -76,25 +74,202 @@ static int shutting_down = 0; /* XXX: better if this is atomic */
 /* number of bg threads running */
 static int num_bg = 0;
 
-/* workers */
-static std::vector<void*> wk_items;
-static int num_wk = 0; /* number of worker threads running */
+/*
+ * workers. with more than one worker, the writes of each incoming rpc are
+ * split by the write lane hash and each lane is always handled by the same
+ * worker. this keeps writes to a lane in their arrival order and lets
+ * workers append through different lanes in parallel. there are never more
+ * workers than lanes, so rpcs are only split with multi-lane local logs.
+ */
+typedef struct rpc_item {
+  hg_handle_t h;
+  write_in_t in;
+  unsigned int req_sz;     /* size of each write */
+  unsigned int req_stride; /* distance between writes in buf */
+  char* buf;               /* writes regrouped by worker */
+  int parts_left;      /* number of workers yet to finish their parts */
+  int rv;              /* first error seen by any worker */
+} rpc_item_t;
+typedef struct rpc_part {
+  hg_handle_t h;     /* set when an entire rpc goes to a single worker */
+  rpc_item_t* item;  /* otherwise, the rpc this part belongs to */
+  char* reqs;        /* first write of the part */
+  int num_reqs;      /* number of writes in the part */
+  uint64_t ts;       /* time (us) the part was queued */
+} rpc_part_t;
+typedef struct wkq {
+  pthread_mutex_t mtx; /* protects items */
+  pthread_cond_t cv;   /* signaled when items become non-empty */
+  std::vector<rpc_part_t> items;
+} wkq_t;
+static wkq_t wkqs[MAX_WORKERS + 1];
+static int nwkqs = 0;   /* number of workers configured */
+static int num_wk = 0;  /* number of worker threads running */
+static int num_fwd = 0; /* number of 2-hop forwarders running */
+/* in 2-hop mode, 2-hop rpcs are handled by a dedicated forwarder that uses
+ * the slot after the last worker. it is never shared with workers: the
+ * forwarder may block sending rpcs, while workers must always make progress
+ * so that those rpcs are replied. */
+#define FWD_WORKER MAX_WORKERS
 static size_t items_submitted = 0;
 static size_t items_completed = 0;
 #define MAX_WORK_ITEM 256
 
-/* rpc queue */
+/* wk_backlog: return the number of incoming rpcs not yet processed */
+static uint32_t wk_backlog() {
+  uint32_t rv;
+  pthread_mtx_lock(&mtx[wk_cv]);
+  rv = static_cast<uint32_t>(items_submitted - items_completed);
+  pthread_mtx_unlock(&mtx[wk_cv]);
+  return rv;
+}
+
+/*
+ * rpc queue. each queue has its own lock so writers going to different
+ * destinations never contend with each other. each queue also has two
+ * buffers: writers keep filling one buffer while the other one is being sent.
+ * writers only block when both buffers are busy.
+ */
 static std::vector<int> rpcq_order; /* flush order */
 typedef struct rpcq {
-  uint32_t sz; /* aggregated size of all pending writes */
-  int lepo;    /* epoch number for the last write */
-  int busy;    /* non-zero when queue is locked and is being flushed */
-  char* buf;   /* heap-allocated memory for the queue */
+  pthread_mutex_t mtx; /* protects everything below */
+  pthread_cond_t cv;   /* signaled when an in-flight buffer is returned */
+  uint32_t sz;         /* aggregated size of all pending writes */
+  int lepo;            /* epoch number for the last write */
+  int busy;            /* number of buffers currently being sent */
+  int cur;             /* index of the buffer currently being filled */
+  int inflight[2];     /* non-zero when a buffer is being sent */
+  char* bufs[2];       /* heap-allocated memory for the queue */
+  hg_bulk_t bulks[2];  /* bufs registered for bulk rpcs (if bulk is on) */
+#define RPCQ_BUF(q) ((q)->bufs[(q)->cur])
+  int dst; /* rank the queue is sent to */
+  int fwd; /* non-zero if sent as 2-hop rpcs */
+  /* 2-hop: writes in the fill buffer. the final receiver of the i-th write
+   * is kept as a 2-byte index at the (i+1)-th slot from the buffer's end */
+  uint32_t nfwd;
+  /* adaptive batching */
+  uint32_t thres; /* flush threshold (no greater than rpcq_cap) */
+  uint64_t lfill; /* time the current fill buffer started to fill */
+  double rate;    /* avg fill rate (bytes per us) */
+  double lat;     /* avg rpc reply latency (us) */
+  /* credit-based flow control */
+  uint32_t credits;     /* async rpcs the receiver lets us have in flight */
+  uint32_t outstanding; /* async rpcs sent but not yet replied */
 } rpcq_t;
 static rpcq_t* rpcqs = NULL;
 static size_t max_rpcq_sz = 0; /* buffer size per rpc queue */
+static size_t min_rpcq_sz = 0; /* min flush threshold per rpc queue */
+/* max bytes a queue may hold (no greater than max_rpcq_sz). lowered by the
+ * memory budget to keep queues from touching all of their buffers */
+static size_t rpcq_cap = 0;
 static int nrpcqs = 0;         /* number of queues */
 
+/*
+ * by default there is one queue per rank. in 2-hop mode, there is one queue
+ * per remote node and one per local receiver. writes for a remote node are
+ * all sent to one of its receivers (picked by our own index within our
+ * node so that senders are spread evenly), which then forwards them to
+ * their final ranks through its local queues. the final rank of each write
+ * is chosen by its sender and sent along with it, so forwarders never
+ * consult their own placement.
+ */
+static std::vector<int> rpcq_map; /* 2-hop: rank -> queue */
+static std::vector<uint16_t> agg_lidx; /* 2-hop: rank -> index among the
+                                        * receivers of its node */
+static int agg_nnodes = 0;        /* 2-hop: number of nodes */
+static int agg_node = 0;          /* 2-hop: our node */
+
+/* rpcq_index: return the queue holding writes for a given rank */
+static inline int rpcq_index(int peer_rank) {
+  if (nnctx.agg) {
+    return rpcq_map[peer_rank];
+  } else {
+    return peer_rank;
+  }
+}
+
+/* rpcq_adapt: adjust the flush threshold of an rpc queue after one of its
+ * rpcs has been replied. the goal is to have each rpc carry as many bytes as
+ * the queue is able to fill while a previous rpc is in flight (with a 2x
+ * slack), so writers never find both buffers busy. larger rpcs are also
+ * used when we are short of rpc slots or when the receiver is backlogged.
+ * the threshold is changed by at most a factor of 2 each time. must be
+ * called with the queue locked. */
+static void rpcq_adapt(rpcq_t* rpcq, uint64_t lat, uint32_t qdep,
+                       int slots_left) {
+  double target;
+
+  if (rpcq->lat == 0) {
+    rpcq->lat = lat;
+  } else {
+    rpcq->lat = 0.875 * rpcq->lat + 0.125 * lat;
+  }
+  if (rpcq->rate == 0) { /* not enough info yet */
+    return;
+  }
+  target = 2.0 * rpcq->rate * rpcq->lat;
+  if (slots_left == 0 || qdep >= MAX_WORK_ITEM / 2) {
+    if (target < 2.0 * rpcq->thres) target = 2.0 * rpcq->thres;
+  }
+  if (target > 2.0 * rpcq->thres) target = 2.0 * rpcq->thres;
+  if (target < 0.5 * rpcq->thres) target = 0.5 * rpcq->thres;
+  if (target > rpcq_cap) target = rpcq_cap;
+  if (target < min_rpcq_sz) target = min_rpcq_sz;
+  rpcq->thres = static_cast<uint32_t>(target);
+}
+
+/*
+ * each receiver grants its senders send credits along with every reply,
+ * and a sender may only have as many async rpcs in flight to a queue as
+ * it has been granted. a queue that is out of credits keeps buffering
+ * writes past its flush threshold (up to its full capacity) instead of
+ * being flushed, so writers move on to other queues while a slow receiver
+ * catches up. writers only block on a queue that is both full and out of
+ * credits. credits are off for sync rpcs.
+ */
+static inline int rpcq_has_credit(const rpcq_t* rpcq) {
+  return nnctx.max_credits == 0 || rpcq->outstanding < rpcq->credits;
+}
+
+/* rpcq_limit: return the number of bytes a queue may hold before it must be
+ * flushed. must be called with the queue locked. */
+static inline size_t rpcq_limit(const rpcq_t* rpcq) {
+  return rpcq_has_credit(rpcq) ? rpcq->thres : rpcq_cap;
+}
+
+/*
+ * writes are queued as fixed-sized records by default: a name directly
+ * followed by its data, with neither a size byte nor a '\0' in between. the
+ * record size is sent once per rpc. with SHUFFLE_Size_prefixed_records,
+ * each write is queued as is, preceded by a 1-byte size.
+ */
+static inline size_t rpcq_wire_sz(unsigned char req_sz) {
+  return nnctx.rec_sz != 0 ? size_t(req_sz) - 1 : size_t(req_sz) + 1;
+}
+
+/* rpcq_fwd_note: remember the final rank of the next num_reqs writes of a
+ * 2-hop queue. must be called with the queue locked. */
+static inline void rpcq_fwd_note(rpcq_t* rpcq, int peer_rank, int num_reqs) {
+  const uint16_t idx = agg_lidx[peer_rank];
+  char* const end = RPCQ_BUF(rpcq) + max_rpcq_sz;
+  int k;
+
+  for (k = 0; k < num_reqs; k++) {
+    rpcq->nfwd++;
+    memcpy(end - 2 * size_t(rpcq->nfwd), &idx, 2);
+  }
+}
+
+static inline char* rpcq_encode(char* dst, const char* reqs,
+                                unsigned char req_sz, int num_reqs) {
+  if (nnctx.rec_sz != 0) {
+    return nn_shuffler_encode_fixed(dst, reqs, req_sz, nnctx.shctx->fname_len,
+                                    num_reqs);
+  } else {
+    return nn_shuffler_encode(dst, reqs, req_sz, num_reqs);
+  }
+}
+
 /* rpc callback slots */
 #define MAX_OUTSTANDING_RPC 128 /* hard limit */
 static hg_handle_t hg_hdls[MAX_OUTSTANDING_RPC] = {0};
@@ -102,6 +277,9 @@ static write_async_cb_t cb_slots[MAX_OUTSTANDING_RPC] = {0};
 static int cb_flags[MAX_OUTSTANDING_RPC] = {0};
 static int cb_allowed = 1; /* soft limit */
 static int cb_left = 1;
+/* total rpcs replied. rpc waits that time out only abort if this has not
+ * moved during the entire wait: a slow receiver is not a dead one */
+static uint64_t rpc_replied = 0;
 
 /* per-thread rusage */
 typedef struct rpcu {
@@ -115,8 +293,8 @@ typedef struct rpcu {
 #define RPCU_HGPRO 3
 #define RPCU_WORKER 4
 } rpcu_t;
-/* 0:ALL, 1:main, 2:looper, 3:hg_progress, 4:worker */
-static rpcu_t rpcus[5] = {0};
+/* 0:ALL, 1:main, 2:looper, 3:hg_progress, 4+:workers */
+static rpcu_t rpcus[RPCU_WORKER + MAX_WORKERS + 1] = {0};
 
 static void rpcu_accumulate(nn_rusage_t* r, rpcu_t* u) {
   uint64_t u0, u1, s0, s1;
@@ -188,21 +366,33 @@ void rpc_explain_timeout() {
       "rpc out %d (%d replied), rpc in %d",
       nnctx.my_uname.nodename, pctx.my_rank, mssg_get_rank(nnctx.mssg),
       mssg_get_addr_str(nnctx.mssg, mssg_get_rank(nnctx.mssg)),
-      int(pctx.mctx.nms), int(pctx.mctx.nmd), int(pctx.mctx.nmr));
+      int(mon_cnt_get(MON_NMS)), int(mon_cnt_get(MON_NMD)),
+      int(mon_cnt_get(MON_NMR)));
 }
 }  // namespace
 
+static hg_return_t nn_shuffler_write_rpc_split(hg_handle_t h);
+static int nn_shuffler_write_rpc_part(rpc_part_t* part);
+static hg_return_t nn_shuffler_write_fwd_handler(hg_handle_t h,
+                                                 write_info_t* info);
+
 /* rpc_work(): dedicated thread function to process rpc. each work item
- * represents an incoming rpc (encoding a batch of writes). */
+ * represents an incoming rpc (encoding a batch of writes), or the part of an
+ * incoming rpc whose names hash to the write lanes owned by this worker.
+ * arg is the index of the worker. */
 static void* rpc_work(void* arg) {
+  const int me = static_cast<int>(reinterpret_cast<intptr_t>(arg));
+  wkq_t* const q = &wkqs[me];
+  rpcu_t* const u = &rpcus[RPCU_WORKER + me];
   write_info info;
   size_t total_writes; /* total individual writes processed */
   size_t total_bytes;  /* total rpc msg size */
-  std::vector<void*> todo;
-  std::vector<void*>::iterator it;
-  size_t num_items;
+  std::vector<rpc_part_t> todo;
+  std::vector<rpc_part_t>::iterator it;
+  size_t num_items; /* num rpcs completed since last report */
+  hstg_t iq_dep;
   hg_return_t hret;
-  hg_handle_t h;
+  uint64_t now;
   int s;
 
 #ifndef NDEBUG
@@ -210,7 +400,8 @@ static void* rpc_work(void* arg) {
 #endif
 
   total_writes = total_bytes = 0;
-  hstg_reset_min(nnctx.iq_dep);
+  memset(&iq_dep, 0, sizeof(hstg_t));
+  hstg_reset_min(iq_dep);
   num_items = 0;
 
   /*
@@ -221,13 +412,14 @@ static void* rpc_work(void* arg) {
   todo.reserve(MAX_WORK_ITEM);
 #ifndef NDEBUG
   if (pctx.verr || pctx.my_rank == 0) {
-    snprintf(msg, sizeof(msg), "[bg] rpc worker up (rank %d)", pctx.my_rank);
+    snprintf(msg, sizeof(msg), "[bg] rpc worker %d up (rank %d)", me,
+             pctx.my_rank);
     INFO(msg);
   }
 #endif
 
 #if defined(__linux)
-  rpcu_start(RUSAGE_THREAD, &rpcus[RPCU_WORKER]);
+  rpcu_start(RUSAGE_THREAD, u);
 #endif
 
   while (true) {
@@ -241,31 +433,41 @@ static void* rpc_work(void* arg) {
     num_items = 0;
     s = is_shuttingdown();
     if (s == 0) {
-      pthread_mtx_lock(&mtx[wk_cv]);
-      while (wk_items.empty() && is_shuttingdown() == 0) {
-        pthread_cv_wait(&cv[wk_cv], &mtx[wk_cv]);
+      pthread_mtx_lock(&q->mtx);
+      while (q->items.empty() && is_shuttingdown() == 0) {
+        pthread_cv_wait(&q->cv, &q->mtx);
       }
-      todo.swap(wk_items);
-      pthread_mtx_unlock(&mtx[wk_cv]);
+      todo.swap(q->items);
+      pthread_mtx_unlock(&q->mtx);
       if (!todo.empty()) {
-        num_items = todo.size();
-        hstg_add(nnctx.iq_dep, num_items);
+        hstg_add(iq_dep, todo.size());
+        now = !pctx.nomon ? now_micros() : 0;
         for (it = todo.begin(); it != todo.end(); ++it) {
-          h = static_cast<hg_handle_t>(*it);
-          if (h != NULL) {
-            hret = nn_shuffler_write_rpc_handler(h, &info);
+          if (!pctx.nomon) mon_lat_add(MON_LAT_QWAIT, now - it->ts);
+          if (it->item != NULL) {
+            total_writes += it->num_reqs;
+            total_bytes += size_t(it->num_reqs) * it->item->req_stride;
+            num_items += nn_shuffler_write_rpc_part(&*it);
+          } else if (it->h != NULL) {
+            if (me == FWD_WORKER) {
+              hret = nn_shuffler_write_fwd_handler(it->h, &info);
+            } else {
+              hret = nn_shuffler_write_rpc_handler(it->h, &info);
+            }
             if (hret != HG_SUCCESS) {
               RPC_FAILED("fail to exec rpc", hret);
             }
             total_writes += info.num_writes;
             total_bytes += info.sz;
+            num_items++;
           }
         }
       }
     } else if (s < 0) {
 #ifndef NDEBUG
       if (pctx.verr || pctx.my_rank == 0) {
-        snprintf(msg, sizeof(msg), "[bg] rpc worker will pause ... (rank %d)",
+        snprintf(msg, sizeof(msg),
+                 "[bg] rpc worker %d will pause ... (rank %d)", me,
                  pctx.my_rank);
         INFO(msg);
       }
@@ -277,7 +479,7 @@ static void* rpc_work(void* arg) {
       pthread_mtx_unlock(&mtx[bg_cv]);
 #ifndef NDEBUG
       if (pctx.verr || pctx.my_rank == 0) {
-        snprintf(msg, sizeof(msg), "[bg] rpc worker resumed (rank %d)",
+        snprintf(msg, sizeof(msg), "[bg] rpc worker %d resumed (rank %d)", me,
                  pctx.my_rank);
         INFO(msg);
       }
@@ -288,21 +490,28 @@ static void* rpc_work(void* arg) {
   }
 
 #if defined(__linux)
-  rpcu_end(RUSAGE_THREAD, &rpcus[RPCU_WORKER]);
+  rpcu_end(RUSAGE_THREAD, u);
 #endif
-  rpcu_accumulate(&nnctx.r[RPCU_WORKER], &rpcus[RPCU_WORKER]);
+  rpcu_accumulate(&nnctx.r[RPCU_WORKER + me], u);
 
   pthread_mtx_lock(&mtx[bg_cv]);
-  assert(num_wk > 0);
-  num_wk--;
+  hstg_merge(iq_dep, nnctx.iq_dep);
+  nnctx.total_writes += total_writes;
+  nnctx.total_msgsz += total_bytes;
+  if (me == FWD_WORKER) {
+    assert(num_fwd > 0);
+    num_fwd--;
+  } else {
+    assert(num_wk > 0);
+    num_wk--;
+  }
   pthread_cv_notifyall(&cv[bg_cv]);
   pthread_mtx_unlock(&mtx[bg_cv]);
 
-  nnctx.total_writes = total_writes;
-  nnctx.total_msgsz = total_bytes;
 #ifndef NDEBUG
   if (pctx.verr || pctx.my_rank == 0) {
-    snprintf(msg, sizeof(msg), "[bg] rpc worker down (rank %d)", pctx.my_rank);
+    snprintf(msg, sizeof(msg), "[bg] rpc worker %d down (rank %d)", me,
+             pctx.my_rank);
     INFO(msg);
   }
 #endif
@@ -310,6 +519,17 @@ static void* rpc_work(void* arg) {
   return NULL;
 }
 
+/* wkq_push: add a work item to a given worker's queue */
+static void wkq_push(wkq_t* q, const rpc_part_t& part) {
+  pthread_mtx_lock(&q->mtx);
+  q->items.push_back(part);
+  q->items.back().ts = !pctx.nomon ? now_micros() : 0;
+  if (q->items.size() == 1) {
+    pthread_cv_notifyall(&q->cv);
+  }
+  pthread_mtx_unlock(&q->mtx);
+}
+
 /* nn_shuffler_bgwait: wait for background rpc work execution */
 void nn_shuffler_bgwait() {
   useconds_t delay;
@@ -345,18 +565,219 @@ void nn_shuffler_bgwait() {
 }
 
 /* nn_shuffler_write_rpc_handler_wrapper: server-side rpc handler wrapper */
+/*
+ * bulk rpcs. instead of the payload itself, a bulk rpc carries an HG_Bulk
+ * handle for the sender's rpc queue buffer, which stays in flight until
+ * the rpc is replied. receivers pull payloads into a fixed set of buffers
+ * registered at init time so no memory is registered per rpc. rpcs that
+ * arrive when all buffers are taken wait for one to be returned. 2-hop
+ * rpcs use a pool of their own: the forwarder may block holding their
+ * buffers, and that must not keep regular rpcs from being received.
+ */
+typedef struct bulkbuf {
+  char* buf;
+  hg_bulk_t hdl;
+  int pool;
+} bulkbuf_t;
+typedef struct bulkpool {
+  std::vector<bulkbuf_t*> free;
+  std::deque<hg_handle_t> waiting; /* rpcs waiting for a buffer */
+} bulkpool_t;
+typedef struct bulk_pull {
+  hg_handle_t h;
+  write_in_t in;
+  bulkbuf_t* b;
+} bulk_pull_t;
+static pthread_mutex_t bulk_mtx; /* protects bulkpools */
+static bulkpool_t bulkpools[2];
+static bulkbuf_t* bulkbufs = NULL;
+static int nbulkbufs = 0;
+static size_t bulk_sz = 0; /* size of each buffer */
+
+/* wk_credits: return the send credits granted to a sender along with a
+ * reply. credits are proportional to our free buffer space, as given by the
+ * room left in our work queues and, when bulk rpcs are on, the free buffers
+ * of our bulk pool: from nnctx.max_credits when idle down to 1 when full,
+ * so no sender is ever left without a credit. */
+static uint32_t wk_credits(uint32_t qdep) {
+  uint32_t c;
+  uint32_t c2;
+  size_t n;
+
+  if (nnctx.max_credits == 0) return 0;
+  if (qdep > MAX_WORK_ITEM) qdep = MAX_WORK_ITEM;
+  c = 1 + (nnctx.max_credits - 1) * (MAX_WORK_ITEM - qdep) / MAX_WORK_ITEM;
+  if (nbulkbufs != 0) {
+    n = nbulkbufs / (nnctx.agg ? 2 : 1);
+    pthread_mtx_lock(&bulk_mtx);
+    c2 = 1 + (nnctx.max_credits - 1) * bulkpools[0].free.size() / n;
+    pthread_mtx_unlock(&bulk_mtx);
+    if (c2 < c) c = c2;
+  }
+
+  return c;
+}
+
+static void bulk_start(hg_handle_t h, bulkbuf_t* b);
+
+/* bulk_pulled: called once the payload of a bulk rpc has arrived. the
+ * buffer is attached to the rpc handle, and the rpc is then handled as if
+ * the payload had come with it. */
+static hg_return_t bulk_pulled(const struct hg_cb_info* info) {
+  bulk_pull_t* const p = static_cast<bulk_pull_t*>(info->arg);
+  const hg_handle_t h = p->h;
+  hg_return_t hret;
+
+  assert(info->type == HG_CB_BULK);
+  if (info->ret != HG_SUCCESS) {
+    RPC_FAILED("HG_Bulk_transfer", info->ret);
+  }
+  HG_Free_input(h, &p->in);
+  hret = HG_Set_data(h, p->b, NULL);
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("HG_Set_data", hret);
+  }
+  free(p);
+  __sync_fetch_and_add(&nnctx.total_bulks, 1);
+  if (HG_Get_info(h)->id == nnctx.hg_fwd_bulk_id) {
+    return nn_shuffler_write_fwd_handler_wrapper(h);
+  } else {
+    return nn_shuffler_write_rpc_handler_wrapper(h);
+  }
+}
+
+/* bulk_start: start pulling the payload of a bulk rpc into a given
+ * buffer */
+static void bulk_start(hg_handle_t h, bulkbuf_t* b) {
+  bulk_pull_t* p;
+  hg_return_t hret;
+
+  p = static_cast<bulk_pull_t*>(malloc(sizeof(bulk_pull_t)));
+  if (p == NULL) ABORT("malloc");
+  p->h = h;
+  p->b = b;
+  p->in.msg = NULL;
+  p->in.bulk = HG_BULK_NULL;
+  hret = HG_Get_input(h, &p->in);
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("HG_Get_input", hret);
+  }
+  if (p->in.sz > bulk_sz) {
+    ABORT("bulk rpc overflow");
+  }
+  hret = HG_Bulk_transfer(nnctx.hg_ctx, bulk_pulled, p, HG_BULK_PULL,
+                          HG_Get_info(h)->addr, p->in.bulk, 0, b->hdl, 0,
+                          p->in.sz, HG_OP_ID_IGNORE);
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("HG_Bulk_transfer", hret);
+  }
+}
+
+/* bulk_put: return a buffer to its pool, handing it to the next rpc
+ * waiting for one if there is any */
+static void bulk_put(bulkbuf_t* b) {
+  bulkpool_t* const pool = &bulkpools[b->pool];
+  hg_handle_t h;
+
+  pthread_mtx_lock(&bulk_mtx);
+  if (pool->waiting.empty()) {
+    pool->free.push_back(b);
+    pthread_mtx_unlock(&bulk_mtx);
+  } else {
+    h = pool->waiting.front();
+    pool->waiting.pop_front();
+    pthread_mtx_unlock(&bulk_mtx);
+    bulk_start(h, b);
+  }
+}
+
+/* nn_shuffler_write_bulk_handler_wrapper: server-side bulk rpc handler
+ * wrapper. never blocks: rpcs are parked when no buffer is available. */
+hg_return_t nn_shuffler_write_bulk_handler_wrapper(hg_handle_t h) {
+  bulkpool_t* const pool =
+      &bulkpools[HG_Get_info(h)->id == nnctx.hg_fwd_bulk_id ? 1 : 0];
+  bulkbuf_t* b;
+
+  pthread_mtx_lock(&bulk_mtx);
+  if (pool->free.empty()) {
+    pool->waiting.push_back(h);
+    pthread_mtx_unlock(&bulk_mtx);
+    return HG_SUCCESS;
+  }
+  b = pool->free.back();
+  pool->free.pop_back();
+  pthread_mtx_unlock(&bulk_mtx);
+  bulk_start(h, b);
+
+  return HG_SUCCESS;
+}
+
+/* nn_shuffler_get_input: HG_Get_input() for incoming rpcs. for bulk rpcs,
+ * msg is set to the buffer the payload has been pulled into. */
+static hg_return_t nn_shuffler_get_input(hg_handle_t h, write_in_t* in) {
+  bulkbuf_t* const b =
+      nnctx.bulk_thres != 0 ? static_cast<bulkbuf_t*>(HG_Get_data(h)) : NULL;
+  hg_return_t hret;
+
+  in->bulk = HG_BULK_NULL;
+  hret = HG_Get_input(h, in);
+  if (hret == HG_SUCCESS && b != NULL) {
+    in->msg = b->buf;
+  }
+  return hret;
+}
+
+/* nn_shuffler_free_input: HG_Free_input() for incoming rpcs. the payload
+ * buffer of a bulk rpc is returned to its pool. */
+static void nn_shuffler_free_input(hg_handle_t h, write_in_t* in) {
+  bulkbuf_t* const b =
+      nnctx.bulk_thres != 0 ? static_cast<bulkbuf_t*>(HG_Get_data(h)) : NULL;
+
+  HG_Free_input(h, in);
+  if (b != NULL) {
+    HG_Set_data(h, NULL, NULL);
+    bulk_put(b);
+  }
+}
+
 hg_return_t nn_shuffler_write_rpc_handler_wrapper(hg_handle_t h) {
+  rpc_part_t part;
   if (num_wk == 0) {
     return nn_shuffler_write_rpc_handler(h, NULL);
+  } else if (nwkqs > 1) {
+    return nn_shuffler_write_rpc_split(h);
   }
   pthread_mtx_lock(&mtx[wk_cv]);
-  wk_items.push_back(static_cast<void*>(h));
-  if (wk_items.size() == 1) {
-    pthread_cv_notifyall(&cv[wk_cv]);
+  items_submitted++;
+  pthread_mtx_unlock(&mtx[wk_cv]);
+
+  part.h = h;
+  part.item = NULL;
+  part.reqs = NULL;
+  part.num_reqs = 0;
+  wkq_push(&wkqs[0], part);
+
+  return HG_SUCCESS;
+}
+
+/* nn_shuffler_write_fwd_handler_wrapper: server-side 2-hop rpc handler
+ * wrapper. 2-hop rpcs are always handed to the forwarder since forwarding
+ * may block and the thread running this wrapper must not. */
+hg_return_t nn_shuffler_write_fwd_handler_wrapper(hg_handle_t h) {
+  rpc_part_t part;
+  if (num_fwd == 0) {
+    return nn_shuffler_write_fwd_handler(h, NULL);
   }
+  pthread_mtx_lock(&mtx[wk_cv]);
   items_submitted++;
   pthread_mtx_unlock(&mtx[wk_cv]);
 
+  part.h = h;
+  part.item = NULL;
+  part.reqs = NULL;
+  part.num_reqs = 0;
+  wkq_push(&wkqs[FWD_WORKER], part);
+
   return HG_SUCCESS;
 }
 
@@ -384,27 +805,25 @@ void nn_shuffler_debug(int src, int dst, int me, int hp) {
 }
 }  // namespace
 
-/* nn_shuffler_write_rpc_handler: server-side rpc handler */
-hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
-  /* here we assume we will only get called by a single thread.
-   * this thread is either a dedicated mercury progressing thread, or a separate
-   * rpc worker thread. */
-  static char buf[MAX_RPC_MESSAGE];
-
+namespace {
+/* nn_shuffler_decode: verify an incoming rpc msg and locate the writes it
+ * carries. all writes within a msg have the same size, so they can be
+ * handed over as a single batch straight from the rpc input buffer: the
+ * i-th write is found at *reqs + i * *req_stride. fixed-sized records are
+ * left as is, one byte short of a full request (no '\0' after each name).
+ * packed msgs are first restored into *scratch, and so are fixed-sized
+ * records of 2-hop msgs (fwd), whose writes may be for any rank on our node
+ * and are forwarded as full requests. return the number of writes found. */
+int nn_shuffler_decode(write_in_t* in, std::vector<char>* scratch,
+                       char** reqs, unsigned int* req_sz,
+                       unsigned int* req_stride, int fwd) {
   char* input;
   uint32_t input_left;
-  hg_return_t hret;
-  write_out_t write_out;
-  write_in_t write_in;
-  write_info_t write_info;
   char* req;
-  unsigned int req_sz;
-  int epoch;
-  int src;
-  int dst;
+  int num_reqs;
   int target_rank;
   int rank;
-  int rv;
+  int i;
 
 #ifndef NDEBUG
   char msg[200];
@@ -414,89 +833,419 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
   assert(nnctx.mssg != NULL);
   rank = mssg_get_rank(nnctx.mssg);
 
-  write_in.msg = buf;
-  write_in.sz = 0;
-
-  hret = HG_Get_input(h, &write_in);
-  if (hret != HG_SUCCESS) {
-    RPC_FAILED("HG_Get_input", hret);
-  }
-
   shuffle_msg_received();
-  if (write_in.hash_sig != nn_shuffler_maybe_hashsig(&write_in)) {
+  if (in->hash_sig != nn_shuffler_maybe_hashsig(in)) {
     ABORT("rpc msg corrupted (hash_sig mismatch)");
   }
 
-  dst = write_in.dst;
-  src = write_in.src;
-  if (dst != rank) {
+  if (in->dst != rank) {
     ABORT("rpc msg misrouted (bad dst)");
   }
 #ifndef NDEBUG
   /* write trace if we are in testing mode */
   if (pctx.testin) {
     if (pctx.logfd != -1) {
-      n = snprintf(msg, sizeof(msg), "[IN] %u bytes r%d << r%d\n", write_in.sz,
-                   dst, src);
+      n = snprintf(msg, sizeof(msg), "[IN] %u bytes r%d << r%d\n", in->sz,
+                   in->dst, in->src);
       n = write(pctx.logfd, msg, n);
 
       errno = 0;
     }
   }
 #endif
-  write_out.rv = 0;
-  input_left = write_info.sz = write_in.sz;
-  epoch = write_in.epo;
-  write_info.num_writes = 0;
-  input = buf;
+  if (in->fwd_sz > in->sz || in->fwd_sz % 2 != 0 || (!fwd && in->fwd_sz != 0)) {
+    ABORT("rpc msg corrupted (bad fwd_sz)");
+  }
+  input_left = in->sz - in->fwd_sz;
+  input = static_cast<char*>(in->msg);
+  if (in->packed) {
+    uint64_t t0 = now_micros();
+    scratch->resize(shuffle_msg_unpacked_size(nnctx.shctx, input, input_left));
+    shuffle_msg_unpack(nnctx.shctx, input, input_left, &(*scratch)[0]);
+    mon_cnt_add(MON_UNZMICROS, now_micros() - t0);
+    input_left = scratch->size();
+    input = &(*scratch)[0];
+  } else if (in->rec_sz != 0) {
+    if (in->rec_sz <= nnctx.shctx->fname_len || in->rec_sz > 254 ||
+        input_left % in->rec_sz != 0) {
+      ABORT("unexpected incoming shuffle request size");
+    }
+    if (fwd) {
+      scratch->resize(size_t(input_left / in->rec_sz) * (in->rec_sz + 2));
+      input_left = nn_shuffler_expand(&(*scratch)[0], input, input_left,
+                                      in->rec_sz, nnctx.shctx->fname_len);
+      input = &(*scratch)[0];
+    }
+  }
+
+  if (in->rec_sz != 0 && !in->packed && !fwd) {
+    num_reqs = int(input_left / in->rec_sz);
+    *reqs = input;
+    *req_sz = in->rec_sz;
+    *req_stride = in->rec_sz;
+  } else {
+    num_reqs = nn_shuffler_frames(input, input_left, reqs, req_sz);
+    *req_stride = *req_sz + 1;
+  }
+  if (nnctx.paranoid_checks) {
+    for (i = 0; i < num_reqs; i++) {
+      req = *reqs + size_t(i) * *req_stride;
+      target_rank = shuffle_target(nnctx.shctx, req, *req_sz);
+      if (fwd ? rpcq_index(target_rank) < agg_nnodes : rank != target_rank) {
+        nn_shuffler_debug(in->src, in->dst, rank, target_rank);
+        ABORT("rpc msg misdirected");
+      }
+    }
+  }
+
+  return num_reqs;
+}
+}  // namespace
+
+/* nn_shuffler_expand: restore a msg of fixed-sized records (rec_sz bytes
+ * each, a name of fname_len bytes directly followed by its data) into *out
+ * as writes each preceded by a 1-byte size and with a '\0' after each
+ * name. *out must have room for 2 more bytes per record. return the size of
+ * the restored msg. */
+uint32_t nn_shuffler_expand(char* out, const char* input, uint32_t input_left,
+                            uint32_t rec_sz, unsigned char fname_len) {
+  const size_t rest = rec_sz - fname_len;
+  char* const start = out;
+
+  assert(rec_sz > fname_len && rec_sz <= 254);
+  for (; input_left >= rec_sz; input_left -= rec_sz) {
+    out[0] = static_cast<char>(rec_sz + 1);
+    memcpy(out + 1, input, fname_len);
+    out[1 + fname_len] = 0;
+    memcpy(out + 2 + fname_len, input + fname_len, rest);
+    out += rec_sz + 2;
+    input += rec_sz;
+  }
+
+  return static_cast<uint32_t>(out - start);
+}
+
+/* nn_shuffler_frames: walk through a msg of writes each preceded by a 1-byte
+ * size, checking that all writes have the same size. */
+int nn_shuffler_frames(char* input, uint32_t input_left, char** reqs,
+                       unsigned int* req_sz) {
+  int num_reqs;
 
-  /* decode and execute writes */
+  *req_sz = 0;
+  *reqs = input + 1;
+  num_reqs = 0;
   while (input_left != 0) {
     if (input_left < 1) {
       ABORT("premature end of msg");
     }
-    req_sz = static_cast<unsigned char>(input[0]);
+    if (num_reqs == 0) {
+      *req_sz = static_cast<unsigned char>(input[0]);
+    } else if (*req_sz != static_cast<unsigned char>(input[0])) {
+      ABORT("unexpected incoming shuffle request size");
+    }
     input_left -= 1;
     input += 1;
-    if (input_left < req_sz) {
+    if (input_left < *req_sz) {
       ABORT("premature end of msg");
     }
-    req = input;
-    input_left -= req_sz;
-    input += req_sz;
+    input_left -= *req_sz;
+    input += *req_sz;
 
-    if (nnctx.paranoid_checks) {
-      target_rank = shuffle_target(nnctx.shctx, req, req_sz);
-      if (rank != target_rank) {
-        nn_shuffler_debug(src, dst, rank, target_rank);
-        ABORT("rpc msg misdirected");
-      }
-    }
+    num_reqs++;
+  }
+
+  return num_reqs;
+}
+
+/* nn_shuffler_write_rpc_handler: server-side rpc handler */
+hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
+  hg_return_t hret;
+  write_out_t write_out;
+  write_in_t write_in;
+  write_info_t write_info;
+  std::vector<char> scratch;
+  char* reqs;
+  unsigned int req_stride;
+  unsigned int req_sz;
+  int num_reqs;
+
+  write_in.msg = NULL; /* decode in place */
+  write_in.sz = 0;
+
+  hret = nn_shuffler_get_input(h, &write_in);
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("HG_Get_input", hret);
+  }
+
+  num_reqs = nn_shuffler_decode(&write_in, &scratch, &reqs, &req_sz,
+                                &req_stride, 0);
+  write_out.rv = 0;
+  write_out.qdep = wk_backlog();
+  write_out.credits = wk_credits(write_out.qdep);
+  write_info.sz = write_in.sz;
+  write_info.num_writes = num_reqs;
+  if (num_reqs != 0) {
+    write_out.rv =
+        shuffle_handle_batch(nnctx.shctx, reqs, req_sz, req_stride, num_reqs,
+                             write_in.epo, write_in.src, write_in.dst);
+  }
+
+  hret = HG_Respond(h, NULL, NULL, &write_out);
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("HG_Respond", hret);
+  }
+  if (info != NULL) {
+    *info = write_info;
+  }
+
+  nn_shuffler_free_input(h, &write_in);
+  HG_Destroy(h);
+
+  return HG_SUCCESS;
+}
+
+/* nn_shuffler_write_fwd_handler: server-side 2-hop rpc handler. writes are
+ * grouped by their final ranks. writes for us are handled right away and
+ * the rest are put into our local rpc queues. the sender is replied once
+ * all writes have been queued. run by the forwarder. */
+static hg_return_t nn_shuffler_write_fwd_handler(hg_handle_t h,
+                                                 write_info_t* info) {
+  const int nlocal = nrpcqs - agg_nnodes;
+  hg_return_t hret;
+  write_out_t write_out;
+  write_in_t write_in;
+  std::vector<char> scratch;
+  std::vector<char> buf;
+  std::vector<int> dst;
+  std::vector<int> off;
+  std::vector<int> pos;
+  const char* fwds;
+  char* reqs;
+  char* req;
+  unsigned int req_stride;
+  unsigned int req_sz;
+  uint16_t idx;
+  int num_reqs;
+  int target;
+  int rank;
+  int rv;
+  int i;
+
+  write_in.msg = NULL; /* decode in place */
+  write_in.sz = 0;
+
+  hret = nn_shuffler_get_input(h, &write_in);
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("HG_Get_input", hret);
+  }
 
-    rv = shuffle_handle(nnctx.shctx, req, req_sz, epoch, src, dst);
-    write_info.num_writes++;
-    if (write_out.rv == 0) {
-      write_out.rv = rv;
+  num_reqs = nn_shuffler_decode(&write_in, &scratch, &reqs, &req_sz,
+                                &req_stride, 1);
+  rank = mssg_get_rank(nnctx.mssg);
+  rv = 0;
+  if (write_in.fwd_sz != 2 * size_t(num_reqs)) {
+    ABORT("rpc msg corrupted (fwd_sz mismatch)");
+  }
+  fwds = static_cast<char*>(write_in.msg) + write_in.sz - write_in.fwd_sz;
+
+  /* counting sort writes by local queue, dropping the size bytes. each
+   * write goes to the receiver its sender picked: our own placement table
+   * may be older or newer than the sender's */
+  dst.resize(num_reqs);
+  off.assign(nlocal + 1, 0);
+  for (i = 0; i < num_reqs; i++) {
+    memcpy(&idx, fwds + 2 * size_t(i), 2);
+    dst[i] = idx;
+    if (dst[i] >= nlocal) {
+      ABORT("rpc msg misrouted (target not local)");
     }
-    if (rv != 0) {
-      break;
+    off[dst[i] + 1]++;
+  }
+  for (i = 0; i < nlocal; i++) {
+    off[i + 1] += off[i];
+  }
+  pos.assign(off.begin(), off.end() - 1);
+  buf.resize(size_t(num_reqs) * req_sz + 1);
+  for (i = 0; i < num_reqs; i++) {
+    memcpy(&buf[size_t(pos[dst[i]]++) * req_sz],
+           reqs + size_t(i) * req_stride, req_sz);
+  }
+
+  for (i = 0; i < nlocal && rv == 0; i++) {
+    if (off[i] == off[i + 1]) continue;
+    req = &buf[size_t(off[i]) * req_sz];
+    target = rpcqs[agg_nnodes + i].dst;
+    if (target == rank) {
+      rv = shuffle_handle_batch(nnctx.shctx, req, req_sz, req_sz,
+                                off[i + 1] - off[i], write_in.epo,
+                                write_in.src, rank);
+    } else {
+      nn_shuffler_enqueue_batch(req, req_sz, off[i + 1] - off[i],
+                                write_in.epo, target, rank);
+      __sync_fetch_and_add(&nnctx.total_fwds, off[i + 1] - off[i]);
     }
   }
 
+  write_out.rv = rv;
+  write_out.qdep = wk_backlog();
+  write_out.credits = wk_credits(write_out.qdep);
   hret = HG_Respond(h, NULL, NULL, &write_out);
   if (hret != HG_SUCCESS) {
     RPC_FAILED("HG_Respond", hret);
   }
   if (info != NULL) {
-    *info = write_info;
+    info->sz = write_in.sz;
+    info->num_writes = num_reqs;
   }
 
-  HG_Free_input(h, &write_in);
+  nn_shuffler_free_input(h, &write_in);
   HG_Destroy(h);
 
   return HG_SUCCESS;
 }
 
+/* nn_shuffler_write_rpc_split: decode an incoming rpc and distribute its
+ * writes among workers by the write lane hash. called by the thread
+ * running mercury rpc handlers. */
+static hg_return_t nn_shuffler_write_rpc_split(hg_handle_t h) {
+  const unsigned char fname_len = nnctx.shctx->fname_len;
+  int owner[MAX_WORKERS];
+  int off[MAX_WORKERS + 1];
+  rpc_part_t parts[MAX_WORKERS];
+  std::vector<unsigned char> w;
+  std::vector<char> scratch;
+  write_out_t write_out;
+  rpc_item_t* item;
+  hg_return_t hret;
+  char* reqs;
+  char* req;
+  unsigned int req_stride;
+  unsigned int req_sz;
+  size_t stride;
+  size_t lead;
+  int num_parts;
+  int num_reqs;
+  int i;
+
+  item = static_cast<rpc_item_t*>(malloc(sizeof(rpc_item_t)));
+  if (item == NULL) ABORT("malloc");
+  item->in.msg = NULL; /* decode in place */
+  item->in.sz = 0;
+
+  hret = nn_shuffler_get_input(h, &item->in);
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("HG_Get_input", hret);
+  }
+
+  num_reqs = nn_shuffler_decode(&item->in, &scratch, &reqs, &req_sz,
+                                &req_stride, 0);
+  if (num_reqs == 0) {
+    write_out.rv = 0;
+    write_out.qdep = wk_backlog();
+    write_out.credits = wk_credits(write_out.qdep);
+    hret = HG_Respond(h, NULL, NULL, &write_out);
+    if (hret != HG_SUCCESS) {
+      RPC_FAILED("HG_Respond", hret);
+    }
+    nn_shuffler_free_input(h, &item->in);
+    HG_Destroy(h);
+    free(item);
+    return HG_SUCCESS;
+  }
+
+  /* counting sort writes by worker. a worker owns all names sharing the
+   * same low bits of their lane hash, which write lanes are picked by too,
+   * so each lane is owned by exactly one worker. the lane hash is seeded
+   * apart from the placement hash, whose bits are the same for all names
+   * sent to us. each write is copied along with its size byte, if any. */
+  if (req_sz < fname_len) ABORT("unexpected incoming shuffle request size");
+  stride = req_stride;
+  lead = stride - req_sz;
+  w.resize(num_reqs);
+  memset(off, 0, sizeof(off));
+  for (i = 0; i < num_reqs; i++) {
+    req = reqs + i * stride;
+    w[i] = preload_lane_hash(req, fname_len) & (nwkqs - 1);
+    off[w[i] + 1]++;
+  }
+  for (i = 0; i < nwkqs; i++) {
+    off[i + 1] += off[i];
+    owner[i] = off[i];
+  }
+  item->buf = static_cast<char*>(malloc(num_reqs * stride));
+  if (item->buf == NULL) ABORT("malloc");
+  for (i = 0; i < num_reqs; i++) {
+    memcpy(item->buf + owner[w[i]]++ * stride, reqs - lead + i * stride,
+           stride);
+  }
+
+  num_parts = 0;
+  for (i = 0; i < nwkqs; i++) {
+    parts[i].h = NULL;
+    parts[i].item = item;
+    parts[i].reqs = item->buf + off[i] * stride + lead;
+    parts[i].num_reqs = off[i + 1] - off[i];
+    if (parts[i].num_reqs != 0) {
+      num_parts++;
+    }
+  }
+
+  /* writes are copied out so the input buffer may be released now */
+  item->h = h;
+  item->req_sz = req_sz;
+  item->req_stride = req_stride;
+  item->parts_left = num_parts;
+  item->rv = 0;
+  nn_shuffler_free_input(h, &item->in);
+
+  pthread_mtx_lock(&mtx[wk_cv]);
+  items_submitted++;
+  pthread_mtx_unlock(&mtx[wk_cv]);
+
+  /* item may be freed by workers as soon as its last part is pushed */
+  for (i = 0; i < nwkqs; i++) {
+    if (parts[i].num_reqs != 0) {
+      wkq_push(&wkqs[i], parts[i]);
+    }
+  }
+
+  return HG_SUCCESS;
+}
+
+/* nn_shuffler_write_rpc_part: execute an rpc part. the worker finishing the
+ * last part of an rpc replies to the sender. return 1 if the rpc is
+ * completed by this call, or 0 otherwise. */
+static int nn_shuffler_write_rpc_part(rpc_part_t* part) {
+  rpc_item_t* const item = part->item;
+  write_out_t write_out;
+  hg_return_t hret;
+  int rv;
+
+  rv = shuffle_handle_batch(nnctx.shctx, part->reqs, item->req_sz,
+                            item->req_stride, part->num_reqs, item->in.epo,
+                            item->in.src, item->in.dst);
+  if (rv != 0) {
+    __sync_bool_compare_and_swap(&item->rv, 0, rv);
+  }
+  if (__sync_sub_and_fetch(&item->parts_left, 1) != 0) {
+    return 0;
+  }
+
+  write_out.rv = item->rv;
+  write_out.qdep = wk_backlog();
+  write_out.credits = wk_credits(write_out.qdep);
+  hret = HG_Respond(item->h, NULL, NULL, &write_out);
+  if (hret != HG_SUCCESS) {
+    RPC_FAILED("HG_Respond", hret);
+  }
+
+  HG_Destroy(item->h);
+  free(item->buf);
+  free(item);
+
+  return 1;
+}
+
 /*
  * nn_shuffler_write_async_handler: rpc callback associated with
  * shuffle_write_send_async(...)
@@ -504,10 +1253,15 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
 hg_return_t nn_shuffler_write_async_handler(const struct hg_cb_info* info) {
   hg_return_t hret;
   hg_handle_t h;
+  uint64_t lat;
+  int slots_left;
+  int peer;
   int cache;
   write_async_cb_t* write_cb;
   write_out_t write_out;
+  hg_bulk_t bulk;
   int rv;
+  int b;
 
   assert(info->type == HG_CB_FORWARD);
   hret = info->ret;
@@ -527,17 +1281,45 @@ hg_return_t nn_shuffler_write_async_handler(const struct hg_cb_info* info) {
 
   HG_Free_output(h, &write_out);
   shuffle_msg_replied(write_cb->arg1, write_cb->arg2);
+  peer = write_cb->peer;
+  bulk = write_cb->bulk;
+  lat = write_cb->ts != 0 ? now_micros() - write_cb->ts : 0;
+  if (!pctx.nomon) mon_lat_add(MON_LAT_RPC, lat);
 
   /* return rpc callback slot */
   pthread_mtx_lock(&mtx[cb_cv]);
   cache = nnctx.cache_hlds && (h == hg_hdls[write_cb->slot]);
   cb_flags[write_cb->slot] = 0;
   assert(cb_left < cb_allowed);
+  slots_left = cb_left;
   if (cb_left == 0 || cb_left == cb_allowed - 1) {
     pthread_cv_notifyall(&cv[cb_cv]);
   }
   cb_left++;
+  __sync_fetch_and_add(&rpc_replied, 1);
   pthread_mtx_unlock(&mtx[cb_cv]);
+  if (nnctx.adaptive || nnctx.max_credits != 0 || bulk != HG_BULK_NULL) {
+    rpcq_t* const rpcq = &rpcqs[rpcq_index(peer)];
+    pthread_mtx_lock(&rpcq->mtx);
+    if (nnctx.adaptive) {
+      rpcq_adapt(rpcq, lat, write_out.qdep, slots_left);
+    }
+    if (nnctx.max_credits != 0) { /* take the receiver's latest grant */
+      assert(rpcq->outstanding > 0);
+      rpcq->outstanding--;
+      rpcq->credits = std::min(std::max(write_out.credits, hg_uint32_t(1)),
+                               nnctx.max_credits);
+      pthread_cv_notifyall(&rpcq->cv);
+    }
+    if (bulk != HG_BULK_NULL) { /* the receiver is done with our buffer */
+      b = (rpcq->bulks[0] == bulk) ? 0 : 1;
+      assert(rpcq->bulks[b] == bulk);
+      pthread_cv_notifyall(&rpcq->cv);
+      rpcq->inflight[b] = 0;
+      rpcq->busy--;
+    }
+    pthread_mtx_unlock(&rpcq->mtx);
+  }
   if (!cache) {
     HG_Destroy(h);
   }
@@ -554,7 +1336,7 @@ hg_return_t nn_shuffler_write_async_handler(const struct hg_cb_info* info) {
  * return without waiting.
  */
 int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
-                                 void* arg1, void* arg2) {
+                                 hg_id_t id, void* arg1, void* arg2) {
   hg_return_t hret;
   hg_addr_t peer_addr;
   hg_handle_t h;
@@ -562,6 +1344,7 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
   time_t now;
   struct timespec abstime;
   useconds_t delay;
+  uint64_t replied;
   int slot;
   int rank;
   int e;
@@ -592,6 +1375,8 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
 
   /* wait for slot */
   pthread_mtx_lock(&mtx[cb_cv]);
+  if (cb_left == 0) mon_cnt_add(MON_NSLOTW, 1);
+  replied = rpc_replied;
   while (cb_left == 0) { /* no slots available */
     if (pctx.testin) {
       pthread_mtx_unlock(&mtx[cb_cv]);
@@ -614,8 +1399,11 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
 
       e = pthread_cv_timedwait(&cv[cb_cv], &mtx[cb_cv], &abstime);
       if (e == ETIMEDOUT) {
-        rpc_explain_timeout();
-        ABORT("timeout waiting for rpc slot");
+        if (rpc_replied == replied) {
+          rpc_explain_timeout();
+          ABORT("timeout waiting for rpc slot");
+        }
+        replied = rpc_replied; /* receivers are slow but alive */
       }
     }
   }
@@ -640,14 +1428,14 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
   assert(nnctx.hg_ctx != NULL);
   h = hg_hdls[slot];
   if (h == NULL) {
-    hret = HG_Create(nnctx.hg_ctx, peer_addr, nnctx.hg_id, &h);
+    hret = HG_Create(nnctx.hg_ctx, peer_addr, id, &h);
     if (hret != HG_SUCCESS) {
       RPC_FAILED("HG_Create", hret);
     } else if (nnctx.cache_hlds) {
       hg_hdls[slot] = h;
     }
   } else {
-    hret = HG_Reset(h, peer_addr, nnctx.hg_id);
+    hret = HG_Reset(h, peer_addr, id);
     if (hret != HG_SUCCESS) {
       RPC_FAILED("HG_Reset", hret);
     }
@@ -656,6 +1444,10 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
   write_cb->slot = slot;
   write_cb->arg1 = arg1;
   write_cb->arg2 = arg2;
+  write_cb->peer = peer_rank;
+  write_cb->bulk = write_in->bulk;
+  /* rpc latency is only needed for mon stats and adaptive batching */
+  write_cb->ts = (!pctx.nomon || nnctx.adaptive) ? now_micros() : 0;
 
   hret = HG_Forward(h, nn_shuffler_write_async_handler, write_cb, write_in);
 
@@ -671,6 +1463,7 @@ void nn_shuffler_waitcb() {
   time_t now;
   struct timespec abstime;
   useconds_t delay;
+  uint64_t replied;
   int e;
 
 #ifndef NDEBUG
@@ -681,6 +1474,7 @@ void nn_shuffler_waitcb() {
   delay = 1000; /* 1000 us */
 
   pthread_mtx_lock(&mtx[cb_cv]);
+  replied = rpc_replied;
   while (cb_left != cb_allowed) {
     if (pctx.testin) {
       pthread_mtx_unlock(&mtx[cb_cv]);
@@ -703,8 +1497,11 @@ void nn_shuffler_waitcb() {
 
       e = pthread_cv_timedwait(&cv[cb_cv], &mtx[cb_cv], &abstime);
       if (e == ETIMEDOUT) {
-        rpc_explain_timeout();
-        ABORT("timeout waiting for all outstanding rpcs to complete");
+        if (rpc_replied == replied) {
+          rpc_explain_timeout();
+          ABORT("timeout waiting for all outstanding rpcs to complete");
+        }
+        replied = rpc_replied;
       }
     }
   }
@@ -724,6 +1521,7 @@ hg_return_t nn_shuffler_write_handler(const struct hg_cb_info* info) {
   pthread_mtx_lock(&mtx[rpc_cv]);
   write_cb->hret = info->ret;
   write_cb->ok = 1;
+  __sync_fetch_and_add(&rpc_replied, 1);
   pthread_cv_notifyall(&cv[rpc_cv]);
   pthread_mtx_unlock(&mtx[rpc_cv]);
 
@@ -734,7 +1532,7 @@ hg_return_t nn_shuffler_write_handler(const struct hg_cb_info* info) {
  * nn_shuffler_write_send: send a write request to a specified peer and wait for
  * its response
  */
-int nn_shuffler_write_send(write_in_t* write_in, int peer_rank) {
+int nn_shuffler_write_send(write_in_t* write_in, int peer_rank, hg_id_t id) {
   hg_return_t hret;
   hg_addr_t peer_addr;
   hg_handle_t h;
@@ -774,7 +1572,7 @@ int nn_shuffler_write_send(write_in_t* write_in, int peer_rank) {
     ABORT("mssg_get_addr");
   }
   assert(nnctx.hg_ctx != NULL);
-  hret = HG_Create(nnctx.hg_ctx, peer_addr, nnctx.hg_id, &h);
+  hret = HG_Create(nnctx.hg_ctx, peer_addr, id, &h);
   if (hret != HG_SUCCESS) {
     RPC_FAILED("HG_Create", hret);
   }
@@ -838,20 +1636,18 @@ int nn_shuffler_write_send(write_in_t* write_in, int peer_rank) {
   return rv;
 }
 
-/* nn_shuffler_enqueue:
- *   encode a req and append it into a corresponding rpc queue */
-void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
-                         int peer_rank, int rank) {
-  write_in_t write_in;
-  rpcq_t* rpcq;
-  int rpcq_idx;
+namespace {
+/* rpcq_block: wait once for the state of an rpc queue to change. in testing
+ * mode, we sleep for an increasing amount of *delay us. otherwise, we wait on
+ * the queue's cv for up to nnctx.timeout secs and only abort if no rpc has
+ * been replied during that time (*replied holds the count seen at the last
+ * wakeup). must be called with the queue locked. returns with the queue
+ * locked. */
+void rpcq_block(rpcq_t* rpcq, useconds_t* delay, uint64_t* replied,
+                const char* tag, const char* what) {
   time_t now;
   struct timespec abstime;
-  useconds_t delay;
-  int world_sz;
-  int rv;
-  void* arg1;
-  void* arg2;
+  uint64_t r;
   int e;
 
 #ifndef NDEBUG
@@ -859,159 +1655,460 @@ void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
   int n;
 #endif
 
-  assert(nnctx.mssg != NULL);
-  assert(rank == mssg_get_rank(nnctx.mssg));
-  world_sz = mssg_get_count(nnctx.mssg);
+  if (pctx.testin) {
+    pthread_mtx_unlock(&rpcq->mtx);
+#ifndef NDEBUG
+    if (pctx.logfd != -1) {
+      n = snprintf(msg, sizeof(msg), "[%s] %d us\n", tag, int(*delay));
+      n = write(pctx.logfd, msg, n);
 
-  if (nnctx.paranoid_checks) {
-    if (!shuffle_is_rank_receiver(nnctx.shctx, peer_rank)) {
-      ABORT("peer rank is not a receiver");
+      errno = 0;
     }
-    if (peer_rank < 0 || peer_rank >= world_sz) {
-      ABORT("invalid peer rank");
+#endif
+    usleep(*delay);
+    *delay <<= 1;
+
+    pthread_mtx_lock(&rpcq->mtx);
+  } else {
+    now = time(NULL);
+    abstime.tv_sec = now + nnctx.timeout;
+    abstime.tv_nsec = 0;
+
+    e = pthread_cv_timedwait(&rpcq->cv, &rpcq->mtx, &abstime);
+    if (e == ETIMEDOUT) {
+      r = __sync_fetch_and_add(&rpc_replied, 0);
+      if (r == *replied) {
+        rpc_explain_timeout();
+        ABORT(what);
+      }
+      *replied = r; /* receivers are slow but alive */
     }
   }
+}
 
-  pthread_mtx_lock(&mtx[qu_cv]);
+/* rpcq_wait: block until a given buffer of an rpc queue is no longer being
+ * sent. must be called with the queue locked. returns with the queue locked. */
+void rpcq_wait(rpcq_t* rpcq, int b) {
+  useconds_t delay;
+  uint64_t replied;
+  uint64_t t0;
 
-  rpcq_idx = peer_rank; /* we have one queue per rank */
-  assert(rpcq_idx < nrpcqs);
-  rpcq = &rpcqs[rpcq_idx];
-  assert(rpcq != NULL);
-  assert(rpcq->buf != NULL);
+  if (rpcq->inflight[b] == 0) return;
+  mon_cnt_add(MON_NQW, 1);
+  replied = __sync_fetch_and_add(&rpc_replied, 0);
+  delay = 1000; /* 1000 us */
+  t0 = now_micros();
+  while (rpcq->inflight[b] != 0) {
+    rpcq_block(rpcq, &delay, &replied, "BLOCK-QUEUE",
+               "timeout waiting for rpc queue to flush");
+  }
+  mon_cnt_add(MON_QSTALL, now_micros() - t0);
+}
 
+/* rpcq_wait_credit: block until the receiver of an rpc queue grants us a
+ * send credit. must be called with the queue locked. returns with the queue
+ * locked. */
+void rpcq_wait_credit(rpcq_t* rpcq) {
+  useconds_t delay;
+  uint64_t replied;
+  uint64_t t0;
+
+  if (rpcq_has_credit(rpcq)) return;
+  mon_cnt_add(MON_NCRW, 1);
+  replied = __sync_fetch_and_add(&rpc_replied, 0);
   delay = 1000; /* 1000 us */
+  t0 = now_micros();
+  while (!rpcq_has_credit(rpcq)) {
+    rpcq_block(rpcq, &delay, &replied, "BLOCK-CREDIT",
+               "timeout waiting for send credits");
+  }
+  mon_cnt_add(MON_QSTALL, now_micros() - t0);
+}
 
-  /* wait for queue */
-  while (rpcq->busy != 0) {
-    if (pctx.testin) {
-      pthread_mtx_unlock(&mtx[qu_cv]);
-#ifndef NDEBUG
-      if (pctx.logfd != -1) {
-        n = snprintf(msg, sizeof(msg), "[BLOCK-QUEUE] %d us\n", int(delay));
-        n = write(pctx.logfd, msg, n);
+/* rpcq_flush: send all pending writes of a given rpc queue to its peer
+ * (rpcq->dst) as a single rpc. must be called with the queue locked, with
+ * a send credit, and with its spare buffer not in flight. the spare buffer
+ * becomes the new fill buffer, and the queue is unlocked while the old fill
+ * buffer is being sent so other writers may continue. the queue is locked
+ * again when we return. */
+void rpcq_flush(rpcq_t* rpcq, int peer_rank, int rank) {
+  std::vector<char> tmp;
+  write_in_t write_in;
+  uint32_t nfwd;
+  uint32_t i;
+  uint64_t lat;
+  hg_id_t id;
+  void* arg1;
+  void* arg2;
+  int bulk;
+  int rv;
+  int b;
 
-        errno = 0;
-      }
-#endif
-      usleep(delay);
-      delay <<= 1;
+  assert(rpcq->inflight[1 - rpcq->cur] == 0);
+  if (rpcq->sz > MAX_RPC_MESSAGE &&
+      (nnctx.bulk_thres == 0 || rpcq->sz > MAX_BULK_MESSAGE)) {
+    /* happens when the total size of queued data is greater than
+     * the size limit for an rpc message */
+    ABORT("rpc overflow");
+  }
 
-      pthread_mtx_lock(&mtx[qu_cv]);
-    } else {
-      now = time(NULL);
-      abstime.tv_sec = now + nnctx.timeout;
-      abstime.tv_nsec = 0;
+  b = rpcq->cur;
+  nfwd = rpcq->nfwd;
+  if (rpcq->bufs[1 - b] == NULL) { /* spare buffers are allocated on demand */
+    rpcq->bufs[1 - b] =
+        static_cast<char*>(tplace_alloc(max_rpcq_sz, TPLACE_BG));
+    if (rpcq->bufs[1 - b] == NULL) {
+      ABORT("malloc");
+    }
+  }
+  rpcq->inflight[b] = 1; /* force other writers to use the spare buffer */
+  rpcq->busy++;
+  if (nnctx.max_credits != 0) {
+    assert(rpcq->outstanding < rpcq->credits);
+    rpcq->outstanding++; /* spend a credit */
+  }
+  rpcq->cur = 1 - b;
+  write_in.dst = peer_rank;
+  write_in.src = rank;
+  write_in.epo = rpcq->lepo;
+  write_in.sz = rpcq->sz;
+  write_in.msg = rpcq->bufs[b];
+  write_in.packed = 0;
+  write_in.rec_sz = nnctx.rec_sz;
+  write_in.fwd_sz = 2 * nfwd;
+  write_in.sz -= write_in.fwd_sz;
+  rpcq->sz = 0;
+  rpcq->nfwd = 0;
+  lat = 0;
+  /* unlock when sending the rpc */
+  pthread_mtx_unlock(&rpcq->mtx);
+  if (nnctx.shctx->pack) {
+    uint64_t t0 = now_micros();
+    size_t sz = shuffle_msg_pack(nnctx.shctx, rpcq->bufs[b], write_in.sz,
+                                 write_in.rec_sz);
+    mon_cnt_add(MON_ZMICROS, now_micros() - t0);
+    mon_cnt_add(MON_ZIN, write_in.sz);
+    if (sz != 0) {
+      write_in.sz = sz;
+      write_in.packed = 1;
+      write_in.rec_sz = 0; /* packed msgs carry their own header */
+    }
+    mon_cnt_add(MON_ZOUT, write_in.sz);
+  }
+  if (nfwd != 0) { /* final ranks follow the (possibly packed) writes */
+    tmp.resize(write_in.fwd_sz);
+    for (i = 0; i < nfwd; i++) {
+      memcpy(&tmp[2 * i], rpcq->bufs[b] + max_rpcq_sz - 2 * (i + 1), 2);
+    }
+    memcpy(rpcq->bufs[b] + write_in.sz, &tmp[0], write_in.fwd_sz);
+    write_in.sz += write_in.fwd_sz;
+  }
+  write_in.hash_sig = nn_shuffler_maybe_hashsig(&write_in);
+  /* large msgs are pulled by the receiver straight out of our buffer */
+  bulk = nnctx.bulk_thres != 0 && write_in.sz >= nnctx.bulk_thres;
+  if (bulk) {
+    write_in.bulk = rpcq->bulks[b];
+    id = rpcq->fwd ? nnctx.hg_fwd_bulk_id : nnctx.hg_bulk_id;
+  } else {
+    write_in.bulk = HG_BULK_NULL;
+    id = rpcq->fwd ? nnctx.hg_fwd_id : nnctx.hg_id;
+  }
+  if (!nnctx.force_sync) {
+    shuffle_msg_sent(0, &arg1, &arg2);
+    rv = nn_shuffler_write_send_async(&write_in, peer_rank, id, arg1, arg2);
+  } else {
+    shuffle_msg_sent(0, &arg1, &arg2);
+    lat = nnctx.adaptive ? now_micros() : 0;
+    rv = nn_shuffler_write_send(&write_in, peer_rank, id);
+    lat = nnctx.adaptive ? now_micros() - lat : 0;
+    shuffle_msg_replied(arg1, arg2);
+  }
+  if (rv != 0) {
+    ABORT("plfsdir peer write failed");
+  }
+  /* rpc input has been encoded by mercury so the buffer can be reused. the
+   * buffer of an async bulk rpc is only returned once the rpc is replied */
+  pthread_mtx_lock(&rpcq->mtx);
+  if (nnctx.force_sync && nnctx.adaptive) {
+    rpcq_adapt(rpcq, lat, 0, 1);
+  }
+  if (!bulk || nnctx.force_sync) {
+    pthread_cv_notifyall(&rpcq->cv);
+    rpcq->inflight[b] = 0;
+    rpcq->busy--;
+  }
+}
 
-      e = pthread_cv_timedwait(&cv[qu_cv], &mtx[qu_cv], &abstime);
-      if (e == ETIMEDOUT) {
-        rpc_explain_timeout();
-        ABORT("timeout waiting for rpc queue to flush");
+/* rpcq_make_room: flush an rpc queue until it has room for at least sz more
+ * bytes. must be called with the queue locked. returns with the queue
+ * locked. */
+void rpcq_make_room(rpcq_t* rpcq, size_t sz, int peer_rank, int rank) {
+  uint64_t now;
+  while (rpcq->sz + sz > std::max(rpcq_limit(rpcq), sz)) {
+    if (rpcq->inflight[1 - rpcq->cur] != 0) {
+      rpcq_wait(rpcq, 1 - rpcq->cur); /* both buffers are busy */
+    } else if (!rpcq_has_credit(rpcq)) {
+      rpcq_wait_credit(rpcq); /* full and out of credits */
+    } else {
+      if (nnctx.adaptive) {
+        now = now_micros();
+        if (rpcq->lfill != 0) {
+          rpcq->rate = 0.875 * rpcq->rate +
+                       0.125 * rpcq->sz / double(now - rpcq->lfill + 1);
+        }
+        rpcq->lfill = now;
       }
+      rpcq_flush(rpcq, peer_rank, rank);
     }
   }
+}
 
-  /* flush queue if full */
-  if (rpcq->sz + req_sz + 1 > max_rpcq_sz) {
-    if (rpcq->sz > MAX_RPC_MESSAGE) {
-      /* happens when the total size of queued data is greater than
-       * the size limit for an rpc message */
-      ABORT("rpc overflow");
+/* rpcq_drain: flush an rpc queue until it is empty and wait for all its
+ * on-going sends. must be called with the queue locked. returns with the
+ * queue locked. */
+void rpcq_drain(rpcq_t* rpcq, int rank) {
+  while (rpcq->sz != 0) {
+    if (rpcq->inflight[1 - rpcq->cur] != 0) {
+      rpcq_wait(rpcq, 1 - rpcq->cur);
+    } else if (!rpcq_has_credit(rpcq)) {
+      rpcq_wait_credit(rpcq);
     } else {
-      rpcq->busy = 1; /* force other writers to block */
-      /* unlock when sending the rpc */
-      pthread_mtx_unlock(&mtx[qu_cv]);
-      write_in.dst = peer_rank;
-      write_in.src = rank;
-      write_in.epo = rpcq->lepo;
-      write_in.sz = rpcq->sz;
-      write_in.msg = rpcq->buf;
-      write_in.hash_sig = nn_shuffler_maybe_hashsig(&write_in);
-      if (!nnctx.force_sync) {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send_async(&write_in, peer_rank, arg1, arg2);
-      } else {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send(&write_in, peer_rank);
-        shuffle_msg_replied(arg1, arg2);
-      }
-      if (rv != 0) {
-        ABORT("plfsdir peer write failed");
-      }
-      pthread_mtx_lock(&mtx[qu_cv]);
-      pthread_cv_notifyall(&cv[qu_cv]);
-      rpcq->busy = 0;
-      rpcq->sz = 0;
+      rpcq_flush(rpcq, rpcq->dst, rank);
     }
   }
+  /* wait for on-going sends initiated by other writers */
+  rpcq_wait(rpcq, 0);
+  rpcq_wait(rpcq, 1);
+}
+
+/* nn_shuffler_check_peer: sanity check a peer rank */
+void nn_shuffler_check_peer(int peer_rank) {
+  int world_sz;
+
+  if (nnctx.paranoid_checks) {
+    world_sz = mssg_get_count(nnctx.mssg);
+    if (!shuffle_is_rank_receiver(nnctx.shctx, peer_rank)) {
+      ABORT("peer rank is not a receiver");
+    }
+    if (peer_rank < 0 || peer_rank >= world_sz) {
+      ABORT("invalid peer rank");
+    }
+  }
+}
+}  // namespace
+
+/* nn_shuffler_encode: append a group of fixed-sized reqs packed back to
+ * back in *reqs to an rpc msg, each preceded by a 1-byte size */
+char* nn_shuffler_encode(char* dst, const char* reqs, unsigned char req_sz,
+                         int num_reqs) {
+  int k;
+
+  for (k = 0; k < num_reqs; k++) {
+    dst[0] = req_sz;
+    memcpy(dst + 1, reqs, req_sz);
+    dst += req_sz + 1;
+    reqs += req_sz;
+  }
+
+  return dst;
+}
+
+/* nn_shuffler_encode_fixed: same as nn_shuffler_encode(), but writes are
+ * appended as fixed-sized records of req_sz - 1 bytes each: no size byte is
+ * added and the '\0' after each name of fname_len bytes is dropped. */
+char* nn_shuffler_encode_fixed(char* dst, const char* reqs,
+                               unsigned char req_sz, unsigned char fname_len,
+                               int num_reqs) {
+  const size_t rest = size_t(req_sz) - fname_len - 1;
+  int k;
+
+  for (k = 0; k < num_reqs; k++) {
+    memcpy(dst, reqs, fname_len);
+    memcpy(dst + fname_len, reqs + fname_len + 1, rest);
+    dst += req_sz - 1;
+    reqs += req_sz;
+  }
+
+  return dst;
+}
+
+/* nn_shuffler_enqueue:
+ *   encode a req and append it into a corresponding rpc queue */
+void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
+                         int peer_rank, int rank) {
+  size_t rec = rpcq_wire_sz(req_sz);
+  rpcq_t* rpcq;
+  int rpcq_idx;
+  char* buf;
+
+  assert(nnctx.mssg != NULL);
+  assert(rank == mssg_get_rank(nnctx.mssg));
+  nn_shuffler_check_peer(peer_rank);
+
+  rpcq_idx = rpcq_index(peer_rank);
+  assert(rpcq_idx >= 0 && rpcq_idx < nrpcqs);
+  rpcq = &rpcqs[rpcq_idx];
+  assert(rpcq != NULL);
+  assert(RPCQ_BUF(rpcq) != NULL);
+  if (rpcq->fwd) rec += 2; /* and its final rank */
+
+  if (rec > max_rpcq_sz) {
+    /* happens when the memory reserved for the queue is smaller than
+     * a single write */
+    ABORT("rpc overflow");
+  }
+  if (nnctx.rec_sz != 0 && req_sz != nnctx.rec_sz + 1) {
+    ABORT("unexpected shuffle request size");
+  }
+
+  pthread_mtx_lock(&rpcq->mtx);
+
+  /* flush queue if full */
+  rpcq_make_room(rpcq, rec, rpcq->dst, rank);
 
   /* enqueue */
-  if (rpcq->sz + req_sz + 1 > max_rpcq_sz) {
+  buf = RPCQ_BUF(rpcq);
+  rpcq->lepo = epoch;
+  rpcq_encode(buf + rpcq->sz - 2 * size_t(rpcq->nfwd), req, req_sz, 1);
+  if (rpcq->fwd) rpcq_fwd_note(rpcq, peer_rank, 1);
+  rpcq->sz += rec;
+
+  pthread_mtx_unlock(&rpcq->mtx);
+}
+
+/* nn_shuffler_enqueue_batch:
+ *   encode a group of reqs going to the same peer and append them into the
+ *   corresponding rpc queue. all reqs are assumed to be of the same size and
+ *   are packed back to back in *reqs. the queue lock is only acquired once
+ *   for the entire group. */
+void nn_shuffler_enqueue_batch(char* reqs, unsigned char req_sz, int num_reqs,
+                               int epoch, int peer_rank, int rank) {
+  size_t rec = rpcq_wire_sz(req_sz);
+  rpcq_t* rpcq;
+  int rpcq_idx;
+  uint32_t room;
+
+  assert(nnctx.mssg != NULL);
+  assert(rank == mssg_get_rank(nnctx.mssg));
+  if (num_reqs <= 0) return;
+  nn_shuffler_check_peer(peer_rank);
+
+  rpcq_idx = rpcq_index(peer_rank);
+  assert(rpcq_idx >= 0 && rpcq_idx < nrpcqs);
+  rpcq = &rpcqs[rpcq_idx];
+  assert(rpcq != NULL);
+  assert(RPCQ_BUF(rpcq) != NULL);
+  if (rpcq->fwd) rec += 2; /* and its final rank */
+
+  if (rec > max_rpcq_sz) {
     /* happens when the memory reserved for the queue is smaller than
      * a single write */
     ABORT("rpc overflow");
-  } else {
+  }
+  if (nnctx.rec_sz != 0 && req_sz != nnctx.rec_sz + 1) {
+    ABORT("unexpected shuffle request size");
+  }
+
+  pthread_mtx_lock(&rpcq->mtx);
+
+  while (num_reqs != 0) {
+    /* flush queue if full */
+    rpcq_make_room(rpcq, rec, rpcq->dst, rank);
+
+    /* enqueue as many reqs as the queue can hold */
+    room = (std::max(rpcq_limit(rpcq), rec) - rpcq->sz) / rec;
+    if (room > uint32_t(num_reqs)) room = num_reqs;
+    assert(room != 0);
+    rpcq_encode(RPCQ_BUF(rpcq) + rpcq->sz - 2 * size_t(rpcq->nfwd), reqs,
+                req_sz, room);
+    if (rpcq->fwd) rpcq_fwd_note(rpcq, peer_rank, room);
+    reqs += size_t(room) * req_sz;
     rpcq->lepo = epoch;
-    rpcq->buf[rpcq->sz] = req_sz;
-    memcpy(rpcq->buf + rpcq->sz + 1, req, req_sz);
-    rpcq->sz += req_sz + 1;
+    rpcq->sz += room * rec;
+    num_reqs -= room;
   }
 
-  pthread_mtx_unlock(&mtx[qu_cv]);
+  pthread_mtx_unlock(&rpcq->mtx);
 }
 
-/* nn_shuffler_flushq: force flushing all rpc queue */
+/* nn_shuffler_set_queue_budget: cap the bytes each rpc queue may hold so
+ * that all queues, each with its two buffers, use no more than a given
+ * budget. queues holding more than their new cap are flushed as they are
+ * next written to. return the bytes the queues may use in total */
+size_t nn_shuffler_set_queue_budget(size_t budget) {
+  size_t cap;
+  int nq;
+  int i;
+
+  nq = 0;
+  for (i = 0; i < nrpcqs; i++) {
+    if (rpcqs[i].dst != -1) nq++;
+  }
+  if (nq == 0) return 0;
+  cap = budget / (2 * size_t(nq));
+  cap = std::max(cap, nnctx.adaptive ? min_rpcq_sz : size_t(128));
+  cap = std::min(cap, max_rpcq_sz);
+  rpcq_cap = cap;
+  for (i = 0; i < nrpcqs; i++) {
+    if (rpcqs[i].dst == -1) continue;
+    pthread_mtx_lock(&rpcqs[i].mtx);
+    if (!nnctx.adaptive || rpcqs[i].thres > cap) {
+      rpcqs[i].thres = static_cast<uint32_t>(cap);
+    }
+    pthread_mtx_unlock(&rpcqs[i].mtx);
+  }
+
+  return 2 * size_t(nq) * cap;
+}
+
+/* nn_shuffler_epoch_start: forget the fill rate measured by each rpc queue
+ * in the previous epoch. otherwise the first flush of an epoch would see
+ * the whole compute phase as fill time and drop its threshold to the min */
+void nn_shuffler_epoch_start() {
+  int i;
+
+  if (!nnctx.adaptive) return;
+  for (i = 0; i < nrpcqs; i++) {
+    if (rpcqs[i].dst == -1) continue;
+    pthread_mtx_lock(&rpcqs[i].mtx);
+    rpcqs[i].lfill = 0;
+    rpcqs[i].rate = 0;
+    pthread_mtx_unlock(&rpcqs[i].mtx);
+  }
+}
+
+/* nn_shuffler_flushq: force flushing all rpc queue. queues whose receivers
+ * have not granted us credits are deferred until all others are flushed */
 void nn_shuffler_flushq() {
-  write_in_t write_in;
+  std::vector<int> deferred;
   rpcq_t* rpcq;
-  void* arg1;
-  void* arg2;
-  int peer_rank_idx;
-  int peer_rank;
+  int rpcq_idx;
   int rank;
-  int rv;
+  size_t i;
 
   assert(nnctx.mssg != NULL);
   rank = mssg_get_rank(nnctx.mssg);
 
-  pthread_mtx_lock(&mtx[qu_cv]);
-
-  for (peer_rank_idx = 0; peer_rank_idx < nrpcqs; peer_rank_idx++) {
-    peer_rank = rpcq_order[peer_rank_idx];
-    rpcq = &rpcqs[peer_rank];
-    if (rpcq->sz == 0) { /* skip empty queue */
+  for (rpcq_idx = 0; rpcq_idx < nrpcqs; rpcq_idx++) {
+    rpcq = &rpcqs[rpcq_order[rpcq_idx]];
+    if (RPCQ_BUF(rpcq) == NULL) { /* skip non-receivers */
       continue;
-    } else if (rpcq->sz > MAX_RPC_MESSAGE) {
-      ABORT("rpc overflow");
+    }
+    pthread_mtx_lock(&rpcq->mtx);
+    if (rpcq->sz != 0 && !rpcq_has_credit(rpcq)) {
+      deferred.push_back(rpcq_order[rpcq_idx]);
     } else {
-      rpcq->busy = 1; /* force other writers to block */
-      /* unlock when sending the rpc */
-      pthread_mtx_unlock(&mtx[qu_cv]);
-      write_in.dst = peer_rank;
-      write_in.src = rank;
-      write_in.epo = rpcq->lepo;
-      write_in.sz = rpcq->sz;
-      write_in.msg = rpcq->buf;
-      write_in.hash_sig = nn_shuffler_maybe_hashsig(&write_in);
-      if (!nnctx.force_sync) {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send_async(&write_in, peer_rank, arg1, arg2);
-      } else {
-        shuffle_msg_sent(0, &arg1, &arg2);
-        rv = nn_shuffler_write_send(&write_in, peer_rank);
-        shuffle_msg_replied(arg1, arg2);
-      }
-      if (rv != 0) {
-        ABORT("plfsdir peer write failed");
-      }
-      pthread_mtx_lock(&mtx[qu_cv]);
-      pthread_cv_notifyall(&cv[qu_cv]);
-      rpcq->busy = 0;
-      rpcq->sz = 0;
+      rpcq_drain(rpcq, rank);
     }
+    pthread_mtx_unlock(&rpcq->mtx);
   }
 
-  pthread_mtx_unlock(&mtx[qu_cv]);
+  for (i = 0; i < deferred.size(); i++) {
+    rpcq = &rpcqs[deferred[i]];
+    pthread_mtx_lock(&rpcq->mtx);
+    rpcq_drain(rpcq, rank);
+    pthread_mtx_unlock(&rpcq->mtx);
+  }
 }
 
 /* bg_work(): dedicated thread function to drive mercury progress */
@@ -1146,6 +2243,9 @@ void nn_shuffler_wakeup() {
   pthread_mtx_unlock(&mtx[bg_cv]);
 }
 
+/* nn_shuffler_backlog: return the number of incoming rpcs not yet processed */
+int nn_shuffler_backlog() { return int(wk_backlog()); }
+
 /* nn_shuffler_init_mssg: init the mssg sublayer */
 static void nn_shuffler_init_mssg(int is_recv) {
   hg_return_t hret;
@@ -1171,16 +2271,123 @@ static void nn_shuffler_init_mssg(int is_recv) {
   }
 }
 
+/* nn_shuffler_init_agg: set up rpc queues for 2-hop shuffling, setting
+ * the destination of each queue in *qdst and whether it is sent as 2-hop
+ * rpcs in *qfwd. ranks sharing a node are found by MPI_COMM_TYPE_SHARED. */
+static void nn_shuffler_init_agg(shuffle_ctx_t* ctx, std::vector<int>* qdst,
+                                 std::vector<int>* qfwd) {
+  std::vector<std::vector<int> > recvs; /* receivers of each node */
+  std::vector<int> leader;              /* lowest rank of each rank's node */
+  std::vector<int> node;                /* node of each rank */
+  char msg[200];
+  MPI_Comm comm;
+  int world_sz;
+  int rank;
+  int lead;
+  int lpos;
+  int rv;
+  int i;
+  int k;
+
+  world_sz = mssg_get_count(nnctx.mssg);
+  rank = mssg_get_rank(nnctx.mssg);
+  lead = rank;
+#if MPI_VERSION >= 3
+  /* ranks keep their relative order so local rank 0 is the lowest */
+  rv = MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0,
+                           MPI_INFO_NULL, &comm);
+  if (rv != MPI_SUCCESS) {
+    ABORT("MPI_Comm_split_type");
+  }
+  MPI_Bcast(&lead, 1, MPI_INT, 0, comm);
+  MPI_Comm_free(&comm);
+#else
+  if (pctx.my_rank == 0) {
+    WARN("no MPI_COMM_TYPE_SHARED\n>>> each rank is treated as a node");
+  }
+#endif
+  leader.resize(world_sz);
+  rv = MPI_Allgather(&lead, 1, MPI_INT, &leader[0], 1, MPI_INT,
+                     MPI_COMM_WORLD);
+  if (rv != MPI_SUCCESS) {
+    ABORT("MPI_Allgather");
+  }
+
+  node.resize(world_sz);
+  agg_nnodes = 0;
+  for (i = 0; i < world_sz; i++) {
+    if (leader[i] > i) ABORT("bad node leader");
+    if (leader[i] == i) {
+      node[i] = agg_nnodes++;
+      recvs.resize(agg_nnodes);
+    } else {
+      node[i] = node[leader[i]];
+    }
+    if (shuffle_is_rank_receiver(ctx, i)) {
+      recvs[node[i]].push_back(i);
+    }
+  }
+  agg_node = node[rank];
+  lpos = 0; /* our index within our node */
+  for (i = 0; i < rank; i++) {
+    if (node[i] == agg_node) lpos++;
+  }
+
+  /* one queue per remote node, followed by one per local receiver */
+  nrpcqs = agg_nnodes + int(recvs[agg_node].size());
+  qdst->assign(nrpcqs, -1);
+  qfwd->assign(nrpcqs, 0);
+  rpcq_map.assign(world_sz, -1);
+  for (i = 0; i < agg_nnodes; i++) {
+    if (i != agg_node && !recvs[i].empty()) {
+      (*qdst)[i] = recvs[i][lpos % recvs[i].size()];
+      (*qfwd)[i] = 1;
+    }
+  }
+  for (i = 0; i < world_sz; i++) {
+    if (node[i] != agg_node) {
+      rpcq_map[i] = node[i];
+    }
+  }
+  for (k = 0; k < int(recvs[agg_node].size()); k++) {
+    (*qdst)[agg_nnodes + k] = recvs[agg_node][k];
+    rpcq_map[recvs[agg_node][k]] = agg_nnodes + k;
+  }
+  agg_lidx.assign(world_sz, 0);
+  for (i = 0; i < agg_nnodes; i++) {
+    if (recvs[i].size() > 65536) ABORT("too many receivers per node");
+    for (k = 0; k < int(recvs[i].size()); k++) {
+      agg_lidx[recvs[i][k]] = uint16_t(k);
+    }
+  }
+
+  if (pctx.my_rank == 0) {
+    snprintf(msg, sizeof(msg),
+             "2-hop shuffle is ON: %s nodes\n>>> %s rpc queues per rank "
+             "(instead of %s)",
+             pretty_num(agg_nnodes).c_str(), pretty_num(nrpcqs).c_str(),
+             pretty_num(world_sz).c_str());
+    INFO(msg);
+  }
+}
+
 /* nn_shuffler_init: init the shuffle layer */
 void nn_shuffler_init(shuffle_ctx_t* ctx) {
+  std::vector<int> qdst;
+  std::vector<int> qfwd;
   hg_return_t hret;
   hg_size_t isz;
   hg_size_t osz;
   pthread_t pid;
   char msg[200];
   const char* env;
+  int fmt[2];
+  unsigned long long bufsz;
   int nbufs;
+  int nq;
+  int pcls;
   int rv;
+  int n;
   int i;
 
   nnctx.shctx = ctx;
@@ -1256,6 +2463,45 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
   if (is_envset("SHUFFLE_Random_flush")) nnctx.random_flush = 1;
   if (is_envset("SHUFFLE_Mercury_cache_handles")) nnctx.cache_hlds = 1;
   if (is_envset("SHUFFLE_Mercury_rusage")) nnctx.hg_rusage = 1;
+  if (is_envset("SHUFFLE_Node_aggregation")) nnctx.agg = 1;
+
+  env = maybe_getenv("SHUFFLE_Max_credits");
+  if (env == NULL) {
+    nnctx.max_credits = DEFAULT_MAX_CREDITS;
+  } else {
+    n = atoi(env);
+    nnctx.max_credits = n > 0 ? n : 0;
+  }
+  if (nnctx.force_sync) {
+    nnctx.max_credits = 0; /* sync rpcs never have more than one in flight */
+  }
+
+  /* fixed-sized records are only used when all ranks agree on them */
+  fmt[0] = is_envset("SHUFFLE_Size_prefixed_records")
+               ? 0
+               : ctx->fname_len + ctx->data_len + ctx->extra_data_len;
+  fmt[1] = -fmt[0];
+  MPI_Allreduce(MPI_IN_PLACE, fmt, 2, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+  if (fmt[0] == -fmt[1]) {
+    nnctx.rec_sz = fmt[0];
+  } else {
+    if (pctx.my_rank == 0)
+      WARN("RANKS DISAGREE ON THE SHUFFLE RECORD FORMAT - SIZE-PREFIXED "
+           "RECORDS ARE USED INSTEAD");
+    nnctx.rec_sz = 0;
+  }
+  if (pctx.my_rank == 0 && nnctx.rec_sz != 0) {
+    snprintf(msg, sizeof(msg), "shuffle wire format: fixed %u-byte records",
+             nnctx.rec_sz);
+    INFO(msg);
+  }
+
+  env = maybe_getenv("SHUFFLE_Bulk_threshold");
+  if (env != NULL && atoi(env) > 0) {
+    nnctx.bulk_thres = std::min(atoi(env), MAX_RPC_MESSAGE);
+  } else {
+    nnctx.bulk_thres = 0;
+  }
 
   nnctx.hg_clz = HG_Init(nnctx.my_addr, ctx->is_receiver);
   if (!nnctx.hg_clz) ABORT("HG_Init");
@@ -1267,6 +2513,34 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
   hret = HG_Register_data(nnctx.hg_clz, nnctx.hg_id, &nnctx, NULL);
   if (hret != HG_SUCCESS) ABORT("HG_Register_data");
 
+  if (nnctx.agg) {
+    nnctx.hg_fwd_id = HG_Register_name(
+        nnctx.hg_clz, "shuffle_rpc_fwd", nn_shuffler_write_in_proc,
+        nn_shuffler_write_out_proc, nn_shuffler_write_fwd_handler_wrapper);
+
+    hret = HG_Register_data(nnctx.hg_clz, nnctx.hg_fwd_id, &nnctx, NULL);
+    if (hret != HG_SUCCESS) ABORT("HG_Register_data");
+  }
+
+  if (nnctx.bulk_thres != 0) {
+    nnctx.hg_bulk_id = HG_Register_name(
+        nnctx.hg_clz, "shuffle_rpc_bulk", nn_shuffler_write_bulk_in_proc,
+        nn_shuffler_write_out_proc, nn_shuffler_write_bulk_handler_wrapper);
+
+    hret = HG_Register_data(nnctx.hg_clz, nnctx.hg_bulk_id, &nnctx, NULL);
+    if (hret != HG_SUCCESS) ABORT("HG_Register_data");
+
+    if (nnctx.agg) {
+      nnctx.hg_fwd_bulk_id = HG_Register_name(
+          nnctx.hg_clz, "shuffle_rpc_fwd_bulk", nn_shuffler_write_bulk_in_proc,
+          nn_shuffler_write_out_proc, nn_shuffler_write_bulk_handler_wrapper);
+
+      hret =
+          HG_Register_data(nnctx.hg_clz, nnctx.hg_fwd_bulk_id, &nnctx, NULL);
+      if (hret != HG_SUCCESS) ABORT("HG_Register_data");
+    }
+  }
+
   nnctx.hg_ctx = HG_Context_create(nnctx.hg_clz);
   if (!nnctx.hg_ctx) ABORT("HG_Context_create");
 
@@ -1274,7 +2548,16 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
 
   /* rpc queue */
   assert(nnctx.mssg != NULL);
-  nrpcqs = mssg_get_count(nnctx.mssg);
+  if (nnctx.agg) {
+    nn_shuffler_init_agg(ctx, &qdst, &qfwd);
+  } else {
+    nrpcqs = mssg_get_count(nnctx.mssg);
+    qdst.resize(nrpcqs);
+    qfwd.assign(nrpcqs, 0);
+    for (i = 0; i < nrpcqs; i++) {
+      qdst[i] = shuffle_is_rank_receiver(ctx, i) ? i : -1;
+    }
+  }
   rpcq_order.resize(nrpcqs);
   for (i = 0; i < nrpcqs; i++) {
     rpcq_order[i] = i;
@@ -1303,43 +2586,172 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
     }
   }
 
+  nq = 0; /* number of queues that are actually sent */
+  for (i = 0; i < nrpcqs; i++) {
+    if (qdst[i] != -1) nq++;
+  }
+
   env = maybe_getenv("SHUFFLE_Buffer_per_queue");
-  if (env == NULL) {
+  if (env == NULL && pctx.mb.total != 0) {
+    /* buffers are made large enough for queues to grow into the slack of
+     * the memory budget. their pages are only touched as queues fill up,
+     * and queues are kept from filling up past their share by their caps */
+    n = nnctx.bulk_thres != 0 ? MAX_BULK_MESSAGE : MAX_RPC_MESSAGE;
+    bufsz = static_cast<unsigned long long>(n);
+    if (nq != 0) {
+      bufsz = std::min(bufsz, static_cast<unsigned long long>(
+                                  (pctx.mb.share[MB_QUEUES] + pctx.mb.slack) /
+                                  (2 * nq)));
+    }
+    /* shares differ between senders and receivers, so all ranks agree on
+     * the smallest size. this keeps every rpc within the bulk buffers that
+     * receivers size by it */
+    MPI_Allreduce(MPI_IN_PLACE, &bufsz, 1, MPI_UNSIGNED_LONG_LONG, MPI_MIN,
+                  MPI_COMM_WORLD);
+    max_rpcq_sz = std::max(size_t(bufsz), size_t(128));
+  } else if (env == NULL) {
     max_rpcq_sz = DEFAULT_BUFFER_PER_QUEUE;
   } else {
     max_rpcq_sz = atoi(env);
-    if (max_rpcq_sz > MAX_RPC_MESSAGE) {
+    n = nnctx.bulk_thres != 0 ? MAX_BULK_MESSAGE : MAX_RPC_MESSAGE;
+    if (max_rpcq_sz > size_t(n)) {
       if (pctx.my_rank == 0)
         WARN("RPC BUFFER SIZE TOO LARGE - A SMALLER ONE IS USED INSTEAD");
-      max_rpcq_sz = MAX_RPC_MESSAGE;
+      max_rpcq_sz = n;
     } else if (max_rpcq_sz < 128) {
       if (pctx.my_rank == 0) WARN("RPC BUFFER SIZE TOO SMALL");
       max_rpcq_sz = 128;
     }
   }
 
+  nnctx.adaptive = is_envset("SHUFFLE_Adaptive_batching");
+  if (nnctx.adaptive) {
+    env = maybe_getenv("SHUFFLE_Min_buffer_per_queue");
+    if (env == NULL) {
+      min_rpcq_sz = DEFAULT_MIN_BUFFER_PER_QUEUE;
+    } else {
+      min_rpcq_sz = atoi(env);
+    }
+    if (min_rpcq_sz > max_rpcq_sz) {
+      min_rpcq_sz = max_rpcq_sz;
+    } else if (min_rpcq_sz < 128) {
+      min_rpcq_sz = 128;
+    }
+    if (pctx.my_rank == 0) {
+      snprintf(msg, sizeof(msg),
+               "adaptive rpc batching is ON\n>>> flush threshold per queue: "
+               "%s - %s",
+               pretty_size(min_rpcq_sz).c_str(),
+               pretty_size(max_rpcq_sz).c_str());
+      INFO(msg);
+    }
+  } else {
+    min_rpcq_sz = max_rpcq_sz;
+  }
+
   nbufs = 0; /* number sender buffers we actually allocated */
+  rpcq_cap = max_rpcq_sz;
 
   rpcqs = static_cast<rpcq_t*>(malloc(nrpcqs * sizeof(rpcq_t)));
   for (i = 0; i < nrpcqs; i++) {
-    if (shuffle_is_rank_receiver(ctx, i)) {
-      rpcqs[i].buf = static_cast<char*>(malloc(max_rpcq_sz));
+    rpcqs[i].dst = qdst[i];
+    rpcqs[i].fwd = qfwd[i];
+    if (qdst[i] != -1) {
+      /* placed near the progress thread that sends them */
+      rpcqs[i].bufs[0] =
+          static_cast<char*>(tplace_alloc(max_rpcq_sz, TPLACE_BG));
       nbufs++;
     } else {
-      rpcqs[i].buf = NULL;
+      rpcqs[i].bufs[0] = NULL;
     }
+    rpcqs[i].bufs[1] = NULL; /* allocated on first flush */
+    rpcqs[i].bulks[0] = rpcqs[i].bulks[1] = HG_BULK_NULL;
+    if (qdst[i] != -1 && nnctx.bulk_thres != 0) {
+      /* both buffers are registered up front */
+      rpcqs[i].bufs[1] =
+          static_cast<char*>(tplace_alloc(max_rpcq_sz, TPLACE_BG));
+      for (int b = 0; b < 2; b++) {
+        void* ptr = rpcqs[i].bufs[b];
+        hg_size_t sz = max_rpcq_sz;
+        if (ptr == NULL) ABORT("malloc");
+        hret = HG_Bulk_create(nnctx.hg_clz, 1, &ptr, &sz, HG_BULK_READ_ONLY,
+                              &rpcqs[i].bulks[b]);
+        if (hret != HG_SUCCESS) ABORT("HG_Bulk_create");
+      }
+    }
+    rv = pthread_mutex_init(&rpcqs[i].mtx, NULL);
+    if (rv) ABORT("pthread_mutex_init");
+    rv = pthread_cond_init(&rpcqs[i].cv, NULL);
+    if (rv) ABORT("pthread_cond_init");
+    rpcqs[i].inflight[0] = rpcqs[i].inflight[1] = 0;
     rpcqs[i].busy = 0;
+    rpcqs[i].cur = 0;
     rpcqs[i].lepo = 0;
     rpcqs[i].sz = 0;
+    rpcqs[i].nfwd = 0;
+    rpcqs[i].thres = rpcq_cap;
+    rpcqs[i].lfill = 0;
+    rpcqs[i].rate = 0;
+    rpcqs[i].lat = 0;
+    rpcqs[i].credits = nnctx.max_credits;
+    rpcqs[i].outstanding = 0;
+  }
+  if (pctx.mb.total != 0) {
+    pctx.mb.used[MB_QUEUES] =
+        nn_shuffler_set_queue_budget(pctx.mb.share[MB_QUEUES]);
   }
   if (pctx.my_rank == 0) {
-    snprintf(msg, sizeof(msg), "rpc buffer: %s x %s (%s total)",
-             pretty_num(nbufs).c_str(), pretty_size(max_rpcq_sz).c_str(),
-             pretty_size(nbufs * max_rpcq_sz).c_str());
+    n = snprintf(msg, sizeof(msg),
+                 "rpc buffer: %s x %s x 2 (up to %s total)",
+                 pretty_num(nbufs).c_str(), pretty_size(max_rpcq_sz).c_str(),
+                 pretty_size(nbufs * max_rpcq_sz * 2).c_str());
+    if (rpcq_cap != max_rpcq_sz) {
+      snprintf(msg + n, sizeof(msg) - n,
+               "\n>>> queues capped at %s each by the memory budget",
+               pretty_size(rpcq_cap).c_str());
+    }
     INFO(msg);
   }
 
-  for (i = 0; i < 5; i++) {
+  if (nnctx.bulk_thres != 0) {
+    rv = pthread_mutex_init(&bulk_mtx, NULL);
+    if (rv) ABORT("pthread_mutex_init");
+    bulk_sz = max_rpcq_sz;
+    env = maybe_getenv("SHUFFLE_Bulk_buffers");
+    if (env == NULL && pctx.mb.total != 0) {
+      n = int(pctx.mb.share[MB_DELIVERY] / bulk_sz / (nnctx.agg ? 2 : 1));
+    } else {
+      n = env != NULL ? atoi(env) : DEFAULT_BULK_BUFFERS;
+    }
+    if (n < 1) n = 1;
+    nbulkbufs = ctx->is_receiver ? n * (nnctx.agg ? 2 : 1) : 0;
+    pctx.mb.used[MB_DELIVERY] = size_t(nbulkbufs) * bulk_sz;
+    bulkbufs = static_cast<bulkbuf_t*>(calloc(n * 2, sizeof(bulkbuf_t)));
+    if (bulkbufs == NULL) ABORT("calloc");
+    for (i = 0; i < nbulkbufs; i++) {
+      /* placed near the threads that consume them */
+      void* ptr = tplace_alloc(bulk_sz, TPLACE_RPC);
+      hg_size_t sz = bulk_sz;
+      if (ptr == NULL) ABORT("malloc");
+      bulkbufs[i].buf = static_cast<char*>(ptr);
+      bulkbufs[i].pool = i / n;
+      hret = HG_Bulk_create(nnctx.hg_clz, 1, &ptr, &sz, HG_BULK_WRITE_ONLY,
+                            &bulkbufs[i].hdl);
+      if (hret != HG_SUCCESS) ABORT("HG_Bulk_create");
+      bulkpools[bulkbufs[i].pool].free.push_back(&bulkbufs[i]);
+    }
+    if (pctx.my_rank == 0) {
+      snprintf(msg, sizeof(msg),
+               "bulk rpcs are ON for msgs of %s or more\n>>> receiver "
+               "buffers: %s x %s (%s total)",
+               pretty_size(nnctx.bulk_thres).c_str(),
+               pretty_num(nbulkbufs).c_str(), pretty_size(bulk_sz).c_str(),
+               pretty_size(double(nbulkbufs) * bulk_sz).c_str());
+      INFO(msg);
+    }
+  }
+
+  for (i = 0; i < 4; i++) {
     rv = pthread_mutex_init(&mtx[i], NULL);
     if (rv) ABORT("pthread_mutex_init");
     rv = pthread_cond_init(&cv[i], NULL);
@@ -1348,20 +2760,83 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
 
   shutting_down = 0;
   num_bg++;
+  pcls = tplace_scope(TPLACE_BG);
   rv = pthread_create(&pid, NULL, bg_work, NULL);
   if (rv) ABORT("pthread_create");
+  tplace_scope(pcls);
   pthread_detach(pid);
 
+  hstg_reset_min(nnctx.iq_dep);
+  nwkqs = 0;
   if (is_envset("SHUFFLE_Use_worker_thread")) {
-    wk_items.reserve(MAX_WORK_ITEM);
-    num_wk++;
-    rv = pthread_create(&pid, NULL, rpc_work, NULL);
-    if (rv) ABORT("pthread_create");
-    pthread_detach(pid);
+    env = maybe_getenv("SHUFFLE_Num_worker_threads");
+    if (env == NULL) {
+      nwkqs = 1;
+    } else {
+      nwkqs = atoi(env);
+      if (nwkqs < 1 || nwkqs > MAX_WORKERS || (nwkqs & (nwkqs - 1)) != 0) {
+        ABORT("bad num of worker threads");
+      }
+    }
+    if (nwkqs > pctx.nlanes) { /* extra workers would share a lane */
+      if (pctx.my_rank == 0) {
+        snprintf(msg, sizeof(msg),
+                 "rpc workers capped at %d (was %d)\n>>> no more workers "
+                 "than write lanes; with plfsdir all writes share 1 lane",
+                 pctx.nlanes, nwkqs);
+        WARN(msg);
+      }
+      nwkqs = pctx.nlanes;
+    }
+    for (i = 0; i < nwkqs; i++) {
+      rv = pthread_mutex_init(&wkqs[i].mtx, NULL);
+      if (rv) ABORT("pthread_mutex_init");
+      rv = pthread_cond_init(&wkqs[i].cv, NULL);
+      if (rv) ABORT("pthread_cond_init");
+      wkqs[i].items.reserve(MAX_WORK_ITEM);
+      if (nwkqs == 1) {
+        strcpy(rpcus[RPCU_WORKER + i].tag, "deliv");
+      } else {
+        snprintf(rpcus[RPCU_WORKER + i].tag, sizeof(rpcus[0].tag), "deliv%d",
+                 i);
+      }
+    }
+    pcls = tplace_scope(TPLACE_RPC);
+    for (i = 0; i < nwkqs; i++) {
+      num_wk++;
+      rv = pthread_create(&pid, NULL, rpc_work,
+                          reinterpret_cast<void*>(intptr_t(i)));
+      if (rv) ABORT("pthread_create");
+      pthread_detach(pid);
+    }
+    tplace_scope(pcls);
+    if (pctx.my_rank == 0 && nwkqs > 1) {
+      snprintf(msg, sizeof(msg),
+               "rpc workers: %d\n>>> incoming writes are partitioned among "
+               "workers by the write lane hash (%d write lanes)",
+               nwkqs, pctx.nlanes);
+      INFO(msg);
+    }
   } else if (pctx.my_rank == 0) {
     WARN("rpc worker disabled\n>>> some rpc stats collection not available");
   }
 
+  if (nnctx.agg) {
+    rv = pthread_mutex_init(&wkqs[FWD_WORKER].mtx, NULL);
+    if (rv) ABORT("pthread_mutex_init");
+    rv = pthread_cond_init(&wkqs[FWD_WORKER].cv, NULL);
+    if (rv) ABORT("pthread_cond_init");
+    wkqs[FWD_WORKER].items.reserve(MAX_WORK_ITEM);
+    strcpy(rpcus[RPCU_WORKER + FWD_WORKER].tag, "fwd");
+    pcls = tplace_scope(TPLACE_RPC);
+    num_fwd++;
+    rv = pthread_create(&pid, NULL, rpc_work,
+                        reinterpret_cast<void*>(intptr_t(FWD_WORKER)));
+    if (rv) ABORT("pthread_create");
+    pthread_detach(pid);
+    tplace_scope(pcls);
+  }
+
   if (pctx.my_rank == 0) {
     snprintf(msg, sizeof(msg),
              "HG_Progress() timeout: %d ms, warn interval: %d ms, "
@@ -1396,7 +2871,6 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
   strcpy(rpcus[RPCU_MAIN].tag, "main");
   strcpy(rpcus[RPCU_LOOPER].tag, "bglooper");
   strcpy(rpcus[RPCU_HGPRO].tag, "-hgpro");
-  strcpy(rpcus[RPCU_WORKER].tag, "deliv");
 
   rpcu_start(RUSAGE_SELF, &rpcus[RPCU_ALLTHREADS]);
 #if defined(__linux)
@@ -1428,8 +2902,18 @@ void nn_shuffler_destroy() {
   shutting_down = 1;
   pthread_cv_notifyall(&cv[wk_cv]);
   pthread_mtx_unlock(&mtx[wk_cv]);
+  for (i = 0; i < nwkqs; i++) {
+    pthread_mtx_lock(&wkqs[i].mtx);
+    pthread_cv_notifyall(&wkqs[i].cv);
+    pthread_mtx_unlock(&wkqs[i].mtx);
+  }
+  if (nnctx.agg) {
+    pthread_mtx_lock(&wkqs[FWD_WORKER].mtx);
+    pthread_cv_notifyall(&wkqs[FWD_WORKER].cv);
+    pthread_mtx_unlock(&wkqs[FWD_WORKER].mtx);
+  }
   pthread_cv_notifyall(&cv[bg_cv]);
-  while (num_bg + num_wk != 0) {
+  while (num_bg + num_wk + num_fwd != 0) {
     pthread_cv_wait(&cv[bg_cv], &mtx[bg_cv]);
   }
   pthread_mtx_unlock(&mtx[bg_cv]);
@@ -1447,14 +2931,32 @@ void nn_shuffler_destroy() {
       assert(rpcqs[i].busy == 0);
       assert(rpcqs[i].sz == 0);
       /* not all buffers are allocated */
-      if (rpcqs[i].buf) {
-        free(rpcqs[i].buf);
+      for (int b = 0; b < 2; b++) {
+        if (rpcqs[i].bulks[b] != HG_BULK_NULL) {
+          HG_Bulk_free(rpcqs[i].bulks[b]);
+        }
+        if (rpcqs[i].bufs[b]) {
+          free(rpcqs[i].bufs[b]);
+        }
       }
+      pthread_cond_destroy(&rpcqs[i].cv);
+      pthread_mutex_destroy(&rpcqs[i].mtx);
     }
 
     free(rpcqs);
   }
 
+  if (bulkbufs != NULL) {
+    for (i = 0; i < nbulkbufs; i++) {
+      HG_Bulk_free(bulkbufs[i].hdl);
+      free(bulkbufs[i].buf);
+    }
+    bulkpools[0].free.clear();
+    bulkpools[1].free.clear();
+    free(bulkbufs);
+    pthread_mutex_destroy(&bulk_mtx);
+  }
+
   if (nnctx.mssg != NULL) {
     mssg_finalize(nnctx.mssg);
   }
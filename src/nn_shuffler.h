@@ -56,6 +56,12 @@
  *    Max num of outstanding rpcs allowed
  *  SHUFFLE_Use_worker_thread
  *    Allocate a dedicated worker thread
+ *  SHUFFLE_Num_worker_threads
+ *    Number of worker threads (a power of 2 no greater than 8) when
+ *      worker threads are in use. incoming writes are partitioned
+ *      among workers by the write lane hash. capped at the number of
+ *      write lanes, so plfsdir (a single lane) always uses 1 worker and
+ *      never splits rpcs
  *  SHUFFLE_Subnet
  *    IP prefix of the subnet we prefer to use
  *  SHUFFLE_Min_port
@@ -63,16 +69,43 @@
  *  SHUFFLE_Max_port
  *    The max port number we can use
  *  SHUFFLE_Buffer_per_queue
- *    Memory allocated for each rpc queue
+ *    Memory allocated for each rpc queue buffer (each queue has two):
+ *      derived from PRELOAD_Memory_budget when not set
+ *  SHUFFLE_Bulk_threshold
+ *    Send rpc msgs of at least this many bytes through HG_Bulk (0 disables):
+ *      receivers pull them from the sender's buffer, which then may be
+ *      larger than the rpc message size limit
+ *  SHUFFLE_Bulk_buffers
+ *    Number of pre-registered receiver buffers for bulk rpcs: derived
+ *      from PRELOAD_Memory_budget when not set
+ *  SHUFFLE_Max_credits
+ *    Max send credits a receiver grants each sender queue (0 disables):
+ *      credits shrink as the receiver's buffers fill up, and a queue out
+ *      of credits keeps buffering instead of being flushed
+ *  SHUFFLE_Adaptive_batching
+ *    Adjust the flush threshold of each rpc queue at runtime according to
+ *      rpc reply latency, rpc slot usage, and receiver backlog
+ *  SHUFFLE_Min_buffer_per_queue
+ *    Min flush threshold for each rpc queue under adaptive batching
  *  SHUFFLE_Random_flush
  *    Flush RPC queues out-of-order
+ *  SHUFFLE_Size_prefixed_records
+ *    Send each write with a 1-byte size and the '\0' after its name
+ *      instead of as back-to-back fixed-sized records. fixed-sized
+ *      records are delivered straight from the rpc buffer; like all
+ *      writes, they are still limited to 255 bytes (id + data)
+ *  SHUFFLE_Node_aggregation
+ *    Keep one rpc queue per destination node instead of per rank (2-hop):
+ *      writes for a node are sent to one of its receivers, which forwards
+ *      them to their final ranks over local rpcs
  *  SHUFFLE_Timeout
- *    RPC timeout
+ *    RPC timeout: abort if no rpc is replied within this amount of time
  */
 
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 #include "preload_shuffle.h"
 
 /* nn_shuffler_init: initialize the shuffle service or die. */
@@ -88,6 +121,38 @@ extern int nn_shuffler_my_rank();
 extern void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
                                 int peer_rank, int rank);
 
+/* nn_shuffler_enqueue_batch: put a group of fixed-sized writes going to the
+ * same peer into an rpc queue. writes are packed back to back in *reqs. */
+extern void nn_shuffler_enqueue_batch(char* reqs, unsigned char req_sz,
+                                      int num_reqs, int epoch, int peer_rank,
+                                      int rank);
+
+/* nn_shuffler_encode: append fixed-sized writes packed back to back in *reqs
+ * to an rpc msg at *dst. return the end of the encoded writes. */
+extern char* nn_shuffler_encode(char* dst, const char* reqs,
+                                unsigned char req_sz, int num_reqs);
+
+/* nn_shuffler_encode_fixed: same as nn_shuffler_encode(), but writes are
+ * appended as fixed-sized records without their size bytes and without the
+ * '\0' after each name. return the end of the encoded records. */
+extern char* nn_shuffler_encode_fixed(char* dst, const char* reqs,
+                                      unsigned char req_sz,
+                                      unsigned char fname_len, int num_reqs);
+
+/* nn_shuffler_expand: restore a msg of fixed-sized records into *out as
+ * writes accepted by nn_shuffler_frames(). only needed by forwarders, as
+ * records are otherwise delivered in place. *out must have room for 2 more
+ * bytes per record. return the size of the restored msg. */
+extern uint32_t nn_shuffler_expand(char* out, const char* input,
+                                   uint32_t input_left, uint32_t rec_sz,
+                                   unsigned char fname_len);
+
+/* nn_shuffler_frames: locate the writes in a decoded rpc msg. set *reqs to
+ * the first write and *req_sz to the size shared by all writes, and return
+ * the number of writes found. abort if the msg is malformed. */
+extern int nn_shuffler_frames(char* input, uint32_t input_left, char** reqs,
+                              unsigned int* req_sz);
+
 /* nn_shuffler_waitcb: wait for all outstanding rpcs to finish. */
 extern void nn_shuffler_waitcb();
 
@@ -97,6 +162,9 @@ extern void nn_shuffler_flushq();
 /* nn_shuffler_bgwait: wait for all background rpc work to finish. */
 extern void nn_shuffler_bgwait();
 
+/* nn_shuffler_epoch_start: reset per-epoch rpc queue state. */
+extern void nn_shuffler_epoch_start();
+
 /* nn_shuffler_destroy: close the shuffler. */
 extern void nn_shuffler_destroy();
 
@@ -106,6 +174,13 @@ extern void nn_shuffler_sleep();
 /* nn_shuffler_wakeup: wake up a sleeping looper. */
 extern void nn_shuffler_wakeup();
 
+/* nn_shuffler_backlog: return the number of incoming rpcs not yet done. */
+extern int nn_shuffler_backlog();
+
+/* nn_shuffler_set_queue_budget: cap the memory used by all rpc queues and
+ * return the memory they may now use. */
+extern size_t nn_shuffler_set_queue_budget(size_t budget);
+
 /*
  * The default min.
  */
@@ -124,6 +199,31 @@ extern void nn_shuffler_wakeup();
  */
 #define DEFAULT_BUFFER_PER_QUEUE 4096
 
+/*
+ * Default min flush threshold for each rpc queue when using adaptive
+ * batching. The max is the size of each queue buffer.
+ */
+#define DEFAULT_MIN_BUFFER_PER_QUEUE 512
+
+/*
+ * Default number of receiver buffers for bulk rpcs.
+ *
+ * Each buffer is as large as an rpc queue buffer. In 2-hop mode
+ * there are twice as many.
+ */
+#define DEFAULT_BULK_BUFFERS 8
+
+/*
+ * Default max send credits per rpc queue.
+ *
+ * Each credit allows one more async rpc to be in flight to the
+ * queue's receiver. Receivers grant fewer credits when their work
+ * queues or bulk buffers are close to full.
+ *
+ * Ignored if rpc is forced to be sync.
+ */
+#define DEFAULT_MAX_CREDITS 8
+
 /*
  * Default num of outstanding rpc.
  *
@@ -137,7 +237,7 @@ extern void nn_shuffler_wakeup();
 /*
  * Default rpc timeout (in secs).
  *
- * Abort when a rpc fails to complete within this amount of time.
+ * Abort when no rpc completes within this amount of time.
  *
  * A server may not be able to finish rpc in time if its
  * in-memory write buffer is full and the background compaction
@@ -160,6 +260,37 @@ extern void nn_shuffler_wakeup();
  */
 #define DEFAULT_VIRTUAL_FACTOR 1024
 
+/*
+ * Max size (log2) of a flattened placement table.
+ *
+ * A table of 2**24 entries takes 64MB per rank.
+ */
+#define MAX_PLACEMENT_TABLE_BITS 24
+
+/*
+ * Default size (log2) of the placement table built for rebalancing
+ * when SHUFFLE_Placement_table_bits is not set.
+ *
+ * Buckets are the unit of rebalancing so more buckets allow a finer
+ * balance, at the cost of a larger per-epoch MPI_Allreduce.
+ */
+#define DEFAULT_REBALANCE_TABLE_BITS 14
+
+/*
+ * Max size (log2) of a placement table that may be rebalanced.
+ *
+ * Each rank keeps an 8-byte write count per bucket and all counts are
+ * summed by an MPI_Allreduce every epoch: 8MB for 2**20 buckets. Larger
+ * jobs get fewer buckets per rank rather than a larger reduction.
+ */
+#define MAX_REBALANCE_TABLE_BITS 20
+
+/*
+ * Default load imbalance (in percent of the average receiver load)
+ * tolerated before placement is rebalanced.
+ */
+#define DEFAULT_REBALANCE_THRESHOLD 10
+
 /*
  * The default subnet.
  *
@@ -97,6 +97,12 @@ hg_return_t nn_shuffler_write_in_proc(hg_proc_t proc, void* data) {
     if (hret != HG_SUCCESS) return (hret);
     hret = hg_proc_hg_uint32_t(proc, &in->sz);
     if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->packed);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->rec_sz);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->fwd_sz);
+    if (hret != HG_SUCCESS) return (hret);
 
     hret = hg_proc_hg_int32_t(proc, &in->dst);
     if (hret != HG_SUCCESS) return (hret);
@@ -112,6 +118,12 @@ hg_return_t nn_shuffler_write_in_proc(hg_proc_t proc, void* data) {
     if (hret != HG_SUCCESS) return (hret);
     hret = hg_proc_hg_uint32_t(proc, &in->sz);
     if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->packed);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->rec_sz);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->fwd_sz);
+    if (hret != HG_SUCCESS) return (hret);
 
     hret = hg_proc_hg_int32_t(proc, &in->dst);
     if (hret != HG_SUCCESS) return (hret);
@@ -120,7 +132,15 @@ hg_return_t nn_shuffler_write_in_proc(hg_proc_t proc, void* data) {
     hret = hg_proc_hg_int32_t(proc, &in->epo);
     if (hret != HG_SUCCESS) return (hret);
 
-    hret = hg_proc_memcpy(proc, in->msg, in->sz);
+    if (in->msg != NULL) {
+      hret = hg_proc_memcpy(proc, in->msg, in->sz);
+    } else if (in->sz != 0) {
+      /* zero-copy: point msg directly into the proc buffer. the msg stays
+       * valid until the rpc handle is destroyed. */
+      in->msg = hg_proc_save_ptr(proc, in->sz);
+      if (in->msg == NULL) return HG_OTHER_ERROR;
+      hret = hg_proc_restore_ptr(proc, in->msg, in->sz);
+    }
 
   } else {
     hret = HG_SUCCESS; /* noop */
@@ -129,6 +149,38 @@ hg_return_t nn_shuffler_write_in_proc(hg_proc_t proc, void* data) {
   return hret;
 }
 
+hg_return_t nn_shuffler_write_bulk_in_proc(hg_proc_t proc, void* data) {
+  hg_return_t hret;
+
+  write_in_t* in = static_cast<write_in_t*>(data);
+  hg_proc_op_t op = hg_proc_get_op(proc);
+
+  if (op == HG_ENCODE || op == HG_DECODE) {
+    hret = hg_proc_hg_uint32_t(proc, &in->hash_sig);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->sz);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->packed);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->rec_sz);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &in->fwd_sz);
+    if (hret != HG_SUCCESS) return (hret);
+
+    hret = hg_proc_hg_int32_t(proc, &in->dst);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_int32_t(proc, &in->src);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_int32_t(proc, &in->epo);
+    if (hret != HG_SUCCESS) return (hret);
+  }
+
+  /* on HG_FREE, this releases the bulk handle obtained on HG_DECODE */
+  hret = hg_proc_hg_bulk_t(proc, &in->bulk);
+
+  return hret;
+}
+
 hg_return_t nn_shuffler_write_out_proc(hg_proc_t proc, void* data) {
   hg_return_t hret;
 
@@ -137,8 +189,16 @@ hg_return_t nn_shuffler_write_out_proc(hg_proc_t proc, void* data) {
 
   if (op == HG_ENCODE) {
     hret = hg_proc_hg_int32_t(proc, &out->rv);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &out->qdep);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &out->credits);
   } else if (op == HG_DECODE) {
     hret = hg_proc_hg_int32_t(proc, &out->rv);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &out->qdep);
+    if (hret != HG_SUCCESS) return (hret);
+    hret = hg_proc_hg_uint32_t(proc, &out->credits);
   } else {
     hret = HG_SUCCESS; /* noop */
   }
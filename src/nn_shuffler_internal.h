@@ -54,6 +54,11 @@
  */
 #define MAX_RPC_MESSAGE (524288)
 
+/*
+ * The max allowed size for a single rpc message sent through HG_Bulk.
+ */
+#define MAX_BULK_MESSAGE (8 << 20)
+
 #define RPC_FAILED_FILENAME \
   (strrchr(__FILE__, '/') ? strrchr(__FILE__, '/') + 1 : __FILE__)
 #define RPC_FAILED(msg, ret) \
@@ -74,6 +79,11 @@ inline void rpc_failed(const char* msg, hg_return_t ret, const char* func,
   abort();
 }
 
+/*
+ * Max number of rpc worker threads.
+ */
+#define MAX_WORKERS 8
+
 /*
  * nn_rusage: cpu usage report.
  */
@@ -99,6 +109,10 @@ typedef struct nn_ctx {
   hg_class_t* hg_clz;
   hg_context_t* hg_ctx;
   hg_id_t hg_id;
+  hg_id_t hg_fwd_id; /* 2-hop rpcs to be forwarded by the receiver */
+  /* same as above, but with payloads pulled by the receiver via HG_Bulk */
+  hg_id_t hg_bulk_id;
+  hg_id_t hg_fwd_bulk_id;
 
   /* hg_progress intervals */
   hstg_t hg_intvl;
@@ -112,18 +126,29 @@ typedef struct nn_ctx {
   int force_sync;   /* avoid async rpc */
   int cache_hlds;   /* cache mercury rpc handles */
   int hash_sig;     /* generate a hash signature for each rpc */
+  int adaptive;     /* adapt rpc batch sizes at runtime */
+  int agg;          /* 2-hop: aggregate rpcs per destination node */
+  /* min msg size for an rpc to be sent through HG_Bulk (0 if bulk is off) */
+  hg_uint32_t bulk_thres;
+  /* max send credits granted per rpc queue (0 if credits are off) */
+  hg_uint32_t max_credits;
+  /* size of the fixed-sized records we send (0 if writes are sent with a
+   * size byte each) */
+  hg_uint32_t rec_sz;
 
   int paranoid_checks;
 
   /* MSSG context */
   mssg_t* mssg;
 
-  /* rpc usage */
-  nn_rusage_t r[5];
+  /* rpc usage (workers followed by the 2-hop forwarder) */
+  nn_rusage_t r[4 + MAX_WORKERS + 1];
 
   /* rpc stats */
   unsigned long long total_writes; /* total number of writes shuffled */
   unsigned long long total_msgsz;  /* total rpc msg size */
+  unsigned long long total_fwds;   /* total writes forwarded (2-hop) */
+  unsigned long long total_bulks;  /* total rpcs pulled through HG_Bulk */
 
   /* rpc incoming queue depth */
   hstg_t iq_dep;
@@ -135,15 +160,23 @@ extern nn_ctx_t nnctx;
 typedef struct write_in {
   hg_uint32_t hash_sig; /* hash signature of the entire payload */
   hg_uint32_t sz;       /* msg size */
+  hg_uint32_t packed;   /* non-zero if msg is packed */
+  hg_uint32_t rec_sz;   /* size of each record (0 if each has a size byte) */
+  /* 2-hop rpcs: bytes at the end of msg giving the final receiver of each
+   * write (a 2-byte index among the receivers of its node), 0 otherwise */
+  hg_uint32_t fwd_sz;
 
   hg_int32_t dst;
   hg_int32_t src;
   hg_int32_t epo;
   void* msg;
+  hg_bulk_t bulk; /* bulk rpcs: sender memory holding msg */
 } write_in_t;
 
 typedef struct write_out {
-  hg_int32_t rv; /* ret value of the write operation */
+  hg_int32_t rv;       /* ret value of the write operation */
+  hg_uint32_t qdep;    /* receiver backlog (num rpcs yet to be processed) */
+  hg_uint32_t credits; /* rpcs the sender may have in flight to us */
 } write_out_t;
 
 typedef struct write_cb {
@@ -154,7 +187,10 @@ typedef struct write_cb {
 typedef struct write_async_cb {
   void* arg1;
   void* arg2;
-  int slot; /* cb slot used */
+  uint64_t ts; /* time the rpc was sent */
+  int peer;    /* destination of the rpc */
+  int slot;    /* cb slot used */
+  hg_bulk_t bulk; /* bulk rpcs: rpc queue buffer to return once replied */
 } write_async_cb_t;
 
 typedef struct write_info {
@@ -166,6 +202,8 @@ typedef struct write_info {
 void nn_vector_random_shuffle(int rank, std::vector<int>* vec);
 hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t*);
 hg_return_t nn_shuffler_write_rpc_handler_wrapper(hg_handle_t handle);
+hg_return_t nn_shuffler_write_fwd_handler_wrapper(hg_handle_t handle);
+hg_return_t nn_shuffler_write_bulk_handler_wrapper(hg_handle_t handle);
 hg_return_t nn_shuffler_write_async_handler(const struct hg_cb_info* info);
 hg_return_t nn_shuffler_write_handler(const struct hg_cb_info* info);
 
@@ -176,21 +214,26 @@ inline void* nn_shuffler_hg_ctx(void) { return nnctx.hg_ctx; }
 /* encoding decoding procedure */
 hg_return_t nn_shuffler_write_out_proc(hg_proc_t proc, void* data);
 hg_return_t nn_shuffler_write_in_proc(hg_proc_t proc, void* data);
+/* bulk rpcs: in->bulk is sent in place of msg. msg is left untouched */
+hg_return_t nn_shuffler_write_bulk_in_proc(hg_proc_t proc, void* data);
 
 hg_uint32_t nn_shuffler_maybe_hashsig(const write_in_t* in);
 
 /*
  * nn_shuffler_write_send_async: asynchronously send one or more encoded writes
  * to a remote peer and return immediately without waiting for response.
+ * id is one of nnctx.hg_id, nnctx.hg_fwd_id (2-hop rpcs), or their bulk
+ * counterparts, in which case the memory behind write_in->bulk must stay
+ * intact until the rpc is replied.
  *
  * return 0 on success, or EOF on errors.
  */
 int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
-                                 void* arg1, void* arg2);
+                                 hg_id_t id, void* arg1, void* arg2);
 /*
  * nn_shuffler_write_send: send one or more encoded writes to a remote peer
  * and wait for its response.
  *
  * return 0 on success, or EOF on errors.
  */
-int nn_shuffler_write_send(write_in_t* write_in, int peer_rank);
+int nn_shuffler_write_send(write_in_t* write_in, int peer_rank, hg_id_t id);
@@ -0,0 +1,834 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * preload-bench.cc  microbenchmarks for the shuffle hot path
+ *
+ * each component is run in a tight loop over a pool of pre-generated
+ * particles and reported in ns/op, plus cycles/op and instructions/op
+ * from papi when hardware counters are available.
+ *
+ * by default (offline mode) no mpi, mercury, or deltafs is touched: a
+ * placement group is built directly from ch-placement for every given
+ * world size and virtual factor, and rpc msgs are encoded/decoded in
+ * memory for every given particle size.  components are:
+ *
+ *  target        shuffle_target() through ch-placement
+ *  target_tbl    shuffle_target() through a flattened placement table (-t)
+ *  target_batch  shuffle_target_batch() through the same table (-t)
+ *  encode        nn_shuffler_encode() one write at a time (enqueue path)
+ *  decode        nn_shuffler_frames() over whole msgs (rpc handler path)
+ *  pack          shuffle_msg_pack() over whole msgs (includes a msg copy)
+ *  unpack        shuffle_msg_unpack() over whole packed msgs
+ *  verify        round trips of whole msgs through shuffle_msg_pack() and
+ *                  shuffle_msg_unpack() (size-prefixed and fixed-sized
+ *                  records) and through nn_shuffler_expand(), checked
+ *                  against the input.  aborts on any mismatch
+ *  hstg          hstg_add()
+ *
+ * with -M (online mode) we run as an mpi job with the preload library
+ * fully up (link order makes us the preload library's MPI_Init) and bench
+ * the real shuffle context.  particle sizes, the world size, and the
+ * placement config then come from the usual PRELOAD_* and SHUFFLE_* env
+ * vars.  components are:
+ *
+ *  target        shuffle_target() on the live shuffle context
+ *  write         preload_write() into the current epoch (final write)
+ *  fwrite        fopen/fwrite/fclose of a particle (full write path,
+ *                  going through mercury unless PRELOAD_Bypass_shuffle
+ *                  is set)
+ *
+ * online numbers are averaged over all ranks.  PRELOAD_Skip_papi is
+ * forced on since papi only allows one running event set per thread.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <mpi.h>
+
+#include <ch-placement.h>
+#ifdef PRELOAD_HAS_PAPI
+#include <papi.h>
+#endif
+
+#include "hstg.h"
+#include "nn_shuffler.h"
+#include "preload_internal.h"
+#include "preload_shuffle.h"
+
+#include <string>
+#include <vector>
+
+/*
+ * default values
+ */
+#define DEF_OPS 1000000        /* ops per component per config */
+#define DEF_POOL 65536         /* particles in the pool */
+#define DEF_WORLDS "16,256,4096"
+#define DEF_VFS "1,64,1024"
+#define DEF_SIZES "8,40,128"   /* particle data sizes */
+#define DEF_ID_SIZE 8          /* particle id size */
+#define DEF_BATCH 64           /* names per shuffle_target_batch() */
+
+/*
+ * gs: shared global data (e.g. from the command line)
+ */
+static struct gs {
+  size_t ops;                /* ops per run */
+  size_t pool;               /* particles in the pool */
+  std::vector<int> worlds;   /* world sizes */
+  std::vector<int> vfs;      /* virtual factors */
+  std::vector<int> sizes;    /* particle data sizes */
+  int id_size;               /* particle id size */
+  int extra_size;            /* particle padding */
+  const char* proto;         /* placement protocol */
+  int tbl_bits;              /* placement table bits (0 to skip) */
+  int batch;                 /* names per target batch */
+  size_t msg_sz;             /* rpc msg size */
+  const char* only;          /* comma separated components to run */
+  int online;                /* run inside the preload library */
+  int rank;
+  int size;
+} g;
+
+/*
+ * meter: wall clock and papi counters over a run
+ */
+#define METER_NCTRS 2 /* cycles, instructions */
+
+struct meter {
+  struct timespec t0;
+  double ns;
+  long long ctrs[METER_NCTRS];
+  int nctrs;
+};
+
+static double sink = 0; /* keeps results alive */
+
+#ifdef PRELOAD_HAS_PAPI
+static int papi_set = PAPI_NULL;
+static int papi_nctrs = 0;
+
+/*
+ * papi_prepare: set up counters for cycles and instructions.  counters
+ * not supported by the hardware (e.g. in a vm) are skipped.
+ */
+static void papi_prepare() {
+  static const int evts[METER_NCTRS] = {PAPI_TOT_CYC, PAPI_TOT_INS};
+  int i;
+
+  if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
+    fprintf(stderr, "!!! WARNING !!! papi init failed: no counters\n");
+    return;
+  }
+  if (PAPI_create_eventset(&papi_set) != PAPI_OK) {
+    fprintf(stderr, "!!! WARNING !!! no papi event set: no counters\n");
+    papi_set = PAPI_NULL;
+    return;
+  }
+  for (i = 0; i < METER_NCTRS; i++) {
+    if (PAPI_add_event(papi_set, evts[i]) != PAPI_OK) break;
+    papi_nctrs++;
+  }
+  if (papi_nctrs < METER_NCTRS && g.rank == 0) {
+    fprintf(stderr, "!!! WARNING !!! only %d of %d papi counters\n",
+            papi_nctrs, METER_NCTRS);
+  }
+}
+#endif
+
+static void meter_start(meter* m) {
+  memset(m, 0, sizeof(*m));
+#ifdef PRELOAD_HAS_PAPI
+  if (papi_set != PAPI_NULL && papi_nctrs != 0) {
+    if (PAPI_reset(papi_set) != PAPI_OK) ABORT("PAPI_reset");
+    if (PAPI_start(papi_set) != PAPI_OK) ABORT("PAPI_start");
+    m->nctrs = papi_nctrs;
+  }
+#endif
+  clock_gettime(CLOCK_MONOTONIC, &m->t0);
+}
+
+static void meter_stop(meter* m) {
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+#ifdef PRELOAD_HAS_PAPI
+  if (m->nctrs != 0) {
+    if (PAPI_stop(papi_set, m->ctrs) != PAPI_OK) ABORT("PAPI_stop");
+  }
+#endif
+  m->ns = (t1.tv_sec - m->t0.tv_sec) * 1e9 + (t1.tv_nsec - m->t0.tv_nsec);
+}
+
+/*
+ * report: print one result line.  in online mode, results are averaged
+ * over all ranks and only printed by rank 0.
+ */
+static void report(const char* comp, const char* wsz, const char* vf,
+                   int rsz, size_t ops, meter* m) {
+  double v[1 + METER_NCTRS];
+  double sum[1 + METER_NCTRS];
+  double maxns;
+  char tmp[2][32];
+  int i;
+
+  v[0] = m->ns;
+  for (i = 0; i < METER_NCTRS; i++) v[1 + i] = double(m->ctrs[i]);
+  maxns = m->ns;
+  if (g.online) {
+    MPI_Reduce(v, sum, 1 + METER_NCTRS, MPI_DOUBLE, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(&m->ns, &maxns, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    for (i = 0; i < 1 + METER_NCTRS; i++) v[i] = sum[i] / g.size;
+  }
+  if (g.rank != 0) return;
+
+  for (i = 0; i < 2; i++) {
+    if (i < m->nctrs) {
+      snprintf(tmp[i], sizeof(tmp[i]), "%.1f", v[1 + i] / ops);
+    } else {
+      snprintf(tmp[i], sizeof(tmp[i]), "-");
+    }
+  }
+  printf("%-13s %6s %5s %4d %10zu %9.2f %9.2f %9s %9s\n", comp, wsz, vf, rsz,
+         ops, v[0] / ops, maxns / ops, tmp[0], tmp[1]);
+  fflush(stdout);
+}
+
+static void report_header() {
+  if (g.rank != 0) return;
+  printf("%-13s %6s %5s %4s %10s %9s %9s %9s %9s\n", "component", "wsz",
+         "vf", "rsz", "ops", "ns/op", "max-ns/op", "cyc/op", "ins/op");
+}
+
+static int enabled(const char* comp) {
+  const char* p;
+  size_t n;
+
+  if (g.only == NULL) return 1;
+  n = strlen(comp);
+  for (p = g.only; p != NULL; p = strchr(p, ',')) {
+    if (*p == ',') p++;
+    if (strncmp(p, comp, n) == 0 && (p[n] == ',' || p[n] == 0)) return 1;
+  }
+  return 0;
+}
+
+/*
+ * particle pool: names are id_size chars (plus a '\0') with a stride of
+ * id_size + 1.  reqs are full shuffle requests (name, '\0', data,
+ * padding) packed back to back.
+ */
+static uint64_t mix(uint64_t x) { /* splitmix64 */
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+static void make_names(std::vector<char>* names, int id_size) {
+  static const char b64[] =
+      "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz-_";
+  uint64_t h;
+  size_t i;
+  int j;
+
+  names->assign(g.pool * (id_size + 1), 0);
+  for (i = 0; i < g.pool; i++) {
+    char* const p = &(*names)[i * (id_size + 1)];
+    h = mix(i + uint64_t(g.rank) * g.pool);
+    for (j = 0; j < id_size; j++) {
+      if (j % 10 == 0 && j != 0) h = mix(h);
+      p[j] = b64[(h >> (6 * (j % 10))) & 63];
+    }
+  }
+}
+
+static void make_reqs(std::vector<char>* reqs, const std::vector<char>& names,
+                      int id_size, int data_len, int req_sz) {
+  size_t i;
+  int j;
+
+  reqs->assign(g.pool * req_sz, 0);
+  for (i = 0; i < g.pool; i++) {
+    char* const p = &(*reqs)[i * req_sz];
+    memcpy(p, &names[i * (id_size + 1)], id_size);
+    for (j = 0; j < data_len; j++) {
+      p[id_size + 1 + j] = char(mix(i * 256 + j));
+    }
+  }
+}
+
+/*
+ * placement benchmarks
+ */
+static void bench_target(shuffle_ctx_t* ctx, const std::vector<char>& names,
+                         const char* comp, const char* wsz, const char* vf) {
+  const int stride = ctx->fname_len + 1;
+  char* const base = const_cast<char*>(&names[0]);
+  meter m;
+  size_t i;
+  size_t j;
+  int acc;
+
+  acc = 0;
+  meter_start(&m);
+  for (i = 0, j = 0; i < g.ops; i++) {
+    acc += shuffle_target(ctx, base + j * stride, ctx->fname_len);
+    if (++j == g.pool) j = 0;
+  }
+  meter_stop(&m);
+  sink += acc;
+  report(comp, wsz, vf, ctx->fname_len, g.ops, &m);
+}
+
+static void bench_target_batch(shuffle_ctx_t* ctx, const char* wsz,
+                               const char* vf) {
+  const int n = g.batch;
+  std::vector<char> names; /* without the '\0', as staged by the writer */
+  std::vector<int> targets(n);
+  size_t nbatches;
+  size_t i;
+  size_t j;
+  meter m;
+
+  names.resize(g.pool * ctx->fname_len);
+  for (i = 0; i < g.pool; i++) {
+    for (j = 0; j < ctx->fname_len; j++) {
+      names[i * ctx->fname_len + j] = char('a' + mix(i * 256 + j) % 26);
+    }
+  }
+  nbatches = g.ops / n;
+  meter_start(&m);
+  for (i = 0, j = 0; i < nbatches; i++) {
+    shuffle_target_batch(ctx, &names[j * ctx->fname_len], ctx->fname_len, n,
+                         &targets[0]);
+    sink += targets[n - 1];
+    j += n;
+    if (j + n > g.pool) j = 0;
+  }
+  meter_stop(&m);
+  report("target_batch", wsz, vf, ctx->fname_len, nbatches * n, &m);
+}
+
+static void bench_placement() {
+  std::vector<char> names;
+  shuffle_ctx_t ctx;
+  char wsz[16];
+  char vf[16];
+  size_t a;
+  size_t b;
+
+  make_names(&names, g.id_size);
+  for (a = 0; a < g.worlds.size(); a++) {
+    for (b = 0; b < g.vfs.size(); b++) {
+      memset(&ctx, 0, sizeof(ctx));
+      ctx.fname_len = g.id_size;
+      ctx.receiver_rate = 1;
+      ctx.receiver_mask = ~static_cast<unsigned int>(0);
+      ctx.world_sz = g.worlds[a];
+      ctx.my_rank = 0;
+      ctx.chp = ch_placement_initialize(g.proto, g.worlds[a], g.vfs[b], 0);
+      if (ctx.chp == NULL) ABORT("ch_init");
+      snprintf(wsz, sizeof(wsz), "%d", g.worlds[a]);
+      snprintf(vf, sizeof(vf), "%d", g.vfs[b]);
+
+      if (enabled("target")) {
+        bench_target(&ctx, names, "target", wsz, vf);
+      }
+      if (g.tbl_bits > 0 && g.worlds[a] != 1) {
+        shuffle_build_ptbl(&ctx, g.tbl_bits);
+        if (enabled("target_tbl")) {
+          bench_target(&ctx, names, "target_tbl", wsz, vf);
+        }
+        if (enabled("target_batch")) {
+          bench_target_batch(&ctx, wsz, vf);
+        }
+        free(ctx.ptbl);
+      }
+
+      ch_placement_finalize(ctx.chp);
+    }
+  }
+}
+
+/*
+ * verify_round_trip: pack and unpack a msg of size-prefixed writes (rec_sz
+ * = 0) or of fixed-sized records (rec_sz = req_sz - 1), making sure we get
+ * the size-prefixed msg back.  a msg that is not packed must be left as is.
+ * return 1 if the msg is packed, or 0 otherwise.
+ */
+static int verify_round_trip(shuffle_ctx_t* ctx, const std::vector<char>& in,
+                             size_t rec_sz, const std::vector<char>& msg) {
+  std::vector<char> work(in);
+  std::vector<char> out;
+  size_t psz;
+
+  psz = shuffle_msg_pack(ctx, &work[0], work.size(), rec_sz);
+  if (psz == 0) {
+    if (work != in) ABORT("msg changed but not packed");
+    return 0;
+  }
+  out.assign(shuffle_msg_unpacked_size(ctx, &work[0], psz), 1);
+  if (out.size() != msg.size()) ABORT("bad unpacked size");
+  shuffle_msg_unpack(ctx, &work[0], psz, &out[0]);
+  if (out != msg) ABORT("pack/unpack mismatch");
+  return 1;
+}
+
+/*
+ * verify_codec: check the round trips of a msg of writes taken from the
+ * pool, whose names rarely share prefixes, and of the same writes with the
+ * first half of their names made the same, which must pack unless the msg
+ * or the names are too short.  in both cases the fixed-sized records (when
+ * writes carry any data) must also expand back to the msg.
+ */
+static void verify_codec(shuffle_ctx_t* ctx, const std::vector<char>& reqs,
+                         int req_sz, size_t msg_reqs) {
+  std::vector<char> tmp(reqs.begin(), reqs.begin() + msg_reqs * req_sz);
+  std::vector<char> fixed;
+  std::vector<char> msg;
+  std::vector<char> out;
+  uint32_t esz;
+  size_t i;
+  int packed;
+  int pass;
+
+  for (pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      for (i = 0; i < msg_reqs; i++) {
+        memset(&tmp[i * req_sz], 'p', ctx->fname_len / 2);
+      }
+    }
+    msg.resize(msg_reqs * (req_sz + 1));
+    nn_shuffler_encode(&msg[0], &tmp[0], req_sz, msg_reqs);
+    fixed.resize(msg_reqs * (req_sz - 1));
+    nn_shuffler_encode_fixed(&fixed[0], &tmp[0], req_sz, ctx->fname_len,
+                             msg_reqs);
+
+    packed = verify_round_trip(ctx, msg, 0, msg);
+    if (pass == 1 && msg_reqs >= 4 && !packed) ABORT("cannot pack msg");
+    if (req_sz - 1 <= ctx->fname_len) continue; /* no fixed-sized format */
+    packed = verify_round_trip(ctx, fixed, req_sz - 1, msg);
+    if (pass == 1 && msg_reqs >= 4 && ctx->fname_len >= 4 && !packed)
+      ABORT("cannot pack fixed-sized records");
+
+    out.assign(msg.size(), 1);
+    esz = nn_shuffler_expand(&out[0], &fixed[0], fixed.size(), req_sz - 1,
+                             ctx->fname_len);
+    if (esz != msg.size() || out != msg) ABORT("expand mismatch");
+  }
+}
+
+/*
+ * codec benchmarks
+ */
+static void bench_codec(int data_len) {
+  const int req_sz = g.id_size + 1 + data_len + g.extra_size;
+  std::vector<char> names;
+  std::vector<char> reqs;
+  std::vector<char> msg;
+  std::vector<char> work;
+  std::vector<char> packed;
+  shuffle_ctx_t ctx;
+  size_t msg_reqs;
+  size_t nmsgs;
+  size_t psz;
+  size_t i;
+  size_t j;
+  char* out;
+  char* r;
+  unsigned int rsz;
+  meter m;
+
+  if (req_sz > 255) {
+    fprintf(stderr, "!!! WARNING !!! skip particle size %d: too large\n",
+            data_len);
+    return;
+  }
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.fname_len = g.id_size;
+  ctx.data_len = data_len;
+  ctx.extra_data_len = g.extra_size;
+  ctx.pack = 1;
+
+  make_names(&names, g.id_size);
+  make_reqs(&reqs, names, g.id_size, data_len, req_sz);
+  msg_reqs = g.msg_sz / (req_sz + 1);
+  if (msg_reqs == 0) msg_reqs = 1;
+  if (msg_reqs > g.pool) msg_reqs = g.pool;
+  msg.resize(msg_reqs * (req_sz + 1));
+  nn_shuffler_encode(&msg[0], &reqs[0], req_sz, msg_reqs);
+  nmsgs = g.ops / msg_reqs;
+  if (nmsgs == 0) nmsgs = 1;
+
+  if (enabled("encode")) {
+    work.resize(msg.size());
+    meter_start(&m);
+    for (i = 0, j = 0, out = &work[0]; i < g.ops; i++) {
+      out = nn_shuffler_encode(out, &reqs[j * req_sz], req_sz, 1);
+      if (++j == msg_reqs) { /* msg full, start a new one */
+        sink += out[-1];
+        j = 0;
+        out = &work[0];
+      }
+    }
+    meter_stop(&m);
+    report("encode", "-", "-", req_sz, g.ops, &m);
+  }
+
+  if (enabled("decode")) {
+    meter_start(&m);
+    for (i = 0; i < nmsgs; i++) {
+      sink += nn_shuffler_frames(&msg[0], msg.size(), &r, &rsz);
+    }
+    meter_stop(&m);
+    report("decode", "-", "-", req_sz, nmsgs * msg_reqs, &m);
+  }
+
+  work.resize(msg.size());
+  if (enabled("pack")) {
+    meter_start(&m);
+    for (i = 0; i < nmsgs; i++) {
+      memcpy(&work[0], &msg[0], msg.size());
+      sink += shuffle_msg_pack(&ctx, &work[0], msg.size(), 0);
+    }
+    meter_stop(&m);
+    report("pack", "-", "-", req_sz, nmsgs * msg_reqs, &m);
+  }
+
+  if (enabled("unpack")) {
+    packed = msg;
+    psz = shuffle_msg_pack(&ctx, &packed[0], packed.size(), 0);
+    if (psz == 0) ABORT("cannot pack msg");
+    work.resize(shuffle_msg_unpacked_size(&ctx, &packed[0], psz));
+    meter_start(&m);
+    for (i = 0; i < nmsgs; i++) {
+      shuffle_msg_unpack(&ctx, &packed[0], psz, &work[0]);
+      sink += work[work.size() - 1];
+    }
+    meter_stop(&m);
+    report("unpack", "-", "-", req_sz, nmsgs * msg_reqs, &m);
+  }
+
+  if (enabled("verify")) {
+    meter_start(&m);
+    verify_codec(&ctx, reqs, req_sz, msg_reqs);
+    meter_stop(&m);
+    report("verify", "-", "-", req_sz, msg_reqs, &m);
+  }
+}
+
+static void bench_hstg() {
+  std::vector<double> vals(g.pool);
+  hstg_t h;
+  size_t i;
+  size_t j;
+  meter m;
+
+  for (i = 0; i < g.pool; i++) { /* latency-like: mostly small, long tail */
+    vals[i] = double(mix(i) % 1000) * double(1 + mix(i + 1) % 64);
+  }
+  memset(h, 0, sizeof(h));
+  hstg_reset_min(h);
+  meter_start(&m);
+  for (i = 0, j = 0; i < g.ops; i++) {
+    hstg_add(h, vals[j]);
+    if (++j == g.pool) j = 0;
+  }
+  meter_stop(&m);
+  sink += hstg_num(h);
+  report("hstg", "-", "-", sizeof(double), g.ops, &m);
+}
+
+/*
+ * online benchmarks: run after MPI_Init with an epoch open
+ */
+static void bench_online() {
+  const int id_size = pctx.particle_id_size;
+  const int data_len = pctx.particle_size;
+  std::vector<char> names;
+  std::vector<char> data;
+  char path[PATH_MAX];
+  char wsz[16];
+  size_t i;
+  size_t j;
+  meter m;
+  FILE* fp;
+  DIR* d;
+
+  if (g.rank == 0) {
+    if (mkdir(pctx.deltafs_mntp, 0777) != 0 && errno != EEXIST) {
+      ABORT("mkdir");
+    }
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+  d = opendir(pctx.deltafs_mntp); /* starts an epoch */
+  if (d == NULL) ABORT("opendir");
+
+  make_names(&names, id_size);
+  data.resize(data_len + 1);
+  for (i = 0; i < size_t(data_len); i++) data[i] = char('a' + i % 26);
+  snprintf(wsz, sizeof(wsz), "%d", g.size);
+
+  if (!IS_BYPASS_SHUFFLE(pctx.mode) && enabled("target")) {
+    bench_target(&pctx.sctx, names, "target", wsz, "-");
+  }
+
+  if (enabled("write")) {
+    MPI_Barrier(MPI_COMM_WORLD);
+    meter_start(&m);
+    for (i = 0, j = 0; i < g.ops; i++) {
+      if (preload_write(&names[j * (id_size + 1)], id_size, &data[0],
+                        data_len, -1) != 0) {
+        ABORT("preload_write");
+      }
+      if (++j == g.pool) j = 0;
+    }
+    meter_stop(&m);
+    report("write", wsz, "-", id_size + 1 + data_len, g.ops, &m);
+  }
+
+  if (enabled("fwrite")) {
+    MPI_Barrier(MPI_COMM_WORLD);
+    meter_start(&m);
+    for (i = 0, j = 0; i < g.ops; i++) {
+      snprintf(path, sizeof(path), "%s/%s", pctx.plfsdir,
+               &names[j * (id_size + 1)]);
+      fp = fopen(path, "a");
+      if (fp == NULL) ABORT("fopen");
+      if (fwrite(&data[0], 1, data_len, fp) != size_t(data_len)) {
+        ABORT("fwrite");
+      }
+      if (fclose(fp) != 0) ABORT("fclose");
+      if (++j == g.pool) j = 0;
+    }
+    meter_stop(&m);
+    report("fwrite", wsz, "-", id_size + 1 + data_len, g.ops, &m);
+  }
+
+  closedir(d);
+}
+
+/*
+ * usage
+ */
+static void usage(const char* argv0, const char* msg) {
+  if (msg) fprintf(stderr, "%s: %s\n", argv0, msg);
+  fprintf(stderr, "usage: %s [options]\n", argv0);
+  fprintf(stderr, "\noptions:\n");
+  fprintf(stderr, "\t-n ops       ops per component and config\n");
+  fprintf(stderr, "\t-N pool      particles in the pool\n");
+  fprintf(stderr, "\t-w list      world sizes (e.g. 16,256)\n");
+  fprintf(stderr, "\t-v list      virtual factors (e.g. 1,64)\n");
+  fprintf(stderr, "\t-s list      particle data sizes (e.g. 8,40)\n");
+  fprintf(stderr, "\t-i bytes     particle id size\n");
+  fprintf(stderr, "\t-x bytes     particle extra (padding) size\n");
+  fprintf(stderr, "\t-p proto     placement protocol\n");
+  fprintf(stderr, "\t-t bits      placement table bits (0 to skip)\n");
+  fprintf(stderr, "\t-b names     names per target batch\n");
+  fprintf(stderr, "\t-q bytes     rpc msg size for the codecs\n");
+  fprintf(stderr, "\t-c list      only run the listed components\n");
+  fprintf(stderr, "\t-M           bench the live preload library under "
+                  "mpi\n");
+  exit(1);
+}
+
+static void parse_list(std::vector<int>* v, const char* s, const char* argv0) {
+  char* end;
+  long n;
+
+  v->clear();
+  while (*s != 0) {
+    n = strtol(s, &end, 10);
+    if (end == s || n <= 0) usage(argv0, "bad list");
+    v->push_back(int(n));
+    s = end;
+    if (*s == ',') s++;
+  }
+  if (v->empty()) usage(argv0, "empty list");
+}
+
+static void print_options() {
+  std::string tmp;
+  size_t i;
+
+  if (g.rank != 0) return;
+  printf("== preload-bench (%s)\n", g.online ? "online" : "offline");
+  printf("   ops        = %zu\n", g.ops);
+  printf("   pool       = %zu\n", g.pool);
+  if (!g.online) {
+    for (i = 0; i < g.worlds.size(); i++)
+      tmp += (i ? "," : "") + std::to_string(g.worlds[i]);
+    printf("   worlds     = %s\n", tmp.c_str());
+    tmp.clear();
+    for (i = 0; i < g.vfs.size(); i++)
+      tmp += (i ? "," : "") + std::to_string(g.vfs[i]);
+    printf("   vfs        = %s\n", tmp.c_str());
+    tmp.clear();
+    for (i = 0; i < g.sizes.size(); i++)
+      tmp += (i ? "," : "") + std::to_string(g.sizes[i]);
+    printf("   sizes      = %s (id %d, extra %d)\n", tmp.c_str(), g.id_size,
+           g.extra_size);
+    printf("   proto      = %s\n", g.proto);
+    printf("   tbl bits   = %d\n", g.tbl_bits);
+    printf("   batch      = %d\n", g.batch);
+    printf("   msg size   = %zu\n", g.msg_sz);
+  } else {
+    printf("   ranks      = %d\n", g.size);
+    printf("   particle   = <%d+1,%d>\n", pctx.particle_id_size,
+           pctx.particle_size);
+  }
+  printf("   components = %s\n", g.only ? g.only : "all");
+  printf("\n");
+}
+
+int main(int argc, char** argv) {
+  size_t i;
+  int ch;
+
+  g.ops = DEF_OPS;
+  g.pool = DEF_POOL;
+  parse_list(&g.worlds, DEF_WORLDS, argv[0]);
+  parse_list(&g.vfs, DEF_VFS, argv[0]);
+  parse_list(&g.sizes, DEF_SIZES, argv[0]);
+  g.id_size = DEF_ID_SIZE;
+  g.extra_size = 0;
+  g.proto = getenv("SHUFFLE_Placement_protocol");
+  if (g.proto == NULL) g.proto = DEFAULT_PLACEMENT_PROTO;
+  g.tbl_bits = 0;
+  g.batch = DEF_BATCH;
+  g.msg_sz = DEFAULT_BUFFER_PER_QUEUE;
+  g.size = 1;
+
+  while ((ch = getopt(argc, argv, "b:c:i:Mn:N:p:q:s:t:v:w:x:")) != -1) {
+    switch (ch) {
+      case 'b':
+        g.batch = atoi(optarg);
+        if (g.batch < 1) usage(argv[0], "bad batch");
+        break;
+      case 'c':
+        g.only = optarg;
+        break;
+      case 'i':
+        g.id_size = atoi(optarg);
+        if (g.id_size < 1 || g.id_size > 254) usage(argv[0], "bad id size");
+        break;
+      case 'M':
+        g.online = 1;
+        break;
+      case 'n':
+        g.ops = strtoull(optarg, NULL, 10);
+        if (g.ops < 1) usage(argv[0], "bad ops");
+        break;
+      case 'N':
+        g.pool = strtoull(optarg, NULL, 10);
+        if (g.pool < 1) usage(argv[0], "bad pool");
+        break;
+      case 'p':
+        g.proto = optarg;
+        break;
+      case 'q':
+        g.msg_sz = strtoull(optarg, NULL, 10);
+        if (g.msg_sz < 1) usage(argv[0], "bad msg size");
+        break;
+      case 's':
+        parse_list(&g.sizes, optarg, argv[0]);
+        break;
+      case 't':
+        g.tbl_bits = atoi(optarg);
+        if (g.tbl_bits < 0 || g.tbl_bits > MAX_PLACEMENT_TABLE_BITS)
+          usage(argv[0], "bad table bits");
+        break;
+      case 'v':
+        parse_list(&g.vfs, optarg, argv[0]);
+        break;
+      case 'w':
+        parse_list(&g.worlds, optarg, argv[0]);
+        break;
+      case 'x':
+        g.extra_size = atoi(optarg);
+        if (g.extra_size < 0) usage(argv[0], "bad extra size");
+        break;
+      default:
+        usage(argv[0], NULL);
+    }
+  }
+  if (optind != argc) usage(argv[0], "bad args");
+  if (g.pool < size_t(g.batch)) g.pool = g.batch;
+
+  if (g.online) {
+    setenv("PRELOAD_Skip_papi", "1", 1);
+    if (MPI_Init(&argc, &argv) != MPI_SUCCESS) ABORT("MPI_Init");
+    MPI_Comm_rank(MPI_COMM_WORLD, &g.rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &g.size);
+    if (pctx.deltafs_mntp == NULL || pctx.plfsdir == NULL)
+      ABORT("no deltafs mntp or plfsdir");
+  }
+#ifdef PRELOAD_HAS_PAPI
+  papi_prepare();
+#endif
+  print_options();
+  report_header();
+
+  if (g.online) {
+    bench_online();
+    MPI_Finalize();
+  } else {
+    bench_placement();
+    for (i = 0; i < g.sizes.size(); i++) {
+      if (enabled("encode") || enabled("decode") || enabled("pack") ||
+          enabled("unpack") || enabled("verify")) {
+        bench_codec(g.sizes[i]);
+      }
+    }
+    if (enabled("hstg")) {
+      bench_hstg();
+    }
+  }
+
+#ifdef PRELOAD_HAS_PAPI
+  if (papi_set != PAPI_NULL) {
+    PAPI_cleanup_eventset(papi_set);
+    PAPI_destroy_eventset(&papi_set);
+    PAPI_shutdown();
+  }
+#endif
+  if (sink == 0.5) printf("%f\n", sink); /* never true, keeps sink used */
+  return 0;
+}
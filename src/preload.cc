@@ -40,13 +40,19 @@
 #include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
+#include <algorithm>
+#include <deque>
 #include <map>
 #include <string>
 #include <vector>
 
 #include "preload_internal.h"
 #include "pthreadtap.h"
+#include "threadplace.h"
+
+#include <pdlfs-common/xxhash.h>
 
 #ifdef PRELOAD_HAS_PAPI
 #include <papi.h>
@@ -58,6 +64,14 @@
 #define DEFAULT_PARTICLE_BYTES 40
 #define DEFAULT_PARTICLE_BUFSIZE (2 << 20)
 
+/* default background throttling period (ms) */
+#define DEFAULT_BG_THROTTLE_PERIOD 100
+
+/* memtable appends slower than this count as write stalls (ns) */
+#define WSTALL_NANOS 1000000
+/* min stall time in an epoch for memory to be shifted (us) */
+#define MEMGOV_MIN_STALL 1000
+
 /* mon output */
 static int mon_dump_bin = 0;
 static int mon_dump_txt = 1;
@@ -65,8 +79,17 @@ static int mon_dump_txt = 1;
 /* mutex to protect preload state */
 static pthread_mutex_t preload_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-/* mutex to synchronize writes */
-static pthread_mutex_t write_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* mutex to protect the write staging area */
+static pthread_mutex_t batch_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * staging area for writes that are to be shuffled as a batch. filenames and
+ * data are packed back to back.
+ */
+static char* batch_fnames = NULL;
+static char* batch_data = NULL;
+static int batch_size = 0; /* num of writes currently staged */
+static int batch_epoch = 0;
 
 /* number of pthread created */
 static int num_pthreads = 0;
@@ -77,11 +100,6 @@ static int num_barriers = 0;
 /* number of epochs generated */
 static int num_epochs = 0;
 
-/*
- * buffer space for generating fake particle data.
- */
-static char particle_buf[64];
-
 /*
  * we use the address of fake_dirptr as a fake DIR* with opendir/closedir
  */
@@ -126,12 +144,238 @@ static void must_getnextdlsym(void** result, const char* symbol) {
   if (*result == NULL) ABORT(symbol);
 }
 
+/*
+ * lanes_init: (re)create write lanes. each lane samples names into its own
+ * sampler, with the per-rank sample capacity split evenly among lanes, and
+ * summarizes writes into its own zonemap. must be called before any write
+ * is made.
+ */
+static void lanes_init(int n) {
+  int cap;
+  int rv;
+
+  assert(n > 0 && (n & (n - 1)) == 0);
+  if (pctx.lanes != NULL) {
+    for (int i = 0; i < pctx.nlanes; i++) {
+      assert(pctx.lanes[i].nw == 0);
+      assert(pctx.lanes[i].llog.fd == -1);
+      free(pctx.lanes[i].llog.buf);
+      free(pctx.lanes[i].llog.ibuf);
+      sampler_destroy(&pctx.lanes[i].smap);
+      zonemap_destroy(&pctx.lanes[i].zmap);
+      pthread_mutex_destroy(&pctx.lanes[i].mtx);
+    }
+    delete[] pctx.lanes;
+  }
+  pctx.lanes = new write_lane_t[n];
+  pctx.nlanes = n;
+  for (int i = 0; i < n; i++) {
+    rv = pthread_mutex_init(&pctx.lanes[i].mtx, NULL);
+    if (rv) ABORT("pthread_mutex_init");
+    if (!pctx.sampling) {
+      cap = 1;
+    } else if (pctx.scap != 0) {
+      cap = std::max(16, (pctx.scap + n - 1) / n);
+    } else {
+      cap = 0; /* grows as needed (PRELOAD_Sample_capacity=0) */
+    }
+    sampler_init(&pctx.lanes[i].smap, pctx.particle_id_size, cap);
+    zonemap_init(&pctx.lanes[i].zmap, pctx.summ_fields, pctx.summ_nfields,
+                 pctx.summ_bits);
+    memset(&pctx.lanes[i].llog, 0, sizeof(local_log_t));
+    pctx.lanes[i].llog.fd = pctx.lanes[i].llog.ifd = -1;
+    pctx.lanes[i].nw = 0;
+    pctx.lanes[i].seed = unsigned(i); /* reseeded by MPI_Init() */
+  }
+}
+
+/*
+ * save_summary: merge the zonemaps of all write lanes, append the result to
+ * the SUMMARY file of our partition as the summary of a given epoch, and
+ * reset the lanes for the next epoch. the reader uses these summaries to
+ * skip partitions and names whose records cannot match a query. all writes
+ * of the epoch must have been received. called by receivers only.
+ */
+static void save_summary(int epoch) {
+  char path[PATH_MAX];
+  zonemap_t zm;
+  uint64_t ts;
+  int fd;
+
+  ts = now_micros();
+  zonemap_init(&zm, pctx.summ_fields, pctx.summ_nfields, pctx.summ_bits);
+  for (int i = 0; i < pctx.nlanes; i++) {
+    pthread_mtx_lock(&pctx.lanes[i].mtx);
+    zonemap_merge(&zm, &pctx.lanes[i].zmap);
+    zonemap_reset(&pctx.lanes[i].zmap);
+    pthread_mtx_unlock(&pctx.lanes[i].mtx);
+  }
+
+  snprintf(path, sizeof(path), "%s/SUMMARY-%07d.bin", pctx.log_home,
+           pctx.recv_rank);
+  fd = open(path, O_WRONLY | O_CREAT | (epoch == 0 ? O_TRUNC : O_APPEND),
+            0644);
+  if (fd == -1) {
+    ERRR("open");
+  } else {
+    if (zonemap_write(&zm, fd, epoch) != 0) {
+      ERRR("write");
+    }
+    close(fd);
+  }
+  zonemap_destroy(&zm);
+  errno = 0;
+
+  if (pctx.my_rank == 0) {
+    char msg[100];
+    snprintf(msg, sizeof(msg), "epoch summary saved %s (rank 0)",
+             pretty_dura(now_micros() - ts).c_str());
+    INFO(msg);
+  }
+}
+
+/*
+ * llog_write: write out data staged in a local log buffer.
+ */
+static int llog_write(int fd, const char* buf, size_t len) {
+  ssize_t n;
+
+  while (len != 0) {
+    n = write(fd, buf, len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += n;
+    len -= n;
+  }
+
+  return 0;
+}
+
+/*
+ * llog_close: write out everything still buffered and close the logs of the
+ * current epoch. return 0 on success, or -1 on errors.
+ */
+static int llog_close(local_log_t* log) {
+  int rv = 0;
+
+  if (log->fd == -1) return 0;
+  if (llog_write(log->fd, log->buf, log->bufsz) != 0) rv = -1;
+  if (llog_write(log->ifd, log->ibuf, log->ibufsz) != 0) rv = -1;
+  log->bufsz = log->ibufsz = 0;
+  close(log->fd);
+  close(log->ifd);
+  log->fd = log->ifd = -1;
+
+  return rv;
+}
+
+/*
+ * llog_open: open the logs of a given epoch for a given lane.
+ */
+static int llog_open(local_log_t* log, int lane, int epoch) {
+  char path[PATH_MAX];
+
+  assert(log->fd == -1);
+  if (log->buf == NULL) {
+    log->buf = static_cast<char*>(malloc(pctx.particle_buf_size));
+    log->ibuf = static_cast<char*>(malloc(pctx.particle_buf_size));
+    if (log->buf == NULL || log->ibuf == NULL) {
+      ABORT("malloc");
+    }
+  }
+  snprintf(path, sizeof(path), "%s/LOG-%d-%d-%d.dat", pctx.local_root,
+           pctx.recv_rank, lane, epoch);
+  log->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  snprintf(path, sizeof(path), "%s/LOG-%d-%d-%d.idx", pctx.local_root,
+           pctx.recv_rank, lane, epoch);
+  log->ifd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (log->fd == -1 || log->ifd == -1) {
+    if (log->fd != -1) close(log->fd);
+    if (log->ifd != -1) close(log->ifd);
+    log->fd = log->ifd = -1;
+    return -1;
+  }
+  log->epoch = epoch;
+  log->off = 0;
+
+  return 0;
+}
+
+/*
+ * llog_append: append a record to the logs of a write lane, switching to
+ * new logs when the record is for a new epoch. return 0 on success, or -1
+ * on errors.
+ */
+static int llog_append(local_log_t* log, int lane, const char* fname,
+                       unsigned char fname_len, const char* data,
+                       unsigned char data_len, int epoch) {
+  const size_t isz = 1 + fname_len + 8 + 4;
+  const uint32_t sz = data_len;
+  char* p;
+
+  if (log->fd != -1 && log->epoch != epoch) {
+    if (llog_close(log) != 0) return -1;
+  }
+  if (log->fd == -1 && llog_open(log, lane, epoch) != 0) {
+    return -1;
+  }
+  if (log->bufsz + data_len > size_t(pctx.particle_buf_size)) {
+    if (llog_write(log->fd, log->buf, log->bufsz) != 0) return -1;
+    log->bufsz = 0;
+  }
+  if (log->ibufsz + isz > size_t(pctx.particle_buf_size)) {
+    if (llog_write(log->ifd, log->ibuf, log->ibufsz) != 0) return -1;
+    log->ibufsz = 0;
+  }
+  memcpy(log->buf + log->bufsz, data, data_len);
+  log->bufsz += data_len;
+  p = log->ibuf + log->ibufsz;
+  p[0] = static_cast<char>(fname_len);
+  memcpy(p + 1, fname, fname_len);
+  memcpy(p + 1 + fname_len, &log->off, 8);
+  memcpy(p + 1 + fname_len + 8, &sz, 4);
+  log->ibufsz += isz;
+  log->off += data_len;
+
+  return 0;
+}
+
+/*
+ * lanes_close_logs: close the local logs of all lanes.
+ */
+static void lanes_close_logs() {
+  int rv;
+
+  for (int i = 0; i < pctx.nlanes; i++) {
+    pthread_mtx_lock(&pctx.lanes[i].mtx);
+    rv = llog_close(&pctx.lanes[i].llog);
+    pthread_mtx_unlock(&pctx.lanes[i].mtx);
+    if (rv != 0) {
+      ABORT("fail to close local logs");
+    }
+  }
+}
+
+/*
+ * lanes_sample_memory: total memory used by the samplers of all lanes.
+ */
+static size_t lanes_sample_memory() {
+  size_t result = 0;
+  for (int i = 0; i < pctx.nlanes; i++) {
+    result += sampler_memory(&pctx.lanes[i].smap);
+  }
+  return result;
+}
+
 /*
  * preload_init: called via init_once.   if this fails we are sunk, so
  * we'll abort the process....
  */
 static void preload_init() {
   std::vector<std::pair<const char*, size_t> > paths;
+  unsigned long long num;
   const char* tmp;
 
   must_getnextdlsym(reinterpret_cast<void**>(&nxt.MPI_Init), "MPI_Init");
@@ -168,13 +412,17 @@ static void preload_init() {
 
   pctx.isdeltafs = new std::set<FILE*>;
   pctx.fnames = new std::set<std::string>;
-  pctx.smap = new std::map<std::string, int>;
 
   pctx.particle_id_size = DEFAULT_PARTICLE_ID_BYTES;
   pctx.particle_extra_size = DEFAULT_PARTICLE_EXTRA_BYTES;
   pctx.particle_size = DEFAULT_PARTICLE_BYTES;
   pctx.particle_buf_size = DEFAULT_PARTICLE_BUFSIZE;
+  pctx.sidebuf_nsegs = DEFAULT_SIDEIO_SEGMENTS;
   pctx.sthres = 100; /* 100 samples per 1 million input */
+  pctx.scap = DEFAULT_SAMPLE_CAPACITY;
+  pctx.summ_bits = DEFAULT_SUMMARY_BITS;
+  pctx.write_batch = 1;
+  pctx.bgthrot_period = DEFAULT_BG_THROTTLE_PERIOD;
 
   pctx.sampling = 1;
   pctx.paranoid_checks = 1;
@@ -302,6 +550,28 @@ static void preload_init() {
     }
   }
 
+  tmp = maybe_getenv("PRELOAD_Lat_precision_bits");
+  if (tmp != NULL) {
+    mon_lat_precision = atoi(tmp);
+    if (mon_lat_precision < LHSTG_MIN_PRECISION ||
+        mon_lat_precision > LHSTG_MAX_PRECISION) {
+      ABORT("bad latency histogram precision");
+    }
+  }
+
+  tmp = maybe_getenv("PRELOAD_Sideio_segment_size");
+  if (tmp != NULL) {
+    pctx.sidebuf_size = static_cast<size_t>(atol(tmp));
+  }
+
+  tmp = maybe_getenv("PRELOAD_Sideio_segments");
+  if (tmp != NULL) {
+    pctx.sidebuf_nsegs = atoi(tmp);
+    if (pctx.sidebuf_nsegs < 1) {
+      ABORT("bad sideio segment count");
+    }
+  }
+
   tmp = maybe_getenv("PRELOAD_Particle_id_size");
   if (tmp != NULL) {
     pctx.particle_id_size = atoi(tmp);
@@ -336,6 +606,54 @@ static void preload_init() {
     }
   }
 
+  tmp = maybe_getenv("PRELOAD_Sample_capacity");
+  if (tmp != NULL) {
+    pctx.scap = atoi(tmp);
+    if (pctx.scap < 0) {
+      pctx.scap = 0;
+    }
+  } else {
+    /* room for twice the names we expect to sample so that the sampler
+     * never has to grow while writes are being made */
+    num = DEFAULT_PARTICLES_PER_RANK;
+    tmp = maybe_getenv("PRELOAD_Particles_per_rank");
+    if (tmp != NULL) {
+      num = strtoull(tmp, NULL, 10);
+    }
+    num = 2 * num * pctx.sthres / 1000000;
+    if (num < DEFAULT_SAMPLE_CAPACITY) num = DEFAULT_SAMPLE_CAPACITY;
+    if (num > (1u << 30)) num = 1u << 30;
+    pctx.scap = int(num);
+  }
+
+  tmp = maybe_getenv("PRELOAD_Summary_fields");
+  if (tmp != NULL && tmp[0] != 0) {
+    pctx.summ_nfields = zonemap_parse(tmp, pctx.summ_fields);
+    if (pctx.summ_nfields < 0) {
+      ABORT("bad PRELOAD_Summary_fields");
+    }
+  }
+
+  tmp = maybe_getenv("PRELOAD_Summary_bits");
+  if (tmp != NULL) {
+    pctx.summ_bits = atoi(tmp);
+    if (pctx.summ_bits < 0) {
+      pctx.summ_bits = 0;
+    } else if (pctx.summ_bits > ZM_MAX_BITS) {
+      pctx.summ_bits = ZM_MAX_BITS;
+    }
+  }
+
+  tmp = maybe_getenv("PRELOAD_Memory_budget");
+  if (tmp != NULL && tmp[0] != 0) {
+    pctx.mem_budget = membudget_parse(tmp);
+    if (pctx.mem_budget == 0) {
+      ABORT("bad PRELOAD_Memory_budget");
+    }
+  }
+
+  lanes_init(1); /* may be re-init'd for local logs */
+
 #ifdef PRELOAD_HAS_PAPI
   tmp = maybe_getenv("PRELOAD_Papi_events");
   if (tmp == NULL || tmp[0] == 0) {
@@ -356,11 +674,27 @@ static void preload_init() {
   }
 #endif
 
+  tmp = maybe_getenv("PRELOAD_Write_batch_size");
+  if (tmp != NULL) {
+    pctx.write_batch = atoi(tmp);
+    if (pctx.write_batch < 1) {
+      pctx.write_batch = 1;
+    }
+  }
+
   tmp = maybe_getenv("PRELOAD_Pthread_tap");
   if (tmp != NULL) {
     pctx.pthread_tap = atoi(tmp);
   }
 
+  tmp = maybe_getenv("PRELOAD_Thread_placement");
+  if (tmp != NULL && tmp[0] != 0) {
+    if (tplace_init(tmp) != 0) {
+      ABORT("bad thread placement");
+    }
+    pctx.tplace = 1;
+  }
+
   if (is_envset("PRELOAD_Bypass_shuffle")) pctx.mode |= BYPASS_SHUFFLE;
   if (is_envset("PRELOAD_Bypass_placement")) pctx.mode |= BYPASS_PLACEMENT;
 
@@ -373,12 +707,52 @@ static void preload_init() {
 
   if (is_envset("PRELOAD_Skip_mon")) pctx.nomon = 1;
   if (is_envset("PRELOAD_Skip_papi")) pctx.nopapi = 1;
+  if (is_envset("PRELOAD_Papi_threads")) pctx.papi_threads = 1;
   if (is_envset("PRELOAD_Skip_mon_dist")) pctx.nodist = 1;
   if (is_envset("PRELOAD_Enable_verbose_mon")) pctx.vmon = 1;
   if (is_envset("PRELOAD_Enable_verbose_error")) pctx.verr = 1;
   if (is_envset("PRELOAD_Enable_bg_pause")) pctx.bgpause = 1;
   if (is_envset("PRELOAD_Enable_bg_sngcomp")) pctx.bgsngcomp = 1;
   if (is_envset("PRELOAD_Enable_wisc")) pctx.sideio = 1;
+  if (is_envset("PRELOAD_Enable_sideio_bg_writer")) pctx.sidebuf_bg = 1;
+  if (is_envset("PRELOAD_Enable_local_logs")) pctx.llogs = 1;
+  /* a log buffer must hold at least one record and one index entry */
+  if (pctx.llogs && pctx.particle_buf_size < 1 + 255 + 8 + 4) {
+    ABORT("particle buf size too small for local logs");
+  }
+  tmp = maybe_getenv("PRELOAD_Local_log_lanes");
+  if (tmp != NULL && pctx.llogs && IS_BYPASS_DELTAFS(pctx.mode)) {
+    int n = 1; /* round down to a power of 2 */
+    while (n * 2 <= atoi(tmp) && n * 2 <= PRELOAD_MAX_LANES) n *= 2;
+    if (n > 1) lanes_init(n);
+  }
+
+  tmp = maybe_getenv("PRELOAD_Bg_throttle");
+  if (tmp != NULL && !pctx.bgpause) {
+    pctx.bgthrot = atoi(tmp);
+    if (pctx.bgthrot <= 0 || pctx.bgthrot >= 100) {
+      pctx.bgthrot = 0;
+    }
+  }
+  tmp = maybe_getenv("PRELOAD_Bg_throttle_period");
+  if (tmp != NULL) {
+    pctx.bgthrot_period = atoi(tmp);
+    if (pctx.bgthrot_period < 1) {
+      pctx.bgthrot_period = 1;
+    }
+  }
+
+  tmp = maybe_getenv("PRELOAD_Async_epochs");
+  if (tmp != NULL) {
+    pctx.async_epochs = atoi(tmp);
+    if (pctx.async_epochs < 0) {
+      pctx.async_epochs = 0;
+    }
+  }
+
+  tmp = maybe_getenv("PRELOAD_Async_defer_size");
+  pctx.defer_buf = membudget_parse(
+      tmp != NULL && tmp[0] != 0 ? tmp : DEFAULT_DEFER_BUF);
 
   if (is_envset("PRELOAD_No_paranoid_checks")) pctx.paranoid_checks = 0;
   if (is_envset("PRELOAD_No_paranoid_pre_barrier"))
@@ -392,6 +766,7 @@ static void preload_init() {
   if (is_envset("PRELOAD_No_paranoid_post_barrier"))
     pctx.paranoid_post_barrier = 0;
   if (is_envset("PRELOAD_No_sys_probing")) pctx.noscan = 1;
+  if (is_envset("PRELOAD_No_startup_overlap")) pctx.serial_startup = 1;
   if (is_envset("PRELOAD_Inject_fake_data")) pctx.fake_data = 1;
   if (is_envset("PRELOAD_Testing")) pctx.testin = 1;
 
@@ -440,21 +815,687 @@ static int under_plfsdir(const char* path) {
 }
 
 /*
- * claim_FILE: look at FILE* and see if we claim it
+ * flush_batch: hand all staged writes to the shuffle. must be called with
+ * batch_mtx held.
  */
-static int claim_FILE(FILE* stream) {
-  std::set<FILE*>::iterator it;
+static void flush_batch() {
   int rv;
 
-  pthread_mtx_lock(&preload_mtx);
-  assert(pctx.isdeltafs != NULL);
-  it = pctx.isdeltafs->find(stream);
-  rv = int(it != pctx.isdeltafs->end());
-  pthread_mtx_unlock(&preload_mtx);
+  if (batch_size != 0) {
+    rv = shuffle_write_batch(&pctx.sctx, batch_fnames, pctx.sctx.fname_len,
+                             batch_data, pctx.sctx.data_len, batch_size,
+                             batch_epoch);
+    if (rv) {
+      ABORT("plfsdir shuffler write failed");
+    }
+    batch_size = 0;
+  }
+}
+
+/*
+ * stage_write: put a write into the staging area. writes are shuffled as a
+ * batch as soon as the staging area is full, or at the end of the epoch.
+ */
+static void stage_write(const char* fname, unsigned char fname_len, char* data,
+                        unsigned char data_len, int epoch) {
+  pthread_mtx_lock(&batch_mtx);
+  if (fname_len != pctx.sctx.fname_len) ABORT("bad filename len");
+  if (data_len != pctx.sctx.data_len) ABORT("bad data len");
+  if (batch_fnames == NULL) {
+    batch_fnames = static_cast<char*>(malloc(pctx.write_batch * fname_len));
+    batch_data = static_cast<char*>(malloc(pctx.write_batch * data_len + 1));
+    if (batch_fnames == NULL || batch_data == NULL) {
+      ABORT("malloc");
+    }
+  }
+  if (batch_size != 0 && batch_epoch != epoch) {
+    flush_batch();
+  }
+  batch_epoch = epoch;
+  memcpy(batch_fnames + batch_size * fname_len, fname, fname_len);
+  memcpy(batch_data + batch_size * data_len, data, data_len);
+  batch_size++;
+  if (batch_size == pctx.write_batch) {
+    flush_batch();
+  }
+  pthread_mtx_unlock(&batch_mtx);
+}
+
+/*
+ * flush_staged_writes: shuffle all writes still sitting in the staging area.
+ */
+static void flush_staged_writes() {
+  pthread_mtx_lock(&batch_mtx);
+  flush_batch();
+  pthread_mtx_unlock(&batch_mtx);
+}
+
+/*
+ * side io write-behind buffer: in the wisc-key mode, particle data goes to
+ * a per-rank side log and only its log offset is shuffled. instead of
+ * appending each particle to the log at fclose() time, particles are
+ * packed into large aligned segments that are appended to the log as they
+ * fill up, either inline or from a background writer. since segments reach
+ * the log in order, a particle's offset is known as soon as it is
+ * buffered. full segments are queued in sidebuf_full; free ones are kept
+ * in sidebuf_free.
+ */
+#define SIDEBUF_ALIGN 4096
+static pthread_mutex_t sidebuf_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sidebuf_cv = PTHREAD_COND_INITIALIZER;
+static std::vector<char*>* sidebuf_free = NULL;
+static std::deque<std::pair<char*, size_t> >* sidebuf_full = NULL;
+static char* sidebuf_cur = NULL; /* segment being filled */
+static size_t sidebuf_pos = 0;   /* bytes used in the current segment */
+static uint64_t sidebuf_off = 0; /* log offset of the next byte */
+static int sidebuf_writing = 0;  /* a segment is being written */
+static int sidebuf_shutdown = 0;
+static pthread_t sidebuf_tid;
+/* stats */
+static unsigned long long sidebuf_nsegs = 0;
+static uint64_t sidebuf_stall = 0; /* time fclose() waited for a segment */
+
+/*
+ * sidebuf_write_seg: append a segment to the side log. must be called with
+ * sidebuf_writing set, and without sidebuf_mtx held.
+ */
+static void sidebuf_write_seg(char* seg, size_t len) {
+  ssize_t n;
+
+  assert(pctx.plfshdl != NULL);
+  n = deltafs_plfsdir_io_append(pctx.plfshdl, seg, len);
+  if (n != len) {
+    ABORT("plfsdir sideio write failed");
+  }
+}
+
+/*
+ * sidebuf_drain: write queued segments inline until none is left. must be
+ * called with sidebuf_mtx held. no-op if there is a background writer.
+ */
+static void sidebuf_drain() {
+  std::pair<char*, size_t> seg;
+
+  if (pctx.sidebuf_bg) return;
+  /* one writer at a time so that segments reach the log in order */
+  while (!sidebuf_full->empty() && !sidebuf_writing) {
+    seg = sidebuf_full->front();
+    sidebuf_full->pop_front();
+    sidebuf_writing = 1;
+    pthread_mtx_unlock(&sidebuf_mtx);
+    sidebuf_write_seg(seg.first, seg.second);
+    pthread_mtx_lock(&sidebuf_mtx);
+    sidebuf_writing = 0;
+    sidebuf_free->push_back(seg.first);
+    sidebuf_nsegs++;
+  }
+  pthread_cv_notifyall(&sidebuf_cv);
+}
+
+/*
+ * sidebuf_main: the background side io writer.
+ */
+static void* sidebuf_main(void*) {
+  std::pair<char*, size_t> seg;
+
+  pthread_mtx_lock(&sidebuf_mtx);
+  while (true) {
+    while (!sidebuf_shutdown && sidebuf_full->empty()) {
+      pthread_cv_wait(&sidebuf_cv, &sidebuf_mtx);
+    }
+    if (sidebuf_full->empty()) {
+      break; /* shutdown */
+    }
+    seg = sidebuf_full->front();
+    sidebuf_full->pop_front();
+    sidebuf_writing = 1;
+    pthread_mtx_unlock(&sidebuf_mtx);
+    sidebuf_write_seg(seg.first, seg.second);
+    pthread_mtx_lock(&sidebuf_mtx);
+    sidebuf_writing = 0;
+    sidebuf_free->push_back(seg.first);
+    sidebuf_nsegs++;
+    pthread_cv_notifyall(&sidebuf_cv);
+  }
+  pthread_mtx_unlock(&sidebuf_mtx);
+
+  return NULL;
+}
+
+/*
+ * sidebuf_init: allocate segments and optionally start the background
+ * writer. segment size is rounded up to a multiple of SIDEBUF_ALIGN.
+ */
+static void sidebuf_init() {
+  char* seg;
+  int rv;
+
+  pctx.sidebuf_size =
+      (pctx.sidebuf_size + SIDEBUF_ALIGN - 1) & ~size_t(SIDEBUF_ALIGN - 1);
+  sidebuf_free = new std::vector<char*>;
+  sidebuf_full = new std::deque<std::pair<char*, size_t> >;
+  for (int i = 0; i < pctx.sidebuf_nsegs; i++) {
+    rv = posix_memalign(reinterpret_cast<void**>(&seg), SIDEBUF_ALIGN,
+                        pctx.sidebuf_size);
+    if (rv) ABORT("posix_memalign");
+    sidebuf_free->push_back(seg);
+  }
+  if (pctx.sidebuf_bg) {
+    rv = pthread_create(&sidebuf_tid, NULL, sidebuf_main, NULL);
+    if (rv) ABORT("pthread_create");
+  }
+}
+
+/*
+ * sidebuf_put: buffer particle data and return its side log offset.
+ * particles may span segment boundaries.
+ */
+static uint64_t sidebuf_put(const char* data, size_t len) {
+  uint64_t start;
+  uint64_t off;
+  size_t n;
+
+  pthread_mtx_lock(&sidebuf_mtx);
+  off = sidebuf_off;
+  sidebuf_off += len;
+  while (len != 0) {
+    if (sidebuf_cur == NULL) {
+      if (sidebuf_free->empty()) {
+        start = now_micros();
+        sidebuf_drain();
+        while (sidebuf_free->empty()) {
+          pthread_cv_wait(&sidebuf_cv, &sidebuf_mtx);
+        }
+        sidebuf_stall += now_micros() - start;
+      }
+      sidebuf_cur = sidebuf_free->back();
+      sidebuf_free->pop_back();
+      sidebuf_pos = 0;
+    }
+    n = std::min(len, pctx.sidebuf_size - sidebuf_pos);
+    memcpy(sidebuf_cur + sidebuf_pos, data, n);
+    sidebuf_pos += n;
+    data += n;
+    len -= n;
+    if (sidebuf_pos == pctx.sidebuf_size) {
+      sidebuf_full->push_back(std::make_pair(sidebuf_cur, sidebuf_pos));
+      sidebuf_cur = NULL;
+      pthread_cv_notifyall(&sidebuf_cv);
+      sidebuf_drain();
+    }
+  }
+  pthread_mtx_unlock(&sidebuf_mtx);
+
+  return off;
+}
+
+/*
+ * sidebuf_flush: write all buffered particle data to the side log and wait
+ * for the writes to finish. must be called before the side log is flushed.
+ */
+static void sidebuf_flush() {
+  if (sidebuf_free == NULL) return;
+  pthread_mtx_lock(&sidebuf_mtx);
+  if (sidebuf_cur != NULL && sidebuf_pos != 0) {
+    sidebuf_full->push_back(std::make_pair(sidebuf_cur, sidebuf_pos));
+    sidebuf_cur = NULL;
+    pthread_cv_notifyall(&sidebuf_cv);
+  }
+  sidebuf_drain();
+  while (!sidebuf_full->empty() || sidebuf_writing) {
+    pthread_cv_wait(&sidebuf_cv, &sidebuf_mtx);
+  }
+  pthread_mtx_unlock(&sidebuf_mtx);
+}
+
+/*
+ * sidebuf_destroy: flush all buffered data, stop the background writer,
+ * and free all segments.
+ */
+static void sidebuf_destroy() {
+  char msg[100];
+
+  if (sidebuf_free == NULL) return;
+  sidebuf_flush();
+  if (pctx.my_rank == 0) {
+    snprintf(msg, sizeof(msg),
+             "side io write-behind: %s segments written, %s stalled (rank 0)",
+             pretty_num(sidebuf_nsegs).c_str(),
+             pretty_dura(sidebuf_stall).c_str());
+    INFO(msg);
+  }
+  if (pctx.sidebuf_bg) {
+    pthread_mtx_lock(&sidebuf_mtx);
+    sidebuf_shutdown = 1;
+    pthread_cv_notifyall(&sidebuf_cv);
+    pthread_mtx_unlock(&sidebuf_mtx);
+    pthread_join(sidebuf_tid, NULL);
+  }
+  if (sidebuf_cur != NULL) sidebuf_free->push_back(sidebuf_cur);
+  for (size_t i = 0; i < sidebuf_free->size(); i++) {
+    free((*sidebuf_free)[i]);
+  }
+  delete sidebuf_free;
+  sidebuf_free = NULL;
+  delete sidebuf_full;
+  sidebuf_full = NULL;
+  sidebuf_cur = NULL;
+}
+
+/*
+ * async epoch flushing: the flush of an epoch is handed to a background
+ * flusher so that vpic may start writing the next epoch right away. writes
+ * for an epoch cannot reach the plfsdir before all previous epochs are
+ * flushed, so they are deferred in memory and replayed by the flusher once
+ * it catches up. epochs in [aflush_next, aflush_end) are waiting to be
+ * flushed. at most pctx.async_epochs of them may be in flight. deferred
+ * writes are charged to the memory budget and may take up to aflush_cap
+ * bytes. past that, writers wait for the flusher to catch up and then
+ * write to the plfsdir directly.
+ */
+static pthread_mutex_t aflush_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aflush_cv = PTHREAD_COND_INITIALIZER;
+static std::map<int, std::string>* aflush_deferred = NULL; /* by epoch */
+/* set if any epoch is in flight. written under aflush_mtx and read
+ * atomically without it by writers */
+static int aflush_busy = 0;
+static int aflush_next = 0;
+static int aflush_end = 0;
+static int aflush_shutdown = 0;
+static int aflush_running = 0;
+static pthread_t aflush_tid;
+static size_t aflush_cap = 0;    /* max bytes of deferred writes */
+static size_t aflush_nbytes = 0; /* bytes of deferred writes held */
+/* stats collected since the last time they were reported */
+static uint64_t aflush_micros = 0; /* time spent flushing and replaying */
+static uint64_t aflush_stall = 0;  /* time vpic spent waiting for us */
+static unsigned long long aflush_ndeferred = 0;
+
+/*
+ * aflush_replay: append a batch of deferred writes to the plfsdir. no lock
+ * is taken: until aflush_next moves past the epoch being flushed, writers
+ * defer or wait instead of appending, so we are the only one appending. the
+ * write lane must not be taken either, as a writer may hold it while it
+ * waits for us in aflush_defer().
+ */
+static void aflush_replay(const std::string& buf, int epoch) {
+  char fname[256];
+  const char* p = buf.data();
+  const char* const end = p + buf.size();
+  unsigned char fname_len;
+  unsigned char data_len;
+  ssize_t n;
+
+  while (p < end) {
+    fname_len = static_cast<unsigned char>(*p++);
+    memcpy(fname, p, fname_len);
+    fname[fname_len] = 0;
+    p += fname_len;
+    data_len = static_cast<unsigned char>(*p++);
+    n = deltafs_plfsdir_append(pctx.plfshdl, fname, epoch, p, data_len);
+    if (n != data_len) {
+      ABORT("fail to append deferred write");
+    }
+    p += data_len;
+  }
+}
+
+/*
+ * aflush_main: the background flusher.
+ */
+static void* aflush_main(void*) {
+  std::map<int, std::string>::iterator it;
+  std::string buf;
+  uint64_t start;
+  int epoch;
+
+  pthread_mtx_lock(&aflush_mtx);
+  while (true) {
+    while (!aflush_shutdown && aflush_next == aflush_end) {
+      pthread_cv_wait(&aflush_cv, &aflush_mtx);
+    }
+    if (aflush_next == aflush_end) {
+      break; /* shutdown */
+    }
+    epoch = aflush_next;
+    pthread_mtx_unlock(&aflush_mtx);
+    start = now_micros();
+    if (pctx.sideio) {
+      /* side io of the next epoch keeps being appended by fclose() or by
+       * the side io writer, so wait for any append in progress and hold
+       * off new ones until the side log is flushed */
+      pthread_mtx_lock(&sidebuf_mtx);
+      while (sidebuf_writing) {
+        pthread_cv_wait(&sidebuf_cv, &sidebuf_mtx);
+      }
+      if (deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
+        ABORT("fail to flush plfsdir side io");
+      pthread_mtx_unlock(&sidebuf_mtx);
+    }
+    if (deltafs_plfsdir_epoch_flush(pctx.plfshdl, epoch) != 0)
+      ABORT("fail to flush plfsdir");
+    pthread_mtx_lock(&aflush_mtx);
+    /* writes may keep being deferred while we replay so loop until none
+     * is left for the next epoch */
+    while (true) {
+      it = aflush_deferred->find(epoch + 1);
+      if (it == aflush_deferred->end() || it->second.empty()) break;
+      buf.swap(it->second);
+      pthread_mtx_unlock(&aflush_mtx);
+      aflush_replay(buf, epoch + 1);
+      pthread_mtx_lock(&aflush_mtx);
+      assert(aflush_nbytes >= buf.size());
+      aflush_nbytes -= buf.size();
+      std::string().swap(buf); /* give the memory back */
+    }
+    aflush_deferred->erase(epoch + 1);
+    aflush_micros += now_micros() - start;
+    aflush_next = epoch + 1;
+    if (aflush_next == aflush_end) __sync_lock_release(&aflush_busy);
+    pthread_cv_notifyall(&aflush_cv);
+  }
+  pthread_mtx_unlock(&aflush_mtx);
+
+  return NULL;
+}
+
+/*
+ * aflush_defer: defer a write if it is for an epoch after one still being
+ * flushed. if deferring it would take us past aflush_cap, wait until all
+ * previous epochs are flushed instead. return 1 if the write is deferred,
+ * or 0 if it may go to the plfsdir now.
+ */
+static int aflush_defer(const char* fname, unsigned char fname_len,
+                        const char* data, unsigned char data_len, int epoch) {
+  const size_t sz = 2 + size_t(fname_len) + data_len;
+  std::string* buf;
+  uint64_t start;
+  int rv = 0;
+
+  pthread_mtx_lock(&aflush_mtx);
+  if (aflush_next < aflush_end && epoch > aflush_next &&
+      aflush_nbytes + sz > aflush_cap) {
+    start = now_micros();
+    while (aflush_next < aflush_end && epoch > aflush_next) {
+      pthread_cv_wait(&aflush_cv, &aflush_mtx);
+    }
+    aflush_stall += now_micros() - start;
+  }
+  if (aflush_next < aflush_end && epoch > aflush_next) {
+    aflush_nbytes += sz;
+    buf = &(*aflush_deferred)[epoch];
+    buf->push_back(static_cast<char>(fname_len));
+    buf->append(fname, fname_len);
+    buf->push_back(static_cast<char>(data_len));
+    buf->append(data, data_len);
+    aflush_ndeferred++;
+    rv = 1;
+  }
+  pthread_mtx_unlock(&aflush_mtx);
 
   return rv;
 }
 
+/*
+ * aflush_wait: wait until no more than a given num of epochs are in flight.
+ */
+static void aflush_wait(int max_inflight) {
+  uint64_t start;
+
+  pthread_mtx_lock(&aflush_mtx);
+  if (aflush_end - aflush_next > max_inflight) {
+    start = now_micros();
+    while (aflush_end - aflush_next > max_inflight) {
+      pthread_cv_wait(&aflush_cv, &aflush_mtx);
+    }
+    aflush_stall += now_micros() - start;
+  }
+  pthread_mtx_unlock(&aflush_mtx);
+}
+
+/*
+ * aflush_schedule: hand the flush of an epoch to the background flusher,
+ * waiting if too many epochs are already in flight.
+ */
+static void aflush_schedule(int epoch) {
+  int rv;
+
+  if (!aflush_running) {
+    aflush_deferred = new std::map<int, std::string>;
+    aflush_next = aflush_end = epoch;
+    rv = pthread_create(&aflush_tid, NULL, aflush_main, NULL);
+    if (rv) ABORT("pthread_create");
+    aflush_running = 1;
+  }
+
+  aflush_wait(pctx.async_epochs - 1);
+  pthread_mtx_lock(&aflush_mtx);
+  assert(epoch == aflush_end);
+  aflush_end = epoch + 1;
+  __sync_lock_test_and_set(&aflush_busy, 1);
+  pthread_cv_notifyall(&aflush_cv);
+  pthread_mtx_unlock(&aflush_mtx);
+}
+
+/*
+ * aflush_shutdown_and_join: wait for all in-flight epochs and stop the
+ * background flusher.
+ */
+static void aflush_shutdown_and_join() {
+  if (!aflush_running) return;
+  pthread_mtx_lock(&aflush_mtx);
+  aflush_shutdown = 1;
+  pthread_cv_notifyall(&aflush_cv);
+  pthread_mtx_unlock(&aflush_mtx);
+  pthread_join(aflush_tid, NULL);
+  assert(aflush_deferred->empty());
+  delete aflush_deferred;
+  aflush_deferred = NULL;
+  aflush_running = 0;
+}
+
+/*
+ * aflush_report: move background flushing stats into a mon ctx.
+ */
+static void aflush_report(mon_ctx_t* mon) {
+  pthread_mtx_lock(&aflush_mtx);
+  mon->max_aflmicros = aflush_micros;
+  mon->max_astmicros = aflush_stall;
+  mon->max_aovmicros =
+      (aflush_micros > aflush_stall) ? aflush_micros - aflush_stall : 0;
+  mon->ndeferred = aflush_ndeferred;
+  aflush_micros = aflush_stall = 0;
+  aflush_ndeferred = 0;
+  pthread_mtx_unlock(&aflush_mtx);
+}
+
+/*
+ * background throttling: instead of pausing background activities for an
+ * entire compute phase (PRELOAD_Enable_bg_pause), a throttler runs them on
+ * a duty cycle. within each period of pctx.bgthrot_period ms, they run for
+ * pctx.bgthrot percent of it and are paused for the rest, using the same
+ * pause and resume calls as bg pause. throttling starts when vpic goes back
+ * to computing (closedir) and stops, leaving everything at full speed, when
+ * the next dump begins (opendir). pauses and resumes are only issued by the
+ * throttler, with bgthrot_mtx held.
+ */
+static pthread_mutex_t bgthrot_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t bgthrot_cv = PTHREAD_COND_INITIALIZER;
+static int bgthrot_on = 0;     /* set during compute phases */
+static int bgthrot_paused = 0; /* set while background activities are held */
+static int bgthrot_shutdown = 0;
+static int bgthrot_running = 0;
+static pthread_t bgthrot_tid;
+/* stats collected since the last time they were reported */
+static uint64_t bgthrot_micros = 0; /* time background activities were held */
+static unsigned long long bgthrot_backlog = 0; /* when throttling stopped */
+
+/*
+ * bgthrot_wait: wait for up to a given amount of us, or until the throttler
+ * is signaled. must be called with bgthrot_mtx held.
+ */
+static void bgthrot_wait(uint64_t us) {
+  struct timespec abstime;
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  us += uint64_t(now.tv_sec) * 1000000 + now.tv_usec;
+  abstime.tv_sec = us / 1000000;
+  abstime.tv_nsec = (us % 1000000) * 1000;
+  pthread_cv_timedwait(&bgthrot_cv, &bgthrot_mtx, &abstime);
+}
+
+/*
+ * bgthrot_hold: pause (or resume) background activities.
+ */
+static void bgthrot_hold(int hold) {
+  if (hold) {
+    if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
+      shuffle_pause(&pctx.sctx);
+    }
+    if (pctx.plfstp != NULL) {
+      deltafs_tp_pause(pctx.plfstp);
+    }
+  } else {
+    if (pctx.plfstp != NULL) {
+      deltafs_tp_rerun(pctx.plfstp);
+    }
+    if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
+      shuffle_resume(&pctx.sctx);
+    }
+  }
+}
+
+/*
+ * bgthrot_main: the background throttler.
+ */
+static void* bgthrot_main(void*) {
+  const uint64_t period = uint64_t(pctx.bgthrot_period) * 1000;
+  const uint64_t run = period * pctx.bgthrot / 100;
+  uint64_t start;
+
+  pthread_mtx_lock(&bgthrot_mtx);
+  while (!bgthrot_shutdown) {
+    if (!bgthrot_on) {
+      pthread_cv_wait(&bgthrot_cv, &bgthrot_mtx);
+      continue;
+    }
+    bgthrot_wait(run);
+    if (!bgthrot_on || bgthrot_shutdown) {
+      continue;
+    }
+    start = now_micros();
+    bgthrot_hold(1);
+    bgthrot_paused = 1;
+    bgthrot_wait(period - run);
+    bgthrot_hold(0);
+    bgthrot_paused = 0;
+    bgthrot_micros += now_micros() - start;
+    pthread_cv_notifyall(&bgthrot_cv);
+  }
+  pthread_mtx_unlock(&bgthrot_mtx);
+
+  return NULL;
+}
+
+/*
+ * bgthrot_start: begin throttling background activities.
+ */
+static void bgthrot_start() {
+  int rv;
+
+  if (!bgthrot_running) {
+    rv = pthread_create(&bgthrot_tid, NULL, bgthrot_main, NULL);
+    if (rv) ABORT("pthread_create");
+    bgthrot_running = 1;
+  }
+
+  pthread_mtx_lock(&bgthrot_mtx);
+  bgthrot_on = 1;
+  pthread_cv_notifyall(&bgthrot_cv);
+  pthread_mtx_unlock(&bgthrot_mtx);
+}
+
+/*
+ * bgthrot_stop: bring background activities back to full speed and take
+ * note of the backlog they are left with.
+ */
+static void bgthrot_stop() {
+  if (!bgthrot_running) return;
+  pthread_mtx_lock(&bgthrot_mtx);
+  bgthrot_on = 0;
+  pthread_cv_notifyall(&bgthrot_cv);
+  while (bgthrot_paused) {
+    pthread_cv_wait(&bgthrot_cv, &bgthrot_mtx);
+  }
+  if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
+    bgthrot_backlog = shuffle_backlog(&pctx.sctx);
+  }
+  pthread_mtx_unlock(&bgthrot_mtx);
+}
+
+/*
+ * bgthrot_shutdown_and_join: stop the background throttler.
+ */
+static void bgthrot_shutdown_and_join() {
+  if (!bgthrot_running) return;
+  bgthrot_stop();
+  pthread_mtx_lock(&bgthrot_mtx);
+  bgthrot_shutdown = 1;
+  pthread_cv_notifyall(&bgthrot_cv);
+  pthread_mtx_unlock(&bgthrot_mtx);
+  pthread_join(bgthrot_tid, NULL);
+  bgthrot_running = 0;
+}
+
+/*
+ * bgthrot_report: move background throttling stats into a mon ctx.
+ */
+static void bgthrot_report(mon_ctx_t* mon) {
+  pthread_mtx_lock(&bgthrot_mtx);
+  mon->max_thrmicros = bgthrot_micros;
+  mon->max_thrbacklog = bgthrot_backlog;
+  bgthrot_micros = 0;
+  bgthrot_backlog = 0;
+  pthread_mtx_unlock(&bgthrot_mtx);
+}
+
+/*
+ * memgov_report: move the memory used by each consumer of the memory
+ * budget into a mon ctx.
+ */
+static void memgov_report(mon_ctx_t* mon) {
+  for (int i = 0; i < MB_NPARTS; i++) {
+    mon->max_mem[i] = pctx.mb.used[i];
+  }
+}
+
+/*
+ * memgov_adjust: shift slack memory to the shuffle send queues when senders
+ * stalled on them more than receivers stalled on memtables in the epoch
+ * just ended, and take it back in the opposite case. memtables cannot be
+ * resized once the plfsdir is opened, so taking slack back from the queues
+ * is all we can do for them.
+ */
+static void memgov_adjust(const mon_ctx_t* mon) {
+  size_t step;
+  size_t n;
+
+  if (pctx.mb.total == 0 || IS_BYPASS_SHUFFLE(pctx.mode)) return;
+  step = pctx.mb.slack >> 2;
+  if (mon->qstall > mon->wstall && mon->qstall >= MEMGOV_MIN_STALL) {
+    n = membudget_lend(&pctx.mb, step);
+  } else if (mon->wstall > mon->qstall && mon->wstall >= MEMGOV_MIN_STALL) {
+    n = membudget_reclaim(&pctx.mb, step);
+  } else {
+    n = 0;
+  }
+  if (n != 0) {
+    pctx.mb.used[MB_QUEUES] =
+        shuffle_set_queue_budget(&pctx.sctx, pctx.mb.share[MB_QUEUES]);
+  }
+}
+
 /*
  * dump in-memory mon stats to files.
  */
@@ -467,6 +1508,9 @@ static void dump_mon(mon_ctx_t* mon, dir_stat_t* tmp_stat,
   int n;
 
   if (!pctx.nomon) {
+    /* collect per-thread counters and latencies */
+    mon_cnt_fold(mon);
+    mon_lat_fold(mon);
     /* collect stats from deltafs */
     if (pctx.plfshdl != NULL) {
       mon_fetch_plfsdir_stat(pctx.plfshdl, tmp_stat);
@@ -554,6 +1598,7 @@ static void plfsdir_error_printer(const char* err, void*) { ERRR(err); }
  */
 static std::string gen_plfsdir_conf(int rank, int* io_engine, int* unordered,
                                     int* force_leveldb_fmt) {
+  static char memtable_size[32];
   char tmp[500];
   int n;
 
@@ -572,7 +1617,14 @@ static std::string gen_plfsdir_conf(int rank, int* io_engine, int* unordered,
   dirc.memtable_size = maybe_getenv("PLFSDIR_Memtable_size");
   if (dirc.memtable_size == NULL) {
     dirc.memtable_size = DEFAULT_MEMTABLE_SIZE;
+    /* memtables get what the memory budget grants them */
+    if (pctx.mb.total != 0 && pctx.mb.share[MB_MEMTABLES] >= (1 << 20)) {
+      snprintf(memtable_size, sizeof(memtable_size), "%zuKiB",
+               pctx.mb.share[MB_MEMTABLES] >> 10);
+      dirc.memtable_size = memtable_size;
+    }
   }
+  pctx.mb.used[MB_MEMTABLES] = membudget_parse(dirc.memtable_size);
 
   n += snprintf(tmp + n, sizeof(tmp) - n, "&memtable_size=%s",
                 dirc.memtable_size);
@@ -620,6 +1672,11 @@ static std::string gen_plfsdir_conf(int rank, int* io_engine, int* unordered,
     dirc.lg_parts = DEFAULT_LG_PARTS;
   }
 
+  pctx.mb.used[MB_DIRBUFS] =
+      (size_t(1) << atoi(dirc.lg_parts)) *
+          (membudget_parse(dirc.comp_buf) + membudget_parse(dirc.index_buf)) +
+      membudget_parse(dirc.data_buf);
+
   if (is_envset("PLFSDIR_Force_leveldb_format")) {
     dirc.force_leveldb_format = 1;
   }
@@ -671,61 +1728,340 @@ static std::string& pretty_plfsdir_conf(std::string& conf) {
   return conf;
 }
 
-namespace {
+namespace {
+/*
+ * fake_file is a replacement for FILE* that we use to accumulate all the
+ * VPIC particle data before sending it to the shuffle layer (on fclose).
+ *
+ * we assume only one thread is writing to the file at a time, so we
+ * do not put a mutex on it.
+ *
+ * we ignore out of memory errors.
+ */
+class fake_file {
+ private:
+  std::string path_; /* path of particle file (malloc'd c++) */
+  char data_[64];    /* enough for one VPIC particle */
+  char* dptr_;       /* ptr to next free space in data_ */
+  size_t resid_;     /* residual */
+
+ public:
+  fake_file() : dptr_(data_), resid_(sizeof(data_)) { path_.reserve(256); }
+
+  void reset(const char* path) {
+    path_.assign(path);
+    resid_ = sizeof(data_);
+    dptr_ = data_;
+  }
+
+  explicit fake_file(const char* path)
+      : path_(path), dptr_(data_), resid_(sizeof(data_)){};
+
+  /* returns the actual number of bytes added. */
+  size_t add_data(const void* toadd, size_t len) {
+    int n = (len > resid_) ? resid_ : len;
+    if (n) {
+      memcpy(dptr_, toadd, n);
+      dptr_ += n;
+      resid_ -= n;
+    }
+    return n;
+  }
+
+  /* get data length */
+  size_t size() { return sizeof(data_) - resid_; }
+
+  /* recover filename. */
+  const char* file_name() { return path_.c_str(); }
+
+  /* get data */
+  char* data() { return data_; }
+};
+
+/*
+ * a pool of preallocated fake_file objects. this avoids repeated mallocs as
+ * long as vpic does not open too many files at a time. a FILE* is recognized
+ * as ours through a simple address range check against the pool so that no
+ * lookups and no locking are needed on the fwrite/fputc/fclose path. files
+ * opened when the pool is exhausted are malloc'd and tracked in
+ * pctx.isdeltafs as before.
+ */
+#define FAKE_FILE_POOL_SIZE 64
+static fake_file ff_pool[FAKE_FILE_POOL_SIZE];
+static int ff_busy[FAKE_FILE_POOL_SIZE] = {0};
+/* where to start looking for a free object. only a hint, so it is read and
+ * written with relaxed atomics */
+static int ff_hint = 0;
+
+/* updated under preload_mtx, but read without it by claim_FILE */
+static int num_heap_files = 0; /* num of open files not from the pool */
+static int num_open_files = 0; /* total num of open fake files */
+
+/* ff_pooled: return the pool index of a FILE*, or -1 if not from the pool */
+inline int ff_pooled(FILE* stream) {
+  uintptr_t p = reinterpret_cast<uintptr_t>(stream);
+  uintptr_t beg = reinterpret_cast<uintptr_t>(&ff_pool[0]);
+  uintptr_t end = reinterpret_cast<uintptr_t>(&ff_pool[FAKE_FILE_POOL_SIZE]);
+  if (p >= beg && p < end) {
+    assert((p - beg) % sizeof(fake_file) == 0);
+    return int((p - beg) / sizeof(fake_file));
+  } else {
+    return -1;
+  }
+}
+
+/* ff_alloc: obtain a fake_file object, preferably from the pool */
+fake_file* ff_alloc(const char* path) {
+  fake_file* ff;
+  int h = __atomic_load_n(&ff_hint, __ATOMIC_RELAXED);
+  for (int i = 0; i < FAKE_FILE_POOL_SIZE; i++) {
+    int idx = (h + i) % FAKE_FILE_POOL_SIZE;
+    if (ff_busy[idx] == 0 &&
+        __sync_bool_compare_and_swap(&ff_busy[idx], 0, 1)) {
+      __atomic_store_n(&ff_hint, (idx + 1) % FAKE_FILE_POOL_SIZE,
+                       __ATOMIC_RELAXED);
+      __sync_fetch_and_add(&num_open_files, 1);
+      ff = &ff_pool[idx];
+      ff->reset(path);
+      return ff;
+    }
+  }
+
+  WARN("vpic is opening too many particle files simultaneously");
+  ff = new fake_file(path);
+  pthread_mtx_lock(&preload_mtx);
+  assert(pctx.isdeltafs != NULL);
+  pctx.isdeltafs->insert(reinterpret_cast<FILE*>(ff));
+  __sync_fetch_and_add(&num_heap_files, 1);
+  pthread_mtx_unlock(&preload_mtx);
+  __sync_fetch_and_add(&num_open_files, 1);
+
+  return ff;
+}
+
+/* ff_free: return a fake_file object obtained via ff_alloc */
+void ff_free(fake_file* ff) {
+  FILE* const stream = reinterpret_cast<FILE*>(ff);
+  int idx = ff_pooled(stream);
+  if (idx != -1) {
+    assert(ff_busy[idx] != 0);
+    __sync_lock_release(&ff_busy[idx]);
+  } else {
+    pthread_mtx_lock(&preload_mtx);
+    assert(pctx.isdeltafs != NULL);
+    pctx.isdeltafs->erase(stream);
+    __sync_fetch_and_sub(&num_heap_files, 1);
+    pthread_mtx_unlock(&preload_mtx);
+    delete ff;
+  }
+  __sync_fetch_and_sub(&num_open_files, 1);
+}
+
+}  // namespace
+
+/*
+ * claim_FILE: look at FILE* and see if we claim it
+ */
+static int claim_FILE(FILE* stream) {
+  int rv;
+
+  if (ff_pooled(stream) != -1) {
+    return 1;
+  } else if (__atomic_load_n(&num_heap_files, __ATOMIC_ACQUIRE) == 0) {
+    /* fast path */
+    return 0;
+  }
+
+  pthread_mtx_lock(&preload_mtx);
+  assert(pctx.isdeltafs != NULL);
+  rv = int(pctx.isdeltafs->count(stream) != 0);
+  pthread_mtx_unlock(&preload_mtx);
+
+  return rv;
+}
+
+/*
+ * startup stages timed by MPI_Init. the breakdown is reduced across
+ * all ranks and printed by rank 0 before the first epoch.
+ */
+#define STARTUP_MPI 0     /* the real MPI_Init */
+#define STARTUP_PROBE 1   /* sys probing (rank 0 only) */
+#define STARTUP_XPORT 2   /* shuffle transport and address exchange */
+#define STARTUP_PLACE 3   /* shuffle placement (overlaps the transport) */
+#define STARTUP_SHFSYNC 4 /* waiting for all peers to have the shuffle */
+#define STARTUP_RECVCOMM 5
+#define STARTUP_PLFSDIR 6
+#define STARTUP_MON 7
+#define STARTUP_TOTAL 8
+#define STARTUP_NSTAGES 9
+static const char* const startup_names[STARTUP_NSTAGES] = {
+    "mpi init",     "sys probing", "shuffle transport",
+    "placement",    "shuffle sync", "receiver comm",
+    "plfsdir open", "mon setup",    "total"};
+static unsigned long long startup_micros[STARTUP_NSTAGES] = {0};
+
+/*
+ * startup_probe: probe sys info. may run in a separate thread so that
+ * rank 0 does not delay the shuffle address exchange of all other ranks.
+ */
+static void* startup_probe(void*) {
+  uint64_t start;
+
+  start = now_micros();
+  /* will skip if we have no access */
+  try_scan_procfs();
+  try_scan_sysfs();
+  check_clockres();
+  startup_micros[STARTUP_PROBE] = now_micros() - start;
+
+  return NULL;
+}
+
 /*
- * fake_file is a replacement for FILE* that we use to accumulate all the
- * VPIC particle data before sending it to the shuffle layer (on fclose).
- *
- * we assume only one thread is writing to the file at a time, so we
- * do not put a mutex on it.
- *
- * we ignore out of memory errors.
+ * startup_report: reduce startup timings across ranks and print the
+ * breakdown at rank 0.
  */
-class fake_file {
- private:
-  std::string path_; /* path of particle file (malloc'd c++) */
-  char data_[64];    /* enough for one VPIC particle */
-  char* dptr_;       /* ptr to next free space in data_ */
-  size_t resid_;     /* residual */
+static void startup_report() {
+  unsigned long long max_micros[STARTUP_NSTAGES];
+  unsigned long long sum_micros[STARTUP_NSTAGES];
+  std::string report;
+  char tmp[100];
+  int i;
+
+  MPI_Reduce(startup_micros, max_micros, STARTUP_NSTAGES,
+             MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+  MPI_Reduce(startup_micros, sum_micros, STARTUP_NSTAGES,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  if (pctx.my_rank == 0) {
+    report = "startup breakdown (max / avg across ranks)";
+    for (i = 0; i < STARTUP_NSTAGES; i++) {
+      snprintf(tmp, sizeof(tmp), "\n>>> %s: %.1f / %.1f ms",
+               startup_names[i], double(max_micros[i]) / 1000,
+               double(sum_micros[i]) / 1000 / pctx.comm_sz);
+      report += tmp;
+    }
+    INFO(report.c_str());
+  }
+}
 
- public:
-  fake_file() : dptr_(data_), resid_(sizeof(data_)) { path_.reserve(256); }
+/*
+ * hardware counters of background threads (PRELOAD_Papi_threads). our
+ * pthread_create() taps new threads to count thr_codes[]. their counts
+ * are folded into per-class sums at epoch boundaries and at exit.
+ */
+static int thr_codes[MON_THR_EVENTS]; /* papi codes of the events counted */
+static int thr_evidx[MON_THR_EVENTS]; /* MON_THR_* of each code */
+static int thr_ncodes = 0;
+static pthread_mutex_t thr_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* counts of threads that ended after the last fold (protected by thr_mtx) */
+static long long thr_pending[MON_THR_CLASSES][MON_THR_EVENTS];
+/* counts since the start */
+static long long thr_total[MON_THR_CLASSES][MON_THR_EVENTS];
 
-  void reset(const char* path) {
-    path_.assign(path);
-    resid_ = sizeof(data_);
-    dptr_ = data_;
+/*
+ * thr_add: add the counts of a thread of class cls to dst
+ */
+static void thr_add(long long (*dst)[MON_THR_EVENTS], int cls,
+                    const long long* counts, int n) {
+  for (int i = 0; i < n; i++) {
+    dst[cls][thr_evidx[i]] += counts[i];
   }
+}
 
-  explicit fake_file(const char* path)
-      : path_(path), dptr_(data_), resid_(sizeof(data_)){};
+/*
+ * thr_collect: tapuseprobe_collect() callback for a running thread
+ */
+static void thr_collect(const char* tag, void* tagarg, const long long* counts,
+                        int n, void* arg) {
+  thr_stat_t* const st = static_cast<thr_stat_t*>(arg);
+  const int cls = int(reinterpret_cast<intptr_t>(tagarg));
 
-  /* returns the actual number of bytes added. */
-  size_t add_data(const void* toadd, size_t len) {
-    int n = (len > resid_) ? resid_ : len;
-    if (n) {
-      memcpy(dptr_, toadd, n);
-      dptr_ += n;
-      resid_ -= n;
+  thr_add(st->num, cls, counts, n);
+  st->nthreads[cls]++;
+}
+
+/*
+ * thr_tap_done: tap output routine called when a tapped thread ends
+ */
+static void* thr_tap_done(const char* tag, void* tagarg,
+                          struct tapuseprobe* up) {
+  long long diff[TAP_MAX_PAPI_EVENTS];
+  const int cls = int(reinterpret_cast<intptr_t>(tagarg));
+
+  if (up->papi_n != 0) {
+    for (int i = 0; i < up->papi_n; i++) {
+      diff[i] = up->papi1[i] - up->papi0[i];
     }
-    return n;
+    pthread_mtx_lock(&thr_mtx);
+    thr_add(thr_pending, cls, diff, up->papi_n);
+    pthread_mtx_unlock(&thr_mtx);
+  }
+  if (pctx.my_rank < pctx.pthread_tap) {
+    tapuseprobe_print(stderr, up, tag, getpid());
   }
 
-  /* get data length */
-  size_t size() { return sizeof(data_) - resid_; }
-
-  /* recover filename. */
-  const char* file_name() { return path_.c_str(); }
+  return NULL;
+}
 
-  /* get data */
-  char* data() { return data_; }
-};
+/*
+ * thr_fold: collect the counts of background threads since the last fold
+ * into the totals and, if epoch is not NULL, into *epoch.
+ */
+static void thr_fold(thr_stat_t* epoch) {
+  thr_stat_t st;
+
+  memset(&st, 0, sizeof(st));
+  tapuseprobe_collect(thr_collect, &st);
+  pthread_mtx_lock(&thr_mtx);
+  for (int c = 0; c < MON_THR_CLASSES; c++) {
+    for (int e = 0; e < MON_THR_EVENTS; e++) {
+      st.num[c][e] += thr_pending[c][e];
+      thr_pending[c][e] = 0;
+    }
+  }
+  pthread_mtx_unlock(&thr_mtx);
+  for (int c = 0; c < MON_THR_CLASSES; c++) {
+    for (int e = 0; e < MON_THR_EVENTS; e++) {
+      thr_total[c][e] += st.num[c][e];
+    }
+  }
+  if (epoch != NULL) {
+    memcpy(epoch->num, st.num, sizeof(st.num));
+    memcpy(epoch->max, st.num, sizeof(st.num));
+    memcpy(epoch->nthreads, st.nthreads, sizeof(st.nthreads));
+  }
+}
 
-/* avoids repeated malloc if vpic only opens one file a time */
-static fake_file vpic_file_buffer;
-static fake_file* vpic_file = &vpic_file_buffer;
+/*
+ * thr_report: reduce the counts of background threads since the start
+ * across ranks and print them at rank 0.
+ */
+static void thr_report() {
+  long long sum[MON_THR_CLASSES][MON_THR_EVENTS];
+  long long max[MON_THR_CLASSES][MON_THR_EVENTS];
+  char msg[200];
 
-}  // namespace
+  thr_fold(NULL);
+  MPI_Reduce(&thr_total[0][0], &sum[0][0], MON_THR_CLASSES * MON_THR_EVENTS,
+             MPI_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(&thr_total[0][0], &max[0][0], MON_THR_CLASSES * MON_THR_EVENTS,
+             MPI_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+  if (pctx.my_rank == 0) {
+    for (int c = 0; c < MON_THR_CLASSES; c++) {
+      const long long* const v = sum[c];
+      if (v[MON_THR_CYC] == 0) continue;
+      snprintf(msg, sizeof(msg),
+               "[thr] %s threads: %.2f ipc, %s stall cycles (%.1f%%)\n>>> "
+               "%s llc misses (max: %s per rank)",
+               tplace_name(c), double(v[MON_THR_INS]) / v[MON_THR_CYC],
+               pretty_num(v[MON_THR_STL]).c_str(),
+               100.0 * v[MON_THR_STL] / v[MON_THR_CYC],
+               pretty_num(v[MON_THR_LLCM]).c_str(),
+               pretty_num(max[c][MON_THR_LLCM]).c_str());
+      INFO(msg);
+    }
+  }
+}
 
 /*
  * here are the actual override functions from libc...
@@ -755,12 +2091,17 @@ int MPI_Init(int* argc, char*** argv) {
   int deltafs_minor;
   int deltafs_patch;
   intptr_t mpi_wtime_is_global;
+  pthread_t probe_tid;
+  int overlap_probe;
+  uint64_t init_start;
+  uint64_t start;
   uid_t uid;
   int flag;
   int size;
   int unordered;
   int force_leveldb_fmt;
   int io_engine;
+  int pcls;
   int rank;
   int rv;
   int n;
@@ -768,7 +2109,9 @@ int MPI_Init(int* argc, char*** argv) {
   rv = pthread_once(&init_once, preload_init);
   if (rv) ABORT("pthread_once");
 
+  init_start = now_micros();
   rv = nxt.MPI_Init(argc, argv);
+  startup_micros[STARTUP_MPI] = now_micros() - init_start;
   if (rv == MPI_SUCCESS) {
     MPI_Comm_size(MPI_COMM_WORLD, &size);
     MPI_Comm_rank(MPI_COMM_WORLD, &rank);
@@ -939,20 +2282,32 @@ int MPI_Init(int* argc, char*** argv) {
   /* obtain number of logic cpu cores */
   pctx.my_cpus = my_cpu_cores();
 
-  /* probe system info */
+  /* probe system info. the slow part is done in the background if there
+   * is a shuffle address exchange it can overlap with. */
+  overlap_probe = 0;
   if (rank == 0) {
     check_sse42();
     maybe_warn_numa();
+    if (pctx.tplace) {
+      snprintf(msg, sizeof(msg), "[numa] bg thread placement: %s",
+               tplace_summary().c_str());
+      INFO(msg);
+    }
     maybe_warn_rlimit(pctx.my_rank, pctx.comm_sz);
     if (pctx.noscan) {
       WARN("auto platform hardware detection disabled");
     } else {
-      /* will skip if we have no access */
-      try_scan_procfs();
-      try_scan_sysfs();
+      overlap_probe = !pctx.serial_startup && pctx.len_deltafs_mntp != 0 &&
+                      pctx.len_plfsdir != 0 && !IS_BYPASS_SHUFFLE(pctx.mode);
+    }
+    if (overlap_probe) {
+      rv = pthread_create(&probe_tid, NULL, startup_probe, NULL);
+      if (rv) ABORT("pthread_create");
+    } else if (pctx.noscan) {
+      check_clockres();
+    } else {
+      startup_probe(NULL);
     }
-
-    check_clockres();
   }
 
   if (rank == 0) {
@@ -984,6 +2339,42 @@ int MPI_Init(int* argc, char*** argv) {
       INFO(msg);
     }
 
+    /* papi must be ready before the background threads it may count are
+     * created by the shuffle and the plfsdir */
+    if (!pctx.nomon && !pctx.nopapi) {
+#ifdef PRELOAD_HAS_PAPI
+      if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
+        ABORT("cannot init PAPI");
+      }
+
+      rv = PAPI_thread_init(pthread_self);
+      if (rv != PAPI_OK) ABORT("cannot init PAPI thread");
+
+      if (pctx.papi_threads) {
+        static const char* const thr_events[MON_THR_EVENTS] = {
+            "PAPI_TOT_INS", "PAPI_TOT_CYC", "PAPI_L3_TCM", "PAPI_RES_STL"};
+        for (int e = 0; e < MON_THR_EVENTS; e++) {
+          rv = PAPI_event_name_to_code(const_cast<char*>(thr_events[e]), &n);
+          if (rv == PAPI_OK) rv = PAPI_query_event(n);
+          if (rv == PAPI_OK) {
+            thr_codes[thr_ncodes] = n;
+            thr_evidx[thr_ncodes] = e;
+            thr_ncodes++;
+          } else if (rank == 0) {
+            snprintf(msg, sizeof(msg),
+                     "papi event %s not available - NOT COUNTED FOR "
+                     "BACKGROUND THREADS",
+                     thr_events[e]);
+            WARN(msg);
+          }
+        }
+        if (rank == 0 && thr_ncodes != 0) {
+          INFO("papi counters for background threads ON");
+        }
+      }
+#endif
+    }
+
     /* everyone is a receiver by default. when shuffle is enabled, some ranks
      * may become sender-only */
     pctx.recv_comm = MPI_COMM_WORLD;
@@ -993,11 +2384,21 @@ int MPI_Init(int* argc, char*** argv) {
         INFO("shuffle starting ...");
       }
       shuffle_init(&pctx.sctx);
+      startup_micros[STARTUP_XPORT] = pctx.sctx.xport_micros;
+      startup_micros[STARTUP_PLACE] = pctx.sctx.place_micros;
+      start = now_micros();
       /* ensures all peers have the shuffle ready */
       preload_barrier(MPI_COMM_WORLD);
+      startup_micros[STARTUP_SHFSYNC] = now_micros() - start;
       if (rank == 0) {
         INFO("shuffle started");
+        if (pctx.write_batch > 1) {
+          snprintf(msg, sizeof(msg), "shuffle writes batched every %d writes",
+                   pctx.write_batch);
+          INFO(msg);
+        }
       }
+      start = now_micros();
       if (!shuffle_is_everyone_receiver(&pctx.sctx)) {
         /* rank 0 must be a receiver */
         if (rank == 0) assert(shuffle_is_rank_receiver(&pctx.sctx, rank) != 0);
@@ -1009,10 +2410,14 @@ int MPI_Init(int* argc, char*** argv) {
           ABORT("MPI_Comm_split");
         }
       }
+      startup_micros[STARTUP_RECVCOMM] = now_micros() - start;
     } else {
       if (rank == 0) {
         WARN("shuffle bypassed");
       }
+      if (pctx.mem_budget != 0) {
+        membudget_init(&pctx.mb, pctx.mem_budget, 1, 0, 1);
+      }
     }
 
     if (pctx.recv_comm != MPI_COMM_NULL) {
@@ -1033,6 +2438,7 @@ int MPI_Init(int* argc, char*** argv) {
     }
 
     /* pre-create plfsdirs if there is any */
+    start = now_micros();
     if (!IS_BYPASS_WRITE(pctx.mode)) {
       assert(claim_path(pctx.plfsdir, &exact));
       /* relative paths we pass through; absolute we strip off prefix */
@@ -1088,7 +2494,9 @@ int MPI_Init(int* argc, char*** argv) {
           deltafs_plfsdir_set_side_io_buf_size(pctx.plfshdl,
                                                pctx.particle_buf_size);
           pctx.plfsparts = deltafs_plfsdir_get_memparts(pctx.plfshdl);
+          pcls = tplace_scope(TPLACE_COMP);
           pctx.plfstp = deltafs_tp_init(pctx.bgsngcomp ? 1 : pctx.plfsparts);
+          tplace_scope(pcls);
           deltafs_plfsdir_set_thread_pool(pctx.plfshdl, pctx.plfstp);
           pctx.plfsenv = deltafs_env_init(
               1, reinterpret_cast<void**>(const_cast<char**>(&env)));
@@ -1099,6 +2507,12 @@ int MPI_Init(int* argc, char*** argv) {
           if (rv != 0) {
             ABORT("cannot open plfsdir");
           } else {
+            if (pctx.async_epochs != 0) {
+              /* deferred writes get what the memory budget grants them */
+              aflush_cap = pctx.mb.total != 0 ? pctx.mb.share[MB_DEFERRED]
+                                              : pctx.defer_buf;
+              pctx.mb.used[MB_DEFERRED] = aflush_cap;
+            }
             if (rank == 0) {
               snprintf(msg, sizeof(msg),
                        "plfsdir (via deltafs-LT, env=%s, io_engine=%d, "
@@ -1115,11 +2529,22 @@ int MPI_Init(int* argc, char*** argv) {
             if (rv != 0) {
               ABORT("cannot open plfsdir io");
             } else {
+              if (pctx.sidebuf_size != 0) {
+                sidebuf_init();
+              }
               if (rank == 0) {
                 snprintf(msg, sizeof(msg),
                          "plfsdir side io opened\n>>> io buf size: %s",
                          pretty_size(pctx.particle_buf_size).c_str());
                 INFO(msg);
+                if (pctx.sidebuf_size != 0) {
+                  snprintf(msg, sizeof(msg),
+                           "side io write-behind: %d x %s segments (%s)",
+                           pctx.sidebuf_nsegs,
+                           pretty_size(pctx.sidebuf_size).c_str(),
+                           pctx.sidebuf_bg ? "bg writer" : "inline");
+                  INFO(msg);
+                }
               }
             }
           }
@@ -1142,6 +2567,9 @@ int MPI_Init(int* argc, char*** argv) {
       }
     }
 
+    startup_micros[STARTUP_PLFSDIR] = now_micros() - start;
+
+    start = now_micros();
     if (!pctx.nomon) {
       assert(sizeof(mon_ctx_t) <= MON_BUF_SIZE);
 
@@ -1173,12 +2601,6 @@ int MPI_Init(int* argc, char*** argv) {
         pctx.papi_events->resize(MAX_PAPI_EVENTS);
       }
 
-      if (PAPI_library_init(PAPI_VER_CURRENT) != PAPI_VER_CURRENT) {
-        ABORT("cannot init PAPI");
-      }
-
-      rv = PAPI_thread_init(pthread_self);
-      if (rv != PAPI_OK) ABORT("cannot init PAPI thread");
       rv = PAPI_create_eventset(&pctx.papi_set);
       if (rv != PAPI_OK) ABORT("cannot init PAPI event set");
 
@@ -1197,18 +2619,77 @@ int MPI_Init(int* argc, char*** argv) {
       }
 #endif
     }
+    startup_micros[STARTUP_MON] = now_micros() - start;
+
+    if (overlap_probe) {
+      rv = pthread_join(probe_tid, NULL);
+      if (rv) ABORT("pthread_join");
+    }
+    startup_micros[STARTUP_TOTAL] = now_micros() - init_start;
+    startup_report();
 
     if (rank == 0) {
       if (pctx.sampling) {
         snprintf(msg, sizeof(msg),
-                 "########## | >>> particle sampling: %s in %s",
-                 pretty_num(pctx.sthres).c_str(), pretty_num(1000000).c_str());
+                 "########## | >>> particle sampling: %s in %s (up to %s "
+                 "names per rank, %s)",
+                 pretty_num(pctx.sthres).c_str(), pretty_num(1000000).c_str(),
+                 pctx.scap != 0 ? pretty_num(pctx.scap).c_str() : "unlimited",
+                 pretty_size(lanes_sample_memory()).c_str());
         INFO(msg);
       } else {
         INFO("particle sampling skipped");
       }
+      if (pctx.summ_nfields != 0) {
+        snprintf(msg, sizeof(msg),
+                 "epoch summary: %d fields, %d name buckets (%s per lane)",
+                 pctx.summ_nfields, 1 << pctx.summ_bits,
+                 pretty_size(zonemap_memory(&pctx.lanes[0].zmap)).c_str());
+        INFO(msg);
+      }
+      if (pctx.async_epochs != 0) {
+        snprintf(msg, sizeof(msg),
+                 "async epoch flushing: up to %d epochs in flight, "
+                 "%s of deferred writes",
+                 pctx.async_epochs, pretty_size(aflush_cap).c_str());
+        INFO(msg);
+        if (!IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
+          WARN("async epoch flushing only applies to deltafs plfsdirs");
+        }
+      }
+      if (pctx.bgthrot != 0) {
+        snprintf(msg, sizeof(msg),
+                 "bg throttling: running %d%% of every %d ms between dumps",
+                 pctx.bgthrot, pctx.bgthrot_period);
+        INFO(msg);
+        if (!IS_BYPASS_SHUFFLE(pctx.mode) && pctx.sctx.type == SHUFFLE_XN) {
+          WARN("bg throttling does not pause 3-hop shuffle threads\n>>> "
+               "only the plfsdir thread pool is throttled");
+        }
+      }
+      if (pctx.mb.total != 0) {
+        char mbmsg[500];
+        size_t used = 0;
+        n = snprintf(mbmsg, sizeof(mbmsg),
+                     "memory budget: %s per rank (%s kept as slack)",
+                     pretty_size(pctx.mb.total).c_str(),
+                     pretty_size(pctx.mb.slack).c_str());
+        for (int i = 0; i < MB_NPARTS; i++) {
+          n += snprintf(mbmsg + n, sizeof(mbmsg) - n,
+                        "\n>>> %s: %s granted, %s used", membudget_name(i),
+                        pretty_size(pctx.mb.share[i]).c_str(),
+                        pretty_size(pctx.mb.used[i]).c_str());
+          used += pctx.mb.used[i];
+        }
+        INFO(mbmsg);
+        if (used > pctx.mb.total) {
+          WARN(
+              "memory budget exceeded (rank 0)\n>>> some consumers are "
+              "sized by their own settings or have a minimum size");
+        }
+      }
 
-      if (pctx.fake_data) WARN("vpic output replaced with fake data");
+      if (pctx.fake_data) WARN("vpic output replaced with synthetic data");
       if (pctx.paranoid_checks)
         WARN(
             "paranoid checks enabled: benchmarks unnecessarily slow "
@@ -1225,6 +2706,13 @@ int MPI_Init(int* argc, char*** argv) {
         WARN("deltafs plfsdir bypassed");
       } else if (IS_BYPASS_DELTAFS(pctx.mode)) {
         WARN("deltafs bypassed");
+        if (pctx.llogs) {
+          snprintf(msg, sizeof(msg),
+                   "particles written to per-epoch local logs\n>>> "
+                   "write lanes: %d",
+                   pctx.nlanes);
+          INFO(msg);
+        }
       }
     }
 
@@ -1242,10 +2730,15 @@ int MPI_Init(int* argc, char*** argv) {
       if (pctx.my_rank == 0) {
         INFO("pausing done (rank 0)");
       }
+    } else if (pctx.bgthrot != 0) {
+      bgthrot_start();
     }
   }
 
   srand(rank);
+  for (int l = 0; l < pctx.nlanes; l++) {
+    pctx.lanes[l].seed = unsigned(rank) * unsigned(pctx.nlanes) + unsigned(l);
+  }
 
   return rv;
 }
@@ -1301,9 +2794,10 @@ int MPI_Finalize(void) {
   unsigned long long num_bytes_read; /* per rank */
   unsigned long long sum_bytes_read;
   std::string tmp;
-  /* num names sampled: 0 -> total, 1 -> total valid */
-  unsigned long long num_samples[2]; /* per rank */
-  unsigned long long sum_samples[2];
+  /* num names sampled: 0 -> total, 1 -> total valid, 2 -> dropped */
+  unsigned long long num_samples[3]; /* per rank */
+  unsigned long long sum_samples[3];
+  std::vector<std::string> names; /* valid sampled names */
   /* num names dumped */
   unsigned long long num_names; /* per rank */
   unsigned long long sum_names;
@@ -1341,6 +2835,8 @@ int MPI_Finalize(void) {
     if (pctx.my_rank == 0) {
       INFO("resuming done (rank 0)");
     }
+  } else if (pctx.bgthrot != 0) {
+    bgthrot_shutdown_and_join();
   }
 
   if (pctx.my_rank == 0) {
@@ -1367,7 +2863,12 @@ int MPI_Finalize(void) {
         if (fd0 != -1) {
           n = snprintf(msg, sizeof(msg), "num_epochs=%d\n", num_epochs);
           n = write(fd0, msg, n);
-          n = snprintf(msg, sizeof(msg), "key_size=%s\n", dirc.key_size);
+          if (dirc.key_size != NULL) {
+            n = snprintf(msg, sizeof(msg), "key_size=%s\n", dirc.key_size);
+          } else { /* no plfsdir: names are stored in full */
+            n = snprintf(msg, sizeof(msg), "key_size=%d\n",
+                         pctx.particle_id_size);
+          }
           n = write(fd0, msg, n);
           n = snprintf(msg, sizeof(msg), "value_size=%d\n", pctx.particle_size);
           n = write(fd0, msg, n);
@@ -1395,6 +2896,11 @@ int MPI_Finalize(void) {
           n = write(fd0, msg, n);
           n = snprintf(msg, sizeof(msg), "comm_sz=%d\n", pctx.recv_sz);
           n = write(fd0, msg, n);
+          if (IS_BYPASS_DELTAFS(pctx.mode) && pctx.llogs) {
+            n = snprintf(msg, sizeof(msg), "local_log_lanes=%d\n",
+                         pctx.nlanes);
+            n = write(fd0, msg, n);
+          }
           close(fd0);
           errno = 0;
         } else {
@@ -1409,6 +2915,8 @@ int MPI_Finalize(void) {
       if (pctx.my_rank == 0) {
         INFO("shuffle shutting down ...");
       }
+      /* writes left in the staging area after the last epoch */
+      flush_staged_writes();
       /* ensures all peer messages are received */
       preload_barrier(MPI_COMM_WORLD);
       /* shuffle flush */
@@ -1429,20 +2937,34 @@ int MPI_Finalize(void) {
        */
       preload_barrier(MPI_COMM_WORLD);
       shuffle_finalize(&pctx.sctx);
+      free(batch_fnames);
+      batch_fnames = NULL;
+      free(batch_data);
+      batch_data = NULL;
       if (pctx.my_rank == 0) {
         INFO("shuffle off");
       }
     }
 
+    if (num_epochs != 0 && pctx.summ_nfields != 0 && !pctx.nodist &&
+        pctx.recv_comm != MPI_COMM_NULL) {
+      save_summary(num_epochs - 1);
+    }
+
     /* all writes are concluded, do the last flush, finish the directory,
      * retrieve final mon stats, and free the directory. note that the mon stats
      * must be retrieved before the directory is destroyed. */
     if (pctx.plfshdl != NULL) {
+      /* wait for epochs still being flushed in the background */
+      aflush_shutdown_and_join();
       finish_start = now_micros();
       if (pctx.my_rank == 0) {
         INFO("finalizing plfsdir ... (rank 0)");
       }
-      if (pctx.sideio) deltafs_plfsdir_io_finish(pctx.plfshdl);
+      if (pctx.sideio) {
+        sidebuf_destroy();
+        deltafs_plfsdir_io_finish(pctx.plfshdl);
+      }
       deltafs_plfsdir_finish(pctx.plfshdl);
       finish_end = now_micros();
       if (pctx.my_rank == 0) {
@@ -1490,6 +3012,9 @@ int MPI_Finalize(void) {
         INFO("plfsdir closed (rank 0)");
       }
     } else {
+      if (IS_BYPASS_DELTAFS(pctx.mode) && pctx.llogs) {
+        lanes_close_logs();
+      }
       if (num_epochs != 0) {
         dump_mon(&pctx.mctx, &tmp_stat, &pctx.last_dir_stat);
       }
@@ -1497,6 +3022,9 @@ int MPI_Finalize(void) {
 
 #ifdef PRELOAD_HAS_PAPI
     /* close papi */
+    if (thr_ncodes != 0) {
+      thr_report();
+    }
     if (pctx.papi_set != PAPI_NULL) {
       PAPI_destroy_eventset(&pctx.papi_set);
       PAPI_shutdown();
@@ -1505,15 +3033,23 @@ int MPI_Finalize(void) {
 
     /* conclude sampling */
     if (pctx.sampling && pctx.recv_comm != MPI_COMM_NULL) {
-      num_samples[0] = num_samples[1] = 0;
-      for (std::map<std::string, int>::const_iterator it = pctx.smap->begin();
-           it != pctx.smap->end(); ++it) {
-        if (it->second == num_epochs) {
-          num_samples[1]++;
+      num_samples[0] = num_samples[1] = num_samples[2] = 0;
+      for (int l = 0; l < pctx.nlanes; l++) {
+        const sampler_t* const sp = &pctx.lanes[l].smap;
+        for (uint32_t i = 0; i < sampler_slots(sp); i++) {
+          const int c = sampler_count(sp, i);
+          if (c == 0) continue;
+          if (c == num_epochs) {
+            names.push_back(std::string(sampler_key(sp, i), sp->key_sz));
+            num_samples[1]++;
+          }
+          num_samples[0]++;
         }
-        num_samples[0]++;
+        num_samples[2] += sp->ndropped;
       }
-      MPI_Reduce(num_samples, sum_samples, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM,
+      /* keep names sorted as they used to come out of a std::map */
+      std::sort(names.begin(), names.end());
+      MPI_Reduce(num_samples, sum_samples, 3, MPI_UNSIGNED_LONG_LONG, MPI_SUM,
                  0, pctx.recv_comm);
       if (pctx.my_rank == 0) {
         snprintf(msg, sizeof(msg),
@@ -1521,6 +3057,13 @@ int MPI_Finalize(void) {
                  pretty_num(sum_samples[0]).c_str(),
                  pretty_num(sum_samples[1]).c_str());
         INFO(msg);
+        if (sum_samples[2] != 0) {
+          snprintf(msg, sizeof(msg),
+                   "%s samples dropped due to sampler capacity\n>>> "
+                   "consider increasing PRELOAD_Sample_capacity",
+                   pretty_num(sum_samples[2]).c_str());
+          WARN(msg);
+        }
       }
       if (!pctx.nodist) {
         num_names = 0;
@@ -1533,21 +3076,18 @@ int MPI_Finalize(void) {
         fd0 = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
         if (fd0 != -1) {
           tmp = "dumped names = (\n    ...\n";
-          for (std::map<std::string, int>::const_iterator it =
-                   pctx.smap->begin();
-               it != pctx.smap->end(); ++it) {
-            if (it->second == num_epochs) {
-              n = snprintf(msg, sizeof(msg), "%s\n", it->first.c_str());
-              n = write(fd0, msg, n);
-              if (n == -1) {
-                break;
-              }
-              num_names++;
-              if (num_names <= 7) {
-                tmp += " !! ";
-                tmp += it->first;
-                tmp += "\n";
-              }
+          for (std::vector<std::string>::const_iterator it = names.begin();
+               it != names.end(); ++it) {
+            n = snprintf(msg, sizeof(msg), "%s\n", it->c_str());
+            n = write(fd0, msg, n);
+            if (n == -1) {
+              break;
+            }
+            num_names++;
+            if (num_names <= 7) {
+              tmp += " !! ";
+              tmp += *it;
+              tmp += "\n";
             }
           }
           tmp += "    ...\n";
@@ -1690,6 +3230,20 @@ int MPI_Finalize(void) {
                     INFO(msg);
                   }
                 }
+                for (int c = 0; c < MON_THR_CLASSES; c++) {
+                  const long long* const v = glob.thr_stat.num[c];
+                  if (v[MON_THR_CYC] == 0) continue;
+                  snprintf(msg, sizeof(msg),
+                           "         > %s threads: %.2f ipc, %s llc misses "
+                           "(max: %s per rank), %.1f%% stalled",
+                           tplace_name(c),
+                           double(v[MON_THR_INS]) / v[MON_THR_CYC],
+                           pretty_num(v[MON_THR_LLCM]).c_str(),
+                           pretty_num(glob.thr_stat.max[c][MON_THR_LLCM])
+                               .c_str(),
+                           100.0 * v[MON_THR_STL] / v[MON_THR_CYC]);
+                  INFO(msg);
+                }
 #endif
                 snprintf(msg, sizeof(msg),
                          "   > %s particle writes (%s collisions), %s per rank "
@@ -1982,6 +3536,47 @@ int mkdir(const char* dir, mode_t mode) {
   return rv;
 }
 
+/*
+ * save_placement: append the placement table used from a given epoch on to
+ * the PLACEMENT file so the reader can still find names once buckets have
+ * been moved. each record is the epoch and the number of buckets as two
+ * uint32s, followed by the partition (receiver index) of each bucket as
+ * an int32. called by rank 0 only.
+ */
+static void save_placement(int epoch) {
+  shuffle_ctx_t* const ctx = &pctx.sctx;
+  const size_t n = size_t(1) << ctx->ptbl_bits;
+  std::vector<int32_t> parts;
+  uint32_t hdr[2];
+  char path[PATH_MAX];
+  ssize_t nw;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/PLACEMENT", pctx.log_home);
+  fd = open(path, O_WRONLY | O_CREAT | (epoch == 0 ? O_TRUNC : O_APPEND),
+            0644);
+  if (fd == -1) {
+    ERRR("open");
+    return;
+  }
+  hdr[0] = uint32_t(epoch);
+  hdr[1] = uint32_t(n);
+  parts.resize(n);
+  for (size_t i = 0; i < n; i++) {
+    parts[i] = int32_t((ctx->ptbl[i] & ctx->receiver_mask) /
+                       ctx->receiver_rate);
+  }
+  nw = write(fd, hdr, sizeof(hdr));
+  if (nw == ssize_t(sizeof(hdr))) {
+    nw = write(fd, &parts[0], n * sizeof(int32_t));
+  }
+  if (nw == -1) {
+    ERRR("write");
+  }
+  close(fd);
+  errno = 0;
+}
+
 /*
  * opendir
  */
@@ -1992,6 +3587,11 @@ DIR* opendir(const char* dir) {
   uint64_t epoch_start;
   uint64_t flush_start;
   uint64_t flush_end;
+  uint64_t tr_barrier;
+  uint64_t tr_drain;
+  uint64_t tr_flush;
+  uint64_t ts;
+  int rebalanced;
   DIR* rv;
 
   int ret = pthread_once(&init_once, preload_init);
@@ -2031,36 +3631,59 @@ DIR* opendir(const char* dir) {
     if (pctx.my_rank == 0) {
       INFO("resuming done (rank 0)");
     }
+  } else if (pctx.bgthrot != 0) {
+    bgthrot_stop();
   }
 
+  tr_barrier = tr_drain = tr_flush = 0;
+  rebalanced = 0;
   if (pctx.paranoid_barrier) {
     if (num_epochs != 0) {
+      ts = now_micros();
       /*
        * this ensures we have received all peer writes and no more
        * writes will happen for the previous epoch.
        */
       preload_barrier(MPI_COMM_WORLD);
+      tr_barrier = now_micros() - ts;
     }
   }
 
   /* flush the shuffle layer so all messages are delivered */
   if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
     if (num_epochs != 0) {
+      flush_start = now_micros();
       if (pctx.my_rank == 0) {
-        flush_start = now_micros();
         INFO("flushing shuffle receivers ... (rank 0)");
       }
       shuffle_epoch_start(&pctx.sctx);
+      flush_end = now_micros();
+      tr_drain = flush_end - flush_start;
       if (pctx.my_rank == 0) {
-        flush_end = now_micros();
         snprintf(msg, sizeof(msg), "receiver flushing done %s",
                  pretty_dura(flush_end - flush_start).c_str());
         INFO(msg);
       }
     }
+    /* all writes of the previous epoch have been placed so placement
+     * can now change for the next one */
+    if (pctx.sctx.bload != NULL) {
+      rebalanced = num_epochs != 0 && shuffle_rebalance(&pctx.sctx) != 0;
+      if ((num_epochs == 0 || rebalanced) && pctx.my_rank == 0 &&
+          !pctx.nodist && pctx.len_plfsdir != 0) {
+        save_placement(num_epochs);
+      }
+    }
+  }
+
+  /* all writes of the previous epoch have been received */
+  if (num_epochs != 0 && pctx.summ_nfields != 0 && !pctx.nodist &&
+      pctx.recv_comm != MPI_COMM_NULL) {
+    save_summary(num_epochs - 1);
   }
 
   /* epoch flush */
+  ts = now_micros();
   if (num_epochs != 0 && pctx.recv_comm != MPI_COMM_NULL) {
     /*
      * unable to perform epoch flush at closedir() time because we are
@@ -2078,7 +3701,15 @@ DIR* opendir(const char* dir) {
       /* noop */
 
     } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
-      if (pctx.plfshdl != NULL) {
+      /* side io data still buffered must reach the log first */
+      if (pctx.sideio) sidebuf_flush();
+      if (pctx.plfshdl != NULL && pctx.async_epochs != 0) {
+        /* writes for the new epoch will be deferred until this is done */
+        aflush_schedule(num_epochs - 1);
+        if (pctx.my_rank == 0) {
+          INFO("plfsdir flushing scheduled (rank 0)");
+        }
+      } else if (pctx.plfshdl != NULL) {
         if (pctx.my_rank == 0) {
           flush_start = now_micros();
           INFO("flushing plfsdir ... (rank 0)");
@@ -2108,12 +3739,28 @@ DIR* opendir(const char* dir) {
         ABORT("plfsdir not opened");
       }
 
+    } else if (IS_BYPASS_DELTAFS(pctx.mode) && pctx.llogs) {
+      lanes_close_logs();
+      if (pctx.my_rank == 0) {
+        INFO("local logs closed (rank 0)");
+      }
+
     } else {
       /* noop */
     }
   }
 
+  tr_flush = now_micros() - ts;
+
   if (num_epochs != 0) {
+    if (!pctx.nomon) {
+      pctx.mctx.max_trbarrier = tr_barrier;
+      pctx.mctx.max_trdrain = tr_drain;
+      pctx.mctx.max_trflush = tr_flush;
+      aflush_report(&pctx.mctx);
+      bgthrot_report(&pctx.mctx);
+      memgov_report(&pctx.mctx);
+    }
     /*
      * delay dumping mon stats collected from the previous epoch
      * until the beginning of the next epoch, which allows us
@@ -2121,13 +3768,23 @@ DIR* opendir(const char* dir) {
      * compaction work.
      */
     dump_mon(&pctx.mctx, &tmp_stat, &pctx.last_dir_stat);
+    if (!pctx.nomon) {
+      memgov_adjust(&pctx.mctx);
+    }
+  }
+
+  if (!pctx.nomon) {
+    /* clear mon stats so the barrier below counts toward the new epoch */
+    mon_reinit(&pctx.mctx);
   }
 
-  if (pctx.paranoid_post_barrier) {
+  if (pctx.paranoid_post_barrier || rebalanced) {
     if (num_epochs != 0) {
       /*
        * this ensures all writes made for the next epoch
-       * will go to a new write buffer.
+       * will go to a new write buffer. after a placement change, it also
+       * keeps any rank from sending with the new table before every
+       * receiver has it, regardless of PRELOAD_No_paranoid_post_barrier.
        */
       preload_barrier(MPI_COMM_WORLD);
     }
@@ -2137,7 +3794,6 @@ DIR* opendir(const char* dir) {
   num_epochs++;
 
   if (!pctx.nomon) {
-    mon_reinit(&pctx.mctx); /* clear mon stats */
     /* reset epoch id */
     pctx.mctx.epoch_seq = num_epochs;
 
@@ -2162,6 +3818,9 @@ DIR* opendir(const char* dir) {
     if ((ret = PAPI_start(pctx.papi_set)) != PAPI_OK) {
       ABORT(PAPI_strerror(ret));
     }
+    if (thr_ncodes != 0) {
+      thr_fold(NULL); /* counts between epochs are only kept in the totals */
+    }
     if (pctx.my_rank == 0) {
       INFO("papi on");
     }
@@ -2202,7 +3861,7 @@ int closedir(DIR* dirp) {
   }
 
   if (pctx.paranoid_checks) {
-    if (!pctx.isdeltafs->empty()) {
+    if (num_open_files != 0) {
       ABORT("some plfsdir files still open!");
     }
     pctx.fnames->clear();
@@ -2214,6 +3873,7 @@ int closedir(DIR* dirp) {
       flush_start = now_micros();
       INFO("flushing shuffle senders ... (rank 0)");
     }
+    flush_staged_writes();
     shuffle_epoch_end(&pctx.sctx);
     if (pctx.my_rank == 0) {
       flush_end = now_micros();
@@ -2244,6 +3904,10 @@ int closedir(DIR* dirp) {
 
   /* epoch pre-flush */
   if (pctx.pre_flushing && pctx.recv_comm != MPI_COMM_NULL) {
+    /* the previous epoch must be fully flushed before this one is */
+    if (pctx.async_epochs != 0) {
+      aflush_wait(0);
+    }
     if (IS_BYPASS_WRITE(pctx.mode)) {
       /* noop */
 
@@ -2254,6 +3918,7 @@ int closedir(DIR* dirp) {
           INFO("pre-flushing plfsdir ... (rank 0)");
         }
 
+        if (pctx.sideio) sidebuf_flush();
         if (pctx.sideio && deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
           ABORT("fail to flush plfsdir side io");
         if (deltafs_plfsdir_flush(pctx.plfshdl, num_epochs - 1) != 0)
@@ -2303,6 +3968,9 @@ int closedir(DIR* dirp) {
            sizeof(pctx.mctx.mem_stat.num));
     memcpy(pctx.mctx.mem_stat.max, pctx.mctx.mem_stat.num,
            sizeof(pctx.mctx.mem_stat.num));
+    if (thr_ncodes != 0) {
+      thr_fold(&pctx.mctx.thr_stat);
+    }
     if (pctx.my_rank == 0) {
       INFO("papi off");
     }
@@ -2350,6 +4018,8 @@ int closedir(DIR* dirp) {
     if (pctx.my_rank == 0) {
       INFO("pausing done (rank 0)");
     }
+  } else if (pctx.bgthrot != 0) {
+    bgthrot_start();
   }
 
   /* record epoch duration */
@@ -2398,32 +4068,20 @@ FILE* fopen(const char* fpath, const char* mode) {
     stripped = (exact) ? "/" : (fpath + pctx.len_deltafs_mntp);
   }
 
-  pthread_mtx_lock(&preload_mtx);
   if (pctx.paranoid_checks) {
+    pthread_mtx_lock(&preload_mtx);
     fname = stripped + pctx.len_plfsdir + 1;
     if (pctx.fnames->count(fname) == 0) {
       pctx.fnames->insert(fname);
     } else {
-      pctx.mctx.ncw++;
+      mon_cnt_add(MON_NCW, 1);
     }
+    pthread_mtx_unlock(&preload_mtx);
   }
-  pctx.mctx.min_nw++;
-  pctx.mctx.max_nw++;
-  pctx.mctx.nw++;
-  /* allocate a fake FILE* and put it in the set */
-  fake_file* ff = NULL;
-  if (vpic_file != &vpic_file_buffer) {
-    ff = new fake_file(stripped);
-    WARN("vpic is opening multiple particle files simultaneously");
-  } else {
-    ff = vpic_file;
-    ff->reset(stripped);
-    vpic_file = NULL;
-  }
+  mon_cnt_add(MON_NW, 1);
+  /* allocate a fake FILE* */
+  fake_file* ff = ff_alloc(stripped);
   rv = reinterpret_cast<FILE*>(ff);
-  assert(pctx.isdeltafs != NULL);
-  pctx.isdeltafs->insert(rv);
-  pthread_mtx_unlock(&preload_mtx);
 
   return rv;
 }
@@ -2495,6 +4153,7 @@ int fclose(FILE* stream) {
   fake_file* const ff = reinterpret_cast<fake_file*>(stream);
   fname = ff->file_name();
   assert(fname != NULL);
+  mon_cnt_add(MON_NBW, ff->size());
   off = 0;
 
   /* check file path and remove parent directories */
@@ -2521,10 +4180,18 @@ int fclose(FILE* stream) {
 
     } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
       assert(pctx.plfshdl != NULL);
-      n = deltafs_plfsdir_io_append(pctx.plfshdl, ff->data(), ff->size());
-
-      if (n != ff->size()) {
-        ABORT("plfsdir sideio write failed");
+      if (pctx.sidebuf_size != 0) {
+        off = sidebuf_put(ff->data(), ff->size());
+      } else {
+        pthread_mtx_lock(&sidebuf_mtx);
+        off = sidebuf_off;
+        n = deltafs_plfsdir_io_append(pctx.plfshdl, ff->data(), ff->size());
+        sidebuf_off += ff->size();
+        pthread_mtx_unlock(&sidebuf_mtx);
+
+        if (n != ff->size()) {
+          ABORT("plfsdir sideio write failed");
+        }
       }
 
     } else if (IS_BYPASS_DELTAFS(pctx.mode)) {
@@ -2542,7 +4209,10 @@ int fclose(FILE* stream) {
     data = ff->data();
   }
 
-  if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
+  if (!IS_BYPASS_SHUFFLE(pctx.mode) && pctx.write_batch > 1) {
+    stage_write(fname, fname_len, data, data_len, num_epochs - 1);
+    rv = 0;
+  } else if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
     rv = shuffle_write(&pctx.sctx, fname, fname_len, data, data_len,
                        num_epochs - 1);
     if (rv) {
@@ -2555,34 +4225,43 @@ int fclose(FILE* stream) {
     }
   }
 
-  pthread_mtx_lock(&preload_mtx);
-  assert(pctx.isdeltafs != NULL);
-  pctx.isdeltafs->erase(stream);
-  if (ff == &vpic_file_buffer) {
-    vpic_file = &vpic_file_buffer;
-  } else {
-    delete ff;
-  }
-  pthread_mtx_unlock(&preload_mtx);
+  ff_free(ff);
 
   return rv;
 }
 
 /*
- * pthread_create: here we do the thread counting.
+ * pthread_create: here we do the thread counting.  threads created
+ * within a tplace_scope() are also pinned according to the placement
+ * policy, and their placement is added to the tap tag.
  */
 int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
                    void* (*start_routine)(void*), void* arg) {
   int rv;
+  int slot;
+  int cls;
   char* start;
   char tagbuf[20];
+  char place[32];
   std::string tagstr;
   const char* tag;
   void* bt[16];
   char** syms;
 
-  if (pctx.my_rank >= pctx.pthread_tap) {
+  slot = -1;
+  cls = tplace_current();
+  if (cls != -1) {
+    slot = tplace_pick(cls, place, sizeof(place));
+  }
+
+  if (pctx.my_rank >= pctx.pthread_tap && thr_ncodes == 0) {
     rv = nxt.pthread_create(thread, attr, start_routine, arg);
+  } else if (pctx.my_rank >= pctx.pthread_tap) {
+    /* tapped only for the hardware counters: no tag is ever printed */
+    rv = pthread_create_tap(
+        thread, attr, start_routine, arg, "",
+        reinterpret_cast<void*>(intptr_t(cls != -1 ? cls : TPLACE_NCLASSES)),
+        thr_tap_done, nxt.pthread_create, thr_codes, thr_ncodes);
   } else {
     snprintf(tagbuf, sizeof(tagbuf), "rank %d, bg %d, ", pctx.my_rank,
              num_pthreads);
@@ -2599,9 +4278,21 @@ int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
     if (syms) {
       free(syms);
     }
+    if (slot != -1) {
+      tagstr += " [";
+      tagstr += place;
+      tagstr += "]";
+    }
     tag = strdup(tagstr.c_str());
-    rv = pthread_create_tap(thread, attr, start_routine, arg, tag, NULL, NULL,
-                            nxt.pthread_create);
+    rv = pthread_create_tap(
+        thread, attr, start_routine, arg, tag,
+        reinterpret_cast<void*>(intptr_t(cls != -1 ? cls : TPLACE_NCLASSES)),
+        thr_tap_done, nxt.pthread_create, thr_codes, thr_ncodes);
+  }
+
+  if (rv == 0 && slot != -1) {
+    errno = tplace_apply(*thread, slot);
+    if (errno != 0) ABORT("pthread_setaffinity_np");
   }
 
   num_pthreads++;
@@ -2717,13 +4408,139 @@ long ftell(FILE* stream) {
 
 } /* extern "C" */
 
+/*
+ * preload_lane: return the write lane for a given name
+ */
+static inline write_lane_t* preload_lane(const char* fname,
+                                         unsigned char fname_len) {
+  if (pctx.nlanes == 1) return &pctx.lanes[0];
+  return &pctx.lanes[preload_lane_hash(fname, fname_len) & (pctx.nlanes - 1)];
+}
+
 /*
  * preload_write
  */
 int preload_write(const char* fname, unsigned char fname_len, char* data,
                   unsigned char data_len, int epoch) {
+  write_lane_t* const lane = preload_lane(fname, fname_len);
+  int rv;
+
+  pthread_mtx_lock(&lane->mtx);
+  rv = preload_lane_write(lane, fname, fname_len, data, data_len, epoch);
+  pthread_mtx_unlock(&lane->mtx);
+
+  return rv;
+}
+
+/*
+ * preload_lane_write_req: perform a write found in a batch through a given
+ * lane. names not followed by a '\0' are terminated in a copy on the stack.
+ */
+static inline int preload_lane_write_req(write_lane_t* lane, char* req,
+                                         unsigned char fname_len,
+                                         int fname_nul, unsigned char data_len,
+                                         int epoch) {
+  char fname[256];
+
+  if (fname_nul) {
+    return preload_lane_write(lane, req, fname_len, req + fname_len + 1,
+                              data_len, epoch);
+  }
+  memcpy(fname, req, fname_len);
+  fname[fname_len] = 0;
+  return preload_lane_write(lane, fname, fname_len, req + fname_len, data_len,
+                            epoch);
+}
+
+/*
+ * preload_write_batch: writes are first grouped by lane so that each lane
+ * is locked only once for the entire batch.
+ */
+int preload_write_batch(char* reqs, unsigned int req_stride, int num_reqs,
+                        unsigned char fname_len, int fname_nul,
+                        unsigned char data_len, int epoch) {
+  std::vector<int> order;
+  std::vector<int> off;
+  write_lane_t* lane;
+  char* req;
+  int rv;
+  int i;
+  int j;
+
+  rv = 0;
+  if (num_reqs <= 0) return rv;
+  if (pctx.nlanes == 1) {
+    lane = &pctx.lanes[0];
+    pthread_mtx_lock(&lane->mtx);
+    for (i = 0; i < num_reqs && rv == 0; i++) {
+      req = reqs + size_t(i) * req_stride;
+      rv = preload_lane_write_req(lane, req, fname_len, fname_nul, data_len,
+                                  epoch);
+    }
+    pthread_mtx_unlock(&lane->mtx);
+    return rv;
+  }
+
+  /* counting sort writes by lane */
+  off.resize(pctx.nlanes + 1, 0);
+  order.resize(num_reqs);
+  for (i = 0; i < num_reqs; i++) {
+    req = reqs + size_t(i) * req_stride;
+    order[i] = int(preload_lane(req, fname_len) - pctx.lanes);
+    off[order[i] + 1]++;
+  }
+  for (j = 0; j < pctx.nlanes; j++) {
+    off[j + 1] += off[j];
+  }
+  std::vector<int> idx(num_reqs);
+  std::vector<int> pos(off.begin(), off.end() - 1);
+  for (i = 0; i < num_reqs; i++) {
+    idx[pos[order[i]]++] = i;
+  }
+
+  for (j = 0; j < pctx.nlanes && rv == 0; j++) {
+    if (off[j] == off[j + 1]) continue;
+    lane = &pctx.lanes[j];
+    pthread_mtx_lock(&lane->mtx);
+    for (i = off[j]; i < off[j + 1] && rv == 0; i++) {
+      req = reqs + size_t(idx[i]) * req_stride;
+      rv = preload_lane_write_req(lane, req, fname_len, fname_nul, data_len,
+                                  epoch);
+    }
+    pthread_mtx_unlock(&lane->mtx);
+  }
+
+  return rv;
+}
+
+/*
+ * fake_particle: generate synthetic particle data.  each 4-byte word is
+ * a hash of the particle name and the epoch, so the data is cheap to
+ * make, differs across particles and epochs, and can be verified by
+ * a reader that knows the name and the epoch.
+ */
+static void fake_particle(char* buf, unsigned char data_len, const char* fname,
+                          unsigned char fname_len, int epoch) {
+  uint32_t word;
+  unsigned i;
+
+  for (i = 0; i < data_len; i += sizeof(word)) {
+    word = pdlfs::xxhash32(fname, fname_len, uint32_t(epoch) + i);
+    memcpy(buf + i, &word, std::min(sizeof(word), size_t(data_len - i)));
+  }
+}
+
+/*
+ * preload_lane_write: perform a write through a given lane. the lane must
+ * have been locked by the caller.
+ */
+int preload_lane_write(write_lane_t* lane, const char* fname,
+                       unsigned char fname_len, char* data,
+                       unsigned char data_len, int epoch) {
   int rv;
+  char fake[256];
   char path[PATH_MAX];
+  uint64_t t0;
   ssize_t n;
   int fd;
 
@@ -2732,12 +4549,11 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
   }
 
   if (pctx.fake_data) {
-    memset(particle_buf, 0, sizeof(particle_buf));
-    // TODO
+    fake_particle(fake, data_len, fname, fname_len, epoch);
+    data = fake;
   }
 
-  pthread_mtx_lock(&write_mtx);
-
+  lane->nw++;
   if (pctx.paranoid_checks) {
     if (fname_len != strlen(fname)) {
       ABORT("bad particle filename length");
@@ -2751,19 +4567,20 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
   }
 
   if (pctx.sampling) {
-    assert(pctx.smap != NULL);
     if (num_epochs == 1) {
       /* during the initial epoch, we accept as many names as possible */
-      if (getr(0, 1000000 - 1) < pctx.sthres) {
-        pctx.smap->insert(std::make_pair(fname, 1));
+      if (getr_r(&lane->seed, 0, 1000000 - 1) < pctx.sthres) {
+        sampler_insert(&lane->smap, fname, fname_len);
       }
     } else {
-      if (pctx.smap->count(fname) != 0) {
-        pctx.smap->at(fname)++;
-      }
+      sampler_touch(&lane->smap, fname, fname_len);
     }
   }
 
+  if (lane->zmap.nfields != 0) {
+    zonemap_add(&lane->zmap, fname, fname_len, data, data_len);
+  }
+
   rv = EOF; /* Return 0 on success, or EOF on errors */
 
   if (IS_BYPASS_WRITE(pctx.mode)) {
@@ -2771,9 +4588,27 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
 
   } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
     assert(pctx.plfshdl != NULL);
-    n = deltafs_plfsdir_append(pctx.plfshdl, fname, epoch, data, data_len);
+    if (__sync_fetch_and_add(&aflush_busy, 0) != 0 &&
+        aflush_defer(fname, fname_len, data, data_len, epoch)) {
+      rv = 0; /* to be replayed once the previous epoch is flushed */
+    } else {
+      t0 = !pctx.nomon ? now_nanos() : 0;
+      n = deltafs_plfsdir_append(pctx.plfshdl, fname, epoch, data, data_len);
+      t0 = !pctx.nomon ? now_nanos() - t0 : 0;
+      if (!pctx.nomon) {
+        mon_lat_add(MON_LAT_APPEND, t0);
+        if (t0 >= WSTALL_NANOS) {
+          mon_cnt_add(MON_WSTALL, t0 / 1000);
+        }
+      }
+      if (n == data_len) {
+        rv = 0;
+      }
+    }
 
-    if (n == data_len) {
+  } else if (IS_BYPASS_DELTAFS(pctx.mode) && pctx.llogs) {
+    if (llog_append(&lane->llog, int(lane - pctx.lanes), fname, fname_len,
+                    data, data_len, epoch) == 0) {
       rv = 0;
     }
 
@@ -2793,7 +4628,5 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
     ABORT("not implemented");
   }
 
-  pthread_mtx_unlock(&write_mtx);
-
   return rv;
 }
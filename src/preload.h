@@ -45,8 +45,13 @@
  *    Bytes of each particle
  *  PRELOAD_Particle_extra_size
  *    Extra bytes for each particle
+ *  PRELOAD_Write_batch_size
+ *    Number of writes staged before shuffled as a batch (1 disables batching)
  *  PRELOAD_Pthread_tap
  *    Rank# less than this will get their rusage tapped
+ *  PRELOAD_Thread_placement (e.g. "bg=n0;rpc=4-7;shuf=n1;comp=8,9")
+ *    Pin background threads by class (bg, rpc, shuf, comp) to a
+ *      numa node (nX) or round-robin to a list of cpus
  *  PRELOAD_Ignore_dirs (semicolon separated paths)
  *    Path to a set of directories where file I/O should be ignored
  *  PRELOAD_Bypass_shuffle
@@ -67,17 +72,30 @@
  *    Skip copying mon files out
  *  PRELOAD_Skip_papi
  *    Skip PAPI events collection
+ *  PRELOAD_Papi_threads
+ *    Also count instructions, cycles, llc misses, and stall cycles of
+ *      background threads, reported per thread class
  *  PRELOAD_Enable_verbose_mon
  *    Print mon info at the end of each epoch
  *  PRELOAD_Enable_verbose_error
  *    Print error info when write op fails
  *  PRELOAD_Enable_bg_pause
  *    Pause background threads between I/O phases
+ *  PRELOAD_Bg_throttle
+ *    Percent of time background threads may run between I/O phases
+ *      (0 disables): they are paused for the rest of each throttling
+ *      period and return to full speed when the next I/O phase begins
+ *      (the 3-hop shuffler's threads are never paused)
+ *  PRELOAD_Bg_throttle_period
+ *    Length of each throttling period in ms
  *  PRELOAD_Enable_bg_sngcomp
  *    Use only a single thread for memtable compaction
  *      regardless of the actual number of memtable partitions
  *  PRELOAD_No_sys_probing
  *    Do not scan operating system or device settings
+ *  PRELOAD_No_startup_overlap
+ *    Do not overlap local startup work (sys probing, placement
+ *      construction) with the shuffle address exchange
  *  PRELOAD_No_paranoid_checks
  *    Disable misc checks on vpic writes
  *  PRELOAD_No_paranoid_barrier
@@ -91,16 +109,52 @@
  *      and right before a soft epoch flush
  *  PRELOAD_No_epoch_pre_flushing
  *    No soft epoch flush at the end of an epoch
+ *  PRELOAD_Async_epochs
+ *    Max num of epochs flushed in the background (0 to flush in foreground)
+ *  PRELOAD_Async_defer_size
+ *    Max size of the writes held back while an epoch is flushed in the
+ *      background; writers wait for the flush once it is reached
+ *      Derived from PRELOAD_Memory_budget when not set
  *  PRELOAD_Local_root
  *    Local file system root that backs deltafs
+ *  PRELOAD_Enable_local_logs
+ *    Write particles to per-epoch local logs when deltafs is bypassed
+ *  PRELOAD_Local_log_lanes
+ *    Num of write lanes appending to local logs in parallel, each
+ *      with its own logs (rounded down to a power of 2)
  *  PRELOAD_Testing
  *    Used by developers to debug code
  *  PRELOAD_Inject_fake_data
- *    Replace particle data with artificial data
+ *    Replace particle data with synthetic data (a hash of name and epoch)
+ *  PRELOAD_Sideio_segment_size
+ *    Coalesce wisc-key side io into segments of this many bytes (0 = off)
+ *  PRELOAD_Sideio_segments
+ *    Num of side io segments that may be buffered
+ *  PRELOAD_Enable_sideio_bg_writer
+ *    Write side io segments from a background thread
+ *  PRELOAD_Lat_precision_bits
+ *    Precision of latency histograms in bits (1 to 10)
  *  PRELOAD_Sample_threshold
  *    Num samples per 1 million input particles
+ *  PRELOAD_Sample_capacity
+ *    Max num of particle names sampled per rank: derived from
+ *      PRELOAD_Sample_threshold and PRELOAD_Particles_per_rank when not
+ *      set. 0 lets the sampler grow, rehashing all names while writes
+ *      are being made
+ *  PRELOAD_Particles_per_rank
+ *    Expected num of particles written per rank per epoch
  *  PRELOAD_Skip_sampling
  *    Disable particle sampling
+ *  PRELOAD_Memory_budget
+ *    Per-rank memory budget (e.g. "512MiB") split among shuffle send
+ *      queues, shuffle delivery, memtables, dir buffers, and writes
+ *      deferred by async epoch flushing; memory is
+ *      shifted between send queues and a slack reserve across epochs
+ *      according to where stalls are observed
+ *  PRELOAD_Summary_fields
+ *    Particle data fields summarized per epoch (e.g. "0:f;4:f;12:i")
+ *  PRELOAD_Summary_bits
+ *    Log2 of the num of name buckets of the per-epoch summary
  *  PLFSDIR_Key_size
  *    Hash key size for encoding file names
  *  PLFSDIR_Filter_bits_per_key
@@ -167,6 +221,37 @@
 extern int preload_write(const char* id, unsigned char id_sz, char* data,
                          unsigned char data_len, int epoch);
 
+/*
+ * preload_write_batch: ship a group of writes to fs. the i-th write has its
+ * id at reqs + i * req_stride, followed by a '\0' and then its data. if
+ * id_nul is 0, the data directly follows the id instead. writes stop at the
+ * first error.
+ */
+extern int preload_write_batch(char* reqs, unsigned int req_stride,
+                               int num_reqs, unsigned char id_sz, int id_nul,
+                               unsigned char data_len, int epoch);
+
+/*
+ * Default num of side io write-behind segments.
+ */
+#define DEFAULT_SIDEIO_SEGMENTS 4
+
+/*
+ * Min default num of particle names sampled per rank. The default is
+ * twice the num of names expected to be sampled, but no less than this.
+ */
+#define DEFAULT_SAMPLE_CAPACITY 4096
+
+/*
+ * Default expected num of particles written per rank per epoch.
+ */
+#define DEFAULT_PARTICLES_PER_RANK 1048576
+
+/*
+ * Default log2 of the num of name buckets of the per-epoch summary.
+ */
+#define DEFAULT_SUMMARY_BITS 8
+
 /*
  * Default hash key size for encoding file names.
  * Specified as a string.
@@ -215,6 +300,12 @@ extern int preload_write(const char* id, unsigned char id_sz, char* data,
  */
 #define DEFAULT_DATA_MIN_WRITE_SIZE "6MiB"
 
+/*
+ * Default max size of the writes deferred by async epoch flushing.
+ * Specified as a string.
+ */
+#define DEFAULT_DEFER_BUF "16MiB"
+
 /*
  * Default logarithmic number of partitions.
  * Specified as a string.
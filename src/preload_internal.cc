@@ -31,6 +31,10 @@
 #include "preload_internal.h"
 
 #include <mpi.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 /* The global preload context */
 preload_ctx_t pctx = {0};
@@ -40,7 +44,19 @@ int exotic_write(const char* fname, unsigned char fname_len, char* data,
   int rv;
 
   rv = preload_write(fname, fname_len, data, data_len, epoch);
-  pctx.mctx.nfw++;
+  mon_cnt_add(MON_NFW, 1);
+
+  return rv;
+}
+
+int exotic_write_batch(char* reqs, unsigned int req_stride, int num_reqs,
+                       unsigned char fname_len, int fname_nul,
+                       unsigned char data_len, int epoch) {
+  int rv;
+
+  rv = preload_write_batch(reqs, req_stride, num_reqs, fname_len, fname_nul,
+                           data_len, epoch);
+  mon_cnt_add(MON_NFW, num_reqs);
 
   return rv;
 }
@@ -50,11 +66,18 @@ int native_write(const char* fname, unsigned char fname_len, char* data,
   int rv;
 
   rv = preload_write(fname, fname_len, data, data_len, epoch);
-  pctx.mctx.nlw++;
+  mon_cnt_add(MON_NLW, 1);
 
   return rv;
 }
 
+/* barrier backoff: first spin on MPI_Test, then yield the cpu between
+ * tests, then sleep with an exponentially increasing delay */
+#define BARRIER_SPINS 1000
+#define BARRIER_YIELDS 1000
+#define BARRIER_MIN_SLEEP 100       /* us */
+#define BARRIER_MAX_SLEEP 50 * 1000 /* us */
+
 namespace {
 struct barrier_state {
   double time;
@@ -66,30 +89,56 @@ void preload_barrier(MPI_Comm comm) {
   char msg[100];
   MPI_Request req;
   MPI_Status status;
-  struct barrier_state start;
-  struct barrier_state min;
-  double dura;
+  /* 0 -> {start time, rank}, 1 -> {negated start time, rank} */
+  struct barrier_state start[2];
+  /* 0 -> last rank to arrive, 1 -> first rank to arrive */
+  struct barrier_state max[2];
+  useconds_t delay = BARRIER_MIN_SLEEP;
+  double wait;
+  double skew;
+  int rounds = 0;
   int ok = 0;
 
   if (pctx.my_rank == 0) {
     INFO("barrier ...\n   B-A-R-R-I-E-R");
   }
-  start.time = MPI_Wtime();
-  start.rank = pctx.my_rank;
-  MPI_Iallreduce(&start, &min, 1, MPI_DOUBLE_INT, MPI_MINLOC, comm, &req);
-  while (!ok) {
-    usleep(50 * 1000);
+  start[0].time = MPI_Wtime();
+  start[0].rank = pctx.my_rank;
+  start[1].time = -start[0].time;
+  start[1].rank = pctx.my_rank;
+  MPI_Iallreduce(start, max, 2, MPI_DOUBLE_INT, MPI_MAXLOC, comm, &req);
+  while (true) {
     MPI_Test(&req, &ok, &status);
+    if (ok) break;
+    if (rounds < BARRIER_SPINS) {
+      /* noop */
+    } else if (rounds < BARRIER_SPINS + BARRIER_YIELDS) {
+      sched_yield();
+    } else {
+      usleep(delay);
+      delay = std::min(2 * delay, useconds_t(BARRIER_MAX_SLEEP));
+    }
+    rounds++;
+  }
+  wait = (MPI_Wtime() - start[0].time) * 1000000;
+  skew = (max[0].time + max[1].time) * 1000000;
+  if (!pctx.nomon) {
+    hstg_add(pctx.mctx.bar_wait, wait);
+    /* all ranks see the same skew so the slowest rank is agreed upon */
+    if (skew >= pctx.mctx.max_bar_skew) {
+      pctx.mctx.max_bar_skew = static_cast<unsigned long long>(skew);
+      pctx.mctx.bar_slowest = max[0].rank;
+    }
   }
   if (pctx.my_rank == 0) {
-    dura = MPI_Wtime() - min.time;
+    wait = (MPI_Wtime() + max[1].time) * 1000000;
 #ifdef PRELOAD_BARRIER_VERBOSE
     snprintf(msg, sizeof(msg),
-             "barrier ok (\n /* rank %d waited longest */\n %s+\n)", min.rank,
-             pretty_dura(dura * 1000000).c_str());
+             "barrier ok (\n /* rank %d waited longest */\n %s+\n"
+             " /* rank %d arrived last */\n)",
+             max[1].rank, pretty_dura(wait).c_str(), max[0].rank);
 #else
-    snprintf(msg, sizeof(msg), "barrier %s+",
-             pretty_dura(dura * 1000000).c_str());
+    snprintf(msg, sizeof(msg), "barrier %s+", pretty_dura(wait).c_str());
 #endif
     INFO(msg);
   }
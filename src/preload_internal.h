@@ -36,10 +36,14 @@
 #include <sys/time.h>
 
 #include <deltafs/deltafs_api.h>
+#include <pdlfs-common/xxhash.h>
 
 #include "common.h"
+#include "membudget.h"
 #include "preload_mon.h"
 #include "preload_shuffle.h"
+#include "sampler.h"
+#include "zonemap.h"
 
 #include "preload.h"
 
@@ -47,6 +51,58 @@
 #include <set>
 #include <vector>
 
+/*
+ * local_log: log-structured backend used by the BYPASS_DELTAFS mode when
+ * local logs are enabled. each write lane appends particle data to its own
+ * data log for the current epoch, batching records into large writes. each
+ * data log comes with an index that has one entry per record: a 1-byte
+ * name length, the name, the 8-byte record offset in the data log, and the
+ * 4-byte record size (in host byte order). logs are named
+ * LOG-<rank>-<lane>-<epoch>.{dat,idx} under local_root, where rank is the
+ * rank in the receiver group (as in NAMES-*.txt). the reader finds them
+ * through the local_log_lanes entry of the MANIFEST.
+ */
+typedef struct local_log {
+  int fd;       /* data log of the current epoch, -1 if none is open */
+  int ifd;      /* index of the current epoch */
+  int epoch;    /* epoch of the open logs */
+  uint64_t off; /* data log offset of the next record */
+  char* buf;    /* data not yet written */
+  size_t bufsz;
+  char* ibuf; /* index entries not yet written */
+  size_t ibufsz;
+} local_log_t;
+
+/*
+ * write_lane: receive-side write path. each name is hashed to one lane and
+ * writes going to different lanes may run in parallel. only local logs,
+ * where each lane appends to its own files, have more than one lane. a
+ * plfsdir handle takes one append at a time and the deltafs api has no way
+ * to append to a specific memtable partition, so writes going to a plfsdir
+ * always share a single lane, whose mutex is the only lock taken around
+ * each append.
+ */
+#define PRELOAD_MAX_LANES 64
+typedef struct write_lane {
+  pthread_mutex_t mtx;   /* serializes writes through this lane */
+  sampler_t smap;        /* names sampled by this lane */
+  zonemap_t zmap;        /* summary of writes through this lane */
+  local_log_t llog;      /* local logs written by this lane */
+  unsigned long long nw; /* num of writes through this lane */
+  unsigned int seed;     /* rand_r() state for sampling */
+} write_lane_t;
+
+/*
+ * preload_lane_hash: hash a name to pick its write lane. the seed differs
+ * from the one used by the shuffle placement, so names sent to the same
+ * receiver still spread over all lanes. shuffle workers and delivery
+ * threads split writes by the same hash so that they line up with lanes.
+ */
+#define PRELOAD_LANE_SEED 0x9e3779b9u
+inline uint32_t preload_lane_hash(const char* fname, unsigned char fname_len) {
+  return pdlfs::xxhash32(fname, fname_len, PRELOAD_LANE_SEED);
+}
+
 /*
  * preload context:
  *   - run-time state of the preload layer
@@ -80,6 +136,14 @@ typedef struct preload_ctx {
   int pre_flushing_wait;
   int pre_flushing_sync;
 
+  int async_epochs; /* max num of epochs flushed in the background (0=off) */
+  size_t defer_buf; /* max bytes of writes deferred by async flushing */
+
+  /* per-rank memory budget shared by shuffle queues, delivery, memtables,
+   * dir buffers, and deferred writes (0=off) */
+  size_t mem_budget;
+  membudget_t mb;
+
   int my_rank; /* my MPI world rank */
   int comm_sz; /* my MPI world size */
   int my_cpus; /* num of available cpu cores */
@@ -108,28 +172,47 @@ typedef struct preload_ctx {
   int plfsparts; /* num of memtable partitions */
   int plfsfd;    /* fd for the plfsdir */
 
+  write_lane_t* lanes; /* receive-side write lanes */
+  int nlanes;          /* num of write lanes (power of 2) */
+
 #ifdef PRELOAD_HAS_PAPI
   std::vector<const char*>* papi_events;
   int papi_set; /* opaque event set descriptor */
 #endif
 
-  std::set<FILE*>* isdeltafs;    /* open files owned by deltafs */
+  std::set<FILE*>* isdeltafs;    /* open files owned by deltafs (non-pooled) */
   std::set<std::string>* fnames; /* used for checking unique file names */
 
-  std::map<std::string, int>* smap; /* sampled particle names */
-
+  int scap;     /* max num of names sampled per rank (0 lets it grow) */
   int sthres;   /* sample threshold (num samples per 1 million input names) */
   int sampling; /* enable particle name sampling */
+
+  /* per-epoch summary index (summ_nfields=0 means off) */
+  zm_field_t summ_fields[ZM_MAX_FIELDS];
+  int summ_nfields;
+  int summ_bits; /* log2 of the num of name buckets */
+
   int sideio;   /* using the wisc-key format */
+  int llogs;    /* use local logs in the BYPASS_DELTAFS mode */
+
+  /* side io write-behind (wisc-key mode only; sidebuf_size=0 means off) */
+  size_t sidebuf_size; /* bytes per segment */
+  int sidebuf_nsegs;   /* num of segments */
+  int sidebuf_bg;      /* segments are written by a background thread */
 
   shuffle_ctx_t sctx; /* shuffle context */
+  /* num of writes staged before handed to the shuffle as a batch */
+  int write_batch;
 
   int testin;    /* developer mode - for debug use only */
-  int fake_data; /* replace vpic output with fake data - for debug only */
+  int fake_data; /* replace vpic output with synthetic data */
   int noscan;    /* do not probe sys info */
+  /* run local startup work in series with the shuffle address exchange */
+  int serial_startup;
 
   /* rank# less than this will get tapped */
   int pthread_tap;
+  int tplace; /* pin bg threads according to PRELOAD_Thread_placement */
 
   mon_ctx_t mctx; /* mon stats */
 
@@ -139,15 +222,20 @@ typedef struct preload_ctx {
   dir_stat_t last_dir_stat;
   uint64_t epoch_start;
 
-  int nomon;  /* skip monitoring */
-  int nopapi; /* skip papi monitoring  */
-  int nodist; /* skip releasing mon and sampling results */
+  int nomon;        /* skip monitoring */
+  int nopapi;       /* skip papi monitoring  */
+  int papi_threads; /* papi counters for background threads too */
+  int nodist;       /* skip releasing mon and sampling results */
 
   int logfd; /* descriptor for the testing log file */
   int monfd; /* descriptor for the mon dump file */
 
   int bgsngcomp; /* use a single background thread for memtable compaction */
   int bgpause;   /* no background activities during compuation */
+  /* % of time background activities may run during computation (0=off),
+   * and the length of each throttling period (ms) */
+  int bgthrot;
+  int bgthrot_period;
   int vmon;      /* verbose mon stats */
   int verr;      /* verbose error */
 
@@ -162,6 +250,16 @@ extern preload_ctx_t pctx;
 extern int exotic_write(const char* fname, unsigned char fname_len, char* data,
                         unsigned char data_len, int epoch);
 
+/*
+ * exotic_write_batch: perform a group of writes on behalf of remote ranks.
+ * see preload_write_batch() for the layout of the writes.
+ * return 0 on success, or EOF on errors.
+ */
+extern int exotic_write_batch(char* reqs, unsigned int req_stride,
+                              int num_reqs, unsigned char fname_len,
+                              int fname_nul, unsigned char data_len,
+                              int epoch);
+
 /*
  * native_write: perform a direct local write.
  * return 0 on success, or EOF on errors.
@@ -169,6 +267,15 @@ extern int exotic_write(const char* fname, unsigned char fname_len, char* data,
 extern int native_write(const char* fname, unsigned char fname_len, char* data,
                         unsigned char data_len, int epoch);
 
+/*
+ * preload_lane_write: perform a write through a specific write lane.
+ * the lane must be locked by the caller.
+ * return 0 on success, or EOF on errors.
+ */
+extern int preload_lane_write(write_lane_t* lane, const char* fname,
+                              unsigned char fname_len, char* data,
+                              unsigned char data_len, int epoch);
+
 /*
  * preload_barrier: perform a collective barrier operation
  * on the give communicator.
@@ -29,6 +29,7 @@
  */
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
@@ -112,8 +113,194 @@ void mem_stat_reduce(const mem_stat_t* src, mem_stat_t* sum) {
              MPI_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
 }
 
+void thr_stat_reduce(const thr_stat_t* src, thr_stat_t* sum) {
+  MPI_Reduce(const_cast<long long*>(&src->num[0][0]), &sum->num[0][0],
+             MON_THR_CLASSES * MON_THR_EVENTS, MPI_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<long long*>(&src->max[0][0]), &sum->max[0][0],
+             MON_THR_CLASSES * MON_THR_EVENTS, MPI_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<int*>(src->nthreads), sum->nthreads, MON_THR_CLASSES,
+             MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+}
+
 }  // namespace
 
+/*
+ * per-thread counter slots. a slot is released when its thread exits: its
+ * counts are moved to cnt_retired, its latencies to lat_retired, and the
+ * slot is put on cnt_free for the next thread to register. the last slot is
+ * shared by threads finding no free slot and is never released.
+ */
+static pthread_mutex_t cnt_mtx = PTHREAD_MUTEX_INITIALIZER;
+static mon_cnt_slot_t cnt_slots[MON_MAX_CNT_SLOTS];
+static int cnt_nslots = 0; /* slots ever handed out */
+static int cnt_free[MON_MAX_CNT_SLOTS];
+static int cnt_nfree = 0;
+static unsigned long long cnt_retired[MON_NUM_CNTS] = {0};
+static pthread_once_t cnt_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cnt_key; /* lets us know when a thread exits */
+/* counter sums at the last fold */
+static unsigned long long cnt_last[MON_NUM_CNTS] = {0};
+
+__thread mon_cnt_slot_t* mon_cnt_myslot = NULL;
+
+static void mon_cnt_retire(void* arg);
+
+static void mon_cnt_key_init() {
+  if (pthread_key_create(&cnt_key, mon_cnt_retire) != 0) {
+    ABORT("pthread_key_create");
+  }
+}
+
+mon_cnt_slot_t* mon_cnt_register() {
+  int i;
+
+  pthread_once(&cnt_once, mon_cnt_key_init);
+  pthread_mtx_lock(&cnt_mtx);
+  if (cnt_nfree != 0) {
+    i = cnt_free[--cnt_nfree];
+  } else if (cnt_nslots < MON_MAX_CNT_SLOTS - 1) {
+    i = cnt_nslots++;
+  } else {
+    i = MON_MAX_CNT_SLOTS - 1; /* out of slots; share the last one */
+    cnt_nslots = MON_MAX_CNT_SLOTS;
+    cnt_slots[i].shared = 1;
+  }
+  pthread_mtx_unlock(&cnt_mtx);
+  if (!cnt_slots[i].shared) {
+    pthread_setspecific(cnt_key, &cnt_slots[i]);
+  }
+  mon_cnt_myslot = &cnt_slots[i];
+  return mon_cnt_myslot;
+}
+
+unsigned long long mon_cnt_get(int c) {
+  unsigned long long sum;
+
+  pthread_mtx_lock(&cnt_mtx);
+  sum = cnt_retired[c];
+  for (int i = 0; i < cnt_nslots; i++) {
+    sum += *static_cast<volatile unsigned long long*>(&cnt_slots[i].v[c]);
+  }
+  pthread_mtx_unlock(&cnt_mtx);
+  return sum;
+}
+
+void mon_cnt_fold(mon_ctx_t* ctx) {
+  unsigned long long d[MON_NUM_CNTS];
+  unsigned long long sum;
+
+  for (int c = 0; c < MON_NUM_CNTS; c++) {
+    sum = mon_cnt_get(c);
+    d[c] = sum - cnt_last[c];
+    cnt_last[c] = sum;
+  }
+
+  /* counts are added to what is already there so that stats copied in by
+   * other means (such as the xn shuffler's own rpc counters) are kept */
+  ctx->nw += d[MON_NW];
+  ctx->min_nw = ctx->max_nw = ctx->nw;
+  ctx->nbw += d[MON_NBW];
+  ctx->ncw += d[MON_NCW];
+  ctx->nfw += d[MON_NFW];
+  ctx->nlw += d[MON_NLW];
+  ctx->nms += d[MON_NMS];
+  ctx->min_nms = ctx->max_nms = ctx->nms;
+  ctx->nmd += d[MON_NMD];
+  ctx->nmr += d[MON_NMR];
+  ctx->min_nmr = ctx->max_nmr = ctx->nmr;
+  ctx->nslotw += d[MON_NSLOTW];
+  ctx->nqw += d[MON_NQW];
+  ctx->ncrw += d[MON_NCRW];
+  ctx->qstall += d[MON_QSTALL];
+  ctx->max_qstall = ctx->qstall;
+  ctx->wstall += d[MON_WSTALL];
+  ctx->max_wstall = ctx->wstall;
+  ctx->zin += d[MON_ZIN];
+  ctx->zout += d[MON_ZOUT];
+  ctx->zmicros += d[MON_ZMICROS];
+  ctx->unzmicros += d[MON_UNZMICROS];
+}
+
+int mon_lat_precision = 5;
+
+static pthread_mutex_t lat_mtx = PTHREAD_MUTEX_INITIALIZER;
+/* latencies of threads that have exited */
+static lhstg_t lat_retired[MON_NUM_LATS];
+/* latency sums at the last fold */
+static lhstg_t lat_last[MON_NUM_LATS];
+
+/* mon_cnt_retire: release the slot of an exiting thread. called by
+ * pthreads with the slot as the value of cnt_key. */
+static void mon_cnt_retire(void* arg) {
+  mon_cnt_slot_t* const s = static_cast<mon_cnt_slot_t*>(arg);
+
+  pthread_mtx_lock(&cnt_mtx);
+  for (int c = 0; c < MON_NUM_CNTS; c++) {
+    cnt_retired[c] += s->v[c];
+    s->v[c] = 0;
+  }
+  pthread_mtx_lock(&lat_mtx);
+  for (int l = 0; l < MON_NUM_LATS; l++) {
+    if (s->lat[l].b == NULL) continue;
+    if (lat_retired[l].b == NULL) {
+      lhstg_init(&lat_retired[l], mon_lat_precision);
+    }
+    lhstg_merge(&s->lat[l], &lat_retired[l]);
+    lhstg_destroy(&s->lat[l]);
+    s->lat[l].num = s->lat[l].sum = 0;
+  }
+  pthread_mtx_unlock(&lat_mtx);
+  cnt_free[cnt_nfree++] = int(s - cnt_slots);
+  pthread_mtx_unlock(&cnt_mtx);
+  mon_cnt_myslot = NULL; /* later counts take a new slot */
+}
+
+void mon_lat_alloc(mon_cnt_slot_t* s, int l) {
+  lhstg_t tmp;
+  pthread_mtx_lock(&lat_mtx);
+  if (s->lat[l].b == NULL) {
+    lhstg_init(&tmp, mon_lat_precision);
+    s->lat[l].p = tmp.p;
+    s->lat[l].nb = tmp.nb;
+    __sync_synchronize();
+    s->lat[l].b = tmp.b; /* publish */
+  }
+  pthread_mtx_unlock(&lat_mtx);
+}
+
+void mon_lat_fold(mon_ctx_t* ctx) {
+  const int n = __sync_fetch_and_add(&cnt_nslots, 0);
+  const double scale[MON_NUM_LATS] = {1, 1, 1000}; /* to us */
+  lhstg_t cur[MON_NUM_LATS];
+
+  for (int l = 0; l < MON_NUM_LATS; l++) {
+    lhstg_init(&cur[l], mon_lat_precision);
+    /* keeps slots from being released while we read them */
+    pthread_mtx_lock(&lat_mtx);
+    if (lat_last[l].b == NULL) lhstg_init(&lat_last[l], mon_lat_precision);
+    if (lat_retired[l].b != NULL) lhstg_merge(&lat_retired[l], &cur[l]);
+    for (int i = 0; i < n; i++) {
+      if (cnt_slots[i].lat[l].b != NULL) {
+        lhstg_merge(&cnt_slots[i].lat[l], &cur[l]);
+      }
+    }
+    pthread_mtx_unlock(&lat_mtx);
+    /* cur becomes what is new since the last fold */
+    lhstg_subtract(&lat_last[l], &cur[l]);
+    lhstg_merge(&cur[l], &lat_last[l]);
+  }
+  lhstg_allreduce(cur, MON_NUM_LATS, MPI_COMM_WORLD);
+  for (int l = 0; l < MON_NUM_LATS; l++) {
+    ctx->lat[l][0] = lhstg_ptile(&cur[l], 50) / scale[l];
+    ctx->lat[l][1] = lhstg_ptile(&cur[l], 99) / scale[l];
+    ctx->lat[l][2] = lhstg_ptile(&cur[l], 99.9) / scale[l];
+    ctx->lat[l][3] = lhstg_max(&cur[l]) / scale[l];
+    lhstg_destroy(&cur[l]);
+  }
+}
+
 void mon_reduce(const mon_ctx_t* src, mon_ctx_t* sum) {
   MPI_Reduce(const_cast<unsigned long long*>(&src->min_dura), &sum->min_dura, 1,
              MPI_UNSIGNED_LONG_LONG, MPI_MIN, 0, MPI_COMM_WORLD);
@@ -166,9 +353,80 @@ void mon_reduce(const mon_ctx_t* src, mon_ctx_t* sum) {
   MPI_Reduce(const_cast<unsigned long long*>(&src->max_nw), &sum->max_nw, 1,
              MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
 
+  MPI_Reduce(const_cast<unsigned long long*>(&src->nbw), &sum->nbw, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->nslotw), &sum->nslotw, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->nqw), &sum->nqw, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->ncrw), &sum->ncrw, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->qstall), &sum->qstall, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_qstall),
+             &sum->max_qstall, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->wstall), &sum->wstall, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_wstall),
+             &sum->max_wstall, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+
+  MPI_Reduce(const_cast<unsigned long long*>(&src->zin), &sum->zin, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->zout), &sum->zout, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->zmicros), &sum->zmicros, 1,
+             MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->unzmicros),
+             &sum->unzmicros, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_trbarrier),
+             &sum->max_trbarrier, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_trdrain),
+             &sum->max_trdrain, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_trflush),
+             &sum->max_trflush, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_aflmicros),
+             &sum->max_aflmicros, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_aovmicros),
+             &sum->max_aovmicros, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_astmicros),
+             &sum->max_astmicros, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->ndeferred),
+             &sum->ndeferred, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_thrmicros),
+             &sum->max_thrmicros, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_thrbacklog),
+             &sum->max_thrbacklog, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(src->max_mem), sum->max_mem,
+             MB_NPARTS, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+
+  hstg_reduce(src->bar_wait, sum->bar_wait, MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<unsigned long long*>(&src->max_bar_skew),
+             &sum->max_bar_skew, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(const_cast<int*>(&src->bar_slowest), &sum->bar_slowest, 1,
+             MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+
+  /* same on all ranks */
+  MPI_Reduce(const_cast<double*>(&src->lat[0][0]), &sum->lat[0][0],
+             MON_NUM_LATS * 4, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+
   dir_stat_reduce(&src->dir_stat, &sum->dir_stat);
   cpu_stat_reduce(&src->cpu_stat, &sum->cpu_stat);
   mem_stat_reduce(&src->mem_stat, &sum->mem_stat);
+  thr_stat_reduce(&src->thr_stat, &sum->thr_stat);
 }
 
 #define DUMP(fd, buf, fmt, ...)                             \
@@ -205,6 +463,79 @@ void mon_dumpstate(int fd, const mon_ctx_t* ctx) {
   DUMP(fd, buf, "[M] min num writes per rank: %llu", ctx->min_nw);
   DUMP(fd, buf, "[M] max num writes per rank: %llu", ctx->max_nw);
   DUMP(fd, buf, "[M] total writes: %llu", ctx->nw);
+  DUMP(fd, buf, "[M] total bytes written: %llu", ctx->nbw);
+  DUMP(fd, buf, "[M] total rpc slot waits: %llu", ctx->nslotw);
+  DUMP(fd, buf, "[M] total rpc queue waits: %llu", ctx->nqw);
+  DUMP(fd, buf, "[M] total send credit waits: %llu", ctx->ncrw);
+  DUMP(fd, buf, "[M] total rpc queue stall time: %llu us", ctx->qstall);
+  DUMP(fd, buf, "[M] max rpc queue stall time per rank: %llu us",
+       ctx->max_qstall);
+  DUMP(fd, buf, "[M] total memtable write stall time: %llu us",
+       ctx->wstall);
+  DUMP(fd, buf, "[M] max memtable write stall time per rank: %llu us",
+       ctx->max_wstall);
+  if (ctx->zin != 0) {
+    DUMP(fd, buf, "[M] total payload packed: %llu -> %llu bytes (%.2f%%)",
+         ctx->zin, ctx->zout, 100.0 * ctx->zout / ctx->zin);
+    DUMP(fd, buf, "[M] total packing time: %llu us", ctx->zmicros);
+    DUMP(fd, buf, "[M] total unpacking time: %llu us", ctx->unzmicros);
+  }
+  DUMP(fd, buf, "[M] max epoch transition barrier time: %llu us",
+       ctx->max_trbarrier);
+  DUMP(fd, buf, "[M] max epoch transition drain time: %llu us",
+       ctx->max_trdrain);
+  DUMP(fd, buf, "[M] max epoch transition flush time: %llu us",
+       ctx->max_trflush);
+  if (ctx->max_aflmicros != 0) {
+    DUMP(fd, buf, "[M] max bg epoch flush time: %llu us", ctx->max_aflmicros);
+    DUMP(fd, buf, "[M] max bg epoch flush overlap: %llu us",
+         ctx->max_aovmicros);
+    DUMP(fd, buf, "[M] max bg epoch flush stall: %llu us",
+         ctx->max_astmicros);
+    DUMP(fd, buf, "[M] total deferred writes: %llu", ctx->ndeferred);
+  }
+  if (pctx.bgthrot != 0) {
+    DUMP(fd, buf, "[M] max bg throttled time: %llu us", ctx->max_thrmicros);
+    DUMP(fd, buf, "[M] max bg shuffle backlog: %llu msgs",
+         ctx->max_thrbacklog);
+  }
+  if (pctx.mb.total != 0) {
+    for (int i = 0; i < MB_NPARTS; i++) {
+      DUMP(fd, buf, "[M] max %s memory per rank: %llu bytes",
+           membudget_name(i), ctx->max_mem[i]);
+    }
+  }
+  {
+    static const char* const names[MON_NUM_LATS] = {"rpc", "rpc queue wait",
+                                                    "plfsdir append"};
+    for (int l = 0; l < MON_NUM_LATS; l++) {
+      if (ctx->lat[l][3] == 0) continue;
+      DUMP(fd, buf,
+           "[M] %s latency: %.1f us p50, %.1f us p99, %.1f us p99.9, "
+           "%.1f us max",
+           names[l], ctx->lat[l][0], ctx->lat[l][1], ctx->lat[l][2],
+           ctx->lat[l][3]);
+    }
+  }
+  for (int c = 0; c < MON_THR_CLASSES; c++) {
+    const long long* const v = ctx->thr_stat.num[c];
+    if (v[MON_THR_CYC] == 0) continue;
+    DUMP(fd, buf,
+         "[M] %s threads (%d): %.2f ipc, %lld llc misses, %lld stall cycles "
+         "(%lld cycles)",
+         tplace_name(c), ctx->thr_stat.nthreads[c],
+         double(v[MON_THR_INS]) / v[MON_THR_CYC], v[MON_THR_LLCM],
+         v[MON_THR_STL], v[MON_THR_CYC]);
+  }
+  if (hstg_num(ctx->bar_wait) >= 1.0) {
+    DUMP(fd, buf, "[M] total barrier waits: %.0f", hstg_num(ctx->bar_wait));
+    DUMP(fd, buf, "[M] barrier wait: %.0f us avg, %.0f us p50, %.0f us p99",
+         hstg_avg(ctx->bar_wait), hstg_ptile(ctx->bar_wait, 50),
+         hstg_ptile(ctx->bar_wait, 99));
+    DUMP(fd, buf, "[M] max barrier wait: %.0f us", hstg_max(ctx->bar_wait));
+    DUMP(fd, buf, "[M] max barrier skew: %llu us (rank %d arrived last)",
+         ctx->max_bar_skew, ctx->bar_slowest);
+  }
   if (!ctx->global) DUMP(fd, buf, "!!! NON GLOBAL !!!");
   DUMP(fd, buf, "--- end ---\n");
 }
@@ -212,4 +543,5 @@ void mon_dumpstate(int fd, const mon_ctx_t* ctx) {
 void mon_reinit(mon_ctx_t* ctx) {
   mon_ctx_t tmp = {0};
   *ctx = tmp;
+  hstg_reset_min(ctx->bar_wait);
 }
@@ -35,6 +35,11 @@
 
 #include <deltafs/deltafs_api.h>
 
+#include "hstg.h"
+#include "lhstg.h"
+#include "membudget.h"
+#include "threadplace.h"
+
 /* statistics for an opened plfsdir */
 typedef struct dir_stat {
   long long min_num_keys; /* min number of keys inserted per rank */
@@ -80,6 +85,28 @@ typedef struct mem_stat {
   long long num[MAX_PAPI_EVENTS];
 } mem_stat_t;
 
+/* hardware counters of background threads, summed per thread class
+ * (the threadplace classes plus one for all other threads) */
+#define MON_THR_CLASSES (TPLACE_NCLASSES + 1)
+#define MON_THR_INS 0  /* instructions completed */
+#define MON_THR_CYC 1  /* cycles */
+#define MON_THR_LLCM 2 /* last-level cache misses */
+#define MON_THR_STL 3  /* stall cycles */
+#define MON_THR_EVENTS 4
+typedef struct thr_stat {
+  long long max[MON_THR_CLASSES][MON_THR_EVENTS]; /* per rank max */
+  long long num[MON_THR_CLASSES][MON_THR_EVENTS];
+  int nthreads[MON_THR_CLASSES]; /* threads counted */
+} thr_stat_t;
+
+/* latencies recorded in log-linear histograms */
+enum mon_lat_id {
+  MON_LAT_RPC = 0, /* rpc round trip (us) */
+  MON_LAT_QWAIT,   /* wait in rpc delivery queues (us) */
+  MON_LAT_APPEND,  /* deltafs_plfsdir_append (ns) */
+  MON_NUM_LATS
+};
+
 /*  NOTE
  * -------
  * + foreign write:
@@ -133,6 +160,61 @@ typedef struct mon_ctx {
   /* total num of particle writes */
   unsigned long long nw;
 
+  /* total size of particle data written */
+  unsigned long long nbw;
+  /* total num of times senders waited for a free rpc slot, or for an rpc
+   * queue buffer still being sent */
+  unsigned long long nslotw;
+  unsigned long long nqw;
+  /* total num of times senders ran out of send credits for a queue */
+  unsigned long long ncrw;
+  /* time senders spent blocked on rpc queues (us) */
+  unsigned long long max_qstall; /* per rank max */
+  unsigned long long qstall;
+  /* time receivers spent in slow memtable appends (us) */
+  unsigned long long max_wstall; /* per rank max */
+  unsigned long long wstall;
+
+  /* total size of shuffle payloads before and after packing */
+  unsigned long long zin;
+  unsigned long long zout;
+  /* total time spent packing and unpacking shuffle payloads (us) */
+  unsigned long long zmicros;
+  unsigned long long unzmicros;
+
+  /* time spent in each stage of the epoch transition that follows, max
+   * across ranks (us) */
+  unsigned long long max_trbarrier;
+  unsigned long long max_trdrain;
+  unsigned long long max_trflush;
+  /* time spent flushing the previous epoch in the background, the part of
+   * it that overlapped with writes, and the time vpic stalled waiting for
+   * it, max across ranks (us) */
+  unsigned long long max_aflmicros;
+  unsigned long long max_aovmicros;
+  unsigned long long max_astmicros;
+  /* total num of writes deferred while the previous epoch was flushed */
+  unsigned long long ndeferred;
+  /* time background activities were held back by the throttler during the
+   * compute phase before this epoch (us), and the num of incoming shuffle
+   * msgs still queued when the epoch began, max across ranks */
+  unsigned long long max_thrmicros;
+  unsigned long long max_thrbacklog;
+  /* memory reserved by each consumer of the memory budget at the end of
+   * the epoch, max across ranks (bytes) */
+  unsigned long long max_mem[MB_NPARTS];
+
+  /* latency over all ranks, computed at epoch boundaries (us):
+   * 0 -> p50, 1 -> p99, 2 -> p99.9, 3 -> max */
+  double lat[MON_NUM_LATS][4];
+
+  /* time each rank waited in each preload barrier (us) */
+  hstg_t bar_wait;
+  /* max time between the first and the last rank reaching a barrier (us),
+   * and the rank that arrived last at that barrier */
+  unsigned long long max_bar_skew;
+  int bar_slowest;
+
   /* !!! collected by deltafs !!! */
   dir_stat_t dir_stat;
 
@@ -141,15 +223,88 @@ typedef struct mon_ctx {
 
   /* !!! collected by papi !!! */
   mem_stat_t mem_stat;
+  thr_stat_t thr_stat;
 
   /* !!! auxiliary state !!! */
   int global; /* is stats global or local (per-rank) */
 
   int epoch_seq; /* epoch seq num */
 
-#define MON_BUF_SIZE 512
+#define MON_BUF_SIZE 4096
 } mon_ctx_t;
 
+/*
+ * hot-path counters: instead of updating mon_ctx_t fields from many threads,
+ * each thread counts into a cache-line-aligned slot of its own, which needs
+ * neither atomics nor locks. slots are summed and folded into a mon ctx at
+ * epoch boundaries by mon_cnt_fold(). a thread's slot is released when the
+ * thread exits so short-lived threads do not use up all slots. adding a
+ * counter takes a new mon_cnt_id and a line in mon_cnt_fold().
+ */
+enum mon_cnt_id {
+  MON_NW = 0,    /* particle writes */
+  MON_NBW,       /* particle bytes written */
+  MON_NCW,       /* particle name collisions */
+  MON_NFW,       /* foreign writes */
+  MON_NLW,       /* local writes */
+  MON_NMS,       /* rpc sent */
+  MON_NMD,       /* rpc replied */
+  MON_NMR,       /* rpc received */
+  MON_NSLOTW,    /* waits for a free rpc slot */
+  MON_NQW,       /* waits for an rpc queue buffer */
+  MON_NCRW,      /* waits for send credits */
+  MON_QSTALL,    /* time blocked on rpc queues (us) */
+  MON_WSTALL,    /* time in slow memtable appends (us) */
+  MON_ZIN,       /* shuffle payload bytes before packing */
+  MON_ZOUT,      /* ... after packing */
+  MON_ZMICROS,   /* time spent packing (us) */
+  MON_UNZMICROS, /* time spent unpacking (us) */
+  MON_NUM_CNTS
+};
+
+#define MON_MAX_CNT_SLOTS 256
+typedef struct mon_cnt_slot {
+  unsigned long long v[MON_NUM_CNTS];
+  lhstg_t lat[MON_NUM_LATS]; /* allocated on first use */
+  int shared; /* slot shared by threads that found no free slot */
+} __attribute__((aligned(64))) mon_cnt_slot_t;
+
+extern __thread mon_cnt_slot_t* mon_cnt_myslot;
+extern mon_cnt_slot_t* mon_cnt_register();
+extern void mon_lat_alloc(mon_cnt_slot_t* s, int l);
+
+inline void mon_cnt_add(int c, unsigned long long n) {
+  mon_cnt_slot_t* s = mon_cnt_myslot;
+  if (s == NULL) s = mon_cnt_register();
+  if (!s->shared) {
+    s->v[c] += n;
+  } else {
+    __sync_fetch_and_add(&s->v[c], n);
+  }
+}
+
+/* record a latency in the calling thread's histogram */
+inline void mon_lat_add(int l, uint64_t v) {
+  mon_cnt_slot_t* s = mon_cnt_myslot;
+  if (s == NULL) s = mon_cnt_register();
+  if (s->lat[l].b == NULL) mon_lat_alloc(s, l);
+  if (!s->shared) {
+    lhstg_add(&s->lat[l], v);
+  } else {
+    lhstg_add_atomic(&s->lat[l], v);
+  }
+}
+
+/* sum of a counter over all threads since the start of the run */
+extern unsigned long long mon_cnt_get(int c);
+/* fold counts made since the last fold into a mon ctx */
+extern void mon_cnt_fold(mon_ctx_t* ctx);
+/* histogram precision in bits. must be set before any latency is added. */
+extern int mon_lat_precision;
+/* merge latencies recorded since the last fold over all ranks and put
+ * their percentiles into a mon ctx. collective over MPI_COMM_WORLD. */
+extern void mon_lat_fold(mon_ctx_t* ctx);
+
 extern int mon_fetch_plfsdir_stat(deltafs_plfsdir_t* dir, dir_stat_t* buf);
 
 extern void mon_reduce(const mon_ctx_t* src, mon_ctx_t* sum);
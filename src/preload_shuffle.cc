@@ -46,6 +46,10 @@
 
 #include "common.h"
 
+#include <algorithm>
+#include <utility>
+#include <vector>
+
 namespace {
 const char* shuffle_prepare_sm_uri(char* buf, const char* proto) {
   int min_port;
@@ -322,6 +326,7 @@ void shuffle_epoch_start(shuffle_ctx_t* ctx) {
     pctx.mctx.nmd = pctx.mctx.nms;
   } else {
     nn_shuffler_bgwait();
+    nn_shuffler_epoch_start();
   }
 }
 
@@ -335,6 +340,15 @@ void shuffle_epoch_end(shuffle_ctx_t* ctx) {
       /* wait for rpc replies */
       nn_shuffler_waitcb();
     }
+    if (nnctx.agg) {
+      /* writes forwarded to us are only queued once the first hop is
+       * replied so flush again after all ranks have finished the first */
+      MPI_Barrier(MPI_COMM_WORLD);
+      nn_shuffler_flushq();
+      if (!nnctx.force_sync) {
+        nn_shuffler_waitcb();
+      }
+    }
   }
 }
 
@@ -351,6 +365,9 @@ int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
   if (world_sz != 1) {
     if (IS_BYPASS_PLACEMENT(pctx.mode)) {
       rv = pdlfs::xxhash32(buf, ctx->fname_len, 0) % world_sz;
+    } else if (ctx->ptbl != NULL) {
+      rv = ctx->ptbl[pdlfs::xxhash64(buf, ctx->fname_len, 0) >>
+                     (64 - ctx->ptbl_bits)];
     } else {
       assert(ctx->chp != NULL);
       ch_placement_find_closest(
@@ -364,6 +381,49 @@ int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
   return (rv & ctx->receiver_mask);
 }
 
+void shuffle_target_batch(shuffle_ctx_t* ctx, const char* fnames,
+                          unsigned char fname_len, int num_names,
+                          int* targets) {
+  uint64_t h[4];
+  unsigned int shift;
+  int world_sz;
+  int i;
+
+  assert(ctx != NULL);
+  assert(fname_len == ctx->fname_len);
+
+  world_sz = shuffle_world_sz(ctx);
+
+  /* without a flattened placement table, each name has to go through
+   * ch-placement separately anyway */
+  if (world_sz == 1 || IS_BYPASS_PLACEMENT(pctx.mode) || ctx->ptbl == NULL) {
+    for (i = 0; i < num_names; i++) {
+      targets[i] = shuffle_target(
+          ctx, const_cast<char*>(fnames + size_t(i) * fname_len), fname_len);
+    }
+    return;
+  }
+
+  /* hash 4 names at a time. the hashes are independent of each other
+   * so the cpu is free to overlap their computations */
+  shift = 64 - ctx->ptbl_bits;
+  for (i = 0; i + 4 <= num_names; i += 4) {
+    const char* const p = fnames + size_t(i) * fname_len;
+    h[0] = pdlfs::xxhash64(p, fname_len, 0);
+    h[1] = pdlfs::xxhash64(p + fname_len, fname_len, 0);
+    h[2] = pdlfs::xxhash64(p + 2 * fname_len, fname_len, 0);
+    h[3] = pdlfs::xxhash64(p + 3 * fname_len, fname_len, 0);
+    targets[i] = ctx->ptbl[h[0] >> shift] & ctx->receiver_mask;
+    targets[i + 1] = ctx->ptbl[h[1] >> shift] & ctx->receiver_mask;
+    targets[i + 2] = ctx->ptbl[h[2] >> shift] & ctx->receiver_mask;
+    targets[i + 3] = ctx->ptbl[h[3] >> shift] & ctx->receiver_mask;
+  }
+  for (; i < num_names; i++) {
+    h[0] = pdlfs::xxhash64(fnames + size_t(i) * fname_len, fname_len, 0);
+    targets[i] = ctx->ptbl[h[0] >> shift] & ctx->receiver_mask;
+  }
+}
+
 namespace {
 #ifndef NDEBUG
 void shuffle_write_debug(shuffle_ctx_t* ctx, char* buf, unsigned char buf_sz,
@@ -389,6 +449,14 @@ void shuffle_write_debug(shuffle_ctx_t* ctx, char* buf, unsigned char buf_sz,
   errno = 0;
 }
 #endif
+
+/* charge a write to its placement table bucket. may be called by multiple
+ * writers at the same time. */
+inline void shuffle_count_load(shuffle_ctx_t* ctx, const char* fname) {
+  __sync_fetch_and_add(&ctx->bload[pdlfs::xxhash64(fname, ctx->fname_len, 0) >>
+                                   (64 - ctx->ptbl_bits)],
+                       1ULL);
+}
 }  // namespace
 
 int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
@@ -413,6 +481,9 @@ int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
 
   peer_rank = shuffle_target(ctx, buf, buf_sz);
   rank = shuffle_rank(ctx);
+  if (ctx->bload != NULL) {
+    shuffle_count_load(ctx, buf);
+  }
 
 #ifndef NDEBUG
   /* write trace if we are in testing mode */
@@ -428,6 +499,12 @@ int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
   }
 
   if (ctx->type == SHUFFLE_XN) {
+    if (ctx->pack) { /* drop the '\0' and the padding */
+      memmove(buf + fname_len, buf + fname_len + 1, data_len);
+      mon_cnt_add(MON_ZIN, buf_sz);
+      buf_sz = fname_len + data_len;
+      mon_cnt_add(MON_ZOUT, buf_sz);
+    }
     xn_shuffler_enqueue(static_cast<xn_ctx_t*>(ctx->rep), buf, buf_sz, epoch,
                         peer_rank, rank);
   } else {
@@ -437,6 +514,111 @@ int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
   return 0;
 }
 
+int shuffle_write_batch(shuffle_ctx_t* ctx, const char* fnames,
+                        unsigned char fname_len, char* data,
+                        unsigned char data_len, int num_writes, int epoch) {
+  std::vector<std::pair<int, int> > order; /* (peer_rank, write idx) */
+  std::vector<int> targets;
+  std::vector<char> bufs;
+  char* buf;
+  int peer_rank;
+  int rank;
+  int rv;
+  int i;
+  int j;
+
+  assert(ctx == &pctx.sctx);
+  assert(ctx->extra_data_len + ctx->data_len < 255 - ctx->fname_len - 1);
+  if (ctx->fname_len != fname_len) ABORT("bad filename len");
+  if (ctx->data_len != data_len) ABORT("bad data len");
+  if (num_writes <= 0) return 0;
+
+  unsigned char base_sz = 1 + fname_len + data_len;
+  unsigned char buf_sz = base_sz + ctx->extra_data_len;
+  rank = shuffle_rank(ctx);
+
+  /* pass 1: hash and place all writes. placement only looks at the
+   * filename so we do not need to encode the writes first. */
+  targets.resize(num_writes);
+  shuffle_target_batch(ctx, fnames, fname_len, num_writes, &targets[0]);
+  if (ctx->bload != NULL) {
+    for (i = 0; i < num_writes; i++) {
+      shuffle_count_load(ctx, fnames + size_t(i) * fname_len);
+    }
+  }
+  order.resize(num_writes);
+  for (i = 0; i < num_writes; i++) {
+    order[i].first = targets[i];
+    order[i].second = i;
+  }
+
+  /* group writes by destination, keeping the original order of writes going
+   * to the same destination */
+  std::stable_sort(order.begin(), order.end());
+
+  /* pass 2: encode writes in destination order so that each group is packed
+   * back to back */
+  bufs.resize(size_t(num_writes) * buf_sz);
+  buf = &bufs[0];
+  for (i = 0; i < num_writes; i++) {
+    j = order[i].second;
+    memcpy(buf, fnames + size_t(j) * fname_len, fname_len);
+    buf[fname_len] = 0;
+    memcpy(buf + fname_len + 1, data + size_t(j) * data_len, data_len);
+    if (buf_sz != base_sz) memset(buf + base_sz, 0, buf_sz - base_sz);
+#ifndef NDEBUG
+    /* write trace if we are in testing mode */
+    if (pctx.testin && pctx.logfd != -1) {
+      shuffle_write_debug(ctx, buf, buf_sz, epoch, rank, order[i].first);
+    }
+#endif
+    buf += buf_sz;
+  }
+
+  /* pass 3: hand each group to the underlying transport */
+  buf = &bufs[0];
+  for (i = 0; i < num_writes; i = j) {
+    peer_rank = order[i].first;
+    for (j = i + 1; j < num_writes; j++) {
+      if (order[j].first != peer_rank) {
+        break;
+      }
+    }
+    /* bypass rpc if target is local */
+    if (peer_rank == rank && !ctx->force_rpc) {
+      for (int k = i; k < j; k++) {
+        rv = native_write(buf + size_t(k) * buf_sz, fname_len,
+                          buf + size_t(k) * buf_sz + fname_len + 1, data_len,
+                          epoch);
+        if (rv != 0) {
+          return rv;
+        }
+      }
+    } else if (ctx->type == SHUFFLE_XN) {
+      unsigned char sz = buf_sz;
+      char* const base = buf + size_t(i) * buf_sz;
+      if (ctx->pack) { /* drop the '\0' and the padding of each write */
+        sz = fname_len + data_len;
+        for (int k = 0; k < j - i; k++) {
+          memmove(base + size_t(k) * sz, base + size_t(k) * buf_sz, fname_len);
+          memmove(base + size_t(k) * sz + fname_len,
+                  base + size_t(k) * buf_sz + fname_len + 1, data_len);
+        }
+        mon_cnt_add(MON_ZIN,
+                    static_cast<unsigned long long>(j - i) * buf_sz);
+        mon_cnt_add(MON_ZOUT, static_cast<unsigned long long>(j - i) * sz);
+      }
+      xn_shuffler_enqueue_batch(static_cast<xn_ctx_t*>(ctx->rep), base, sz,
+                                j - i, epoch, peer_rank, rank);
+    } else {
+      nn_shuffler_enqueue_batch(buf + size_t(i) * buf_sz, buf_sz, j - i, epoch,
+                                peer_rank, rank);
+    }
+  }
+
+  return 0;
+}
+
 namespace {
 #ifndef NDEBUG
 void shuffle_handle_debug(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
@@ -458,11 +640,171 @@ void shuffle_handle_debug(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
 #endif
 }  // namespace
 
+/*
+ * packed messages: a 1-byte write size followed by the packed writes. each
+ * packed write is a 1-byte length of the prefix it shares with the
+ * previous write's name, the rest of the name, and the data. the '\0' after
+ * each name and the zero padding after each data are not sent.
+ */
+size_t shuffle_msg_pack(shuffle_ctx_t* ctx, char* msg, size_t msg_sz,
+                        size_t rec_sz) {
+  const size_t fname_len = ctx->fname_len;
+  const size_t data_len = ctx->data_len;
+  const size_t req_sz = fname_len + 1 + data_len + ctx->extra_data_len;
+  /* fixed-sized records have neither the size byte nor the '\0' */
+  const size_t gap = rec_sz != 0 ? 0 : 1;
+  const size_t stride = req_sz - 1 + 2 * gap;
+  std::vector<char> tmp;
+  char prev[256];
+  char req[256];
+  char* dst;
+  size_t in;
+  size_t out;
+  size_t p;
+  size_t i;
+
+  if (rec_sz != 0 && rec_sz != req_sz - 1) return 0;
+  if (msg_sz == 0 || msg_sz % stride != 0) return 0;
+  /* make sure everything we drop can be recreated */
+  for (in = 0; in < msg_sz; in += stride) {
+    if (rec_sz == 0) {
+      if (static_cast<unsigned char>(msg[in]) != req_sz) return 0;
+      if (msg[in + 1 + fname_len] != 0) return 0;
+    }
+    for (i = 2 * gap + fname_len + data_len; i < stride; i++) {
+      if (msg[in + i] != 0) return 0;
+    }
+  }
+
+  /* count the packed size first and only pack when that saves space */
+  out = 1;
+  for (in = 0; in < msg_sz; in += stride) {
+    p = 0;
+    if (in != 0) {
+      while (p < fname_len &&
+             msg[in + gap + p] == msg[in - stride + gap + p])
+        p++;
+    }
+    out += 1 + fname_len - p + data_len;
+  }
+  if (out >= msg_sz) return 0;
+
+  /* the packed size of each size-prefixed write is never more than its
+   * original size so writing may go in place without ever overwriting input
+   * not yet read. fixed-sized records may grow, so they are packed into a
+   * copy instead. */
+  dst = msg;
+  if (rec_sz != 0) {
+    tmp.resize(out);
+    dst = &tmp[0];
+  }
+  dst[0] = static_cast<char>(req_sz);
+  out = 1;
+  for (in = 0; in < msg_sz; in += stride) {
+    memcpy(req, msg + in + gap, stride - gap);
+    p = 0;
+    if (in != 0) {
+      while (p < fname_len && req[p] == prev[p]) p++;
+    }
+    dst[out++] = static_cast<char>(p);
+    memcpy(dst + out, req + p, fname_len - p);
+    out += fname_len - p;
+    memcpy(dst + out, req + fname_len + gap, data_len);
+    out += data_len;
+    memcpy(prev, req, fname_len);
+  }
+  if (dst != msg) memcpy(msg, dst, out);
+
+  assert(out < msg_sz);
+  return out;
+}
+
+size_t shuffle_msg_unpacked_size(shuffle_ctx_t* ctx, const char* msg,
+                                 size_t msg_sz) {
+  const size_t fname_len = ctx->fname_len;
+  const size_t data_len = ctx->data_len;
+  size_t req_sz;
+  size_t num_reqs;
+  size_t in;
+  size_t p;
+
+  if (msg_sz < 1) ABORT("premature end of msg");
+  req_sz = static_cast<unsigned char>(msg[0]);
+  if (req_sz != fname_len + 1 + data_len + ctx->extra_data_len)
+    ABORT("unexpected incoming shuffle request size");
+  num_reqs = 0;
+  in = 1;
+  while (in < msg_sz) {
+    p = static_cast<unsigned char>(msg[in]);
+    if (p > fname_len || (num_reqs == 0 && p != 0)) {
+      ABORT("bad packed msg");
+    }
+    in += 1 + fname_len - p + data_len;
+    num_reqs++;
+  }
+  if (in != msg_sz) ABORT("premature end of msg");
+
+  return num_reqs * (req_sz + 1);
+}
+
+void shuffle_msg_unpack(shuffle_ctx_t* ctx, const char* msg, size_t msg_sz,
+                        char* out) {
+  const size_t fname_len = ctx->fname_len;
+  const size_t data_len = ctx->data_len;
+  const size_t req_sz = static_cast<unsigned char>(msg[0]);
+  const char* prev;
+  size_t in;
+  size_t p;
+
+  prev = NULL;
+  in = 1;
+  while (in < msg_sz) {
+    p = static_cast<unsigned char>(msg[in++]);
+    out[0] = static_cast<char>(req_sz);
+    if (p != 0) memcpy(out + 1, prev, p);
+    memcpy(out + 1 + p, msg + in, fname_len - p);
+    in += fname_len - p;
+    out[1 + fname_len] = 0;
+    memcpy(out + 2 + fname_len, msg + in, data_len);
+    in += data_len;
+    memset(out + 2 + fname_len + data_len, 0,
+           req_sz - fname_len - 1 - data_len);
+    prev = out + 1;
+    out += req_sz + 1;
+  }
+}
+
+unsigned int shuffle_msg_restore(shuffle_ctx_t* ctx, const char* buf,
+                                 unsigned int buf_sz, char* out) {
+  const unsigned int req_sz =
+      ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1;
+
+  if (ctx->pack && buf_sz == ctx->fname_len + ctx->data_len) {
+    /* restore the '\0' and the padding dropped by the sender */
+    memcpy(out, buf, ctx->fname_len);
+    out[ctx->fname_len] = 0;
+    memcpy(out + ctx->fname_len + 1, buf + ctx->fname_len, ctx->data_len);
+    memset(out + ctx->fname_len + 1 + ctx->data_len, 0,
+           ctx->extra_data_len);
+  } else if (buf_sz == req_sz) {
+    memcpy(out, buf, req_sz);
+  } else {
+    ABORT("unexpected incoming shuffle request size");
+  }
+
+  return req_sz;
+}
+
 int shuffle_handle(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
                    int epoch, int src, int dst) {
+  char tmp[256];
   int rv;
 
   ctx = &pctx.sctx;
+  if (ctx->pack && buf_sz == ctx->fname_len + ctx->data_len) {
+    buf_sz = shuffle_msg_restore(ctx, buf, buf_sz, tmp);
+    buf = tmp;
+  }
   if (buf_sz != ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1)
     ABORT("unexpected incoming shuffle request size");
   rv = exotic_write(buf, ctx->fname_len, buf + ctx->fname_len + 1,
@@ -476,6 +818,31 @@ int shuffle_handle(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
   return rv;
 }
 
+int shuffle_handle_batch(shuffle_ctx_t* ctx, char* reqs, unsigned int req_sz,
+                         unsigned int req_stride, int num_reqs, int epoch,
+                         int src, int dst) {
+  unsigned int full_sz;
+  int rv;
+
+  ctx = &pctx.sctx;
+  full_sz = ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1;
+  /* fixed-sized records come without the '\0' after each name */
+  if (req_sz != full_sz && req_sz != full_sz - 1)
+    ABORT("unexpected incoming shuffle request size");
+  rv = exotic_write_batch(reqs, req_stride, num_reqs, ctx->fname_len,
+                          req_sz == full_sz, ctx->data_len, epoch);
+#ifndef NDEBUG
+  /* write trace if we are in testing mode */
+  if (pctx.testin && pctx.logfd != -1) {
+    for (int i = 0; i < num_reqs; i++) {
+      shuffle_handle_debug(ctx, reqs + size_t(i) * req_stride, req_sz, epoch,
+                           src, dst);
+    }
+  }
+#endif
+  return rv;
+}
+
 void shuffle_finalize(shuffle_ctx_t* ctx) {
   char msg[200];
   assert(ctx != NULL);
@@ -527,6 +894,8 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
     nn_rusage_t total_rusage[NUM_RUSAGE];
     unsigned long long total_writes;
     unsigned long long total_msgsz;
+    unsigned long long total_fwds;
+    unsigned long long total_bulks;
     hstg_t iq_dep;
     nn_shuffler_destroy();
     if (ctx->finalize_pause > 0) {
@@ -633,6 +1002,20 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
                  MPI_SUM, 0, pctx.recv_comm);
       MPI_Reduce(&nnctx.total_msgsz, &total_msgsz, 1, MPI_UNSIGNED_LONG_LONG,
                  MPI_SUM, 0, pctx.recv_comm);
+      MPI_Reduce(&nnctx.total_fwds, &total_fwds, 1, MPI_UNSIGNED_LONG_LONG,
+                 MPI_SUM, 0, pctx.recv_comm);
+      if (pctx.my_rank == 0 && nnctx.agg) {
+        snprintf(msg, sizeof(msg), "[nn] 2-hop writes forwarded: %s",
+                 pretty_num(total_fwds).c_str());
+        INFO(msg);
+      }
+      MPI_Reduce(&nnctx.total_bulks, &total_bulks, 1, MPI_UNSIGNED_LONG_LONG,
+                 MPI_SUM, 0, pctx.recv_comm);
+      if (pctx.my_rank == 0 && nnctx.bulk_thres != 0) {
+        snprintf(msg, sizeof(msg), "[nn] rpcs pulled through HG_Bulk: %s",
+                 pretty_num(total_bulks).c_str());
+        INFO(msg);
+      }
       if (pctx.my_rank == 0 && hstg_num(iq_dep) >= 1.0) {
         snprintf(
             msg, sizeof(msg),
@@ -656,12 +1039,133 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
     }
 #undef NUM_RUSAGE
   }
+  if (ctx->bload != NULL) {
+    free(ctx->bload);
+    ctx->bload = NULL;
+  }
+  if (ctx->ptbl != NULL) {
+    free(ctx->ptbl);
+    ctx->ptbl = NULL;
+  }
   if (ctx->chp != NULL) {
     ch_placement_finalize(ctx->chp);
     ctx->chp = NULL;
   }
 }
 
+/* sample the consistent hash ring at the middle of each of the 2**bits
+ * equal-sized hash ranges to get a direct-mapped placement table. the table
+ * is a pure function of the placement group so all ranks get the same
+ * table. */
+void shuffle_build_ptbl(shuffle_ctx_t* ctx, unsigned int bits) {
+  const uint64_t n = uint64_t(1) << bits;
+  const unsigned int shift = 64 - bits;
+  unsigned long target;
+  uint64_t i;
+
+  assert(ctx->chp != NULL);
+  assert(bits > 0 && bits < 32);
+  ctx->ptbl = static_cast<int*>(malloc(n * sizeof(int)));
+  if (ctx->ptbl == NULL) ABORT("malloc");
+  ctx->ptbl_bits = bits;
+  for (i = 0; i < n; i++) {
+    ch_placement_find_closest(
+        ctx->chp, (i << shift) | (uint64_t(1) << (shift - 1)), 1, &target);
+    ctx->ptbl[i] = static_cast<int>(target);
+  }
+}
+
+/* loads are per-bucket write counts summed over all ranks so every rank
+ * makes the same moves. each move takes a bucket from the most loaded
+ * receiver to the least loaded one, picking the bucket that brings the
+ * two closest together, until the most loaded receiver is within the
+ * threshold or no move helps anymore. */
+int shuffle_rebalance(shuffle_ctx_t* ctx) {
+  const size_t n = size_t(1) << ctx->ptbl_bits;
+  std::vector<std::vector<uint32_t> > owned; /* buckets of each receiver */
+  std::vector<unsigned long long> load;      /* load of each receiver */
+  std::vector<unsigned long long> cnt;
+  unsigned long long total;
+  unsigned long long limit;
+  unsigned long long gap;
+  unsigned long long c;
+  unsigned long long max0;
+  char msg[200];
+  size_t best;
+  size_t b;
+  int nrecvs;
+  int moved;
+  int hi;
+  int lo;
+  int r;
+  int rv;
+
+  assert(ctx->bload != NULL && ctx->ptbl != NULL);
+  cnt.resize(n);
+  rv = MPI_Allreduce(ctx->bload, &cnt[0], int(n), MPI_UNSIGNED_LONG_LONG,
+                     MPI_SUM, MPI_COMM_WORLD);
+  if (rv != MPI_SUCCESS) {
+    ABORT("MPI_Allreduce");
+  }
+  memset(ctx->bload, 0, n * sizeof(unsigned long long));
+
+  nrecvs = int((shuffle_world_sz(ctx) + ctx->receiver_rate - 1) /
+               ctx->receiver_rate);
+  owned.resize(nrecvs);
+  load.assign(nrecvs, 0);
+  total = 0;
+  for (b = 0; b < n; b++) {
+    r = int((ctx->ptbl[b] & ctx->receiver_mask) / ctx->receiver_rate);
+    owned[r].push_back(uint32_t(b));
+    load[r] += cnt[b];
+    total += cnt[b];
+  }
+  if (total == 0) {
+    return 0;
+  }
+
+  limit = total / nrecvs * (100 + ctx->rebal_thres) / 100;
+  max0 = *std::max_element(load.begin(), load.end());
+  moved = 0;
+  while (size_t(moved) < n) {
+    hi = int(std::max_element(load.begin(), load.end()) - load.begin());
+    lo = int(std::min_element(load.begin(), load.end()) - load.begin());
+    if (load[hi] <= limit) break;
+    gap = load[hi] - load[lo];
+    best = owned[hi].size();
+    for (b = 0; b < owned[hi].size(); b++) {
+      c = cnt[owned[hi][b]];
+      if (c == 0 || c >= gap) continue;
+      if (best == owned[hi].size() ||
+          std::min(c, gap - c) > std::min(cnt[owned[hi][best]],
+                                          gap - cnt[owned[hi][best]])) {
+        best = b;
+      }
+    }
+    if (best == owned[hi].size()) break;
+    c = cnt[owned[hi][best]];
+    ctx->ptbl[owned[hi][best]] = int(unsigned(lo) * ctx->receiver_rate);
+    owned[lo].push_back(owned[hi][best]);
+    owned[hi][best] = owned[hi].back();
+    owned[hi].pop_back();
+    load[hi] -= c;
+    load[lo] += c;
+    moved++;
+  }
+
+  if (pctx.my_rank == 0 && moved != 0) {
+    snprintf(msg, sizeof(msg),
+             "placement rebalanced: %s buckets moved\n>>> max receiver load "
+             "%.2f -> %.2f of avg",
+             pretty_num(moved).c_str(), double(max0) * nrecvs / total,
+             double(*std::max_element(load.begin(), load.end())) * nrecvs /
+                 total);
+    INFO(msg);
+  }
+
+  return moved;
+}
+
 namespace {
 /* convert an integer number to an unsigned char */
 unsigned char TOUCHAR(int input) {
@@ -671,12 +1175,78 @@ unsigned char TOUCHAR(int input) {
 }
 }  // namespace
 
+/* placement construction parameters */
+struct shuffle_place_args {
+  shuffle_ctx_t* ctx;
+  const char* proto;
+  int world_sz;
+  int vf; /* vir factor */
+};
+
+/* shuffle_init_placement: build the consistent hash ring, and the
+ * flattened placement table if asked, for the given world size */
+static void* shuffle_init_placement(void* arg) {
+  shuffle_place_args* const place = static_cast<shuffle_place_args*>(arg);
+  shuffle_ctx_t* const ctx = place->ctx;
+  const int world_sz = place->world_sz;
+  const char* env;
+  uint64_t start;
+  int n;
+
+  start = now_micros();
+  ctx->chp = ch_placement_initialize(place->proto, world_sz, place->vf,
+                                     0 /* hash seed */);
+  if (ctx->chp == NULL) {
+    ABORT("ch_init");
+  }
+
+  env = maybe_getenv("SHUFFLE_Placement_table_bits");
+  if (env != NULL) {
+    n = atoi(env);
+    if (n < 0 || n > MAX_PLACEMENT_TABLE_BITS) {
+      ABORT("bad placement table bits");
+    } else if (n > 0 && world_sz != 1) {
+      shuffle_build_ptbl(ctx, n);
+    }
+  }
+
+  if (is_envset("SHUFFLE_Rebalance") && world_sz != 1) {
+    env = maybe_getenv("SHUFFLE_Rebalance_threshold");
+    if (env != NULL) {
+      ctx->rebal_thres = atoi(env);
+      if (ctx->rebal_thres < 0) {
+        ctx->rebal_thres = 0;
+      }
+    }
+    if (ctx->ptbl == NULL) {
+      /* 64 buckets per rank so loads can be evened out, up to a cap */
+      n = DEFAULT_REBALANCE_TABLE_BITS;
+      while (n < MAX_REBALANCE_TABLE_BITS && (1 << n) < 64 * world_sz) n++;
+      shuffle_build_ptbl(ctx, n);
+    }
+    if (ctx->ptbl_bits <= MAX_REBALANCE_TABLE_BITS) {
+      ctx->bload = static_cast<unsigned long long*>(
+          calloc(size_t(1) << ctx->ptbl_bits, sizeof(unsigned long long)));
+      if (ctx->bload == NULL) ABORT("calloc");
+    } else if (pctx.my_rank == 0) {
+      WARN("placement table too large to rebalance\n>>> rebalancing is OFF");
+    }
+  }
+
+  ctx->place_micros = now_micros() - start;
+  return NULL;
+}
+
 void shuffle_init(shuffle_ctx_t* ctx) {
+  shuffle_place_args place;
+  pthread_t place_tid;
+  uint64_t start;
   int vf;
   int world_sz;
   char msg[200];
   const char* proto;
   const char* env;
+  int rv;
   int n;
 
   assert(ctx != NULL);
@@ -708,6 +1278,12 @@ void shuffle_init(shuffle_ctx_t* ctx) {
     }
   }
   ctx->is_receiver = shuffle_is_rank_receiver(ctx, pctx.my_rank);
+  if (pctx.mem_budget != 0) {
+    membudget_init(&pctx.mb, pctx.mem_budget, pctx.comm_sz,
+                   int((unsigned(pctx.comm_sz) + ctx->receiver_rate - 1) /
+                       ctx->receiver_rate),
+                   ctx->is_receiver);
+  }
   if (pctx.my_rank == 0) {
     snprintf(msg, sizeof(msg),
              "%u shuffle senders per receiver\n>>> receiver mask is %#x",
@@ -758,17 +1334,21 @@ void shuffle_init(shuffle_ctx_t* ctx) {
       WARN(msg);
     }
   }
-  if (ctx->type == SHUFFLE_XN) {
-    xn_ctx_t* rep = static_cast<xn_ctx_t*>(malloc(sizeof(xn_ctx_t)));
-    memset(rep, 0, sizeof(xn_ctx_t));
-    xn_shuffler_init(rep);
-    world_sz = xn_shuffler_world_size(rep);
-    ctx->rep = rep;
+  if (is_envset("SHUFFLE_Pack_payload")) {
+    ctx->pack = 1;
+    if (pctx.my_rank == 0) {
+      INFO("shuffle payload packing is ON\n>>> padding is stripped and names "
+           "are delta-encoded");
+    }
   } else {
-    nn_shuffler_init(ctx);
-    world_sz = nn_shuffler_world_size();
+    ctx->pack = 0;
   }
-
+  ctx->chp = NULL;
+  ctx->ptbl = NULL;
+  ctx->ptbl_bits = 0;
+  ctx->bload = NULL;
+  ctx->rebal_thres = DEFAULT_REBALANCE_THRESHOLD;
+  ctx->place_micros = 0;
   if (!IS_BYPASS_PLACEMENT(pctx.mode)) {
     env = maybe_getenv("SHUFFLE_Virtual_factor");
     if (env == NULL) {
@@ -782,10 +1362,43 @@ void shuffle_init(shuffle_ctx_t* ctx) {
       proto = DEFAULT_PLACEMENT_PROTO;
     }
 
-    ctx->chp = ch_placement_initialize(proto, world_sz, vf /* vir factor */,
-                                       0 /* hash seed */);
-    if (ctx->chp == NULL) {
-      ABORT("ch_init");
+    /* the placement only depends on the world size, so it is built while
+     * the transport exchanges addresses with all peers */
+    place.ctx = ctx;
+    place.proto = proto;
+    place.world_sz = pctx.comm_sz;
+    place.vf = vf;
+    if (!pctx.serial_startup) {
+      rv = pthread_create(&place_tid, NULL, shuffle_init_placement, &place);
+      if (rv) ABORT("pthread_create");
+    }
+  }
+
+  start = now_micros();
+  if (ctx->type == SHUFFLE_XN) {
+    xn_ctx_t* rep = static_cast<xn_ctx_t*>(malloc(sizeof(xn_ctx_t)));
+    memset(rep, 0, sizeof(xn_ctx_t));
+    xn_shuffler_init(rep);
+    world_sz = xn_shuffler_world_size(rep);
+    ctx->my_rank = xn_shuffler_my_rank(rep);
+    ctx->rep = rep;
+  } else {
+    nn_shuffler_init(ctx);
+    world_sz = nn_shuffler_world_size();
+    ctx->my_rank = nn_shuffler_my_rank();
+  }
+  ctx->xport_micros = now_micros() - start;
+  ctx->world_sz = world_sz;
+
+  if (!IS_BYPASS_PLACEMENT(pctx.mode)) {
+    if (!pctx.serial_startup) {
+      rv = pthread_join(place_tid, NULL);
+      if (rv) ABORT("pthread_join");
+    } else {
+      shuffle_init_placement(&place);
+    }
+    if (place.world_sz != world_sz) {
+      ABORT("shuffle world size mismatch");
     }
   }
 
@@ -797,6 +1410,22 @@ void shuffle_init(shuffle_ctx_t* ctx) {
                "static_modulo, hash_lookup3, xor, and ring",
                pretty_num(world_sz).c_str(), pretty_num(vf).c_str(), proto);
       INFO(msg);
+      if (ctx->ptbl != NULL) {
+        snprintf(msg, sizeof(msg),
+                 "placement table: %s buckets (%s per rank)",
+                 pretty_num(uint64_t(1) << ctx->ptbl_bits).c_str(),
+                 pretty_size(double(sizeof(int)) * (uint64_t(1)
+                                                     << ctx->ptbl_bits))
+                     .c_str());
+        INFO(msg);
+      }
+      if (ctx->bload != NULL) {
+        snprintf(msg, sizeof(msg),
+                 "placement rebalancing is ON\n>>> buckets are moved when "
+                 "a receiver is %d%% above the average load",
+                 ctx->rebal_thres);
+        INFO(msg);
+      }
     } else {
       WARN("ch-placement bypassed");
     }
@@ -845,7 +1474,9 @@ int shuffle_is_rank_receiver(shuffle_ctx_t* ctx, int rank) {
 
 int shuffle_world_sz(shuffle_ctx* ctx) {
   assert(ctx != NULL);
-  if (ctx->type == SHUFFLE_XN) {
+  if (ctx->world_sz != 0) {
+    return ctx->world_sz;
+  } else if (ctx->type == SHUFFLE_XN) {
     return xn_shuffler_world_size(static_cast<xn_ctx_t*>(ctx->rep));
   } else {
     return nn_shuffler_world_size();
@@ -854,7 +1485,9 @@ int shuffle_world_sz(shuffle_ctx* ctx) {
 
 int shuffle_rank(shuffle_ctx_t* ctx) {
   assert(ctx != NULL);
-  if (ctx->type == SHUFFLE_XN) {
+  if (ctx->world_sz != 0) {
+    return ctx->my_rank;
+  } else if (ctx->type == SHUFFLE_XN) {
     return xn_shuffler_my_rank(static_cast<xn_ctx_t*>(ctx->rep));
   } else {
     return nn_shuffler_my_rank();
@@ -879,18 +1512,30 @@ void shuffle_pause(shuffle_ctx_t* ctx) {
   }
 }
 
+int shuffle_backlog(shuffle_ctx_t* ctx) {
+  assert(ctx != NULL);
+  if (ctx->type == SHUFFLE_XN) {
+    return xn_shuffler_backlog(static_cast<xn_ctx_t*>(ctx->rep));
+  } else {
+    return nn_shuffler_backlog();
+  }
+}
+
+size_t shuffle_set_queue_budget(shuffle_ctx_t* ctx, size_t budget) {
+  assert(ctx != NULL);
+  if (ctx->type == SHUFFLE_XN) {
+    return pctx.mb.used[MB_QUEUES]; /* xn queues are sized at init */
+  } else {
+    return nn_shuffler_set_queue_budget(budget);
+  }
+}
+
 void shuffle_msg_sent(size_t n, void** arg1, void** arg2) {
-  pctx.mctx.min_nms++;
-  pctx.mctx.max_nms++;
-  pctx.mctx.nms++;
+  mon_cnt_add(MON_NMS, 1);
 }
 
 void shuffle_msg_replied(void* arg1, void* arg2) {
-  pctx.mctx.nmd++; /* delivered */
+  mon_cnt_add(MON_NMD, 1); /* delivered */
 }
 
-void shuffle_msg_received() {
-  pctx.mctx.min_nmr++;
-  pctx.mctx.max_nmr++;
-  pctx.mctx.nmr++;
-}
+void shuffle_msg_received() { mon_cnt_add(MON_NMR, 1); }
@@ -42,6 +42,19 @@
  *      such as static_modulo, hash_spooky, hash_lookup3, xor, as well as ring
  *  SHUFFLE_Virtual_factor
  *    Virtual factor used by nodes in a placement group
+ *  SHUFFLE_Placement_table_bits
+ *    Flatten the placement group into a 2**bits lookup table
+ *      so that each placement becomes a single table lookup (0 disables)
+ *  SHUFFLE_Rebalance
+ *    Rebalance receiver loads at each epoch boundary by moving placement
+ *      table buckets between receivers (implies a placement table, of
+ *      at most 2**20 buckets for rebalancing to stay on)
+ *  SHUFFLE_Rebalance_threshold
+ *    Load imbalance (in % of the average receiver load) tolerated
+ *      before buckets are moved
+ *  SHUFFLE_Pack_payload
+ *    Strip padding and delta-encode names in shuffle messages
+ *      to reduce the number of bytes sent over the network
  *  SHUFFLE_Recv_radix
  *    Number of senders (1**radix) per receiver
  *  SHUFFLE_Finalize_pause
@@ -51,12 +64,26 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct shuffle_ctx {
   /* internal shuffle impl */
   void* rep;
   /* consistent hash context */
   struct ch_placement_instance* chp;
+  /* flattened placement (NULL if not used). the destination of a hash is
+   * ptbl[hash >> (64 - ptbl_bits)]. */
+  int* ptbl;
+  unsigned int ptbl_bits;
+  /* number of writes we sent to each ptbl bucket during the current epoch
+   * (NULL if rebalancing is off), and the load imbalance (in percent)
+   * tolerated before buckets are moved */
+  unsigned long long* bload;
+  int rebal_thres;
+  /* world size and rank of the underlying transport, cached once it is up
+   * (0 if not yet known) so placement does not have to ask it each time */
+  int world_sz;
+  int my_rank;
   /* whether shuffle should never be bypassed
    * even when destination is local. it is often necessary to
    * avoid bypassing the shuffle. this is because the main thread
@@ -64,6 +91,8 @@ typedef struct shuffle_ctx {
    * is bypassed and destination is local. so there is a chance where the main
    * thread is blocked and cannot go send more writes. */
   int force_rpc;
+  /* non-zero if messages are packed before they are sent out */
+  int pack;
   /* number of secs to sleep after releasing the shuffle instance so
    * shuffle bg threads can complete shutdown in the meantime. */
   int finalize_pause;
@@ -74,6 +103,11 @@ typedef struct shuffle_ctx {
   unsigned char fname_len;
   unsigned char extra_data_len;
   unsigned char data_len;
+  /* micros shuffle_init spent bringing up the transport (including the
+   * address exchange with all peers) and building the placement. the
+   * two overlap unless PRELOAD_No_startup_overlap is set. */
+  uint64_t xport_micros;
+  uint64_t place_micros;
   /* shuffle type */
   int type;
 #define SHUFFLE_NN 0 /* default */
@@ -113,6 +147,21 @@ int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
                   unsigned char fname_len, char* data, unsigned char data_len,
                   int epoch);
 
+/*
+ * shuffle_write_batch: shuffle a group of write requests at once.
+ *
+ * filenames and data of all writes are packed back to back in *fnames and
+ * *data, respectively. all writes are hashed and placed in a single pass,
+ * grouped by destination, and each group is handed to the underlying
+ * transport as a whole so that per-destination queues are only locked once
+ * per group instead of once per write.
+ *
+ * return 0 on success, or EOF or errors.
+ */
+int shuffle_write_batch(shuffle_ctx_t* ctx, const char* fnames,
+                        unsigned char fname_len, char* data,
+                        unsigned char data_len, int num_writes, int epoch);
+
 /*
  * shuffle_epoch_start: perform necessary flushes at the
  * beginning of an epoch.
@@ -157,11 +206,90 @@ void shuffle_pause(shuffle_ctx_t* ctx);
  */
 void shuffle_resume(shuffle_ctx_t* ctx);
 
+/*
+ * shuffle_backlog: return the number of incoming messages received but not
+ * yet processed.
+ */
+int shuffle_backlog(shuffle_ctx_t* ctx);
+
+/*
+ * shuffle_set_queue_budget: resize send queues to fit in a given num of
+ * bytes and return the num of bytes they may now use. queues that cannot
+ * be resized at runtime keep their size.
+ */
+size_t shuffle_set_queue_budget(shuffle_ctx_t* ctx, size_t budget);
+
 /*
  * shuffle_target: return the shuffle destination for a given req.
  */
 int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz);
 
+/*
+ * shuffle_target_batch: compute the shuffle destinations for a group of
+ * fixed-sized names packed back to back in *fnames, writing the results
+ * to *targets.
+ */
+void shuffle_target_batch(shuffle_ctx_t* ctx, const char* fnames,
+                          unsigned char fname_len, int num_names,
+                          int* targets);
+
+/*
+ * shuffle_build_ptbl: flatten ctx->chp into a 2**bits placement table.
+ */
+void shuffle_build_ptbl(shuffle_ctx_t* ctx, unsigned int bits);
+
+/*
+ * shuffle_rebalance: move placement table buckets from overloaded receivers
+ * to underloaded ones according to the loads seen in the epoch just ended.
+ * collective over MPI_COMM_WORLD; must be called by all ranks between
+ * epochs, after shuffle_epoch_start(). return the number of buckets moved.
+ */
+int shuffle_rebalance(shuffle_ctx_t* ctx);
+
+/*
+ * shuffle_msg_pack: pack a message of writes, each preceded by a 1-byte
+ * length, in place. if rec_sz is not 0, the message instead holds
+ * fixed-sized records of rec_sz bytes without the '\0' after each name.
+ * return the packed size, or 0 if the message cannot be packed (in which
+ * case it is left unchanged).
+ */
+size_t shuffle_msg_pack(shuffle_ctx_t* ctx, char* msg, size_t msg_sz,
+                        size_t rec_sz);
+
+/*
+ * shuffle_msg_unpacked_size: return the size of a packed message once
+ * unpacked. abort if the message is malformed.
+ */
+size_t shuffle_msg_unpacked_size(shuffle_ctx_t* ctx, const char* msg,
+                                 size_t msg_sz);
+
+/*
+ * shuffle_msg_unpack: unpack a packed message into *out, which must have
+ * room for shuffle_msg_unpacked_size() bytes.
+ */
+void shuffle_msg_unpack(shuffle_ctx_t* ctx, const char* msg, size_t msg_sz,
+                        char* out);
+
+/*
+ * shuffle_msg_restore: copy an incoming shuffled write to *out, restoring
+ * the '\0' and the padding if the sender dropped them. *out must have room
+ * for a full request. return the size of the restored request.
+ */
+unsigned int shuffle_msg_restore(shuffle_ctx_t* ctx, const char* buf,
+                                 unsigned int buf_sz, char* out);
+
+/*
+ * shuffle_handle_batch: process a group of incoming shuffled writes. the
+ * i-th write is found at reqs + i * req_stride and must be req_sz bytes.
+ * writes one byte short of a full request are fixed-sized records, whose
+ * data directly follows the name without a '\0' in between.
+ *
+ * return 0 on success, or EOF on errors.
+ */
+int shuffle_handle_batch(shuffle_ctx_t* ctx, char* reqs, unsigned int req_sz,
+                         unsigned int req_stride, int num_reqs, int epoch,
+                         int src, int dst);
+
 /*
  * shuffle_handle: process an incoming shuffled write. here "peer_rank" refers
  * to the original sender, and "rank" refers to us.
@@ -34,6 +34,13 @@
  */
 #include "pthreadtap.h"
 
+#include <string.h>
+
+#ifdef PRELOAD_HAS_PAPI
+#include <papi.h>
+#include <sys/syscall.h>
+#endif
+
 /*
  * tapuseprobe_start:  load starting values into useprobe
  *
@@ -111,8 +118,117 @@ struct pthreadtap {
   void* tagarg;                       /* arg for tag_routine */
   /* optional user-provided output routine */
   void* (*tag_routine)(const char*, void*, struct tapuseprobe*);
+  int papi_events[TAP_MAX_PAPI_EVENTS]; /* hardware counters wanted */
+  struct pthreadtap* prev;              /* running taps with counters */
+  struct pthreadtap* next;
 };
 
+/*
+ * running taps with hardware counters, protected by taps_mtx
+ */
+static pthread_mutex_t taps_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct pthreadtap* taps = NULL;
+
+/*
+ * tap_papi_start: start the hardware counters of the calling thread.
+ * the tap goes without counters if they cannot be set up.
+ */
+static void tap_papi_start(struct pthreadtap* tap) {
+  struct tapuseprobe* up = &tap->up;
+#ifdef PRELOAD_HAS_PAPI
+  int set = PAPI_NULL;
+  int ok;
+  int i;
+
+  if (up->papi_n == 0) return;
+  /* the set is attached to our own tid so its counts are read through
+   * the kernel. this lets tapuseprobe_collect() read it from another
+   * thread while we run. */
+  ok = PAPI_create_eventset(&set) == PAPI_OK;
+  if (ok) ok = PAPI_assign_eventset_component(set, 0) == PAPI_OK;
+  if (ok) ok = PAPI_attach(set, (unsigned long)syscall(SYS_gettid)) == PAPI_OK;
+  for (i = 0; ok && i < up->papi_n; i++) {
+    ok = PAPI_add_event(set, tap->papi_events[i]) == PAPI_OK;
+  }
+  if (ok) ok = PAPI_start(set) == PAPI_OK;
+  if (!ok) {
+    if (set != PAPI_NULL) {
+      PAPI_cleanup_eventset(set);
+      PAPI_destroy_eventset(&set);
+    }
+    up->papi_n = 0;
+    return;
+  }
+
+  up->papi_set = set;
+  pthread_mutex_lock(&taps_mtx);
+  tap->prev = NULL;
+  tap->next = taps;
+  if (taps != NULL) taps->prev = tap;
+  taps = tap;
+  pthread_mutex_unlock(&taps_mtx);
+#else
+  up->papi_n = 0;
+#endif
+}
+
+/*
+ * tap_papi_end: load the final hardware counts into papi1 and release
+ * the counters of the calling thread
+ */
+static void tap_papi_end(struct pthreadtap* tap) {
+#ifdef PRELOAD_HAS_PAPI
+  struct tapuseprobe* up = &tap->up;
+
+  if (up->papi_n == 0) return;
+  pthread_mutex_lock(&taps_mtx);
+  if (tap->prev != NULL) {
+    tap->prev->next = tap->next;
+  } else {
+    taps = tap->next;
+  }
+  if (tap->next != NULL) tap->next->prev = tap->prev;
+  if (PAPI_stop(up->papi_set, up->papi1) != PAPI_OK) {
+    memcpy(up->papi1, up->papi0, sizeof(up->papi1));
+  }
+  pthread_mutex_unlock(&taps_mtx);
+  PAPI_cleanup_eventset(up->papi_set);
+  PAPI_destroy_eventset(&up->papi_set);
+  PAPI_unregister_thread();
+#else
+  (void)tap;
+#endif
+}
+
+/*
+ * tapuseprobe_collect: read the hardware counters of all running taps
+ */
+void tapuseprobe_collect(void (*fn)(const char*, void*, const long long*,
+                                    int, void*),
+                         void* fnarg) {
+#ifdef PRELOAD_HAS_PAPI
+  long long diff[TAP_MAX_PAPI_EVENTS];
+  struct pthreadtap* tap;
+  struct tapuseprobe* up;
+  int i;
+
+  pthread_mutex_lock(&taps_mtx);
+  for (tap = taps; tap != NULL; tap = tap->next) {
+    up = &tap->up;
+    if (PAPI_read(up->papi_set, up->papi1) != PAPI_OK) continue;
+    for (i = 0; i < up->papi_n; i++) {
+      diff[i] = up->papi1[i] - up->papi0[i];
+      up->papi0[i] = up->papi1[i];
+    }
+    fn(tap->tag, tap->tagarg, diff, up->papi_n, fnarg);
+  }
+  pthread_mutex_unlock(&taps_mtx);
+#else
+  (void)fn;
+  (void)fnarg;
+#endif
+}
+
 /*
  * tap_cleanup: we got canceled, so our routine isn't going to return
  */
@@ -120,6 +236,7 @@ static void tap_cleanup(void* arg) {
   struct pthreadtap* tap = (struct pthreadtap*)arg;
 
   tapuseprobe_end(&tap->up);
+  tap_papi_end(tap);
 
   if (tap->tag_routine == NULL) {
     tapuseprobe_print(stderr, &tap->up, tap->tag, getpid());
@@ -139,10 +256,12 @@ static void* tap_wrap(void* arg) {
   void* rv;
 
   tapuseprobe_start(&tap->up, RUSAGE_THREAD); /* linux only! */
+  tap_papi_start(tap);
   pthread_cleanup_push(tap_cleanup, tap);
   rv = tap->user_start_routine(tap->user_start_arg);
   pthread_cleanup_pop(0);
   tapuseprobe_end(&tap->up);
+  tap_papi_end(tap);
 
   if (tap->tag_routine == NULL) {
     tapuseprobe_print(stderr, &tap->up, tap->tag, getpid());
@@ -162,7 +281,8 @@ int pthread_create_tap(
     void* (*start_routine)(void*), void* startarg, const char* tag,
     void* tagarg, void*(tag_routine)(const char*, void*, struct tapuseprobe*),
     int (*nxt)(pthread_t* thread, const pthread_attr_t* attr,
-               void* (*start_routine)(void*), void* startarg)) {
+               void* (*start_routine)(void*), void* startarg),
+    const int* papi_events, int papi_n) {
   struct pthreadtap* tap;
   int rv;
 
@@ -177,6 +297,17 @@ int pthread_create_tap(
   tap->tag = tag;
   tap->tagarg = tagarg;
   tap->tag_routine = tag_routine;
+  if (papi_n > TAP_MAX_PAPI_EVENTS) {
+    papi_n = TAP_MAX_PAPI_EVENTS;
+  }
+  tap->up.papi_set = -1; /* PAPI_NULL */
+  tap->up.papi_n = papi_events != NULL ? papi_n : 0;
+  memset(tap->up.papi0, 0, sizeof(tap->up.papi0));
+  memset(tap->up.papi1, 0, sizeof(tap->up.papi1));
+  if (tap->up.papi_n > 0) {
+    memcpy(tap->papi_events, papi_events, papi_n * sizeof(int));
+  }
+  tap->prev = tap->next = NULL;
 
   if (!nxt) {
     rv = pthread_create(thread, attr, tap_wrap, tap);
@@ -52,10 +52,17 @@
 /*
  * tapuseprobe: start-end usage state
  */
+#define TAP_MAX_PAPI_EVENTS 4
 struct tapuseprobe {
   int who;               /* flag to getrusage */
   struct timeval t0, t1; /* time at start/end */
   struct rusage r0, r1;  /* resource usage at start/end */
+  /* optional hardware counters (papi_n is 0 if not used). papi0 holds
+   * the counts at the last tapuseprobe_collect() and papi1 the latest
+   * counts (at the end once the thread is done). */
+  int papi_set;
+  int papi_n;
+  long long papi0[TAP_MAX_PAPI_EVENTS], papi1[TAP_MAX_PAPI_EVENTS];
 };
 
 /**
@@ -69,6 +76,18 @@ struct tapuseprobe {
 void tapuseprobe_print(FILE* out, struct tapuseprobe* up, const char* tag,
                        int n);
 
+/**
+ * tapuseprobe_collect: read the hardware counters of all running tapped
+ * threads.  the counts since the last collect are passed to a callback
+ * along with the thread's tag and tagarg.  no-op without papi.
+ *
+ * @param fn the callback (tag, tagarg, counts, num counts, fnarg)
+ * @param fnarg arg for fn
+ */
+void tapuseprobe_collect(void (*fn)(const char*, void*, const long long*,
+                                    int, void*),
+                         void* fnarg);
+
 /**
  * pthread_create_tap: create new thread with a usage tap added.
  * the first 4 args are the same as normal pthread_create().
@@ -81,6 +100,8 @@ void tapuseprobe_print(FILE* out, struct tapuseprobe* up, const char* tag,
  * @param tagarg arg for tag_routine
  * @param tag_routine user-provided tag routine (NULL means use default)
  * @param nxt the real pthread_create function ptr when preloaded
+ * @param papi_events papi event codes to count in the new thread
+ * @param papi_n number of events (0 means no hardware counters)
  * @return 0 on success, errno on failure
  */
 int pthread_create_tap(
@@ -88,4 +109,5 @@ int pthread_create_tap(
     void* (*start_routine)(void*), void* startarg, const char* tag,
     void* tagarg, void*(tag_routine)(const char*, void*, struct tapuseprobe*),
     int (*nxt)(pthread_t* thread, const pthread_attr_t* attr,
-               void* (*start_routine)(void*), void* startarg));
+               void* (*start_routine)(void*), void* startarg),
+    const int* papi_events, int papi_n);
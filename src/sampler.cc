@@ -0,0 +1,197 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "sampler.h"
+
+#include "common.h"
+
+#include <pdlfs-common/xxhash.h>
+
+/* each bloom block is one 64-byte cache line holding 512 bits */
+#define BLOOM_WORDS_PER_BLOCK 8
+#define BLOOM_BITS_PER_KEY 16
+#define BLOOM_PROBES 3
+
+namespace {
+inline uint32_t next_pow2(uint64_t n) {
+  uint32_t r = 1;
+  while (r < n) r <<= 1;
+  return r;
+}
+
+inline uint64_t hash_of(const char* key, size_t key_sz) {
+  return pdlfs::xxhash64(key, key_sz, 0);
+}
+
+/* the high 32 bits of a hash pick a bloom block, and the low 32 bits pick a
+ * table slot as well as the bits to set or test within the block */
+inline uint64_t* bloom_block(const sampler_t* s, uint64_t h) {
+  const size_t blk = static_cast<size_t>(h >> 32) & (s->nblocks - 1);
+  return s->bloom + blk * BLOOM_WORDS_PER_BLOCK;
+}
+
+inline bool bloom_may_contain(const sampler_t* s, uint64_t h) {
+  const uint64_t* const b = bloom_block(s, h);
+  const uint32_t bits = static_cast<uint32_t>(h);
+  for (int i = 0; i < BLOOM_PROBES; i++) {
+    const uint32_t bit = (bits >> (9 * i)) & 511;
+    if ((b[bit >> 6] & (uint64_t(1) << (bit & 63))) == 0) return false;
+  }
+  return true;
+}
+
+inline void bloom_add(sampler_t* s, uint64_t h) {
+  uint64_t* const b = bloom_block(s, h);
+  const uint32_t bits = static_cast<uint32_t>(h);
+  for (int i = 0; i < BLOOM_PROBES; i++) {
+    const uint32_t bit = (bits >> (9 * i)) & 511;
+    b[bit >> 6] |= uint64_t(1) << (bit & 63);
+  }
+}
+
+/* return the slot holding a given name, or the first empty slot where it
+ * may be inserted */
+inline uint32_t probe(const sampler_t* s, uint64_t h, const char* key) {
+  uint32_t i = static_cast<uint32_t>(h) & (s->nslots - 1);
+  while (s->counts[i] != 0 &&
+         memcmp(s->keys + size_t(i) * s->key_sz, key, s->key_sz) != 0) {
+    i = (i + 1) & (s->nslots - 1);
+  }
+  return i;
+}
+
+/* initial num of names of a sampler without a capacity */
+#define SAMPLER_INITIAL_NAMES 64
+
+void sampler_alloc(sampler_t* s, uint32_t key_sz, uint32_t capacity) {
+  s->key_sz = key_sz;
+  s->capacity = capacity;
+  s->nslots = next_pow2(uint64_t(capacity) * 2); /* load factor <= 0.5 */
+  s->nblocks = next_pow2(uint64_t(capacity) * BLOOM_BITS_PER_KEY /
+                             (BLOOM_WORDS_PER_BLOCK * 64) +
+                         1);
+  s->n = 0;
+  s->ndropped = 0;
+  s->keys = static_cast<char*>(malloc(size_t(s->nslots) * key_sz));
+  s->counts = static_cast<int*>(calloc(s->nslots, sizeof(int)));
+  s->bloom = static_cast<uint64_t*>(calloc(
+      size_t(s->nblocks) * BLOOM_WORDS_PER_BLOCK, sizeof(uint64_t)));
+  if (s->keys == NULL || s->counts == NULL || s->bloom == NULL) {
+    ABORT("malloc");
+  }
+}
+
+/* double the capacity of a sampler, rehashing all names and their counts
+ * into a new table and bloom filter */
+void sampler_grow(sampler_t* s) {
+  sampler_t old = *s;
+  uint64_t h;
+  uint32_t i;
+  uint32_t j;
+
+  if (old.capacity >= (1u << 30)) ABORT("sampler too large");
+  sampler_alloc(s, old.key_sz, old.capacity * 2);
+  s->growable = old.growable;
+  s->ndropped = old.ndropped;
+  for (j = 0; j < old.nslots; j++) {
+    if (old.counts[j] == 0) continue;
+    const char* const key = old.keys + size_t(j) * old.key_sz;
+    h = hash_of(key, old.key_sz);
+    i = probe(s, h, key);
+    memcpy(s->keys + size_t(i) * s->key_sz, key, old.key_sz);
+    s->counts[i] = old.counts[j];
+    bloom_add(s, h);
+    s->n++;
+  }
+  sampler_destroy(&old);
+}
+}  // namespace
+
+void sampler_init(sampler_t* s, uint32_t key_sz, uint32_t capacity) {
+  sampler_alloc(s, key_sz, capacity != 0 ? capacity : SAMPLER_INITIAL_NAMES);
+  s->growable = (capacity == 0);
+}
+
+void sampler_destroy(sampler_t* s) {
+  free(s->keys);
+  free(s->counts);
+  free(s->bloom);
+  s->keys = NULL;
+  s->counts = NULL;
+  s->bloom = NULL;
+  s->n = 0;
+}
+
+int sampler_insert(sampler_t* s, const char* key, size_t key_sz) {
+  uint64_t h;
+  uint32_t i;
+
+  if (key_sz != s->key_sz) return -1; /* not a valid name */
+  h = hash_of(key, key_sz);
+  if (s->n != 0 && bloom_may_contain(s, h)) {
+    i = probe(s, h, key);
+    if (s->counts[i] != 0) {
+      return 0; /* already there */
+    }
+  }
+  if (s->n >= s->capacity) {
+    if (!s->growable) {
+      s->ndropped++;
+      return -1;
+    }
+    sampler_grow(s);
+  }
+  i = probe(s, h, key);
+  memcpy(s->keys + size_t(i) * s->key_sz, key, key_sz);
+  s->counts[i] = 1;
+  bloom_add(s, h);
+  s->n++;
+
+  return 0;
+}
+
+void sampler_touch(sampler_t* s, const char* key, size_t key_sz) {
+  uint64_t h;
+  uint32_t i;
+
+  if (s->n == 0 || key_sz != s->key_sz) return;
+  h = hash_of(key, key_sz);
+  if (!bloom_may_contain(s, h)) return;
+  i = probe(s, h, key);
+  if (s->counts[i] != 0) {
+    s->counts[i]++;
+  }
+}
+
+size_t sampler_memory(const sampler_t* s) {
+  return size_t(s->nslots) * (s->key_sz + sizeof(int)) +
+         size_t(s->nblocks) * BLOOM_WORDS_PER_BLOCK * sizeof(uint64_t);
+}
@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * sampler: a set of sampled particle names, each with a counter. names are
+ * fixed-width keys stored back to back in an open-addressing (linear
+ * probing) hash table. a table created with a capacity is allocated once and
+ * never grows; one created without a capacity doubles and rehashes whenever
+ * it becomes half full. a blocked bloom filter sits in front of the table so
+ * that most names not in the sample are rejected by reading a single cache
+ * line.
+ */
+typedef struct sampler {
+  char* keys;           /* nslots * key_sz bytes */
+  int* counts;          /* 0 marks an empty slot */
+  uint64_t* bloom;      /* nblocks * 8 words */
+  uint32_t nslots;      /* a power of 2 */
+  uint32_t nblocks;     /* a power of 2 */
+  uint32_t capacity;    /* max num of names (at most 1/2 of nslots) */
+  uint32_t n;           /* num of names inserted */
+  uint32_t key_sz;      /* size of each name */
+  int growable;         /* grow the table instead of dropping names */
+  unsigned long long ndropped; /* num of names rejected due to capacity */
+} sampler_t;
+
+/* sampler api. a capacity of 0 means no limit */
+void sampler_init(sampler_t* s, uint32_t key_sz, uint32_t capacity);
+void sampler_destroy(sampler_t* s);
+
+/* add a name with a count of 1 unless it is already there. return 0 if the
+ * name is added or already there, or -1 if the sampler is at its capacity or
+ * the name is not key_sz bytes long. */
+int sampler_insert(sampler_t* s, const char* key, size_t key_sz);
+/* increase the count of a name if it is in the sampler */
+void sampler_touch(sampler_t* s, const char* key, size_t key_sz);
+
+/* total memory used by the sampler */
+size_t sampler_memory(const sampler_t* s);
+
+/* iterate over names: slots with a non-zero count hold a name */
+inline uint32_t sampler_slots(const sampler_t* s) { return s->nslots; }
+inline int sampler_count(const sampler_t* s, uint32_t i) {
+  return s->counts[i];
+}
+inline const char* sampler_key(const sampler_t* s, uint32_t i) {
+  return s->keys + size_t(i) * s->key_sz;
+}
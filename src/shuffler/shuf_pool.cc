@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * shuf_pool.cc  size class object pools for the shuffler
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "shuf_pool.h"
+
+#define SHUFPOOL_MINSHIFT 6         /* smallest class is 64 bytes */
+#define SHUFPOOL_TCMAX 64           /* max# objs per class in a thread cache */
+#define SHUFPOOL_XFER 32            /* #objs moved to/from a depot at once */
+
+/*
+ * shufpool_obj: a free object (we reuse its first bytes as linkage)
+ */
+struct shufpool_obj {
+  struct shufpool_obj *next;        /* next free object */
+};
+
+/*
+ * shufpool_depot: shared free objects of a size class
+ */
+struct shufpool_depot {
+  pthread_mutex_t lock;             /* protects the fields below */
+  struct shufpool_obj *head;        /* list of free objects */
+  int ndepot;                       /* #of objects on the list */
+  int created;                      /* #of objects ever malloc'd */
+};
+
+#define DEPOT_INIT { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 }
+static struct shufpool_depot depots[SHUFPOOL_NCLASSES] = {
+  DEPOT_INIT, DEPOT_INIT, DEPOT_INIT, DEPOT_INIT,
+  DEPOT_INIT, DEPOT_INIT, DEPOT_INIT
+};
+static int nbig = 0;                /* #of allocs too big for a class */
+
+/*
+ * shufpool_tcache: a thread's cache of free objects
+ */
+struct shufpool_tcache {
+  int n[SHUFPOOL_NCLASSES];         /* #of objects cached per class */
+  struct shufpool_obj *objs[SHUFPOOL_NCLASSES][SHUFPOOL_TCMAX];
+};
+
+static __thread struct shufpool_tcache *tcache = NULL;
+static pthread_key_t tckey;         /* to flush a cache at thread exit */
+static pthread_once_t tconce = PTHREAD_ONCE_INIT;
+
+/*
+ * cls_size: size of the objects in a class
+ *
+ * @param c the class
+ * @return the size
+ */
+static inline size_t cls_size(int c) {
+  return(size_t(1) << (c + SHUFPOOL_MINSHIFT));
+}
+
+/*
+ * cls_of: return the class for an object size
+ *
+ * @param sz the size
+ * @return the class, or -1 if sz is too big for any class
+ */
+static inline int cls_of(size_t sz) {
+  int c;
+
+  for (c = 0 ; c < SHUFPOOL_NCLASSES ; c++) {
+    if (sz <= cls_size(c))
+      return(c);
+  }
+  return(-1);
+}
+
+/*
+ * depot_put: move n objects to a class' depot
+ *
+ * @param c the class
+ * @param objs the objects
+ * @param n the number of objects
+ */
+static void depot_put(int c, struct shufpool_obj **objs, int n) {
+  struct shufpool_depot *d = &depots[c];
+  int lcv;
+
+  pthread_mutex_lock(&d->lock);
+  for (lcv = 0 ; lcv < n ; lcv++) {
+    objs[lcv]->next = d->head;
+    d->head = objs[lcv];
+  }
+  d->ndepot += n;
+  pthread_mutex_unlock(&d->lock);
+}
+
+/*
+ * tcache_flush: return a thread's cached objects to the depots
+ * (pthread key destructor, runs at thread exit)
+ *
+ * @param arg the thread's cache
+ */
+static void tcache_flush(void *arg) {
+  struct shufpool_tcache *tc = (struct shufpool_tcache *)arg;
+  int c;
+
+  for (c = 0 ; c < SHUFPOOL_NCLASSES ; c++) {
+    if (tc->n[c])
+      depot_put(c, tc->objs[c], tc->n[c]);
+  }
+  if (tc == tcache)
+    tcache = NULL;
+  free(tc);
+}
+
+/*
+ * tcache_keyinit: create the key used to flush caches at thread exit
+ */
+static void tcache_keyinit() {
+  pthread_key_create(&tckey, tcache_flush);
+}
+
+/*
+ * tcache_get: get the current thread's cache (create it if needed)
+ *
+ * @return the cache, or NULL if we could not create it
+ */
+static struct shufpool_tcache *tcache_get() {
+  struct shufpool_tcache *tc;
+
+  if (tcache)
+    return(tcache);
+  pthread_once(&tconce, tcache_keyinit);
+  tc = (struct shufpool_tcache *)calloc(1, sizeof(*tc));
+  if (tc == NULL)
+    return(NULL);
+  if (pthread_setspecific(tckey, tc) != 0) {
+    free(tc);
+    return(NULL);
+  }
+  tcache = tc;
+  return(tc);
+}
+
+/*
+ * shufpool_alloc: allocate an object of a given size
+ */
+void *shufpool_alloc(size_t sz) {
+  struct shufpool_tcache *tc;
+  struct shufpool_depot *d;
+  struct shufpool_obj *o;
+  int c;
+
+  c = cls_of(sz);
+  if (c < 0) {
+    __sync_fetch_and_add(&nbig, 1);
+    return(malloc(sz));
+  }
+  tc = tcache_get();
+  if (tc && tc->n[c] > 0)                /* fast path, no locking */
+    return(tc->objs[c][--tc->n[c]]);
+
+  /* cache empty (or we have none), refill from the depot */
+  d = &depots[c];
+  o = NULL;
+  pthread_mutex_lock(&d->lock);
+  if (tc) {
+    while (d->head && tc->n[c] < SHUFPOOL_XFER) {
+      tc->objs[c][tc->n[c]++] = d->head;
+      d->head = d->head->next;
+      d->ndepot--;
+    }
+    if (tc->n[c] > 0)
+      o = tc->objs[c][--tc->n[c]];
+  } else if (d->head) {
+    o = d->head;
+    d->head = o->next;
+    d->ndepot--;
+  }
+  if (o == NULL)
+    d->created++;                        /* depot empty, need a new one */
+  pthread_mutex_unlock(&d->lock);
+
+  return((o) ? (void *)o : malloc(cls_size(c)));
+}
+
+/*
+ * shufpool_free: free an object from shufpool_alloc
+ */
+void shufpool_free(void *p, size_t sz) {
+  struct shufpool_tcache *tc;
+  struct shufpool_obj *o = (struct shufpool_obj *)p;
+  int c;
+
+  if (p == NULL)
+    return;
+  c = cls_of(sz);
+  if (c < 0) {
+    free(p);
+    return;
+  }
+  tc = tcache_get();
+  if (tc == NULL) {
+    depot_put(c, &o, 1);
+    return;
+  }
+
+  if (tc->n[c] == SHUFPOOL_TCMAX) {      /* full, return half to depot */
+    tc->n[c] -= SHUFPOOL_XFER;
+    depot_put(c, &tc->objs[c][tc->n[c]], SHUFPOOL_XFER);
+  }
+  tc->objs[c][tc->n[c]++] = o;
+}
+
+/*
+ * shufpool_stats: get the stats of all size classes
+ */
+void shufpool_stats(struct shufpool_stat *st, int *nbigp) {
+  struct shufpool_depot *d;
+  int c;
+
+  for (c = 0 ; c < SHUFPOOL_NCLASSES ; c++) {
+    d = &depots[c];
+    pthread_mutex_lock(&d->lock);
+    st[c].objsize = cls_size(c);
+    st[c].created = d->created;
+    st[c].depot = d->ndepot;
+    pthread_mutex_unlock(&d->lock);
+  }
+  *nbigp = __sync_fetch_and_add(&nbig, 0);
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2017, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * shuf_pool.h  size class object pools for the shuffler
+ */
+
+/*
+ * the shuffler allocates (and later frees) a request structure for
+ * every message it sends or forwards, plus req_parent and output
+ * structures on the flow control and rpc paths.  rather than going
+ * to malloc for each one, we keep freed objects in a set of size
+ * class pools.  each thread has a small cache of objects per class
+ * that it can alloc from and free to without locking.   when a
+ * thread's cache fills (e.g. the thread frees reqs that another
+ * thread allocated) we return half of it to a shared per-class depot,
+ * and when it runs empty we refill from the depot.   objects are never
+ * returned to malloc, so the number of objects created for a class is
+ * the high-water mark of that class.  allocations larger than the
+ * biggest class go directly to malloc.
+ *
+ * the pools are process-wide (shared by all shuffler instances).
+ */
+
+#pragma once
+
+#include <stddef.h>
+
+#define SHUFPOOL_NCLASSES 7         /* 64, 128, ... 4096 bytes */
+
+/*
+ * shufpool_stat: stats for one size class
+ */
+struct shufpool_stat {
+  size_t objsize;                   /* size of objects in this class */
+  int created;                      /* #of objects malloc'd (high-water) */
+  int depot;                        /* #of objects on the shared depot */
+};
+
+/*
+ * shufpool_alloc: allocate an object of a given size
+ *
+ * @param sz size of the object
+ * @return the object or NULL if malloc failed
+ */
+void *shufpool_alloc(size_t sz);
+
+/*
+ * shufpool_free: free an object from shufpool_alloc
+ *
+ * @param p the object to free (NULL is ok)
+ * @param sz size it was allocated with
+ */
+void shufpool_free(void *p, size_t sz);
+
+/*
+ * shufpool_stats: get the stats of all size classes
+ *
+ * @param st array of SHUFPOOL_NCLASSES entries to fill in
+ * @param nbig set to the #of allocations too big for any class
+ */
+void shufpool_stats(struct shufpool_stat *st, int *nbig);
@@ -46,10 +46,13 @@
 #include <sys/time.h>
 #include <sys/types.h>
 
+#include <vector>
+
 #include <mercury.h>
 #include <mercury_macros.h>
 #include <deltafs-nexus/deltafs-nexus_api.h>
 
+#include "shuf_pool.h"
 #include "shuffler.h"
 
 #define SHUFFLER_COUNT           /* enable/disable internal counters */
@@ -173,6 +176,50 @@ err:
   return(-1);
 }
 
+static int shufcfg_trace_every = 0;   /* set by shuffler_cfgtrace() */
+
+static struct shufcfgdlvr {          /* set by shuffler_cfgdeliver() */
+  int nthreads;                      /* number of delivery threads */
+  int maxbatch;                      /* max# of reqs delivered at once */
+  shuffler_deliverv_t delivervcb;    /* batch callback (or NULL) */
+  shuffler_dpart_t dpartcb;          /* partition fn (or NULL) */
+} shufcfgd = { 1, 1, NULL, NULL };
+
+/*
+ * shuffler_cfgdeliver: setup batched/multi-threaded delivery before
+ * starting the shuffler.
+ */
+int shuffler_cfgdeliver(int nthreads, int maxbatch,
+                        shuffler_deliverv_t delivervcb,
+                        shuffler_dpart_t dpartcb) {
+  if (nthreads < 1 || nthreads > SHUFFLER_MAXDTHREADS) {
+    fprintf(stderr, "shuffler_cfgdeliver: bad nthreads %d\n", nthreads);
+    return(-1);
+  }
+  if (maxbatch < 1) {
+    fprintf(stderr, "shuffler_cfgdeliver: bad maxbatch %d\n", maxbatch);
+    return(-1);
+  }
+  shufcfgd.nthreads = nthreads;
+  shufcfgd.maxbatch = maxbatch;
+  shufcfgd.delivervcb = delivervcb;
+  shufcfgd.dpartcb = dpartcb;
+  return(0);
+}
+
+/*
+ * shuffler_cfgtrace: setup sampled request tracing before starting
+ * the shuffler.
+ */
+int shuffler_cfgtrace(int sample_every) {
+  if (sample_every < 0) {
+    fprintf(stderr, "shuffler_cfgtrace: bad sample rate %d\n", sample_every);
+    return(-1);
+  }
+  shufcfg_trace_every = sample_every;
+  return(0);
+}
+
 /*
  * shuffler_openlog: start the log
  *
@@ -424,6 +471,134 @@ static int do_cond_timedwait(struct shuffler *sh, pthread_cond_t *ccv,
 #define shufzero(X)    /* nothing */
 #endif
 
+/*
+ * sampled tracing: we only touch a req's trace if it has one
+ */
+
+/*
+ * trace_now: current wall clock time in usecs
+ *
+ * @return the time
+ */
+static uint64_t trace_now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return(uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * trace_enter: charge the time since the last transition to the req's
+ * current stage and move it to a new one.  TRS_NSTAGES ends the trace.
+ *
+ * @param req the request (may or may not have a trace)
+ * @param stage the stage we are entering
+ */
+static void trace_enter(struct request *req, int stage) {
+  struct req_trace *tr = req->trace;
+  uint64_t now;
+
+  if (tr == NULL)
+    return;
+  now = trace_now();
+  /* a remote clock ahead of ours can make this go negative */
+  if (tr->stage < TRS_NSTAGES && now > tr->tslast)
+    tr->st[tr->stage] += now - tr->tslast;
+  tr->tslast = now;
+  tr->stage = stage;
+  if (stage < TRS_NSTAGES)
+    tr->seen |= (1 << stage);
+}
+
+/*
+ * trace_oqstage: return the stage for a req waiting on an outset's queues
+ *
+ * @param oset the outset
+ * @return the stage (the hop stage is this plus one)
+ */
+static int trace_oqstage(struct outset *oset) {
+  if (oset->settype == SHUFFLER_REMOTE_QUEUES)
+    return(TRS_REMOTEQ);
+  if (oset->settype == SHUFFLER_RELAY_QUEUES)
+    return(TRS_RELAYQ);
+  return(TRS_ORIGINQ);
+}
+
+/*
+ * trace_done: end a req's trace and add it to our per-stage histograms.
+ * caller must hold deliverlock (it protects the histograms).
+ *
+ * @param sh the shuffler
+ * @param req the delivered request
+ */
+static void trace_done(struct shuffler *sh, struct request *req) {
+  struct req_trace *tr = req->trace;
+  struct trace_hist *h;
+  uint32_t v;
+  int lcv, b;
+
+  if (tr == NULL)
+    return;
+  trace_enter(req, TRS_NSTAGES);
+  for (lcv = 0 ; lcv < TRS_NSTAGES ; lcv++) {
+    if ((tr->seen & (1 << lcv)) == 0)
+      continue;               /* req skipped this stage */
+    h = &sh->trhist[lcv];
+    v = tr->st[lcv];
+    for (b = 0 ; b < TRH_NBUCKETS - 1 && (v >> b) != 0 ; b++)
+      /*null*/;
+    h->b[b]++;
+    h->cnt++;
+    h->sum += v;
+    if (v > h->max) h->max = v;
+  }
+}
+
+/*
+ * trace_ptile: approx percentile of a trace_hist (top of the bucket)
+ *
+ * @param h the histogram
+ * @param p the percentile (0 to 100)
+ * @return the value in usecs
+ */
+static uint32_t trace_ptile(struct trace_hist *h, double p) {
+  uint64_t want, sum;
+  int b;
+
+  want = (uint64_t)(h->cnt * p / 100.0 + 0.5);
+  if (want == 0) want = 1;
+  for (b = 0, sum = 0 ; b < TRH_NBUCKETS ; b++) {
+    sum += h->b[b];
+    if (sum >= want)
+      break;
+  }
+  if (b == 0) return(0);
+  if (b >= 32) return(h->max);
+  return( ((1U << b) - 1) < h->max ? ((1U << b) - 1) : h->max );
+}
+
+/*
+ * req_alloc: allocate a request from the pool (trace and data follow it)
+ *
+ * @param trsz size of the trace area (0 or sizeof(struct req_trace))
+ * @param datalen size of the data area
+ * @return the new request or NULL on failure
+ */
+static struct request *req_alloc(size_t trsz, uint32_t datalen) {
+  return((struct request *)shufpool_alloc(sizeof(struct request) +
+                                          trsz + datalen));
+}
+
+/*
+ * req_free: return a request allocated with req_alloc() to the pool.
+ * the request's trace and datalen must be set (they give us the size).
+ *
+ * @param req the request to free
+ */
+static void req_free(struct request *req) {
+  shufpool_free(req, sizeof(*req) + ((req->trace) ? sizeof(struct req_trace)
+                                                  : 0) + req->datalen);
+}
+
 /*
  * RPC handler registered with mercury
  */
@@ -474,6 +649,7 @@ static void parent_stopwait(struct shuffler *sh, struct req_parent *parent,
                             int abort);
 static hg_return_t shuffler_desthand_cb(const struct hg_cb_info *cbi);
 static hg_return_t shuffler_respond_cb(const struct hg_cb_info *cbi);
+static void shuffler_dthreads_discard(struct shuffler *sh, int ninit);
 static int start_threads(struct shuffler *sh);
 static void stop_threads(struct shuffler *sh);
 static void start_qflush(struct shuffler *sh, struct outset *oset,
@@ -493,6 +669,26 @@ static uint32_t zero = 0;   /* for end of list marker */
     goto done; \
 }
 
+/*
+ * hg_proc_req_trace: encode/decode the trace of a sampled request
+ *
+ * @param proc the proc used to serialize/deserialize the data
+ * @param tr the trace being worked on
+ * @return HG_SUCCESS or an error code
+ */
+static hg_return_t hg_proc_req_trace(hg_proc_t proc, struct req_trace *tr) {
+  hg_return_t ret;
+  int lcv;
+
+  ret = hg_proc_hg_uint64_t(proc, &tr->tslast);
+  if (ret == HG_SUCCESS) ret = hg_proc_hg_uint32_t(proc, &tr->stage);
+  if (ret == HG_SUCCESS) ret = hg_proc_hg_uint32_t(proc, &tr->seen);
+  for (lcv = 0 ; lcv < TRS_NSTAGES && ret == HG_SUCCESS ; lcv++) {
+    ret = hg_proc_hg_uint32_t(proc, &tr->st[lcv]);
+  }
+  return(ret);
+}
+
 /*
  * hg_proc_rpcin_t: encode/decode the rpcin_t structure
  *
@@ -507,6 +703,7 @@ static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
   struct request *rp, *nrp;
   int cnt, lcv;
   uint32_t dlen, typ;
+  size_t trsz;
   mlog(UTIL_CALL, "hg_proc_rpcin_t proc=%p op=%d", proc, op);
 
   if (op == HG_FREE)               /* we combine free and err handling below */
@@ -526,12 +723,18 @@ static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
     XSIMPLEQ_FOREACH(rp, &struct_data->inreqs, next) {
       ret = hg_proc_hg_uint32_t(proc, &rp->datalen);
       procheck(ret, "Proc en err datalen");
-      ret = hg_proc_hg_uint32_t(proc, &rp->type);
+      typ = rp->type;
+      if (rp->trace) typ |= SHUFFLER_TRACE_FLAG;
+      ret = hg_proc_hg_uint32_t(proc, &typ);
       procheck(ret, "Proc en err type");
       ret = hg_proc_hg_int32_t(proc, &rp->src);
       procheck(ret, "Proc en err src");
       ret = hg_proc_hg_int32_t(proc, &rp->dst);
       procheck(ret, "Proc en err dst");
+      if (rp->trace) {
+        ret = hg_proc_req_trace(proc, rp->trace);
+        procheck(ret, "Proc en err trace");
+      }
       ret = hg_proc_memcpy(proc, rp->data, rp->datalen);
       procheck(ret, "Proc en err data");
       cnt++;
@@ -553,18 +756,23 @@ static hg_return_t hg_proc_rpcin_t(hg_proc_t proc, void *data) {
     ret = hg_proc_hg_uint32_t(proc, &typ);
     procheck(ret, "Proc de err type");
     if (dlen == 0 && typ == 0) break;     /* got end of list marker */
-    rp = (request*)malloc(sizeof(*rp) + dlen);
+    trsz = (typ & SHUFFLER_TRACE_FLAG) ? sizeof(struct req_trace) : 0;
+    rp = req_alloc(trsz, dlen);
     if (rp == NULL) ret = HG_NOMEM_ERROR;
     procheck(ret, "Proc de malloc");
     rp->datalen = dlen;
-    rp->type = typ;
+    rp->type = typ & ~SHUFFLER_TRACE_FLAG;
+    rp->trace = (trsz) ? (struct req_trace *)(((char *)rp) + sizeof(*rp))
+                       : NULL;
     ret = hg_proc_hg_int32_t(proc, &rp->src);
     if (ret == HG_SUCCESS) ret = hg_proc_hg_int32_t(proc, &rp->dst);
-    rp->data = ((char *)rp) + sizeof(*rp);
+    if (ret == HG_SUCCESS && rp->trace)
+      ret = hg_proc_req_trace(proc, rp->trace);
+    rp->data = ((char *)rp) + sizeof(*rp) + trsz;
     if (ret == HG_SUCCESS) ret = hg_proc_memcpy(proc, rp->data, dlen);
     rp->owner = NULL;
     if (ret != HG_SUCCESS) {
-      free(rp);
+      req_free(rp);
       procheck(ret, "Proc decoder");
     }
 
@@ -578,7 +786,7 @@ done:
   if ( ((op == HG_DECODE && ret != HG_SUCCESS) || op == HG_FREE) &&
        XSIMPLEQ_FIRST(&struct_data->inreqs) != NULL) {
     XSIMPLEQ_FOREACH_SAFE(rp, &struct_data->inreqs, next, nrp) {
-      free(rp);
+      req_free(rp);
     }
     XSIMPLEQ_INIT(&struct_data->inreqs);
   }
@@ -652,6 +860,7 @@ static void shuffler_outset_discard(struct outset *oset) {
   for (oqit = oset->oqs.begin() ; oqit != oset->oqs.end() ; oqit++) {
     oq = oqit->second;
     pthread_mutex_destroy(&oq->oqlock);
+    reqring_destroy(&oq->oqwaitq);
     delete oq;
   }
 
@@ -722,7 +931,12 @@ static int shuffler_init_outset(struct outset *oset, int maxoqrpc,
     oq->dst = ha;         /* shared with nexus, nexus owns it */
     oq->subrank = nexus_iter_subrank(nit);
     oq->grank = nexus_iter_globalrank(nit);
+    if (reqring_init(&oq->oqwaitq, 16) != 0) {
+      delete oq;
+      goto err;
+    }
     if (pthread_mutex_init(&oq->oqlock, NULL) != 0) {
+      reqring_destroy(&oq->oqwaitq);
       delete oq;
       goto err;
     }
@@ -739,7 +953,6 @@ static int shuffler_init_outset(struct outset *oset, int maxoqrpc,
     shufzero(&oq->cntoqflushes);
     shufzero(&oq->cntoqflushorder);
 
-    /* waitq init'd by ctor */
     oset->oqs[ha] = oq;    /* map insert, malloc's under the hood */
     mlog(UTIL_D1, "init_outset: add oq=%p rnks=%d.%d addr=%p", oq, oq->grank,
          oq->subrank, ha);
@@ -882,10 +1095,13 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
        rbuftarget);
   mlog(SHUF_CALL, "sndrlimit(l/r)=%d/%d dqmax/th=%d/%d",
        localsenderlimit, remotesenderlimit, deliverq_max, deliverq_threshold);
+  mlog(SHUF_CALL, "dthreads=%d dmaxbatch=%d vcb=%d", shufcfgd.nthreads,
+       shufcfgd.maxbatch, shufcfgd.delivervcb != NULL);
 
   sh = new shuffler;    /* aborts w/std::bad_alloc on failure */
 
-  /* make sure these oqflush_counters are not pointing at garbage */
+  /* make sure these counters are not pointing at garbage */
+  sh->seqsrc = sh->trcnt = NULL;
   sh->local_orq.oqflush_counter = NULL;
   sh->local_rlq.oqflush_counter = NULL;
   sh->remoteq.oqflush_counter = NULL;
@@ -898,6 +1114,7 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
   shufzero(&sh->cntflushwait);
   shufzero(&sh->cntdblock);
   shufzero(&sh->cntdeliver);
+  shufzero(&sh->cntdbatch);
   shufzero(&sh->cntdreqs[0]); shufzero(&sh->cntdreqs[1]);
   shufzero(&sh->cntdwait[0]); shufzero(&sh->cntdwait[1]);
   shufzero(&sh->cntdmaxwait);
@@ -912,6 +1129,11 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
     goto err;
   sh->disablesend = 0;
   sh->boottime = shuftime();
+  sh->trace_every = shufcfg_trace_every;
+  sh->trcnt = acnt32_alloc();
+  if (!sh->trcnt)
+    goto err;
+  memset(sh->trhist, 0, sizeof(sh->trhist));
 
   nit = nexus_iter(nxp, 1);
   if (nit == NULL) goto err;
@@ -950,25 +1172,44 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
   sh->deliverq_max = deliverq_max;
   sh->deliverq_threshold = deliverq_threshold;
   sh->delivercb = delivercb;
+  sh->delivervcb = shufcfgd.delivervcb;
+  sh->dpartcb = shufcfgd.dpartcb;
+  sh->dmaxbatch = shufcfgd.maxbatch;
+  sh->ndthreads = shufcfgd.nthreads;
   if (pthread_mutex_init(&sh->deliverlock, NULL) != 0)
     goto err;
-  if (pthread_cond_init(&sh->delivercv, NULL) != 0) {
-    pthread_mutex_destroy(&sh->deliverlock);
-    goto err;
+  for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+    sh->dthr[lcv].dshuf = sh;
+    sh->dthr[lcv].didx = lcv;
+    sh->dthr[lcv].dflush_counter = 0;
+    sh->dthr[lcv].drunning = 0;
+    if (reqring_init(&sh->dthr[lcv].deliverq,
+                     (deliverq_max > 0) ? deliverq_max : 1) != 0) {
+      shuffler_dthreads_discard(sh, lcv);
+      goto err;
+    }
+    if (reqring_init(&sh->dthr[lcv].dwaitq, 64) != 0) {
+      reqring_destroy(&sh->dthr[lcv].deliverq);
+      shuffler_dthreads_discard(sh, lcv);
+      goto err;
+    }
+    if (pthread_cond_init(&sh->dthr[lcv].delivercv, NULL) != 0) {
+      reqring_destroy(&sh->dthr[lcv].deliverq);
+      reqring_destroy(&sh->dthr[lcv].dwaitq);
+      shuffler_dthreads_discard(sh, lcv);
+      goto err;
+    }
   }
-  sh->dflush_counter = 0;
-  sh->dshutdown = sh->drunning = 0;
+  sh->dshutdown = 0;
 
   if (shuffler_init_flush(sh) != HG_SUCCESS) {
-    pthread_mutex_destroy(&sh->deliverlock);
-    pthread_cond_destroy(&sh->delivercv);
+    shuffler_dthreads_discard(sh, sh->ndthreads);
     goto err;
   }
 
-  /* now start our three worker threads */
+  /* now start our worker threads */
   if (start_threads(sh) != 0) {
-    pthread_mutex_destroy(&sh->deliverlock);
-    pthread_cond_destroy(&sh->delivercv);
+    shuffler_dthreads_discard(sh, sh->ndthreads);
     shuffler_flush_discard(sh);
     goto err;
   }
@@ -981,6 +1222,7 @@ err:
   shuffler_outset_discard(&sh->local_rlq);
   shuffler_outset_discard(&sh->remoteq);
   if (sh->seqsrc) acnt32_free(&sh->seqsrc);
+  if (sh->trcnt) acnt32_free(&sh->trcnt);
   if (sh->funname) free(sh->funname);
   delete sh;
   shuffler_closelog();
@@ -988,23 +1230,45 @@ err:
 }
 
 /*
- * start_threads: attempt to start our three worker threads
+ * shuffler_dthreads_discard: free the delivery thread state that
+ * shuffler_init() set up (after the threads have stopped)
+ *
+ * @param sh the shuffler
+ * @param ninit number of dthreads whose condvar and rings were init'd
+ */
+static void shuffler_dthreads_discard(struct shuffler *sh, int ninit) {
+  int lcv;
+
+  for (lcv = 0 ; lcv < ninit ; lcv++) {
+    pthread_cond_destroy(&sh->dthr[lcv].delivercv);
+    reqring_destroy(&sh->dthr[lcv].deliverq);
+    reqring_destroy(&sh->dthr[lcv].dwaitq);
+  }
+  pthread_mutex_destroy(&sh->deliverlock);
+}
+
+/*
+ * start_threads: attempt to start our worker threads (the delivery
+ * threads, the na+sm thread, and the network thread)
  *
  * @param sh the shuffler we are starting
  * @return 0 on success, -1 on error
  */
 static int start_threads(struct shuffler *sh) {
-  int rv;
+  int rv, lcv;
   mlog(SHUF_CALL, "start_threads called");
 
-  /* start delivery thread */
-  rv = pthread_create(&sh->dtask, NULL, delivery_main, (void *)sh);
-   if (rv != 0) {
-     notify(SHUF_CRIT, "shuffler:start_threads: delivery_main failed");
-     stop_threads(sh);
-     return(-1);
-   }
-   sh->drunning = 1;
+  /* start delivery threads */
+  for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+    rv = pthread_create(&sh->dthr[lcv].dtask, NULL, delivery_main,
+                        (void *)&sh->dthr[lcv]);
+    if (rv != 0) {
+      notify(SHUF_CRIT, "shuffler:start_threads: delivery_main failed");
+      stop_threads(sh);
+      return(-1);
+    }
+    sh->dthr[lcv].drunning = 1;
+  }
 
    /* start local na+sm thread */
   rv = pthread_create(&sh->hgt_local.ntask, NULL,
@@ -1037,7 +1301,7 @@ static int start_threads(struct shuffler *sh) {
  * @param sh shuffler
  */
 static void stop_threads(struct shuffler *sh) {
-  int stranded;
+  int stranded, lcv, dstarted[SHUFFLER_MAXDTHREADS];
   mlog(SHUF_CALL, "stop_threads");
 
   /* stop network */
@@ -1056,16 +1320,20 @@ static void stop_threads(struct shuffler *sh) {
     sh->hgt_local.nshutdown = 0;
   }
 
-  /* stop delivery */
-  if (sh->drunning) {
-    mlog(SHUF_D1, "join delivery");
-    pthread_mutex_lock(&sh->deliverlock);
-    sh->dshutdown = 1;
-    pthread_cond_broadcast(&sh->delivercv);
-    pthread_mutex_unlock(&sh->deliverlock);
-    pthread_join(sh->dtask, NULL);
-    sh->dshutdown = 0;
+  /* stop delivery (threads clear drunning themselves as they exit) */
+  mlog(SHUF_D1, "join delivery");
+  pthread_mutex_lock(&sh->deliverlock);
+  sh->dshutdown = 1;
+  for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+    dstarted[lcv] = sh->dthr[lcv].drunning;
+    pthread_cond_broadcast(&sh->dthr[lcv].delivercv);
   }
+  pthread_mutex_unlock(&sh->deliverlock);
+  for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+    if (dstarted[lcv])
+      pthread_join(sh->dthr[lcv].dtask, NULL);
+  }
+  sh->dshutdown = 0;
 
   /* look for stranded requests and warn about them */
   stranded = purge_reqs(sh);
@@ -1087,26 +1355,35 @@ static void stop_threads(struct shuffler *sh) {
 static int purge_reqs(struct shuffler *sh) {
   int rv = 0;
   struct request *req;
+  struct dthread *dt;
+  int lcv;
   mlog(SHUF_CALL, "purge_reqs");
 
-  if (sh->drunning || sh->hgt_local.nrunning || sh->hgt_remote.nrunning) {
+  for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+    if (sh->dthr[lcv].drunning) {
+      notify(SHUF_CRIT, "ERROR!  purge_reqs called on active system?!!?");
+      abort();   /* should never happen */
+    }
+  }
+  if (sh->hgt_local.nrunning || sh->hgt_remote.nrunning) {
     notify(SHUF_CRIT, "ERROR!  purge_reqs called on active system?!!?");
     abort();   /* should never happen */
   }
 
   /* clear delivery queues */
-  while (!sh->dwaitq.empty()) {
-    req = sh->dwaitq.front();
-    sh->dwaitq.pop_front();
-    parent_dref_stopwait(sh, req->owner, 1);
-    free(req);
-    rv++;
-  }
-  while (!sh->deliverq.empty()) {
-    req = sh->dwaitq.front();
-    sh->dwaitq.pop_front();
-    free(req);
-    rv++;
+  for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+    dt = &sh->dthr[lcv];
+    while (!reqring_empty(&dt->dwaitq)) {
+      req = reqring_pop(&dt->dwaitq);
+      parent_dref_stopwait(sh, req->owner, 1);
+      req_free(req);
+      rv++;
+    }
+    while (!reqring_empty(&dt->deliverq)) {
+      req = reqring_pop(&dt->deliverq);
+      req_free(req);
+      rv++;
+    }
   }
 
   /* clear local and remote queeus */
@@ -1148,17 +1425,16 @@ static int purge_reqs_outset(struct shuffler *sh, struct outset *oset) {
    }
 
    /* zap the wait queue */
-    while (!oq->oqwaitq.empty()) {
-      req = oq->oqwaitq.front();
-      oq->oqwaitq.pop_front();
+    while (!reqring_empty(&oq->oqwaitq)) {
+      req = reqring_pop(&oq->oqwaitq);
       parent_dref_stopwait(sh, req->owner, 1);
-      free(req);
+      req_free(req);
       rv++;
     }
 
     /* now zap the loading requests */
     XSIMPLEQ_FOREACH_SAFE(req, &oq->loading, next, nxt) {
-      free(req);
+      req_free(req);
       rv++;
     }
 
@@ -1171,7 +1447,7 @@ static int purge_reqs_outset(struct shuffler *sh, struct outset *oset) {
        * at any rate.
        */
       HG_Destroy(oput->outhand);
-      free(oput);
+      shufpool_free(oput, sizeof(*oput));
     }
   }
 
@@ -1183,109 +1459,149 @@ static int purge_reqs_outset(struct shuffler *sh, struct outset *oset) {
 }
 
 /*
- * delivery_main: main routine for delivery thread.  the delivery
+ * delivery_main: main routine for a delivery thread.  the delivery
  * thread does final delivery of messages to the application (via
  * the delivery callback).   we need this thread because the final
  * delivery can block (e.g. for flow control) and we don't want to
  * block our network threads because of it (since it would stop
- * traffic that we are a REP for).
+ * traffic that we are a REP for).  we take up to dmaxbatch reqs
+ * off our deliverq per pass so that the lock is taken once per
+ * batch rather than once per req.
  *
- * @param arg void* pointer to our shuffler
+ * @param arg void* pointer to our dthread
  */
 static void *delivery_main(void *arg) {
-  struct shuffler *sh = (struct shuffler *)arg;
+  struct dthread *dt = (struct dthread *)arg;
+  struct shuffler *sh = dt->dshuf;
   struct request *req;
   struct req_parent *parent;
   struct museprobe delivery_use;
-  mlog(DLIV_CALL, "delivery_main running");
+  std::vector<struct request *> batch;
+  std::vector<struct shuffler_msg> msgs;
+  int lcv, n;
+  mlog(DLIV_CALL, "delivery_main %d running", dt->didx);
 
   museprobe_start(&delivery_use, MUSEPROBE_THREAD);
+  batch.reserve(sh->dmaxbatch);
+  if (sh->delivervcb)
+    msgs.resize(sh->dmaxbatch);
 
   pthread_mutex_lock(&sh->deliverlock);
   while (sh->dshutdown == 0) {
-    if (sh->deliverq.empty()) {
+    if (reqring_empty(&dt->deliverq)) {
       mlog(DLIV_D1, "queue empty, blocked");
       shufcount(&sh->cntdblock);
-      (void)pthread_cond_wait(&sh->delivercv, &sh->deliverlock);
+      (void)pthread_cond_wait(&dt->delivercv, &sh->deliverlock);
       mlog(DLIV_D1, "woke up after blocking");
       continue;
     }
 
     /*
-     * start first entry of the queue -- this may block, so unlock
-     * to allow other threads to append to the queues.   note that
-     * this is the only thread that dequeues reqs from deliverq, so
-     * it is safe to leave req at the front while we are running the
-     * callback...
+     * start the first entries of the queue -- this may block, so
+     * unlock to allow other threads to append to the queues.   note
+     * that this is the only thread that dequeues reqs from our deliverq,
+     * so it is safe to leave the batch at the front while we are running
+     * the callback...
      */
-    req = sh->deliverq.front();
-    if (!req) {
+    n = reqring_size(&dt->deliverq);
+    if (n > sh->dmaxbatch) n = sh->dmaxbatch;
+    batch.clear();
+    for (lcv = 0 ; lcv < n ; lcv++) {
+      batch.push_back(reqring_at(&dt->deliverq, lcv));
+    }
+    if (!batch[0]) {
       notify(DLIV_CRIT, "notified with empty deliverq?  not possible");
       abort();   /* shouldn't ever happen */
     }
 
-    shufcount(&sh->cntdeliver);
+    shufadd(&sh->cntdeliver, n);
+    shufcount(&sh->cntdbatch);
     pthread_mutex_unlock(&sh->deliverlock);
-    mlog(DLIV_D1, "deliver %d->%d t=%d, dl=%d req=%p",
-         req->src, req->dst, req->type, req->datalen, req);
+    for (lcv = 0 ; lcv < n ; lcv++) {
+      req = batch[lcv];
+      mlog(DLIV_D1, "deliver %d->%d t=%d, dl=%d req=%p",
+           req->src, req->dst, req->type, req->datalen, req);
+      trace_enter(req, TRS_DELIVER);
+    }
     /* note: may block in callback */
-    sh->delivercb(req->src, req->dst, req->type, req->data, req->datalen);
-    mlog(DLIV_D1, "deliver %p complete", req);
+    if (sh->delivervcb) {
+      for (lcv = 0 ; lcv < n ; lcv++) {
+        req = batch[lcv];
+        msgs[lcv].src = req->src;
+        msgs[lcv].dst = req->dst;
+        msgs[lcv].type = req->type;
+        msgs[lcv].data = req->data;
+        msgs[lcv].datalen = req->datalen;
+      }
+      sh->delivervcb(&msgs[0], n);
+    } else {
+      for (lcv = 0 ; lcv < n ; lcv++) {
+        req = batch[lcv];
+        sh->delivercb(req->src, req->dst, req->type, req->data,
+                      req->datalen);
+      }
+    }
+    mlog(DLIV_D1, "deliver %p (+%d) complete", batch[0], n - 1);
     pthread_mutex_lock(&sh->deliverlock);
 
     /* see if anyone is waiting for us to flush */
-    if (sh->dflush_counter > 0) {
-      sh->dflush_counter--;
-      mlog(DLIV_D1, "drop dflush_counter to %d", sh->dflush_counter);
-      if (sh->dflush_counter == 0) {   /* droped to 0, wake up flusher */
+    if (dt->dflush_counter > 0) {
+      dt->dflush_counter -= (n < dt->dflush_counter) ? n : dt->dflush_counter;
+      mlog(DLIV_D1, "drop dflush_counter to %d", dt->dflush_counter);
+      if (dt->dflush_counter == 0) {   /* droped to 0, wake up flusher */
         if (sh->curflush)
           pthread_cond_signal(&sh->curflush->flush_waitcv);
       }
     }
 
-    /* dispose of the req we just delivered */
-    sh->deliverq.pop_front();
-    if (req->owner)        /* should never happen */
-      notify(DLIV_CRIT, "delivery_main: freeing req with owner!?!");
-    free(req);
+    /* dispose of the reqs we just delivered (hists are locked by us) */
+    for (lcv = 0 ; lcv < n ; lcv++) {
+      req = reqring_pop(&dt->deliverq);
+      trace_done(sh, req);
+      if (req->owner)        /* should never happen */
+        notify(DLIV_CRIT, "delivery_main: freeing req with owner!?!");
+      req_free(req);
+    }
     req = NULL;
 
-    /* just made space in deliveryq, see if we can advance one from waitq */
-    if (sh->dwaitq.empty())
-      continue;                 /* waitq empty, loop back up */
+    /* just made space in deliveryq, see if we can advance some from waitq */
+    for (lcv = 0 ; lcv < n && !reqring_empty(&dt->dwaitq) ; lcv++) {
 
-    /* move it to deliveryq */
-    req = sh->dwaitq.front();
-    sh->dwaitq.pop_front();
-    sh->deliverq.push_back(req); /* deliverq should be full again */
-    mlog(DLIV_D1, "promoted %p from dwaitq", req);
+      /* move it to deliveryq */
+      req = reqring_pop(&dt->dwaitq);
+      reqring_push(&dt->deliverq, req); /* deliverq should be full again */
+      trace_enter(req, TRS_DELIVERQ);
+      mlog(DLIV_D1, "promoted %p from dwaitq", req);
 
-    /*
-     * now we need to tell req's parent it can stop waiting.  since
-     * we are holding the deliver lock (covers the dwaitq) we can
-     * clear the owner to detach the req from the parent.   then
-     * we need to call parent_dref_stopwait() to drop the parent's
-     * reference counter.
-     *
-     * XXX: be safe and drop deliverlock when calling parent_dref_stopwait().
-     * normally parent_dref_stopwait() will just drop the reference count and
-     * if it drops to zero it will call HG_Reply (if parent->input !NULL)
-     * pthread_cond_signal (if parent->input == NULL).  the main worry
-     * is HG_Reply() since that code is external to us and we can't
-     * know what it (or any mercury NA layer under it) will do.
-     */
-    parent = req->owner;
-    req->owner = NULL;
-    pthread_mutex_unlock(&sh->deliverlock);
-    parent_dref_stopwait(sh, parent, 0);
-    pthread_mutex_lock(&sh->deliverlock);
+      /*
+       * now we need to tell req's parent it can stop waiting.  since
+       * we are holding the deliver lock (covers the dwaitq) we can
+       * clear the owner to detach the req from the parent.   then
+       * we need to call parent_dref_stopwait() to drop the parent's
+       * reference counter.
+       *
+       * XXX: be safe and drop deliverlock when calling
+       * parent_dref_stopwait().  normally parent_dref_stopwait() will
+       * just drop the reference count and if it drops to zero it will
+       * call HG_Reply (if parent->input !NULL) pthread_cond_signal (if
+       * parent->input == NULL).  the main worry is HG_Reply() since
+       * that code is external to us and we can't know what it (or any
+       * mercury NA layer under it) will do.
+       */
+      parent = req->owner;
+      req->owner = NULL;
+      pthread_mutex_unlock(&sh->deliverlock);
+      parent_dref_stopwait(sh, parent, 0);
+      pthread_mutex_lock(&sh->deliverlock);
+    }
   }
-  sh->drunning = 0;
+  dt->drunning = 0;
   pthread_mutex_unlock(&sh->deliverlock);
   museprobe_end(&delivery_use);
 
-  mlog(DLIV_CALL, "delivery_main exiting");
-  museprobe_print(&delivery_use, "delivery", -1);
+  mlog(DLIV_CALL, "delivery_main %d exiting", dt->didx);
+  museprobe_print(&delivery_use, "delivery",
+                  (sh->ndthreads > 1) ? dt->didx : -1);
   return(NULL);
 }
 
@@ -1425,14 +1741,9 @@ static hg_return_t shuffler_respond_cb(const struct hg_cb_info *cbi) {
   struct req_parent *parent = (struct req_parent *)cbi->arg;
   mlog(SHUF_CALL, "shuffler_respond_cb parent=%p", parent);
 
-  /*
-   * XXX: if we want to cache a list of free parent structures,
-   * we could do it here...
-   */
-
   HG_Destroy(parent->input);
   acnt32_free(&parent->nrefs);
-  free(parent);
+  shufpool_free(parent, sizeof(*parent));
 
   return(HG_SUCCESS);
 }
@@ -1545,12 +1856,12 @@ static hg_return_t req_parent_init(struct shuffler *sh,
       notify(SHUF_CRIT, "shuffler: req_parent_init usage error");
       return(HG_INVALID_PARAM);  /* should never happen */
     }
-    /* NOTE: we only malloc() parent if input != NULL */
-    parent = (struct req_parent *)malloc(sizeof(*parent));
+    /* NOTE: we only alloc a parent if input != NULL */
+    parent = (struct req_parent *)shufpool_alloc(sizeof(*parent));
     if (parent) {
       parent->nrefs = acnt32_alloc();
       if (parent->nrefs == NULL) {
-        free(parent);
+        shufpool_free(parent, sizeof(*parent));
         parent = NULL;
       }
     }
@@ -1639,7 +1950,7 @@ void drop_reqs(struct request **reqp, struct request_queue *reqq,
       notify(SHUF_CRIT, "drop_reqs: drop %p(o=%d) due to err (%s), data LOST!",
            rp, owned, msg);
     }
-    free(rp);
+    req_free(rp);
     *reqp = NULL;
   }
 
@@ -1651,7 +1962,7 @@ void drop_reqs(struct request **reqp, struct request_queue *reqq,
             "drop_reqs: drop %p(O=%d) due to err (%s) - data LOST!",
              rp, owned, msg);
       }
-      free(rp);
+      req_free(rp);
     }
     XSIMPLEQ_INIT(reqq);
   }
@@ -1732,12 +2043,21 @@ hg_return_t shuffler_send(shuffler_t sh, int dst, uint32_t type,
   struct outset *oset;
   std::map<hg_addr_t, struct outqueue *>::iterator it;
   struct outqueue *oq;
+  size_t trsz;
 
   mlog(CLNT_CALL, "shuffler_send: dst=%d t=%d dl=%d", dst, type, datalen);
 
   /* first, check to see if send is generally disabled */
   if (sh->disablesend)
     return(HG_OTHER_ERROR);
+  if (type & SHUFFLER_TRACE_FLAG)    /* reserved for our wire format */
+    return(HG_INVALID_PARAM);
+
+  /* sample 1 in trace_every reqs for tracing */
+  trsz = 0;
+  if (sh->trace_every > 0 &&
+      (uint32_t)acnt32_incr(sh->trcnt) % sh->trace_every == 0)
+    trsz = sizeof(struct req_trace);
 
   /* determine next hop */
   nexus = nexus_next_hop(sh->nxp, dst, &rank, &dstaddr);
@@ -1755,7 +2075,7 @@ hg_return_t shuffler_send(shuffler_t sh, int dst, uint32_t type,
    * HG_Forward() which takes an unpacked set of requests and packs
    * them all at once... there is no way to incrementally add data).
    */
-  req = (struct request *) malloc(sizeof(*req) + datalen);
+  req = req_alloc(trsz, datalen);
   if (req == NULL) {
     mlog(CLNT_ERR, "shuffler_send: dst=%d dl=%d malloc failed", dst, datalen);
     return(HG_NOMEM_ERROR);
@@ -1767,7 +2087,14 @@ hg_return_t shuffler_send(shuffler_t sh, int dst, uint32_t type,
   req->type = type;
   req->src = sh->grank;
   req->dst = dst;
-  req->data = (char *)req + sizeof(*req);
+  req->trace = NULL;
+  if (trsz) {
+    req->trace = (struct req_trace *)((char *)req + sizeof(*req));
+    memset(req->trace, 0, sizeof(*req->trace));
+    req->trace->tslast = trace_now();
+    req->trace->stage = TRS_NSTAGES;   /* not in a stage yet */
+  }
+  req->data = (char *)req + sizeof(*req) + trsz;
   memcpy(req->data, d, datalen);    /* DATA COPY HERE */
   req->owner = NULL;
   req->next.sqe_next = NULL;        /* to be safe */
@@ -1832,6 +2159,27 @@ hg_return_t shuffler_send(shuffler_t sh, int dst, uint32_t type,
   return(rv);
 }
 
+/*
+ * req_dthread: pick the delivery thread for a req.  reqs with the same
+ * destination partition (or SRC, if we have no partition fn) always
+ * go to the same thread.
+ *
+ * @param sh the shuffler involved
+ * @param req the request being delivered
+ * @return the dthread
+ */
+static struct dthread *req_dthread(struct shuffler *sh, struct request *req) {
+  unsigned int part;
+
+  if (sh->ndthreads == 1)
+    return(&sh->dthr[0]);
+  if (sh->dpartcb)
+    part = sh->dpartcb(req->data, req->datalen);
+  else
+    part = req->src;
+  return(&sh->dthr[part % sh->ndthreads]);
+}
+
 /*
  * req_to_self: sending/forward a req to ourself via the delivery thread.
  *
@@ -1876,6 +2224,7 @@ static hg_return_t req_to_self(struct shuffler *sh, struct request *req,
   int qsize, needwait;
   struct req_parent *parent;
   struct cond_timedwait ctw;
+  struct dthread *dt;
 
   if (rpcin)
     mlog(SHUF_CALL, "req_to_self req=%p, handle=%p R%d-%d", req, input,
@@ -1886,12 +2235,13 @@ static hg_return_t req_to_self(struct shuffler *sh, struct request *req,
   /* this allows delivery to be turned off for debugging... */
   if (sh->deliverq_max < 0) {
     mlog(SHUF_D1, "req_to_self: req=%p discarded (delivery disabled)", req);
-    free(req);
+    req_free(req);
     return(rv);
   }
 
+  dt = req_dthread(sh, req);
   pthread_mutex_lock(&sh->deliverlock);
-  qsize = sh->deliverq.size();
+  qsize = reqring_size(&dt->deliverq);
   needwait = (qsize >= sh->deliverq_max); /* wait if no room in deliverq */
   shufcount(&sh->cntdreqs[input != NULL]);
 
@@ -1899,11 +2249,12 @@ static hg_return_t req_to_self(struct shuffler *sh, struct request *req,
 
     /* easy!  just queue and wake delivery thread (if needed) */
     mlog(SHUF_D1, "req_to_self: deliverq req=%p qsize=%d", req, qsize);
-    sh->deliverq.push_back(req);
+    trace_enter(req, TRS_DELIVERQ);
+    reqring_push(&dt->deliverq, req);
     /* crossed threshold if the queue size before push_back == threshold */
     if (qsize == sh->deliverq_threshold) {
       mlog(SHUF_D1, "req_to_self: need to wake delivery thread");
-      pthread_cond_signal(&sh->delivercv);  /* wake blocked thread */
+      pthread_cond_signal(&dt->delivercv);  /* wake blocked thread */
     }
 
   } else {
@@ -1914,8 +2265,9 @@ static hg_return_t req_to_self(struct shuffler *sh, struct request *req,
 
     if (rv == HG_SUCCESS) {
       mlog(SHUF_D1, "req_to_self: dwaitq! req=%p parent=%p", req, req->owner);
-      sh->dwaitq.push_back(req); /* add req to wait queue */
-      shufmax(&sh->cntdmaxwait, sh->dwaitq.size());
+      trace_enter(req, TRS_DWAITQ);
+      reqring_push(&dt->dwaitq, req); /* add req to wait queue */
+      shufmax(&sh->cntdmaxwait, reqring_size(&dt->dwaitq));
     } else {
       notify(SHUF_CRIT, "shuffler: req_to_self parent init failed (%d)", rv);
       drop_reqs(&req, NULL, "req_to_self"); /* error means we can't send it */
@@ -2000,6 +2352,7 @@ static hg_return_t req_via_mercury(struct shuffler *sh, struct outset *oset,
     mlog(SHUF_CALL, "req_via_mercury: req=%p type=%s rnk=[%d.%d] dst=%p CLI",
          req, outset_typstr(oset->settype), oq->grank, oq->subrank, oq->dst);
 
+  trace_enter(req, trace_oqstage(oset));
   pthread_mutex_lock(&oq->oqlock);
   needwait = (oq->nsending >= oset->maxoqrpc);
   tosend = false;
@@ -2021,8 +2374,8 @@ static hg_return_t req_via_mercury(struct shuffler *sh, struct outset *oset,
     if (rv == HG_SUCCESS) {
       mlog(SHUF_D1, "req_via_mercury: oqwaitq, req=%p, parent=%p",
            req, req->owner);
-      oq->oqwaitq.push_back(req); /* add req to oq's waitq */
-      shufmax(&oq->cntoqmaxwait, oq->oqwaitq.size());
+      reqring_push(&oq->oqwaitq, req); /* add req to oq's waitq */
+      shufmax(&oq->cntoqmaxwait, reqring_size(&oq->oqwaitq));
     } else {
       notify(SHUF_CRIT, "shuffler: req_via_mercury parent init failed (%d)",
               rv);
@@ -2136,7 +2489,7 @@ static bool append_req_to_locked_outqueue(struct outset *oset,
    * structure fails we are in a bad place and discard reqs (so we
    * drop data!).  we complain loudly if we have to do this.
    */
-  newoutput = (struct output *) malloc(sizeof(*newoutput));
+  newoutput = (struct output *) shufpool_alloc(sizeof(*newoutput));
   if (newoutput == NULL) {
     mlog(SHUF_ERR, "append_to_locked malloc failed!  data likely lost!");
     if (flushnow) {
@@ -2247,6 +2600,9 @@ static hg_return_t forward_reqs_now(struct request_queue *tosend,
 
     mlog(SHUF_D1, "forward_now: HG_Forward R%d-%d to [%d.%d] dst=%p cnt=%d",
          in.forwardrank, in.iseq, oq->grank, oq->subrank, oq->dst, cnt);
+    XSIMPLEQ_FOREACH(rp, &in.inreqs, next) {
+      trace_enter(rp, trace_oqstage(oset) + 1);   /* now on the hop */
+    }
     rv = HG_Forward(oput->outhand, forw_cb, oput, &in);   /* SEND HERE! */
 
     if (rv != HG_SUCCESS) {   /* failure to launch, walk back outset_nrpcs */
@@ -2270,7 +2626,7 @@ static hg_return_t forward_reqs_now(struct request_queue *tosend,
 
     /* success!  the data was copied to the handle, so we can free reqs */
     XSIMPLEQ_FOREACH_SAFE(rp, &in.inreqs, next, nrp) {
-      free(rp);
+      req_free(rp);
     }
   }
 
@@ -2416,7 +2772,7 @@ static void forw_start_next(struct outqueue *oq, struct output *oput) {
   XTAILQ_REMOVE(&oq->outs, oput, q);
   mlog(SHUF_D1, "forw_start_next: done with output=%p, oseq=%d",
        oput, oput->outseq);
-  free(oput);
+  shufpool_free(oput, sizeof(*oput));
   oput = NULL;
   if (oq->nsending > 0) oq->nsending--;
   mlog(SHUF_D1, "forw_start_next: dst=%p nsending=%d", oq->dst, oq->nsending);
@@ -2426,9 +2782,8 @@ static void forw_start_next(struct outqueue *oq, struct output *oput) {
   XSIMPLEQ_INIT(&tosendq);   /* to be safe */
   fq = NULL;
   fq_end = &fq;
-  while (!oq->oqwaitq.empty() && tosend == false) {
-    req = oq->oqwaitq.front();
-    oq->oqwaitq.pop_front();
+  while (!reqring_empty(&oq->oqwaitq) && tosend == false) {
+    req = reqring_pop(&oq->oqwaitq);
 
     /* if flushing, see if we pulled the last req of interest */
     if (oq->oqflushing && oq->oqflush_waitcounter > 0) {
@@ -2775,7 +3130,8 @@ static hg_return_t aquire_flush(struct shuffler *sh, struct flush_op *fop,
         (sh->hgt_local.nshutdown  != 0 || sh->hgt_local.nrunning  == 0)) ||
       (type == FLUSH_REMOTEQ &&
         (sh->hgt_remote.nshutdown != 0 || sh->hgt_remote.nrunning == 0)) ||
-      (type == FLUSH_DELIVER && (sh->dshutdown != 0 || sh->drunning == 0)) ) {
+      (type == FLUSH_DELIVER &&
+        (sh->dshutdown != 0 || sh->dthr[0].drunning == 0)) ) {
 
     drop_curflush(sh);
     rv = HG_CANCELED;
@@ -2828,6 +3184,8 @@ hg_return_t shuffler_flush_delivery(shuffler_t sh) {
   struct flush_op fop;
   hg_return_t rv;
   struct cond_timedwait ctw;
+  struct dthread *dt;
+  int cnt, lcv;
   mlog(CLNT_CALL, "shuffler_flush_delivery");
 
   rv = aquire_flush(sh, &fop, FLUSH_DELIVER, NULL);    /* may BLOCK here */
@@ -2836,19 +3194,33 @@ hg_return_t shuffler_flush_delivery(shuffler_t sh) {
   mlog(CLNT_D1, "shuffler_flush_delivery: aquired flush");
 
   /*
-   * we now own the current flush operation, set counter and wait.
-   * counter is dropped after we deliver a req with the callback
-   * and will send us a cond_signal when it drops from 1 to zero.
+   * we now own the current flush operation, set counters and wait.
+   * each dthread's counter is dropped after it delivers reqs with the
+   * callback and it will send us a cond_signal when it drops to zero.
    */
   pthread_mutex_lock(&sh->deliverlock);
-  sh->dflush_counter = sh->deliverq.size() + sh->dwaitq.size();
-  mlog(CLNT_D1, "shuffler_flush_delivery: count=%d", sh->dflush_counter);
+  cnt = 0;
+  for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+    dt = &sh->dthr[lcv];
+    dt->dflush_counter = reqring_size(&dt->deliverq) +
+                         reqring_size(&dt->dwaitq);
+    cnt += dt->dflush_counter;
+  }
+  mlog(CLNT_D1, "shuffler_flush_delivery: count=%d", cnt);
   init_cond_timedwait(&ctw, SHUFFLER_TIMEOUT, 1, "flush_delivery");
-  while (sh->dflush_counter > 0 && fop.status == FLUSHQ_READY) {
-    pthread_cond_signal(&sh->delivercv);  /* flush always wakes thread */
+  while (cnt > 0 && fop.status == FLUSHQ_READY) {
+    for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+      if (sh->dthr[lcv].dflush_counter > 0)  /* flush always wakes thread */
+        pthread_cond_signal(&sh->dthr[lcv].delivercv);
+    }
     do_cond_timedwait(sh, &fop.flush_waitcv, &sh->deliverlock, &ctw); /*BLOCK*/
+    for (cnt = 0, lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+      cnt += sh->dthr[lcv].dflush_counter;
+    }
+  }
+  for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+    sh->dthr[lcv].dflush_counter = 0;
   }
-  sh->dflush_counter = 0;
   pthread_mutex_unlock(&sh->deliverlock);
 
   drop_curflush(sh);
@@ -2988,8 +3360,8 @@ static void start_qflush(struct shuffler *sh, struct outset *oset,
   }
 
   /* first, look for waiting requests in the oq->waitq */
-  if (!oq->oqwaitq.empty()) {
-    oq->oqflush_waitcounter = oq->oqwaitq.size();
+  if (!reqring_empty(&oq->oqwaitq)) {
+    oq->oqflush_waitcounter = reqring_size(&oq->oqwaitq);
     oq->oqflush_output = NULL;   /* to be safe */
     oq->oqflushing = 1;
     acnt32_incr(oset->oqflush_counter);
@@ -3110,8 +3482,8 @@ static void dumpstats(shuffler_t sh) {
   int lcv;
 
   mlog(SHUF_NOTE, "stat counter dump follows");
-  mlog(SHUF_NOTE, "deliver-thread: dblock=%d, delivery=%d", sh->cntdblock,
-       sh->cntdeliver);
+  mlog(SHUF_NOTE, "deliver-thread: dblock=%d, delivery=%d, batches=%d",
+       sh->cntdblock, sh->cntdeliver, sh->cntdbatch);
   mlog(SHUF_NOTE, "deliver: reqs=%d/%d, waits=%d/%d, mxwait=%d",
        sh->cntdreqs[0], sh->cntdreqs[1], sh->cntdwait[0], sh->cntdwait[1],
        sh->cntdmaxwait);
@@ -3180,13 +3552,28 @@ hg_return_t shuffler_recv_stats(shuffler_t sh, hg_uint64_t* local,
   return(HG_SUCCESS);
 }
 
+/*
+ * shuffler_deliver_backlog: number of reqs not yet delivered
+ */
+int shuffler_deliver_backlog(shuffler_t sh) {
+  int lcv, rv;
+
+  rv = 0;
+  pthread_mutex_lock(&sh->deliverlock);
+  for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+    rv += reqring_size(&sh->dthr[lcv].deliverq);
+    rv += reqring_size(&sh->dthr[lcv].dwaitq);
+  }
+  pthread_mutex_unlock(&sh->deliverlock);
+  return(rv);
+}
+
 /*
  * statedump_oset: helper fn for shuffler statedump
  */
 static void statedump_oset(shuffler_t sh, int lvl, const char *name,
   struct outset *oset) {
   std::map<hg_addr_t,struct outqueue *>::iterator oqit;
-  std::deque<request *>::iterator reqit;
   struct request *req;
   struct req_parent *parent;
   struct outqueue *oq;
@@ -3202,14 +3589,14 @@ static void statedump_oset(shuffler_t sh, int lvl, const char *name,
     oq = oqit->second;
     lck_rv = pthread_mutex_trylock(&oq->oqlock);
 
-    ql = oq->oqwaitq.size();
-    notify(lvl, "[%d.%d] waslck=%d, loadsz=%d, nsend=%d, nwait=%d, fl=%d/%d",
+    ql = reqring_size(&oq->oqwaitq);
+    notify(lvl,
+           "[%d.%d] waslck=%d, loadsz=%d, nsend=%d, nwait=%d(hwm=%u), fl=%d/%d",
            oq->grank, oq->subrank, lck_rv != 0, oq->loadsize, oq->nsending,
-           ql, oq->oqflushing, oq->oqflush_waitcounter);
+           ql, oq->oqwaitq.rr_max, oq->oqflushing, oq->oqflush_waitcounter);
 
-    for (idx = 0, reqit = oq->oqwaitq.begin() ;
-         reqit != oq->oqwaitq.end() ; reqit++, idx++) {
-      req = *reqit;
+    for (idx = 0 ; idx < ql ; idx++) {
+      req = reqring_at(&oq->oqwaitq, idx);
       parent = req->owner;
 
       if (parent == NULL) {
@@ -3266,14 +3653,63 @@ static void statedump_oset(shuffler_t sh, int lvl, const char *name,
 
 }
 
+/*
+ * statedump_trace: helper fn for shuffler statedump that reports the
+ * per-stage times of the sampled reqs delivered to us.  the delivery
+ * thread may be adding to the histograms as we read them, so numbers
+ * are approximate.
+ */
+static void statedump_trace(shuffler_t sh, int lvl) {
+  static const char *stnames[TRS_NSTAGES] = {
+    "originq", "originhop", "remoteq", "remotehop", "relayq",
+    "relayhop", "dwaitq", "deliverq", "deliver"
+  };
+  struct trace_hist *h;
+  int lcv;
+
+  if (sh->trace_every <= 0)
+    return;
+  notify(lvl, "trace: 1 in %d, sent=%d, delivered=%lld", sh->trace_every,
+         acnt32_get(sh->trcnt) / sh->trace_every,
+         (long long)sh->trhist[TRS_DELIVER].cnt);
+  for (lcv = 0 ; lcv < TRS_NSTAGES ; lcv++) {
+    h = &sh->trhist[lcv];
+    if (h->cnt == 0)
+      continue;
+    notify(lvl, "trace %s: n=%lld, avg=%.1f, p50=%u, p99=%u, max=%u (usec)",
+           stnames[lcv], (long long)h->cnt, (double)h->sum / h->cnt,
+           trace_ptile(h, 50), trace_ptile(h, 99), h->max);
+  }
+}
+
+/*
+ * statedump_pool: helper fn for shuffler statedump that reports the
+ * request/output pool size classes.  objects are never returned to
+ * malloc, so "created" is the high-water mark of each class.  the
+ * pools are shared by all shufflers in the process.
+ */
+static void statedump_pool(int lvl) {
+  struct shufpool_stat st[SHUFPOOL_NCLASSES];
+  int lcv, nbig;
+
+  shufpool_stats(st, &nbig);
+  for (lcv = 0 ; lcv < SHUFPOOL_NCLASSES ; lcv++) {
+    if (st[lcv].created == 0)
+      continue;
+    notify(lvl, "pool[%zu]: created(hwm)=%d, depot=%d", st[lcv].objsize,
+           st[lcv].created, st[lcv].depot);
+  }
+  notify(lvl, "pool: %d allocs too big for pool (used malloc)", nbig);
+}
+
 /*
  * shuffler_statedump: dump out current state of shuffle for diagnostics
  */
 void shuffler_statedump(shuffler_t sh, int tostderr) {
-  int lvl, lck_rv, qsz, wsz, idx, rtime;
-  std::deque<request *>::iterator reqit;
+  int lvl, lck_rv, qsz, wsz, idx, rtime, lcv;
   struct request *req;
   struct req_parent *parent;
+  struct dthread *dt;
 
   dumpstats(sh);   /* dump stats first */
 
@@ -3284,15 +3720,20 @@ void shuffler_statedump(shuffler_t sh, int tostderr) {
          sh->disablesend, acnt32_get(sh->seqsrc));
 
   lck_rv = pthread_mutex_trylock(&sh->deliverlock);
-  qsz = sh->deliverq.size();
-  wsz = sh->dwaitq.size();
-  notify(lvl, "dlvr: waslck=%d, wait=%d, inprog=%d, flcnt=%d, run/shut=%d/%d",
-         lck_rv != 0, qsz, wsz, sh->dflush_counter,
-         sh->drunning, sh->dshutdown);
-
-  for (idx = 0, reqit = sh->dwaitq.begin() ;
-       reqit != sh->dwaitq.end() ; reqit++, idx++) {
-    req = *reqit;
+  for (lcv = 0 ; lcv < sh->ndthreads ; lcv++) {
+   dt = &sh->dthr[lcv];
+   qsz = reqring_size(&dt->deliverq);
+   wsz = reqring_size(&dt->dwaitq);
+   notify(lvl,
+          "dlvr[%d]: waslck=%d, wait=%d, inprog=%d, flcnt=%d, run/shut=%d/%d",
+          lcv, lck_rv != 0, qsz, wsz, dt->dflush_counter,
+          dt->drunning, sh->dshutdown);
+   notify(lvl, "dlvr[%d]: ring hwm: deliverq=%u/%u, dwaitq=%u/%u", lcv,
+          dt->deliverq.rr_max, dt->deliverq.rr_cap,
+          dt->dwaitq.rr_max, dt->dwaitq.rr_cap);
+
+   for (idx = 0 ; idx < wsz ; idx++) {
+    req = reqring_at(&dt->dwaitq, idx);
     parent = req->owner;
 
     if (parent == NULL) {
@@ -3315,6 +3756,7 @@ void shuffler_statedump(shuffler_t sh, int tostderr) {
                 parent->rpcin_seq, acnt32_get(parent->nrefs),
                 parent->input != NULL, rtime);
 
+   }
   }
 
   if (lck_rv == 0) pthread_mutex_unlock(&sh->deliverlock);
@@ -3324,6 +3766,8 @@ void shuffler_statedump(shuffler_t sh, int tostderr) {
   statedump_oset(sh, lvl, "local_orgin", &sh->local_orq);
   statedump_oset(sh, lvl, "local_relay", &sh->local_rlq);
   statedump_oset(sh, lvl, "remote", &sh->remoteq);
+  statedump_trace(sh, lvl);
+  statedump_pool(lvl);
 }
 
 /*
@@ -3352,6 +3796,8 @@ hg_return_t shuffler_shutdown(shuffler_t sh) {
 
   /* dump counters */
   dumpstats(sh);
+  statedump_trace(sh, SHUF_NOTE);
+  statedump_pool(SHUF_INFO);
 
   /* now free remaining structure */
   shuffler_outset_discard(&sh->local_orq);     /* ensures maps are empty */
@@ -3359,8 +3805,8 @@ hg_return_t shuffler_shutdown(shuffler_t sh) {
   shuffler_outset_discard(&sh->remoteq);
   if (sh->funname) free(sh->funname);
   if (sh->seqsrc) acnt32_free(&sh->seqsrc);
-  pthread_mutex_destroy(&sh->deliverlock);
-  pthread_cond_destroy(&sh->delivercv);
+  if (sh->trcnt) acnt32_free(&sh->trcnt);
+  shuffler_dthreads_discard(sh, sh->ndthreads);
   pthread_mutex_destroy(&sh->flushlock);
   delete sh;
   mlog(CLNT_CALL, "shuffer_shutdown: DONE closing log...");
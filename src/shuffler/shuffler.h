@@ -136,6 +136,34 @@ typedef struct shuffler *shuffler_t;
 typedef void (*shuffler_deliver_t)(int src, int dst, uint32_t type,
                                    void *d, uint32_t datalen);
 
+/*
+ * shuffler_msg: a msg being delivered to the DST by a batch callback.
+ * the data is only valid until the callback returns.
+ */
+struct shuffler_msg {
+  int src;                          /* SRC rank */
+  int dst;                          /* DST rank */
+  uint32_t type;                    /* message type */
+  void *data;                       /* message data */
+  uint32_t datalen;                 /* length of data */
+};
+
+/*
+ * shuffler_deliverv_t: pointer to a callback function used to
+ * deliver a batch of msgs to the DST at once.  like shuffler_deliver_t
+ * it may block if the DST is busy/full.
+ */
+typedef void (*shuffler_deliverv_t)(struct shuffler_msg *msgs, int nmsgs);
+
+/*
+ * shuffler_dpart_t: pointer to a callback function that maps a msg
+ * to a destination partition.  msgs in the same partition are always
+ * delivered by the same delivery thread, in the order they arrive.
+ */
+typedef int (*shuffler_dpart_t)(void *d, uint32_t datalen);
+
+#define SHUFFLER_MAXDTHREADS 16     /* max# of delivery threads */
+
 
 /*
  * shuffler_init: init's the shuffler layer.  if this returns an
@@ -176,7 +204,7 @@ shuffler_t shuffler_init(nexus_ctx_t nxp, char *funname,
  *
  * @param sh shuffler service handle
  * @param dst target to send to
- * @param type message type (normally 0)
+ * @param type message type (normally 0, top bit is reserved)
  * @param d data buffer
  * @param datalen length of data
  * @return status (success if we've queued the data)
@@ -282,6 +310,38 @@ int shuffler_cfglog(int max_xtra_rank, const char *defpri,
                     int alllogs, int msgbufsz, int stderrlog,
                     int xtra_stderrlog);
 
+/*
+ * shuffler_cfgtrace: setup sampled request tracing before starting
+ * the shuffler.  call this before shuffler_init().  one in every
+ * "sample_every" reqs passed to shuffler_send() records the time it
+ * spends in each queue and hop on its way to the DST.  the DST adds
+ * the times to per-stage histograms that shuffler_statedump() reports.
+ *
+ * @param sample_every trace 1 in this many reqs, 0 disables tracing
+ * @return 0 on success, -1 on error
+ */
+int shuffler_cfgtrace(int sample_every);
+
+/*
+ * shuffler_cfgdeliver: setup batched and/or multi-threaded delivery
+ * before starting the shuffler.  call this before shuffler_init().
+ * each delivery thread takes up to "maxbatch" msgs off its queue at
+ * a time and hands them to "delivervcb" (or to the regular delivery
+ * callback one at a time if delivervcb is NULL).  with more than one
+ * thread, msgs are split among threads by "dpartcb" (or by SRC rank if
+ * dpartcb is NULL) and the callbacks must be thread safe.  the default
+ * is one thread delivering one msg at a time.
+ *
+ * @param nthreads number of delivery threads (1 to SHUFFLER_MAXDTHREADS)
+ * @param maxbatch max# of msgs delivered at once
+ * @param delivervcb batch delivery callback (NULL = use per-msg callback)
+ * @param dpartcb msg to destination partition fn (NULL = by SRC rank)
+ * @return 0 on success, -1 on error
+ */
+int shuffler_cfgdeliver(int nthreads, int maxbatch,
+                        shuffler_deliverv_t delivervcb,
+                        shuffler_dpart_t dpartcb);
+
 /*
  * shuffler_send_stats: retrieve shuffle sender statistics
  * @param sh shuffler service handle
@@ -303,6 +363,14 @@ hg_return_t shuffler_send_stats(shuffler_t sh, hg_uint64_t* local_origin,
 hg_return_t shuffler_recv_stats(shuffler_t sh, hg_uint64_t* local,
                                 hg_uint64_t* remote);
 
+/*
+ * shuffler_deliver_backlog: number of reqs received for our local DSTs
+ * but not yet delivered (queued or waiting on all delivery threads)
+ * @param sh shuffler service handle
+ * @return number of reqs
+ */
+int shuffler_deliver_backlog(shuffler_t sh);
+
 
 /*
  * shuffler_statedump: dump out the current state of the shuffle
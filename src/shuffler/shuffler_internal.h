@@ -37,10 +37,11 @@
  * internal data structures for the 3 hop shuffler.
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <time.h>
 
 #include <map>
-#include <deque>
 #include "acnt_wrap.h"
 #include "xqueue.h"
 
@@ -48,11 +49,57 @@ struct req_parent;                  /* forward decl, see below */
 struct outset;                      /* forward decl, see below */
 struct hgthread;                    /* forward decl, see below */
 
+/*
+ * req_trace: per-stage timing for a sampled request.  one in every
+ * "trace_every" requests sent via shuffler_send() carries one of
+ * these from SRC to DST (on the wire we set SHUFFLER_TRACE_FLAG in
+ * the type to mark it).  as the request moves between queues and
+ * hops we charge the time since the last transition to the stage
+ * it was in.  timestamps are wall clock, so the network hop (and
+ * only that hop, since the other stages are measured on a single
+ * node) includes any clock skew between the nodes.
+ */
+#define SHUFFLER_TRACE_FLAG 0x80000000   /* type bit: req has a trace */
+
+#define TRS_ORIGINQ     0           /* SRC: on a local origin output queue */
+#define TRS_ORIGINHOP   1           /* na+sm rpc from SRC */
+#define TRS_REMOTEQ     2           /* SRCREP: on a remote output queue */
+#define TRS_REMOTEHOP   3           /* network rpc SRCREP -> DSTREP */
+#define TRS_RELAYQ      4           /* DSTREP: on a local relay output queue */
+#define TRS_RELAYHOP    5           /* na+sm rpc DSTREP -> DST */
+#define TRS_DWAITQ      6           /* DST: on the delivery wait queue */
+#define TRS_DELIVERQ    7           /* DST: on the delivery queue */
+#define TRS_DELIVER     8           /* DST: in the delivery callback */
+#define TRS_NSTAGES     9           /* number of stages */
+
+struct req_trace {
+  uint64_t tslast;                  /* time (usec) we entered cur stage */
+  uint32_t stage;                   /* current stage */
+  uint32_t seen;                    /* bitmap of stages visited */
+  uint32_t st[TRS_NSTAGES];         /* usecs spent in each stage */
+};
+
+/*
+ * trace_hist: log2 histogram of the time traced requests spent in
+ * a stage.  b[0] counts zero usec samples, b[i] counts samples in
+ * the range [2^(i-1), 2^i) usec.
+ */
+#define TRH_NBUCKETS 33             /* enough for any uint32_t */
+
+struct trace_hist {
+  uint64_t cnt;                     /* number of samples */
+  uint64_t sum;                     /* total usecs */
+  uint32_t max;                     /* largest sample */
+  uint64_t b[TRH_NBUCKETS];         /* buckets */
+};
+
 /*
  * request: a structure to describe a single write request.
  * it has a fixed sized header (first four fields), and a
  * variable length data buffer.   we always allocate the header
  * and the data together.   data will be null if datalen == 0.
+ * sampled requests also carry a req_trace, which is allocated
+ * between the header and the data.
  */
 struct request {
   /* fields that are transmitted over the wire */
@@ -60,6 +107,7 @@ struct request {
   uint32_t type;                    /* message type (0=normal) */
   int32_t src;                      /* SRC rank */
   int32_t dst;                      /* DST rank */
+  struct req_trace *trace;          /* timing (sampled reqs only, or NULL) */
   void *data;                       /* request data */
 
   /* internal fields (not sent over the wire) */
@@ -78,6 +126,102 @@ struct request {
  */
 XSIMPLEQ_HEAD(request_queue, request);
 
+/*
+ * reqring: a ring buffer of request pointers, used for our wait and
+ * delivery queues.   the ring starts out with a fixed capacity sized
+ * for the expected load, and only doubles (a rare realloc) if it fills,
+ * so steady-state queueing does not allocate memory.   the owner of the
+ * ring provides locking.
+ */
+struct reqring {
+  struct request **rr_buf;          /* the ring (rr_cap slots) */
+  uint32_t rr_cap;                  /* capacity (a power of 2) */
+  uint32_t rr_head;                 /* index of the front */
+  uint32_t rr_cnt;                  /* #of reqs in the ring */
+  uint32_t rr_max;                  /* high-water mark of rr_cnt */
+};
+
+/*
+ * reqring_init: init a ring with at least a given capacity
+ *
+ * @param rr the ring
+ * @param cap the initial capacity
+ * @return 0 on success, -1 on malloc failure
+ */
+static inline int reqring_init(struct reqring *rr, uint32_t cap) {
+  rr->rr_cap = 1;
+  while (rr->rr_cap < cap) rr->rr_cap <<= 1;
+  rr->rr_buf = (struct request **)malloc(rr->rr_cap * sizeof(*rr->rr_buf));
+  rr->rr_head = rr->rr_cnt = rr->rr_max = 0;
+  return((rr->rr_buf) ? 0 : -1);
+}
+
+/*
+ * reqring_destroy: free a ring's memory (reqs in the ring are not freed)
+ *
+ * @param rr the ring
+ */
+static inline void reqring_destroy(struct reqring *rr) {
+  free(rr->rr_buf);
+  rr->rr_buf = NULL;
+  rr->rr_cap = rr->rr_cnt = 0;
+}
+
+static inline uint32_t reqring_size(struct reqring *rr) {
+  return(rr->rr_cnt);
+}
+
+static inline bool reqring_empty(struct reqring *rr) {
+  return(rr->rr_cnt == 0);
+}
+
+/* reqring_at: the i'th req from the front (i < size) */
+static inline struct request *reqring_at(struct reqring *rr, uint32_t i) {
+  return(rr->rr_buf[(rr->rr_head + i) & (rr->rr_cap - 1)]);
+}
+
+static inline struct request *reqring_front(struct reqring *rr) {
+  return(rr->rr_buf[rr->rr_head]);
+}
+
+/* reqring_pop: remove and return the front req (ring must not be empty) */
+static inline struct request *reqring_pop(struct reqring *rr) {
+  struct request *req = rr->rr_buf[rr->rr_head];
+  rr->rr_head = (rr->rr_head + 1) & (rr->rr_cap - 1);
+  rr->rr_cnt--;
+  return(req);
+}
+
+/*
+ * reqring_push: add a req to the back of the ring, growing it if full.
+ * like "new" we abort if we run out of memory.
+ *
+ * @param rr the ring
+ * @param req the request to add
+ */
+static inline void reqring_push(struct reqring *rr, struct request *req) {
+  struct request **nbuf;
+  uint32_t lcv;
+
+  if (rr->rr_cnt == rr->rr_cap) {
+    nbuf = (struct request **)malloc(2 * rr->rr_cap * sizeof(*nbuf));
+    if (nbuf == NULL) {
+      fprintf(stderr, "reqring_push: out of memory\n");
+      abort();
+    }
+    for (lcv = 0 ; lcv < rr->rr_cnt ; lcv++) {
+      nbuf[lcv] = reqring_at(rr, lcv);
+    }
+    free(rr->rr_buf);
+    rr->rr_buf = nbuf;
+    rr->rr_head = 0;
+    rr->rr_cap *= 2;
+  }
+  rr->rr_buf[(rr->rr_head + rr->rr_cnt) & (rr->rr_cap - 1)] = req;
+  rr->rr_cnt++;
+  if (rr->rr_cnt > rr->rr_max) rr->rr_max = rr->rr_cnt;
+}
+
 /*
  * rpcin_t: a batch of requests (top-level RPC request structure).
  * when we serialize this, we add a request with datalen/type=zero
@@ -175,7 +319,7 @@ struct outqueue {
   struct sending_outputs outs;      /* outputs currently being sent to dst */
   int nsending;                     /* #of outputs alloc'd for dst */
 
-  std::deque<request *> oqwaitq;    /* if queue full, waitq of reqs */
+  struct reqring oqwaitq;           /* if queue full, waitq of reqs */
 
   /* fields for flushing an output queue */
   int oqflushing;                   /* 1 if oq is flushing */
@@ -283,6 +427,23 @@ struct hgthread {
 #endif
 };
 
+/*
+ * dthread: state for a delivery thread and the queues it delivers
+ * from.  when we have more than one, reqs are split among them by
+ * destination partition (see shuffler_cfgdeliver()).  all fields
+ * other than the config ones are locked by the shuffler's deliverlock.
+ */
+struct dthread {
+  struct shuffler *dshuf;           /* shuffler that owns us */
+  int didx;                         /* our index in dthr[] */
+  pthread_cond_t delivercv;         /* deliver thread blocks on this */
+  struct reqring deliverq;          /* acked reqs being delivered */
+  struct reqring dwaitq;            /* unacked reqs waiting for deliver */
+  int dflush_counter;               /* #of req's flush is waiting for */
+  int drunning;                     /* dtask is valid and running */
+  pthread_t dtask;                  /* delivery thread */
+};
+
 /*
  * shuffler: top-level shuffler structure
  */
@@ -305,20 +466,19 @@ struct shuffler {
   struct outset remoteq;            /* for network to remote nodes */
   acnt32_t seqsrc;                  /* source for seq# */
 
-  /* delivery queue cfg */
+  /* delivery queue cfg (the queue limits apply to each dthread) */
   int deliverq_max;                 /* max #reqs we queue before blocking */
   int deliverq_threshold;           /* wake dlvr when #reqs on q > threshold */
   shuffler_deliver_t delivercb;     /* callback function ptr */
+  shuffler_deliverv_t delivervcb;   /* batch callback function ptr (opt) */
+  shuffler_dpart_t dpartcb;         /* maps a req to a partition (opt) */
+  int dmaxbatch;                    /* max #reqs delivered at once */
+  int ndthreads;                    /* number of delivery threads */
 
-  /* delivery thread and queue itself */
+  /* delivery threads and queues themselves */
   pthread_mutex_t deliverlock;      /* locks this block of fields */
-  pthread_cond_t delivercv;         /* deliver thread blocks on this */
-  std::deque<request *> deliverq;   /* acked reqs being delivered */
-  std::deque<request *> dwaitq;     /* unacked reqs waiting for deliver */
-  int dflush_counter;               /* #of req's flush is waiting for */
-  int dshutdown;                    /* to signal dtask to shutdown */
-  int drunning;                     /* dtask is valid and running */
-  pthread_t dtask;                  /* delivery thread */
+  struct dthread dthr[SHUFFLER_MAXDTHREADS];  /* delivery threads */
+  int dshutdown;                    /* to signal dtasks to shutdown */
 
   /* flush operation management - flush ops are serialized */
   pthread_mutex_t flushlock;        /* locks the following fields */
@@ -342,7 +502,8 @@ struct shuffler {
 
   /* lock by deliverlock */
   int cntdblock;                    /* number of times deliver blocks */
-  int cntdeliver;                   /* number of times delivery cb called */
+  int cntdeliver;                   /* number of reqs delivered */
+  int cntdbatch;                    /* number of batches delivered */
   int cntdreqs[2];                  /* number of reqs input */
   int cntdwait[2];                  /* number of reqs on delivery wait q*/
   unsigned int cntdmaxwait;         /* max waitq size */
@@ -354,4 +515,9 @@ struct shuffler {
   int cntstranded;                  /* number of stranded reqs (@shutdown) */
 #endif
 
+  /* sampled tracing (hists locked by deliverlock) */
+  int trace_every;                  /* trace 1 in N sent reqs, 0=off */
+  acnt32_t trcnt;                   /* count of sent reqs for sampling */
+  struct trace_hist trhist[TRS_NSTAGES];  /* per-stage times at DST */
+
 };
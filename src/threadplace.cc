@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "threadplace.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef PRELOAD_HAS_NUMA
+#include <numa.h>
+#endif
+
+#define TPLACE_MAXSLOTS 256
+
+namespace {
+const char* const class_names[TPLACE_NCLASSES] = {"bg", "rpc", "shuf",
+                                                  "comp"};
+
+struct tplace_class {
+  int first;       /* index of the first slot (-1 if not placed) */
+  int nslots;      /* num of slots after the first */
+  int node;        /* numa node (-1 if unknown or mixed) */
+  unsigned int rr; /* next slot to hand out */
+  std::string where;
+};
+
+cpu_set_t slots[TPLACE_MAXSLOTS];
+int slotcpu[TPLACE_MAXSLOTS]; /* -1 if a slot is a whole node */
+int nslots = 0;
+tplace_class classes[TPLACE_NCLASSES] = {
+    {-1, 0, -1, 0, ""}, {-1, 0, -1, 0, ""}, {-1, 0, -1, 0, ""},
+    {-1, 0, -1, 0, ""}};
+__thread int cur_class = -1;
+
+int cpu_node(int cpu) {
+#ifdef PRELOAD_HAS_NUMA
+  if (numa_available() != -1) return numa_node_of_cpu(cpu);
+#endif
+  return -1;
+}
+
+/* fill set with the allowed cpus of a numa node. return 0 on success. */
+int node_cpus(int node, const cpu_set_t* allowed, cpu_set_t* set) {
+  CPU_ZERO(set);
+#ifdef PRELOAD_HAS_NUMA
+  if (numa_available() == -1 || node < 0 || node > numa_max_node())
+    return -1;
+  struct bitmask* bits = numa_allocate_cpumask();
+  int r = numa_node_to_cpus(node, bits);
+  if (r == 0) {
+    for (unsigned int i = 0; i < bits->size && i < CPU_SETSIZE; i++) {
+      if (numa_bitmask_isbitset(bits, i) && CPU_ISSET(i, allowed)) {
+        CPU_SET(i, set);
+      }
+    }
+  }
+  numa_free_cpumask(bits);
+  if (r != 0 || CPU_COUNT(set) == 0) return -1;
+  return 0;
+#else
+  return -1;
+#endif
+}
+
+/* parse a cpu list such as "1,4-7" into slots of a class */
+int parse_cpus(const char* s, const cpu_set_t* allowed, tplace_class* c) {
+  char* end;
+  long a, b;
+  int node;
+
+  node = -2;
+  while (*s != 0) {
+    a = strtol(s, &end, 10);
+    if (end == s || a < 0 || a >= CPU_SETSIZE) return -1;
+    b = a;
+    s = end;
+    if (*s == '-') {
+      s++;
+      b = strtol(s, &end, 10);
+      if (end == s || b < a || b >= CPU_SETSIZE) return -1;
+      s = end;
+    }
+    for (long i = a; i <= b; i++) {
+      if (!CPU_ISSET(i, allowed) || nslots >= TPLACE_MAXSLOTS) return -1;
+      CPU_ZERO(&slots[nslots]);
+      CPU_SET(i, &slots[nslots]);
+      slotcpu[nslots] = int(i);
+      nslots++;
+      c->nslots++;
+      if (node == -2) {
+        node = cpu_node(int(i));
+      } else if (node != cpu_node(int(i))) {
+        node = -1;
+      }
+    }
+    if (*s == ',') {
+      s++;
+    } else if (*s != 0) {
+      return -1;
+    }
+  }
+
+  c->node = (node >= 0) ? node : -1;
+  return (c->nslots != 0) ? 0 : -1;
+}
+
+/* parse one "class=where" item */
+int parse_item(const std::string& item, const cpu_set_t* allowed) {
+  size_t eq;
+  char* end;
+  long node;
+  int cls;
+
+  eq = item.find('=');
+  if (eq == std::string::npos) return -1;
+  for (cls = 0; cls < TPLACE_NCLASSES; cls++) {
+    if (item.compare(0, eq, class_names[cls]) == 0) break;
+  }
+  if (cls == TPLACE_NCLASSES || classes[cls].first != -1) return -1;
+  tplace_class* const c = &classes[cls];
+  const char* where = item.c_str() + eq + 1;
+  c->first = nslots;
+  c->where = where;
+
+  if (where[0] == 'n') {
+    node = strtol(where + 1, &end, 10);
+    if (end == where + 1 || *end != 0 || nslots >= TPLACE_MAXSLOTS) return -1;
+    if (node_cpus(int(node), allowed, &slots[nslots]) != 0) return -1;
+    slotcpu[nslots] = -1;
+    nslots++;
+    c->nslots = 1;
+    c->node = int(node);
+    return 0;
+  }
+
+  return parse_cpus(where, allowed, c);
+}
+
+}  // namespace
+
+int tplace_init(const char* spec) {
+  cpu_set_t allowed;
+  std::string s;
+  size_t pos, semi;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+    return -1;
+  }
+
+  s = spec;
+  pos = 0;
+  while (pos < s.size()) {
+    semi = s.find(';', pos);
+    if (semi == std::string::npos) semi = s.size();
+    if (semi > pos && parse_item(s.substr(pos, semi - pos), &allowed) != 0) {
+      return -1;
+    }
+    pos = semi + 1;
+  }
+
+  return 0;
+}
+
+int tplace_enabled(int cls) { return classes[cls].first != -1; }
+
+const char* tplace_name(int cls) {
+  if (cls < 0 || cls >= TPLACE_NCLASSES) return "other";
+  return class_names[cls];
+}
+
+int tplace_scope(int cls) {
+  int prev = cur_class;
+  cur_class = cls;
+  return prev;
+}
+
+int tplace_current() { return cur_class; }
+
+int tplace_pick(int cls, char* desc, size_t descsz) {
+  tplace_class* const c = &classes[cls];
+  int slot;
+
+  if (c->first == -1) return -1;
+  slot = c->first + int(__sync_fetch_and_add(&c->rr, 1) % c->nslots);
+  if (slotcpu[slot] == -1) {
+    snprintf(desc, descsz, "%s@%s", class_names[cls], c->where.c_str());
+  } else {
+    snprintf(desc, descsz, "%s@cpu%d", class_names[cls], slotcpu[slot]);
+  }
+
+  return slot;
+}
+
+int tplace_apply(pthread_t thread, int slot) {
+  return pthread_setaffinity_np(thread, sizeof(slots[slot]), &slots[slot]);
+}
+
+int tplace_node(int cls) {
+  return (classes[cls].first != -1) ? classes[cls].node : -1;
+}
+
+void* tplace_alloc(size_t sz, int cls) {
+  int node;
+  void* p;
+
+  node = tplace_node(cls);
+  if (node < 0) return malloc(sz);
+
+  /* must be page aligned for the binding to cover the entire buffer */
+  if (posix_memalign(&p, size_t(getpagesize()), sz) != 0) return NULL;
+#ifdef PRELOAD_HAS_NUMA
+  numa_tonode_memory(p, sz, node);
+#endif
+  return p;
+}
+
+std::string tplace_summary() {
+  std::string result;
+  char tmp[100];
+
+  for (int cls = 0; cls < TPLACE_NCLASSES; cls++) {
+    const tplace_class* const c = &classes[cls];
+    if (c->first == -1) continue;
+    if (!result.empty()) result += ", ";
+    snprintf(tmp, sizeof(tmp), "%s@%s (%d slot%s, node %d)", class_names[cls],
+             c->where.c_str(), c->nslots, c->nslots != 1 ? "s" : "", c->node);
+    result += tmp;
+  }
+
+  return result.empty() ? "none" : result;
+}
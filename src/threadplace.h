@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+
+#include <string>
+
+/*
+ * threadplace: pin classes of background threads to cpus or numa nodes.
+ * the policy is a spec string of "class=where" items separated by ';',
+ * for example "bg=n0;rpc=4-7;shuf=n1;comp=8,9". "nX" lets the threads of
+ * a class run on any allowed cpu of numa node X. a cpu list pins the
+ * threads of a class round-robin, one cpu per thread. classes not named
+ * in the spec are left alone.
+ *
+ * a thread declares the class of the threads it is about to create with
+ * tplace_scope(). our pthread_create() wrapper then picks a slot for the
+ * new thread with tplace_pick() and pins it with tplace_apply().
+ */
+enum {
+  TPLACE_BG = 0, /* mercury progress loop (bg_work) */
+  TPLACE_RPC,    /* rpc workers (rpc_work) */
+  TPLACE_SHUF,   /* 3-hop shuffler network and delivery threads */
+  TPLACE_COMP,   /* deltafs memtable compaction pool */
+  TPLACE_NCLASSES
+};
+
+/* parse a placement spec. return 0 on success, or -1 if the spec is bad
+ * or names cpus we are not allowed to run on. */
+int tplace_init(const char* spec);
+
+/* return non-zero if the given class has a placement */
+int tplace_enabled(int cls);
+
+/* short name of a class as used in specs (e.g. "rpc") */
+const char* tplace_name(int cls);
+
+/* set the class of threads subsequently created by the calling thread
+ * (-1 for none). return the previous class so scopes may be nested. */
+int tplace_scope(int cls);
+int tplace_current();
+
+/* choose a slot for a new thread of the given class and describe it in
+ * desc (e.g. "rpc@cpu5"). return the slot or -1 if the class has no
+ * placement. */
+int tplace_pick(int cls, char* desc, size_t descsz);
+
+/* pin a thread to a slot. return 0 on success, or an errno on error. */
+int tplace_apply(pthread_t thread, int slot);
+
+/* numa node of a class, or -1 if unknown or the class is not placed */
+int tplace_node(int cls);
+
+/* allocate memory that is bound to the numa node of a class (or plain
+ * memory if the class has no node). release with free(). */
+void* tplace_alloc(size_t sz, int cls);
+
+/* describe the placement policy for logging */
+std::string tplace_summary();
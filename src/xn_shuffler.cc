@@ -34,8 +34,12 @@
 #include "common.h"
 #include "nn_shuffler.h"
 #include "nn_shuffler_internal.h"
+#include "threadplace.h"
 #include "xn_shuffler.h"
 
+#include <algorithm>
+#include <vector>
+
 /* xn_local_barrier: perform a barrier across all node-local ranks. */
 void xn_local_barrier(xn_ctx_t* ctx) {
   nexus_ret_t nret;
@@ -110,6 +114,54 @@ static void xn_shuffler_deliver(int src, int dst, uint32_t type, void* buf,
   }
 }
 
+/* buffer each delivery thread unpacks writes into. it is grown to fit the
+ * largest batch seen and is freed when the thread exits */
+static thread_local std::vector<char> dbuf;
+
+/* deliver a batch of writes with as few plfsdir lane round trips as we can:
+ * writes are unpacked back to back and each run of writes from the same
+ * sender is handed to the shuffle layer at once */
+static void xn_shuffler_deliverv(struct shuffler_msg* msgs, int nmsgs) {
+  shuffle_ctx_t* const ctx = &pctx.sctx;
+  const unsigned int req_sz =
+      ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1;
+  char* buf;
+  int rv;
+  int i;
+  int j;
+
+  if (size_t(req_sz) * nmsgs > dbuf.size()) {
+    dbuf.resize(size_t(req_sz) * nmsgs);
+  }
+  buf = &dbuf[0];
+  for (i = 0; i < nmsgs; i++) {
+    shuffle_msg_restore(ctx, static_cast<char*>(msgs[i].data),
+                        msgs[i].datalen, &buf[size_t(i) * req_sz]);
+  }
+  for (i = 0; i < nmsgs; i = j) {
+    j = i + 1;
+    while (j < nmsgs && msgs[j].src == msgs[i].src) j++;
+    rv = shuffle_handle_batch(NULL, &buf[size_t(i) * req_sz], req_sz, req_sz,
+                              j - i, -1, msgs[i].src, msgs[i].dst);
+    if (rv != 0) {
+      ABORT("plfsdir write failed");
+    }
+  }
+}
+
+/* map a write to its destination partition. this matches the write lane of
+ * the write when the number of delivery threads equals the number of lanes,
+ * so that delivery threads never contend for a lane. there are never more
+ * threads than lanes, so plfsdir (a single lane) gets 1 thread. the lane
+ * hash is seeded apart from the placement hash, whose bits are the same for
+ * all writes delivered to us */
+static int xn_shuffler_dpart(void* buf, uint32_t buf_sz) {
+  const unsigned char fname_len = pctx.sctx.fname_len;
+  if (buf_sz < fname_len) ABORT("unexpected incoming shuffle request size");
+  return int(preload_lane_hash(static_cast<char*>(buf), fname_len) &
+             0x7fffffff);
+}
+
 void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, unsigned char buf_sz,
                          int epoch, int dst, int src) {
   hg_return_t hret;
@@ -121,6 +173,22 @@ void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, unsigned char buf_sz,
   }
 }
 
+/* the 3-hop shuffler applies flow control on a per-request basis so we simply
+ * send each write in turn. since writes are grouped by destination they will
+ * land in the same output queue back to back. */
+void xn_shuffler_enqueue_batch(xn_ctx_t* ctx, char* bufs, unsigned char buf_sz,
+                               int num_bufs, int epoch, int dst, int src) {
+  hg_return_t hret;
+  assert(ctx->sh != NULL);
+  for (int i = 0; i < num_bufs; i++) {
+    hret = shuffler_send(ctx->sh, dst, 0, bufs, buf_sz);
+    if (hret != HG_SUCCESS) {
+      RPC_FAILED("plfsdir shuffler send failed", hret);
+    }
+    bufs += buf_sz;
+  }
+}
+
 void xn_shuffler_init(xn_ctx_t* ctx) {
   int deliverq_min;
   int deliverq_max;
@@ -132,10 +200,15 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
   int rmaxrpc;
   int rbuftarget;
   int rsenderlimit;
+  int buftarget;
+  int trace_every;
+  int dthreads;
+  int dbatch;
   const char* logfile;
   const char* env;
   char msg[5000];
   char uri[100];
+  int pcls;
   int n;
 
   assert(ctx != NULL);
@@ -202,9 +275,21 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
     }
   }
 
+  /* with a memory budget, queues without their own targets split the
+   * send queue share evenly, assuming up to two buffers per peer */
+  buftarget = DEFAULT_BUFFER_PER_QUEUE;
+  if (pctx.mb.total != 0) {
+    buftarget = int(std::min(
+        pctx.mb.share[MB_QUEUES] / (2 * size_t(pctx.comm_sz)),
+        size_t(MAX_RPC_MESSAGE)));
+    if (buftarget < 24) {
+      buftarget = 24;
+    }
+  }
+
   env = maybe_getenv("SHUFFLE_Relay_buftarget");
   if (env == NULL) {
-    lrbuftarget = DEFAULT_BUFFER_PER_QUEUE;
+    lrbuftarget = buftarget;
   } else {
     lrbuftarget = atoi(env);
     if (lrbuftarget < 24) {
@@ -214,7 +299,7 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
 
   env = maybe_getenv("SHUFFLE_Local_buftarget");
   if (env == NULL) {
-    lobuftarget = DEFAULT_BUFFER_PER_QUEUE;
+    lobuftarget = buftarget;
   } else {
     lobuftarget = atoi(env);
     if (lobuftarget < 24) {
@@ -224,7 +309,7 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
 
   env = maybe_getenv("SHUFFLE_Remote_buftarget");
   if (env == NULL) {
-    rbuftarget = DEFAULT_BUFFER_PER_QUEUE;
+    rbuftarget = buftarget;
   } else {
     rbuftarget = atoi(env);
     if (rbuftarget < 24) {
@@ -245,6 +330,17 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
   env = maybe_getenv("SHUFFLE_Dq_max");
   if (env == NULL) {
     deliverq_max = DEFAULT_DELIVER_MAX;
+    /* one delivery queue entry holds one shuffled write */
+    if (pctx.mb.total != 0) {
+      deliverq_max = int(std::min(
+          pctx.mb.share[MB_DELIVERY] /
+              (size_t(pctx.particle_id_size) + pctx.particle_size +
+               pctx.particle_extra_size + 64),
+          size_t(1 << 20)));
+      if (deliverq_max < 1) {
+        deliverq_max = 1;
+      }
+    }
   } else {
     deliverq_max = atoi(env);
     if (deliverq_max <= 0) {
@@ -252,26 +348,94 @@ void xn_shuffler_init(xn_ctx_t* ctx) {
     }
   }
 
+  env = maybe_getenv("SHUFFLE_Trace_every");
+  if (env == NULL) {
+    trace_every = 0;
+  } else {
+    trace_every = atoi(env);
+    if (trace_every < 0) {
+      trace_every = 0;
+    }
+  }
+  shuffler_cfgtrace(trace_every);
+
+  env = maybe_getenv("SHUFFLE_Dthreads");
+  if (env == NULL) {
+    dthreads = 1;
+  } else {
+    dthreads = atoi(env);
+    if (dthreads < 1) {
+      dthreads = 1;
+    } else if (dthreads > SHUFFLER_MAXDTHREADS) {
+      dthreads = SHUFFLER_MAXDTHREADS;
+    }
+  }
+  if (dthreads > pctx.nlanes) { /* extra threads would share a lane */
+    if (pctx.my_rank == 0) {
+      snprintf(msg, sizeof(msg),
+               "delivery threads capped at %d (was %d)\n>>> no more "
+               "threads than write lanes; with plfsdir all writes share 1 "
+               "lane",
+               pctx.nlanes, dthreads);
+      WARN(msg);
+    }
+    dthreads = pctx.nlanes;
+  }
+
+  env = maybe_getenv("SHUFFLE_Dbatch");
+  if (env == NULL) {
+    dbatch = 1;
+  } else {
+    dbatch = atoi(env);
+    if (dbatch < 1) {
+      dbatch = 1;
+    }
+  }
+
+  if (dthreads > 1 || dbatch > 1) {
+    shuffler_cfgdeliver(dthreads, dbatch,
+                        dbatch > 1 ? xn_shuffler_deliverv : NULL,
+                        xn_shuffler_dpart);
+  }
+
   logfile = maybe_getenv("SHUFFLE_Log_file");
 #define DEF_CFGLOG_ARGS(log) -1, "INFO", "WARN", NULL, NULL, log, 1, 0, 0, 0
   if (logfile != NULL && logfile[0] != 0 && strcmp(logfile, "/") != 0) {
     shuffler_cfglog(DEF_CFGLOG_ARGS(logfile));
   }
 
+  /* shuffler_init() starts the network and delivery threads */
+  pcls = tplace_scope(TPLACE_SHUF);
   ctx->sh = shuffler_init(ctx->nx, const_cast<char*>("shuffle_rpc_write"),
                           lsenderlimit, rsenderlimit, lomaxrpc, lobuftarget,
                           lrmaxrpc, lrbuftarget, rmaxrpc, rbuftarget,
                           deliverq_max, deliverq_min, xn_shuffler_deliver);
+  tplace_scope(pcls);
 
   if (ctx->sh == NULL) {
     ABORT("shuffler_init");
-  } else if (pctx.my_rank == 0) {
+  }
+
+  /* xn queues are sized once here and are not adjusted later */
+  if (pctx.mb.total != 0) {
+    pctx.mb.used[MB_QUEUES] =
+        size_t(pctx.comm_sz) * 2 *
+        std::max(lobuftarget, std::max(lrbuftarget, rbuftarget));
+    pctx.mb.used[MB_DELIVERY] =
+        size_t(std::max(deliverq_max, 0)) *
+        (size_t(pctx.particle_id_size) + pctx.particle_size +
+         pctx.particle_extra_size + 64);
+  }
+
+  if (pctx.my_rank == 0) {
     n = snprintf(
         msg, sizeof(msg),
         "3-HOP confs: senderlimit(l/r)=%d/%d, maxrpc(lo/lr/r)=%d/%d/%d, "
-        "buftgt(lo/lr/r)=%d/%d/%d, dq(min/max)=%d/%d",
+        "buftgt(lo/lr/r)=%d/%d/%d, dq(min/max)=%d/%d, trace=1/%d, "
+        "dthreads=%d, dbatch=%d",
         lsenderlimit, rsenderlimit, lomaxrpc, lrmaxrpc, rmaxrpc, lobuftarget,
-        lrbuftarget, rbuftarget, deliverq_min, deliverq_max);
+        lrbuftarget, rbuftarget, deliverq_min, deliverq_max, trace_every,
+        dthreads, dbatch);
     if (logfile != NULL && logfile[0] != 0) {
       snprintf(msg + n, sizeof(msg) - n,
                "\n>>> LOGGING is ON, will log to ..."
@@ -305,6 +469,12 @@ int xn_shuffler_my_rank(xn_ctx_t* ctx) {
   return rv;
 }
 
+int xn_shuffler_backlog(xn_ctx_t* ctx) {
+  assert(ctx != NULL);
+  assert(ctx->sh != NULL);
+  return shuffler_deliver_backlog(ctx->sh);
+}
+
 void xn_shuffler_destroy(xn_ctx_t* ctx) {
   if (ctx != NULL) {
     if (ctx->sh != NULL) {
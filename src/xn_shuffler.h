@@ -41,16 +41,19 @@
  *    Total num of outstanding rpcs for the remote hop
  *  SHUFFLE_Remote_buftarget
  *    Memory allocated for each remote rpc queue
+ *      (derived from PRELOAD_Memory_budget when not set)
  *  SHUFFLE_Remote_maxrpc
  *    Max num of outstanding rpcs allowed for each remote outgoing queue
  *  SHUFFLE_Local_senderlimit
  *    Total num of outstanding rpcs for the local hops
  *  SHUFFLE_Local_buftarget
  *    Memory allocated for each local rpc queue
+ *      (derived from PRELOAD_Memory_budget when not set)
  *  SHUFFLE_Local_maxrpc
  *    Max num of outstanding rpcs allowed for each local outgoing queue
  *  SHUFFLE_Relay_buftarget
  *    Memory allocated for each local relay rpc queue
+ *      (derived from PRELOAD_Memory_budget when not set)
  *  SHUFFLE_Relay_maxrpc
  *    Max num of outstanding rpcs allowed for each local relay outgoing queue
  *  SHUFFLE_Dq_min
@@ -59,6 +62,17 @@
  *  SHUFFLE_Dq_max
  *    Max queue size for the final delivery queue
  *      Set to "-1" to disable msg delivery so all msgs will be discarded
+ *      Derived from PRELOAD_Memory_budget when not set
+ *  SHUFFLE_Dthreads
+ *    Number of threads for the final delivery
+ *      Writes are split among threads by write lane; capped at the
+ *      number of write lanes, so plfsdir (a single lane) uses 1 thread
+ *  SHUFFLE_Dbatch
+ *    Max num of writes taken off the delivery queue at once
+ *      Set to "1" to deliver one write at a time
+ *  SHUFFLE_Trace_every
+ *    Trace 1 in this many msgs through every queue and hop
+ *      Per-stage times are printed with the shuffler state dump
  *  SHUFFLE_Min_port
  *    The min port number we can use
  *  SHUFFLE_Max_port
@@ -109,6 +123,15 @@ extern int xn_shuffler_my_rank(xn_ctx_t* ctx);
 void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, unsigned char buf_sz,
                          int epoch, int dst, int src);
 
+/* xn_shuffler_enqueue_batch: send a group of fixed-sized writes going to the
+ * same destination. writes are packed back to back in *bufs. */
+void xn_shuffler_enqueue_batch(xn_ctx_t* ctx, char* bufs, unsigned char buf_sz,
+                               int num_bufs, int epoch, int dst, int src);
+
+/* xn_shuffler_backlog: return the num of writes received but not yet
+ * delivered */
+extern int xn_shuffler_backlog(xn_ctx_t* ctx);
+
 /* xn_shuffler_epoch_end: do necessary flush at the end of an epoch */
 extern void xn_shuffler_epoch_end(xn_ctx_t* ctx);
 
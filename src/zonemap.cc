@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "zonemap.h"
+
+#include "common.h"
+
+#include <pdlfs-common/xxhash.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <math.h>
+
+#include <algorithm>
+
+namespace {
+inline size_t num_buckets(const zonemap_t* zm) {
+  return size_t(1) << zm->bits;
+}
+
+inline size_t field_size(uint32_t type) {
+  return type == ZM_F64 ? sizeof(double) : sizeof(float);
+}
+
+/* decode a field. fields are stored in host byte order */
+inline double field_value(const char* data, uint32_t type) {
+  float f;
+  double d;
+  int32_t i;
+  switch (type) {
+    case ZM_F32:
+      memcpy(&f, data, sizeof(f));
+      return f;
+    case ZM_F64:
+      memcpy(&d, data, sizeof(d));
+      return d;
+    default:
+      memcpy(&i, data, sizeof(i));
+      return i;
+  }
+}
+
+int write_all(int fd, const void* buf, size_t len) {
+  const char* p = static_cast<const char*>(buf);
+  ssize_t n;
+  while (len != 0) {
+    n = write(fd, p, len);
+    if (n == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += n;
+    len -= size_t(n);
+  }
+  return 0;
+}
+}  // namespace
+
+int zonemap_parse(const char* spec, zm_field_t* fields) {
+  const char* p = spec;
+  char* end;
+  long off;
+  int n = 0;
+
+  while (*p != 0) {
+    if (*p == ';') {
+      p++;
+      continue;
+    }
+    if (n >= ZM_MAX_FIELDS) return -1;
+    off = strtol(p, &end, 10);
+    if (end == p || off < 0 || off > 255 || *end != ':') return -1;
+    p = end + 1;
+    fields[n].off = uint32_t(off);
+    if (*p == 'f') {
+      fields[n].type = ZM_F32;
+    } else if (*p == 'd') {
+      fields[n].type = ZM_F64;
+    } else if (*p == 'i') {
+      fields[n].type = ZM_I32;
+    } else {
+      return -1;
+    }
+    p++;
+    if (*p != 0 && *p != ';') return -1;
+    n++;
+  }
+
+  return n;
+}
+
+void zonemap_init(zonemap_t* zm, const zm_field_t* fields, uint32_t nfields,
+                  uint32_t bits) {
+  assert(nfields <= ZM_MAX_FIELDS);
+  assert(bits <= ZM_MAX_BITS);
+  memset(zm, 0, sizeof(zonemap_t));
+  if (nfields == 0) return;
+  memcpy(zm->fields, fields, nfields * sizeof(zm_field_t));
+  zm->nfields = nfields;
+  zm->bits = bits;
+  zm->counts =
+      static_cast<uint64_t*>(malloc(num_buckets(zm) * sizeof(uint64_t)));
+  zm->zones = static_cast<double*>(
+      malloc(num_buckets(zm) * nfields * 2 * sizeof(double)));
+  if (zm->counts == NULL || zm->zones == NULL) {
+    ABORT("malloc");
+  }
+  zonemap_reset(zm);
+}
+
+void zonemap_destroy(zonemap_t* zm) {
+  free(zm->counts);
+  free(zm->zones);
+  zm->counts = NULL;
+  zm->zones = NULL;
+  zm->nfields = 0;
+}
+
+void zonemap_reset(zonemap_t* zm) {
+  const size_t n = num_buckets(zm) * zm->nfields;
+  if (zm->nfields == 0) return;
+  memset(zm->counts, 0, num_buckets(zm) * sizeof(uint64_t));
+  for (size_t i = 0; i < n; i++) { /* empty zones */
+    zm->zones[2 * i] = HUGE_VAL;
+    zm->zones[2 * i + 1] = -HUGE_VAL;
+  }
+}
+
+void zonemap_add(zonemap_t* zm, const char* name, size_t name_sz,
+                 const char* data, size_t data_sz) {
+  double* z;
+  double v;
+  size_t b;
+
+  if (zm->nfields == 0) return;
+  b = 0;
+  if (zm->bits != 0) {
+    b = pdlfs::xxhash32(name, name_sz, 0) >> (32 - zm->bits);
+  }
+  zm->counts[b]++;
+  z = zm->zones + b * zm->nfields * 2;
+  for (uint32_t i = 0; i < zm->nfields; i++, z += 2) {
+    const zm_field_t* const f = &zm->fields[i];
+    if (f->off + field_size(f->type) > data_sz) continue;
+    v = field_value(data + f->off, f->type);
+    if (v < z[0]) z[0] = v;
+    if (v > z[1]) z[1] = v;
+  }
+}
+
+void zonemap_merge(zonemap_t* dst, const zonemap_t* src) {
+  const size_t n = num_buckets(src) * src->nfields;
+  assert(dst->nfields == src->nfields && dst->bits == src->bits);
+  for (size_t b = 0; b < num_buckets(src) && src->nfields != 0; b++) {
+    dst->counts[b] += src->counts[b];
+  }
+  for (size_t i = 0; i < n; i++) {
+    dst->zones[2 * i] = std::min(dst->zones[2 * i], src->zones[2 * i]);
+    dst->zones[2 * i + 1] =
+        std::max(dst->zones[2 * i + 1], src->zones[2 * i + 1]);
+  }
+}
+
+int zonemap_write(const zonemap_t* zm, int fd, int epoch) {
+  uint32_t hdr[3 + 2 * ZM_MAX_FIELDS];
+  uint32_t i;
+
+  hdr[0] = uint32_t(epoch);
+  hdr[1] = zm->nfields;
+  hdr[2] = uint32_t(num_buckets(zm));
+  for (i = 0; i < zm->nfields; i++) {
+    hdr[3 + 2 * i] = zm->fields[i].off;
+    hdr[4 + 2 * i] = zm->fields[i].type;
+  }
+  if (write_all(fd, hdr, (3 + 2 * zm->nfields) * sizeof(uint32_t)) != 0 ||
+      write_all(fd, zm->counts, num_buckets(zm) * sizeof(uint64_t)) != 0 ||
+      write_all(fd, zm->zones,
+                num_buckets(zm) * zm->nfields * 2 * sizeof(double)) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+size_t zonemap_memory(const zonemap_t* zm) {
+  if (zm->nfields == 0) return 0;
+  return num_buckets(zm) *
+         (sizeof(uint64_t) + zm->nfields * 2 * sizeof(double));
+}
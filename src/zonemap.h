@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2018, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * zonemap: the min and max of a few fixed-offset fields of the particle
+ * data, kept separately for each bucket of names. a name goes to the
+ * bucket picked by the top bits of its xxhash32, so a reader that knows a
+ * name can tell whether any of its records may match a range predicate
+ * without touching the data, and a reader scanning a partition can tell
+ * whether any of its records may match at all. a zonemap is allocated
+ * once and is reset at the end of every epoch.
+ */
+#define ZM_MAX_FIELDS 8
+#define ZM_MAX_BITS 16
+
+/* field types */
+#define ZM_F32 0 /* float */
+#define ZM_F64 1 /* double */
+#define ZM_I32 2 /* int32_t */
+
+typedef struct zm_field {
+  uint32_t off;  /* byte offset into particle data */
+  uint32_t type; /* ZM_F32, ZM_F64, or ZM_I32 */
+} zm_field_t;
+
+typedef struct zonemap {
+  zm_field_t fields[ZM_MAX_FIELDS];
+  uint32_t nfields; /* 0 if disabled */
+  uint32_t bits;    /* log2 of the num of buckets */
+  uint64_t* counts; /* num of records per bucket */
+  double* zones;    /* min and max of each field per bucket */
+} zonemap_t;
+
+/* parse a list of fields such as "0:f;4:f;12:i", where types are f for
+ * float, d for double, and i for int32. return the num of fields parsed,
+ * or -1 if the list is malformed or holds more than ZM_MAX_FIELDS fields */
+int zonemap_parse(const char* spec, zm_field_t* fields);
+
+/* zonemap api */
+void zonemap_init(zonemap_t* zm, const zm_field_t* fields, uint32_t nfields,
+                  uint32_t bits);
+void zonemap_destroy(zonemap_t* zm);
+void zonemap_reset(zonemap_t* zm);
+
+/* fold a record into the bucket of its name. fields not fully covered by
+ * the record are left out */
+void zonemap_add(zonemap_t* zm, const char* name, size_t name_sz,
+                 const char* data, size_t data_sz);
+/* fold all buckets of src into dst. both must have the same fields */
+void zonemap_merge(zonemap_t* dst, const zonemap_t* src);
+
+/* append the zonemap of an epoch to a file. each record is the epoch, the
+ * num of fields, and the num of buckets as three uint32s, followed by the
+ * offset and the type of each field as two uint32s, the num of records of
+ * each bucket as a uint64, and, for each bucket, the min and max of each
+ * field as two doubles. return 0 on success, or -1 on errors */
+int zonemap_write(const zonemap_t* zm, int fd, int epoch);
+
+/* total memory used by the zonemap */
+size_t zonemap_memory(const zonemap_t* zm);
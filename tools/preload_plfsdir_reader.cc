@@ -39,8 +39,11 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -50,8 +53,12 @@
 #include <unistd.h>
 
 #include <deltafs/deltafs_api.h>
+#include <mpi.h>
+#include <pdlfs-common/xxhash.h>
 
 #include <algorithm>
+#include <list>
+#include <map>
 #include <string>
 #include <vector>
 
@@ -61,7 +68,8 @@
  */
 static char* argv0;      /* argv[0], program name */
 static deltafs_tp_t* tp; /* plfsdir worker thread pool */
-static char cf[500];     /* plfsdir conf str */
+static int myrank;       /* our MPI rank (scan mode only) */
+static int worldsz;      /* num of MPI ranks (scan mode only) */
 static struct deltafs_conf {
   int num_epochs;
   int key_size;
@@ -75,6 +83,7 @@ static struct deltafs_conf {
   int unordered_storage;
   int io_engine;
   int comm_sz;
+  int log_lanes; /* num of write lanes of local logs (0 if no local logs) */
 } c; /* plfsdir conf */
 
 /*
@@ -98,7 +107,11 @@ static void complain(const char* format, ...) {
  * print info messages.
  */
 static void vinfo(const char* format, va_list ap) {
-  printf("-INFO- ");
+  if (worldsz > 1) {
+    printf("-INFO- [%d] ", myrank);
+  } else {
+    printf("-INFO- ");
+  }
   vprintf(format, ap);
   printf("\n");
 }
@@ -140,6 +153,16 @@ struct gs {
   int r;         /* number of ranks to read */
   int d;         /* number of names to read per rank */
   int bg;        /* number of background worker threads */
+  int q;         /* number of query threads (0 to query in main thread) */
+  int b;         /* number of lookups sorted as a batch (0 disables) */
+  int noprefetch; /* do not open the next partition ahead of time */
+  int scan;      /* scan mode: export every entry of an epoch */
+  int epoch;     /* epoch to scan */
+  int plo;       /* first partition to scan */
+  int phi;       /* last partition to scan plus 1 (0 for all) */
+  char* out;     /* dir for exported data (NULL to only scan) */
+  uint64_t cachesz; /* bytes of the shared cache (0 disables) */
+  int rounds;    /* num of times to repeat the queries */
   char* in;      /* path to the input dir */
   char* dirname; /* dir name (path to dir storage) */
   int nobf;      /* ignore bloom filters */
@@ -150,7 +173,7 @@ struct gs {
 } g;
 
 /*
- * ms: measurements
+ * ms: measurements (one per query thread, later merged into m)
  */
 struct ms {
   std::vector<uint64_t>* latencies;
@@ -163,11 +186,290 @@ struct ms {
   uint64_t under_seeks;    /* total amount of underlying storage seeks */
   uint64_t table_seeks[3]; /* sum/min/max sstable opened */
   uint64_t seeks[3];       /* sum/min/max data block fetched */
+  uint64_t pruned;         /* num of names or partitions skipped */
 #define SUM 0
 #define MIN 1
 #define MAX 2
 } m;
 
+/*
+ * range predicates given on the command line.  each selects records
+ * with a field of the particle data in [lo, hi], and a record must
+ * satisfy all of them.  fields are typed as in the preload lib.
+ */
+#define ZM_F32 0 /* float */
+#define ZM_F64 1 /* double */
+#define ZM_I32 2 /* int32_t */
+
+struct pred {
+  uint32_t off;  /* byte offset into particle data */
+  uint32_t type; /* ZM_F32, ZM_F64, or ZM_I32 */
+  double lo;
+  double hi;
+};
+
+static std::vector<pred> preds;
+
+/*
+ * summary: the per-epoch summaries of a partition, as saved by the
+ * preload lib in SUMMARY-*.bin.  for each epoch and each bucket of names,
+ * a summary has the num of records and the min and max of each of its
+ * fields.  epochs is empty if the partition has no summary.
+ */
+struct summary {
+  std::vector<int> epochs;
+  std::vector<uint32_t> fields; /* offset and type of each field */
+  uint32_t nfields;
+  uint32_t nbuckets; /* a power of 2 */
+  std::vector<uint64_t> counts; /* epochs x buckets */
+  std::vector<double> zones;    /* epochs x buckets x fields x min/max */
+};
+
+/*
+ * part: an opened data partition (one per rank)
+ */
+struct part {
+  int rank;
+  std::vector<std::string> names; /* names to query (in query order) */
+  int navail;                      /* num of names available */
+  deltafs_plfsdir_t* dir;
+  struct cache_ent* ent;           /* cache entry holding dir (or NULL) */
+  struct llogs* log;               /* local logs (used instead of dir) */
+  long long io0[3];                /* dir io counters when we got it */
+  struct summary summ;             /* summaries (only loaded with preds) */
+};
+
+/*
+ * qthread: state of a query thread
+ */
+struct qthread {
+  int id;
+  pthread_t tid;
+  struct ms m;
+};
+
+static std::vector<int> ranks; /* ranks to query, in query order */
+static int nranks;             /* num of ranks to query */
+static int next_rank;          /* next index into ranks to claim */
+
+/*
+ * placement tables saved by the preload lib when it rebalanced the
+ * shuffle.  ptables[i] maps the hash bucket of a name to its partition
+ * from epoch pepochs[i] on.  both are empty if placement never changed,
+ * in which case every name stays in one partition across all epochs.
+ */
+static std::vector<int> pepochs;
+static std::vector<std::vector<int32_t> > ptables;
+static unsigned int pbits; /* log2 of the number of buckets */
+
+/*
+ * ms_init: reset a measurement set
+ */
+static void ms_init(struct ms* ms) {
+  memset(ms, 0, sizeof(*ms));
+  ms->latencies = new std::vector<uint64_t>;
+  ms->table_seeks[MIN] = ULONG_LONG_MAX;
+  ms->seeks[MIN] = ULONG_LONG_MAX;
+}
+
+/*
+ * ms_merge: add the measurements of a query thread to the total
+ */
+static void ms_merge(struct ms* dst, const struct ms* src) {
+  dst->latencies->insert(dst->latencies->end(), src->latencies->begin(),
+                         src->latencies->end());
+  dst->partitions += src->partitions;
+  dst->ops += src->ops;
+  dst->okops += src->okops;
+  dst->bytes += src->bytes;
+  dst->under_bytes += src->under_bytes;
+  dst->under_files += src->under_files;
+  dst->under_seeks += src->under_seeks;
+  dst->table_seeks[SUM] += src->table_seeks[SUM];
+  dst->table_seeks[MIN] =
+      std::min(dst->table_seeks[MIN], src->table_seeks[MIN]);
+  dst->table_seeks[MAX] =
+      std::max(dst->table_seeks[MAX], src->table_seeks[MAX]);
+  dst->seeks[SUM] += src->seeks[SUM];
+  dst->seeks[MIN] = std::min(dst->seeks[MIN], src->seeks[MIN]);
+  dst->seeks[MAX] = std::max(dst->seeks[MAX], src->seeks[MAX]);
+  dst->pruned += src->pruned;
+}
+
+/*
+ * ptile: get a percentile (in ms) from a sorted list of latencies (in us)
+ */
+static double ptile(const std::vector<uint64_t>* lat, double p) {
+  size_t i;
+  if (lat->empty()) return 0;
+  i = size_t(p / 100 * (lat->size() - 1) + 0.5);
+  return double((*lat)[i]) / 1000;
+}
+
+/*
+ * cache: a process-wide, size-bounded LRU cache shared by all query
+ * threads.  it holds two kinds of entries:
+ *
+ *  - opened dir handles (one per rank).  a plfsdir handle keeps the
+ *    filter and index blocks it loaded at open time, so reusing a handle
+ *    avoids reading them again.  a handle is charged the bytes it read
+ *    while being opened.  handles are used by one thread at a time; a
+ *    thread that finds a cached handle busy opens a private one.
+ *  - values of recently read names, so hot names are answered from
+ *    memory without going to the dir at all.
+ *
+ * entries that are in use are never freed; if they are evicted they
+ * are freed when they are released.
+ */
+#define CACHE_DIR 0
+#define CACHE_VAL 1
+
+struct cache_ent {
+  std::string key;
+  int kind;        /* CACHE_DIR or CACHE_VAL */
+  uint64_t charge; /* bytes charged against the cache */
+  int refs;        /* num of users (the cache itself does not count) */
+  int cached;      /* still in the cache (not evicted or replaced) */
+  deltafs_plfsdir_t* dir;
+  std::string value;
+  std::list<cache_ent*>::iterator lru;
+};
+
+static struct cache {
+  pthread_mutex_t mtx;
+  uint64_t usage;                          /* total charge */
+  std::list<cache_ent*>* lru;              /* most recently used first */
+  std::map<std::string, cache_ent*>* tab;  /* key to entry */
+  uint64_t nents[2];
+  uint64_t hits[2];
+  uint64_t misses[2];
+  uint64_t evictions;
+} cache;
+
+static void cache_init() {
+  pthread_mutex_init(&cache.mtx, NULL);
+  cache.usage = 0;
+  cache.lru = new std::list<cache_ent*>;
+  cache.tab = new std::map<std::string, cache_ent*>;
+  memset(cache.nents, 0, sizeof(cache.nents));
+  memset(cache.hits, 0, sizeof(cache.hits));
+  memset(cache.misses, 0, sizeof(cache.misses));
+  cache.evictions = 0;
+}
+
+static void cache_ent_free(cache_ent* e) {
+  if (e->dir != NULL) deltafs_plfsdir_free_handle(e->dir);
+  delete e;
+}
+
+/* drop an entry from the table (not the lru), caller holds cache.mtx */
+static void cache_unlink(cache_ent* e) {
+  cache.tab->erase(e->key);
+  cache.usage -= e->charge;
+  cache.nents[e->kind]--;
+  e->cached = 0;
+}
+
+/* evict unused entries until we are below capacity, caller holds lock */
+static void cache_evict() {
+  std::list<cache_ent*>::iterator it = cache.lru->end();
+  while (cache.usage > g.cachesz && it != cache.lru->begin()) {
+    --it;
+    cache_ent* const e = *it;
+    if (e->refs != 0) continue;
+    it = cache.lru->erase(it);
+    cache_unlink(e);
+    cache.evictions++;
+    cache_ent_free(e);
+  }
+}
+
+/*
+ * cache_lookup: find an entry and take a reference on it.  if exclusive
+ * is set, entries that are in use are treated as misses.
+ */
+static cache_ent* cache_lookup(const std::string& key, int kind,
+                               int exclusive) {
+  std::map<std::string, cache_ent*>::iterator it;
+  cache_ent* e;
+
+  e = NULL;
+  pthread_mutex_lock(&cache.mtx);
+  it = cache.tab->find(key);
+  if (it != cache.tab->end() && (!exclusive || it->second->refs == 0)) {
+    e = it->second;
+    e->refs++;
+    cache.lru->erase(e->lru);
+    cache.lru->push_front(e);
+    e->lru = cache.lru->begin();
+    cache.hits[kind]++;
+  } else {
+    cache.misses[kind]++;
+  }
+  pthread_mutex_unlock(&cache.mtx);
+
+  return e;
+}
+
+/*
+ * cache_insert: add a new entry (replacing an older one with the same
+ * key) and return it with a reference held for the caller.
+ */
+static cache_ent* cache_insert(cache_ent* e) {
+  std::map<std::string, cache_ent*>::iterator it;
+
+  e->refs = 1;
+  e->cached = 1;
+  pthread_mutex_lock(&cache.mtx);
+  it = cache.tab->find(e->key);
+  if (it != cache.tab->end()) {
+    cache_ent* const old = it->second;
+    cache.lru->erase(old->lru);
+    cache_unlink(old);
+    if (old->refs == 0) cache_ent_free(old);
+  }
+  cache.lru->push_front(e);
+  e->lru = cache.lru->begin();
+  (*cache.tab)[e->key] = e;
+  cache.usage += e->charge;
+  cache.nents[e->kind]++;
+  cache_evict();
+  pthread_mutex_unlock(&cache.mtx);
+
+  return e;
+}
+
+/*
+ * cache_release: drop a reference taken by cache_lookup/cache_insert
+ */
+static void cache_release(cache_ent* e) {
+  int dead;
+
+  pthread_mutex_lock(&cache.mtx);
+  dead = (--e->refs == 0 && !e->cached);
+  if (!dead) cache_evict();
+  pthread_mutex_unlock(&cache.mtx);
+  if (dead) cache_ent_free(e);
+}
+
+/*
+ * cache_destroy: free all entries (no entries may be in use)
+ */
+static void cache_destroy() {
+  std::list<cache_ent*>::iterator it;
+  for (it = cache.lru->begin(); it != cache.lru->end(); ++it) {
+    cache_ent_free(*it);
+  }
+  delete cache.lru;
+  delete cache.tab;
+  pthread_mutex_destroy(&cache.mtx);
+}
+
+static double hit_ratio(int kind) {
+  uint64_t n = cache.hits[kind] + cache.misses[kind];
+  return n != 0 ? 100.0 * cache.hits[kind] / n : 0;
+}
+
 /*
  * report: print performance measurements
  */
@@ -181,6 +483,8 @@ static void report() {
   if (!c.io_engine)
     printf("[R] Total Data Subpartitions: %d\n", c.comm_sz * (1 << c.lg_parts));
   printf("[R] Total Query Ops: %lu (%lu ok ops)\n", m.ops, m.okops);
+  if (!preds.empty())
+    printf("[R] Names Pruned By Summary: %lu\n", m.pruned);
   if (m.okops != 0)
     printf("[R] Total Data Queried: %lu bytes (%lu per entry per epoch)\n",
            m.bytes, m.bytes / m.okops / c.num_epochs);
@@ -206,12 +510,40 @@ static void report() {
            double((*lat)[0]) / 1000, double((*lat)[lat->size() - 1]) / 1000);
     printf("[R] Total Read Latency: %.6f s\n", double(sum) / 1000 / 1000);
   }
+  if (g.cachesz != 0) {
+    printf("[R] Cache: %lu / %lu bytes used (%lu dirs, %lu values)\n",
+           cache.usage, g.cachesz, cache.nents[CACHE_DIR],
+           cache.nents[CACHE_VAL]);
+    printf("[R] Cache Dir Hits: %lu (%lu misses, %.2f%% hit)\n",
+           cache.hits[CACHE_DIR], cache.misses[CACHE_DIR],
+           hit_ratio(CACHE_DIR));
+    printf("[R] Cache Value Hits: %lu (%lu misses, %.2f%% hit)\n",
+           cache.hits[CACHE_VAL], cache.misses[CACHE_VAL],
+           hit_ratio(CACHE_VAL));
+    printf("[R] Cache Evictions: %lu\n", cache.evictions);
+  }
   printf("[R] Dir IO Engine: %d\n", c.io_engine);
   printf("[R] MemTable Size: %s\n", c.memtable_size);
   printf("[R] BF Bits: %s\n", c.filter_bits_per_key);
   printf("\n");
 }
 
+/*
+ * report_threads: print per-thread latency percentiles
+ */
+static void report_threads(std::vector<qthread>* qts) {
+  for (size_t i = 0; i < qts->size(); i++) {
+    std::vector<uint64_t>* const lat = (*qts)[i].m.latencies;
+    if (lat->empty()) continue;
+    std::sort(lat->begin(), lat->end());
+    printf("[R] Query Thread %d: %lu partitions, %lu ops, "
+           "p50/p90/p99/max: %.3f/%.3f/%.3f/%.3f ms\n",
+           (*qts)[i].id, (*qts)[i].m.partitions, (*qts)[i].m.ops,
+           ptile(lat, 50), ptile(lat, 90), ptile(lat, 99), ptile(lat, 100));
+  }
+  printf("\n");
+}
+
 /*
  * alarm signal handler
  */
@@ -227,11 +559,24 @@ static void sigalarm(int foo) {
 static void usage(const char* msg) {
   if (msg) fprintf(stderr, "%s: %s\n", argv0, msg);
   fprintf(stderr, "usage: %s [options] plfsdir infodir\n", argv0);
+  fprintf(stderr, "\n(plfsdir is the local root holding LOG-* files if "
+                  "the run wrote local logs)\n");
   fprintf(stderr, "\noptions:\n");
   fprintf(stderr, "\t-a        enable the special anti-shuffle mode\n");
   fprintf(stderr, "\t-r ranks  number of ranks to read\n");
   fprintf(stderr, "\t-d depth  number of names to read per rank\n");
   fprintf(stderr, "\t-j num    number of background worker threads\n");
+  fprintf(stderr, "\t-q num    number of query threads\n");
+  fprintf(stderr, "\t-b num    sort lookups in batches of num names\n");
+  fprintf(stderr, "\t-n        do not prefetch the next partition\n");
+  fprintf(stderr, "\t-e epoch  scan all entries of an epoch (no queries)\n");
+  fprintf(stderr, "\t-p lo:hi  partitions to scan (default: all)\n");
+  fprintf(stderr, "\t-o dir    export scanned entries to dir\n");
+  fprintf(stderr, "\t-w off:type:lo:hi\n");
+  fprintf(stderr, "\t          only want records with the field at off "
+                  "(type f, d, or i) in [lo, hi]\n");
+  fprintf(stderr, "\t-m mb     size of the shared dir/value cache in MiB\n");
+  fprintf(stderr, "\t-R num    repeat the queries num times\n");
   fprintf(stderr, "\t-t sec    timeout (alarm), in seconds\n");
   fprintf(stderr, "\t-i        ignore bloom filters\n");
   fprintf(stderr, "\t-c        verify crc32c (for both data and indexes)\n");
@@ -299,6 +644,10 @@ static void get_manifest() {
     } else if (strncmp(ch, "comm_sz=", strlen("comm_sz=")) == 0) {
       c.comm_sz = atoi(ch + strlen("comm_sz="));
       if (c.comm_sz < 0) complain("bad comm_sz from manifests");
+    } else if (strncmp(ch, "local_log_lanes=", strlen("local_log_lanes=")) ==
+               0) {
+      c.log_lanes = atoi(ch + strlen("local_log_lanes="));
+      if (c.log_lanes < 0) complain("bad local_log_lanes from manifest");
     }
   }
 
@@ -312,30 +661,222 @@ static void get_manifest() {
   fclose(f);
 }
 
+/*
+ * get_placement: load the placement tables saved at each rebalancing, if
+ * any.  see pepochs and ptables.
+ */
+static void get_placement() {
+  std::vector<int32_t> tbl;
+  char fname[PATH_MAX];
+  uint32_t hdr[2];
+  FILE* f;
+
+  snprintf(fname, sizeof(fname), "%s/PLACEMENT", g.in);
+  f = fopen(fname, "r");
+  if (!f) return; /* placement was never rebalanced */
+
+  while (fread(hdr, sizeof(hdr), 1, f) == 1) {
+    if (hdr[1] == 0 || (hdr[1] & (hdr[1] - 1)) != 0)
+      complain("bad placement table size: %u", hdr[1]);
+    if (!pepochs.empty() && int(hdr[0]) <= pepochs.back())
+      complain("placement tables out of order");
+    tbl.resize(hdr[1]);
+    if (fread(&tbl[0], sizeof(int32_t), hdr[1], f) != hdr[1])
+      complain("error reading %s: truncated table", fname);
+    for (size_t i = 0; i < tbl.size(); i++) {
+      if (tbl[i] < 0 || tbl[i] >= c.comm_sz)
+        complain("bad partition in placement table: %d", tbl[i]);
+    }
+    pepochs.push_back(int(hdr[0]));
+    ptables.push_back(tbl);
+  }
+
+  if (ferror(f)) {
+    complain("error reading %s: %s", fname, strerror(errno));
+  }
+
+  fclose(f);
+
+  if (!pepochs.empty() && pepochs[0] != 0)
+    complain("bad placement: no table for epoch 0");
+  if (ptables.size() <= 1) { /* names never moved */
+    pepochs.clear();
+    ptables.clear();
+    return;
+  }
+  pbits = 0;
+  while ((size_t(1) << pbits) < ptables[0].size()) pbits++;
+  if (pbits == 0) complain("bad placement: single bucket");
+  for (size_t i = 1; i < ptables.size(); i++) {
+    if (ptables[i].size() != ptables[0].size())
+      complain("placement tables differ in size");
+  }
+}
+
+/*
+ * load_summary: load the summaries of a partition, if any.  see struct
+ * summary.
+ */
+static void load_summary(int rank, struct summary* s) {
+  char fname[PATH_MAX];
+  uint32_t hdr[3];
+  std::vector<uint32_t> fields;
+  size_t nz;
+  FILE* f;
+
+  s->epochs.clear();
+  s->counts.clear();
+  s->zones.clear();
+  s->nfields = s->nbuckets = 0;
+
+  snprintf(fname, sizeof(fname), "%s/SUMMARY-%07d.bin", g.in, rank);
+  f = fopen(fname, "r");
+  if (!f) return; /* summaries were not on */
+
+  while (fread(hdr, sizeof(hdr), 1, f) == 1) {
+    if (hdr[1] == 0 || hdr[2] == 0 || (hdr[2] & (hdr[2] - 1)) != 0)
+      complain("bad summary in %s", fname);
+    if (!s->epochs.empty() && int(hdr[0]) <= s->epochs.back())
+      complain("summaries out of order in %s", fname);
+    fields.resize(2 * hdr[1]);
+    if (fread(&fields[0], sizeof(uint32_t), fields.size(), f) !=
+        fields.size())
+      complain("error reading %s: truncated summary", fname);
+    if (s->epochs.empty()) {
+      s->fields = fields;
+      s->nfields = hdr[1];
+      s->nbuckets = hdr[2];
+    } else if (fields != s->fields || hdr[2] != s->nbuckets) {
+      complain("summaries differ in format in %s", fname);
+    }
+    nz = size_t(s->nbuckets) * s->nfields * 2;
+    s->counts.resize(s->counts.size() + s->nbuckets);
+    s->zones.resize(s->zones.size() + nz);
+    if (fread(&s->counts[s->counts.size() - s->nbuckets], sizeof(uint64_t),
+              s->nbuckets, f) != s->nbuckets ||
+        fread(&s->zones[s->zones.size() - nz], sizeof(double), nz, f) != nz)
+      complain("error reading %s: truncated summary", fname);
+    s->epochs.push_back(int(hdr[0]));
+  }
+
+  if (ferror(f)) {
+    complain("error reading %s: %s", fname, strerror(errno));
+  }
+
+  fclose(f);
+}
+
+/*
+ * summary_epoch: return the index of an epoch in a summary, or -1 if the
+ * summary does not have it.
+ */
+static int summary_epoch(const struct summary* s, int epoch) {
+  for (size_t i = 0; i < s->epochs.size(); i++) {
+    if (s->epochs[i] == epoch) return int(i);
+  }
+  return -1;
+}
+
+/*
+ * summary_bucket: return the bucket of a name in a summary.
+ */
+static uint32_t summary_bucket(const struct summary* s, const char* name) {
+  uint32_t bits = 0;
+  while ((uint32_t(1) << bits) < s->nbuckets) bits++;
+  if (bits == 0) return 0;
+  return pdlfs::xxhash32(name, strlen(name), 0) >> (32 - bits);
+}
+
+/*
+ * summary_may_match: check if some records summarized by buckets [b0, b1)
+ * of epochs [e0, e1) (indexes into s->epochs) may satisfy all preds.
+ * preds on fields the summary does not have are assumed to be satisfied.
+ */
+static int summary_may_match(const struct summary* s, size_t e0, size_t e1,
+                             size_t b0, size_t b1) {
+  uint64_t n = 0;
+  double lo;
+  double hi;
+
+  for (size_t e = e0; e < e1; e++) {
+    for (size_t b = b0; b < b1; b++) n += s->counts[e * s->nbuckets + b];
+  }
+  if (n == 0) return 0;
+  for (size_t i = 0; i < preds.size(); i++) {
+    for (uint32_t j = 0; j < s->nfields; j++) {
+      if (s->fields[2 * j] != preds[i].off ||
+          s->fields[2 * j + 1] != preds[i].type)
+        continue;
+      lo = HUGE_VAL;
+      hi = -HUGE_VAL;
+      for (size_t e = e0; e < e1; e++) {
+        for (size_t b = b0; b < b1; b++) {
+          const double* z =
+              &s->zones[((e * s->nbuckets + b) * s->nfields + j) * 2];
+          lo = std::min(lo, z[0]);
+          hi = std::max(hi, z[1]);
+        }
+      }
+      if (hi < preds[i].lo || lo > preds[i].hi) return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * value_match: check if a record satisfies all preds.  records too short
+ * to hold a field, or not in the particle size of the dir (such as
+ * wisc-key pointers), are always taken.
+ */
+static int value_match(const char* value, size_t value_sz) {
+  float f;
+  double d;
+  int32_t i32;
+  double v;
+
+  if (value_sz != size_t(c.value_size)) return 1;
+  for (size_t i = 0; i < preds.size(); i++) {
+    const struct pred* const p = &preds[i];
+    if (p->off + (p->type == ZM_F64 ? sizeof(d) : sizeof(f)) > value_sz)
+      continue;
+    if (p->type == ZM_F32) {
+      memcpy(&f, value + p->off, sizeof(f));
+      v = f;
+    } else if (p->type == ZM_F64) {
+      memcpy(&d, value + p->off, sizeof(d));
+      v = d;
+    } else {
+      memcpy(&i32, value + p->off, sizeof(i32));
+      v = i32;
+    }
+    if (v < p->lo || v > p->hi) return 0;
+  }
+
+  return 1;
+}
+
 /*
  * prepare_conf: generate plfsdir conf
  */
-static void prepare_conf(int rank, int* io_engine, int* unordered,
-                         int* force_leveldb_fmt) {
+static void prepare_conf(int rank, char* cf, size_t cfsz, int* io_engine,
+                         int* unordered, int* force_leveldb_fmt) {
   int n;
 
-  if (g.bg && !tp) tp = deltafs_tp_init(g.bg);
-  if (g.bg && !tp) complain("fail to init thread pool");
-
-  n = snprintf(cf, sizeof(cf), "rank=%d", rank);
-  n += snprintf(cf + n, sizeof(cf) - n, "&key_size=%d", c.key_size);
-  n += snprintf(cf + n, sizeof(cf) - n, "&memtable_size=%s", c.memtable_size);
-  n += snprintf(cf + n, sizeof(cf) - n, "&bf_bits_per_key=%s",
+  n = snprintf(cf, cfsz, "rank=%d", rank);
+  n += snprintf(cf + n, cfsz - n, "&key_size=%d", c.key_size);
+  n += snprintf(cf + n, cfsz - n, "&memtable_size=%s", c.memtable_size);
+  n += snprintf(cf + n, cfsz - n, "&bf_bits_per_key=%s",
                 c.filter_bits_per_key);
 
   if (!c.io_engine) {
-    n += snprintf(cf + n, sizeof(cf) - n, "&num_epochs=%d", c.num_epochs);
-    n += snprintf(cf + n, sizeof(cf) - n, "&skip_checksums=%d", c.skip_crc32c);
-    n += snprintf(cf + n, sizeof(cf) - n, "&verify_checksums=%d", g.crc32c);
-    n += snprintf(cf + n, sizeof(cf) - n, "&paranoid_checks=%d", g.paranoid);
-    n += snprintf(cf + n, sizeof(cf) - n, "&parallel_reads=%d", g.bg != 0);
-    n += snprintf(cf + n, sizeof(cf) - n, "&ignore_filters=%d", g.nobf);
-    snprintf(cf + n, sizeof(cf) - n, "&lg_parts=%d", c.lg_parts);
+    n += snprintf(cf + n, cfsz - n, "&num_epochs=%d", c.num_epochs);
+    n += snprintf(cf + n, cfsz - n, "&skip_checksums=%d", c.skip_crc32c);
+    n += snprintf(cf + n, cfsz - n, "&verify_checksums=%d", g.crc32c);
+    n += snprintf(cf + n, cfsz - n, "&paranoid_checks=%d", g.paranoid);
+    n += snprintf(cf + n, cfsz - n, "&parallel_reads=%d", g.bg != 0);
+    n += snprintf(cf + n, cfsz - n, "&ignore_filters=%d", g.nobf);
+    snprintf(cf + n, cfsz - n, "&lg_parts=%d", c.lg_parts);
   }
 
   *force_leveldb_fmt = c.force_leveldb_format;
@@ -346,10 +887,251 @@ static void prepare_conf(int rank, int* io_engine, int* unordered,
 #endif
 }
 
+/*
+ * local logs: when deltafs was bypassed, the preload lib may have written
+ * particles to per-epoch logs instead of a plfsdir.  each write lane of a
+ * rank has a data log and an index per epoch, LOG-<rank>-<lane>-<epoch>
+ * .{dat,idx}.  an index entry is a 1-byte name length, the name, and the
+ * 8-byte offset and 4-byte size of the record in the data log (in host
+ * byte order).  llogs holds the indexes of all epochs of a rank in memory.
+ */
+struct llog_rec {
+  int epoch;
+  int lane;
+  uint64_t off;
+  uint32_t sz;
+};
+
+struct llogs {
+  int rank;
+  std::map<std::string, std::vector<llog_rec> > idx; /* in epoch order */
+  std::vector<int> fds; /* data logs (epochs x lanes), -1 if missing */
+  uint64_t bytes;       /* total amount of data and indexes read */
+  uint64_t files;       /* num of files opened */
+  uint64_t seeks;       /* num of data reads */
+};
+
+/*
+ * open_logs: load the local log indexes of a rank and open its data logs.
+ */
+static struct llogs* open_logs(int rank) {
+  struct llogs* const l = new llogs;
+  char fname[PATH_MAX];
+  std::string buf;
+  struct stat st;
+  llog_rec r;
+  size_t i;
+  int fd;
+
+  l->rank = rank;
+  l->bytes = l->files = l->seeks = 0;
+  l->fds.resize(size_t(c.num_epochs) * c.log_lanes, -1);
+  for (int e = 0; e < c.num_epochs; e++) {
+    for (int lane = 0; lane < c.log_lanes; lane++) {
+      snprintf(fname, sizeof(fname), "%s/LOG-%d-%d-%d.idx", g.dirname, rank,
+               lane, e);
+      fd = open(fname, O_RDONLY);
+      if (fd == -1 && errno == ENOENT) continue; /* lane wrote nothing */
+      if (fd == -1 || fstat(fd, &st) != 0)
+        complain("error opening %s: %s", fname, strerror(errno));
+      buf.resize(size_t(st.st_size));
+      if (!buf.empty() && pread(fd, &buf[0], buf.size(), 0) != st.st_size)
+        complain("error reading %s: %s", fname, strerror(errno));
+      close(fd);
+      l->bytes += buf.size();
+      l->files++;
+      r.epoch = e;
+      r.lane = lane;
+      for (i = 0; i < buf.size(); i += 1 + size_t(buf[i] & 0xff) + 12) {
+        const size_t n = size_t(buf[i] & 0xff);
+        if (i + 1 + n + 12 > buf.size())
+          complain("bad local log index %s", fname);
+        memcpy(&r.off, &buf[i + 1 + n], 8);
+        memcpy(&r.sz, &buf[i + 1 + n + 8], 4);
+        l->idx[std::string(&buf[i + 1], n)].push_back(r);
+      }
+      snprintf(fname, sizeof(fname), "%s/LOG-%d-%d-%d.dat", g.dirname, rank,
+               lane, e);
+      fd = open(fname, O_RDONLY);
+      if (fd == -1) complain("error opening %s: %s", fname, strerror(errno));
+      l->fds[size_t(e) * c.log_lanes + lane] = fd;
+      l->files++;
+    }
+  }
+
+  return l;
+}
+
+/*
+ * read_log: read the records of a name in a given epoch (-1 for all
+ * epochs) from local logs.  the result is returned in a malloc'ed buffer,
+ * as deltafs_plfsdir_read() would return it.
+ */
+static char* read_log(struct llogs* l, const char* name, int epoch,
+                      size_t* sz) {
+  std::map<std::string, std::vector<llog_rec> >::iterator it;
+  size_t n;
+  char* data;
+  int fd;
+
+  it = l->idx.find(name);
+  n = 0;
+  if (it != l->idx.end()) {
+    for (size_t i = 0; i < it->second.size(); i++) {
+      if (epoch == -1 || it->second[i].epoch == epoch) n += it->second[i].sz;
+    }
+  }
+  data = static_cast<char*>(malloc(n + 1));
+  if (data == NULL) complain("malloc failed");
+  *sz = n;
+  if (n == 0) return data;
+  n = 0;
+  for (size_t i = 0; i < it->second.size(); i++) {
+    const llog_rec* const r = &it->second[i];
+    if (epoch != -1 && r->epoch != epoch) continue;
+    fd = l->fds[size_t(r->epoch) * c.log_lanes + r->lane];
+    if (pread(fd, data + n, r->sz, off_t(r->off)) != ssize_t(r->sz))
+      complain("error reading local log of rank %d: %s", l->rank,
+               strerror(errno));
+    n += r->sz;
+    l->bytes += r->sz;
+    l->seeks++;
+  }
+
+  return data;
+}
+
+/*
+ * close_logs: close the data logs of a rank and free its indexes.
+ */
+static void close_logs(struct llogs* l) {
+  for (size_t i = 0; i < l->fds.size(); i++) {
+    if (l->fds[i] != -1) close(l->fds[i]);
+  }
+  delete l;
+}
+
 /*
  * do_read: read from plfsdir and measure the performance.
  */
-static void do_read(deltafs_plfsdir_t* dir, const char* name) {
+static deltafs_plfsdir_t* open_dir(int rank);
+static long long io_prop(deltafs_plfsdir_t* dir, const char* key);
+
+/*
+ * part_of: return the partition holding a name in a given epoch.
+ */
+static int part_of(const char* name, int epoch) {
+  const uint64_t b = pdlfs::xxhash64(name, c.key_size, 0) >> (64 - pbits);
+  size_t i = 0;
+  while (i + 1 < pepochs.size() && pepochs[i + 1] <= epoch) i++;
+  return ptables[i][b];
+}
+
+/*
+ * read_moved: read a name whose placement changed across epochs, one
+ * epoch at a time, from whichever partition held it in that epoch.  the
+ * results are appended in epoch order in a malloc'ed buffer, as
+ * deltafs_plfsdir_read() would return them for a single partition.
+ */
+static char* read_moved(struct part* p, const char* name, struct ms* m,
+                        size_t* sz, size_t* table_seeks, size_t* seeks) {
+  deltafs_plfsdir_t* dir;
+  cache_ent* ent;
+  std::string buf;
+  char key[20];
+  char* data;
+  size_t n;
+  size_t ts;
+  size_t s;
+  int dst;
+
+  *table_seeks = *seeks = 0;
+  if (p->log != NULL) { /* read each epoch from the logs of its rank */
+    for (int e = 0; e < c.num_epochs; e++) {
+      struct llogs* l = p->log;
+      dst = part_of(name, e);
+      if (dst != p->rank) l = open_logs(dst);
+      n = l->seeks;
+      data = read_log(l, name, e, &s);
+      *seeks += l->seeks - n;
+      buf.append(data, s);
+      free(data);
+      if (l != p->log) {
+        m->under_bytes += l->bytes;
+        m->under_files += l->files;
+        m->under_seeks += l->seeks;
+        close_logs(l);
+      }
+    }
+    goto done;
+  }
+  for (int e = 0; e < c.num_epochs; e++) {
+    dst = part_of(name, e);
+    ent = NULL;
+    if (dst == p->rank) {
+      dir = p->dir;
+    } else if (g.cachesz != 0) {
+      snprintf(key, sizeof(key), "d%d", dst);
+      ent = cache_lookup(key, CACHE_DIR, 1);
+      if (ent == NULL) {
+        ent = new cache_ent;
+        ent->key = key;
+        ent->kind = CACHE_DIR;
+        ent->dir = open_dir(dst);
+        ent->charge =
+            sizeof(*ent) + io_prop(ent->dir, "io.total_bytes_read");
+        cache_insert(ent);
+      }
+      dir = ent->dir;
+    } else {
+      dir = open_dir(dst);
+    }
+    if (dir != p->dir) { /* io done by the partition itself is counted later */
+      m->under_bytes -= io_prop(dir, "io.total_bytes_read");
+      m->under_seeks -= io_prop(dir, "io.total_seeks");
+    }
+    n = ts = s = 0;
+    data = static_cast<char*>(
+        deltafs_plfsdir_read(dir, name, e, &n, &ts, &s));
+    if (dir != p->dir) {
+      m->under_bytes += io_prop(dir, "io.total_bytes_read");
+      m->under_seeks += io_prop(dir, "io.total_seeks");
+      if (ent != NULL) {
+        cache_release(ent);
+      } else {
+        deltafs_plfsdir_free_handle(dir);
+      }
+    }
+    if (data == NULL) return NULL;
+    buf.append(data, n);
+    free(data);
+    *table_seeks += ts;
+    *seeks += s;
+  }
+
+done:
+  data = static_cast<char*>(malloc(buf.size() + 1));
+  if (data == NULL) complain("malloc failed");
+  memcpy(data, buf.data(), buf.size());
+  *sz = buf.size();
+  return data;
+}
+
+/*
+ * is_moved: check if a name was placed in partitions other than p->rank
+ * in some epoch.
+ */
+static int is_moved(struct part* p, const char* name) {
+  if (ptables.empty() || g.a || c.bypass_shuffle) return 0;
+  for (int e = 0; e < c.num_epochs; e++) {
+    if (part_of(name, e) != p->rank) return 1;
+  }
+  return 0;
+}
+
+static void do_read(struct part* p, const char* name, struct ms* m) {
+  std::string key;
+  cache_ent* e;
   char* data;
   uint64_t start;
   uint64_t end;
@@ -360,8 +1142,30 @@ static void do_read(deltafs_plfsdir_t* dir, const char* name) {
   table_seeks = seeks = 0;
   start = now();
 
-  data = static_cast<char*>(
-      deltafs_plfsdir_read(dir, name, -1, &sz, &table_seeks, &seeks));
+  if (g.cachesz != 0) {
+    char tmp[20];
+    snprintf(tmp, sizeof(tmp), "v%d/", p->rank);
+    key = tmp;
+    key += name;
+    e = cache_lookup(key, CACHE_VAL, 0);
+    if (e != NULL) {
+      sz = e->value.size();
+      cache_release(e);
+      end = now();
+      goto done;
+    }
+  }
+
+  if (is_moved(p, name)) {
+    data = read_moved(p, name, m, &sz, &table_seeks, &seeks);
+  } else if (p->log != NULL) {
+    seeks = p->log->seeks;
+    data = read_log(p->log, name, -1, &sz);
+    seeks = p->log->seeks - seeks;
+  } else {
+    data = static_cast<char*>(
+        deltafs_plfsdir_read(p->dir, name, -1, &sz, &table_seeks, &seeks));
+  }
   if (data == NULL) {
     complain("error reading %s: %s", name, strerror(errno));
   } else if (sz == 0 && !g.a && !c.bypass_shuffle && c.value_size != 0) {
@@ -370,18 +1174,31 @@ static void do_read(deltafs_plfsdir_t* dir, const char* name) {
 
   end = now();
 
+  /* failed reads are not cached so a later lookup may retry */
+  if (g.cachesz != 0 && data != NULL) {
+    e = new cache_ent;
+    e->key = key;
+    e->kind = CACHE_VAL;
+    e->dir = NULL;
+    e->value.assign(data, sz);
+    e->charge = key.size() + sz + sizeof(*e);
+    cache_release(cache_insert(e));
+  }
+
   free(data);
 
-  m.latencies->push_back(end - start);
-  m.table_seeks[SUM] += table_seeks;
-  m.table_seeks[MIN] = std::min(table_seeks, m.table_seeks[MIN]);
-  m.table_seeks[MAX] = std::max(table_seeks, m.table_seeks[MAX]);
-  m.seeks[SUM] += seeks;
-  m.seeks[MIN] = std::min(seeks, m.seeks[MIN]);
-  m.seeks[MAX] = std::max(seeks, m.seeks[MAX]);
-  m.bytes += sz;
-  if (sz != 0) m.okops++;
-  m.ops++;
+done:
+
+  m->latencies->push_back(end - start);
+  m->table_seeks[SUM] += table_seeks;
+  m->table_seeks[MIN] = std::min(table_seeks, m->table_seeks[MIN]);
+  m->table_seeks[MAX] = std::max(table_seeks, m->table_seeks[MAX]);
+  m->seeks[SUM] += seeks;
+  m->seeks[MIN] = std::min(seeks, m->seeks[MIN]);
+  m->seeks[MAX] = std::max(seeks, m->seeks[MAX]);
+  m->bytes += sz;
+  if (sz != 0) m->okops++;
+  m->ops++;
 }
 
 /*
@@ -411,19 +1228,18 @@ static void get_names(int rank, std::vector<std::string>* results) {
 }
 
 /*
- * run_queries: open plfsdir and do reads on a specific rank.
+ * open_dir: open plfsdir for a specific rank.
  */
-static void run_queries(int rank) {
-  std::vector<std::string> names;
+static deltafs_plfsdir_t* open_dir(int rank) {
   deltafs_plfsdir_t* dir;
+  char cf[500];
   int unordered;
   int force_leveldb_fmt;
   int io_engine;
   int r;
 
-  get_names((g.a || c.bypass_shuffle) ? 0 : rank, &names);
-  std::random_shuffle(names.begin(), names.end());
-  prepare_conf(rank, &io_engine, &unordered, &force_leveldb_fmt);
+  prepare_conf(rank, cf, sizeof(cf), &io_engine, &unordered,
+               &force_leveldb_fmt);
 
   dir = deltafs_plfsdir_create_handle(cf, O_RDONLY, io_engine);
   if (!dir) complain("fail to create dir handle");
@@ -436,33 +1252,449 @@ static void run_queries(int rank) {
   r = deltafs_plfsdir_open(dir, g.dirname);
   if (r) complain("error opening plfsdir: %s", strerror(errno));
 
+  return dir;
+}
+
+static long long io_prop(deltafs_plfsdir_t* dir, const char* key) {
+  return deltafs_plfsdir_get_integer_property(dir, key);
+}
+
+/*
+ * open_part: load names and open plfsdir for a specific rank.  if the
+ * cache is on, a cached handle for the rank is reused when possible.
+ */
+static void open_part(struct part* p) {
+  char key[20];
+
+  get_names((g.a || c.bypass_shuffle) ? 0 : p->rank, &p->names);
+  if (!preds.empty()) load_summary(p->rank, &p->summ);
+  std::random_shuffle(p->names.begin(), p->names.end());
+  p->navail = int(p->names.size());
+  if (p->navail > g.d) p->names.resize(g.d);
+  p->io0[0] = p->io0[1] = p->io0[2] = 0;
+  p->ent = NULL;
+  p->log = NULL;
+  if (c.log_lanes != 0) {
+    p->dir = NULL;
+    p->log = open_logs(p->rank);
+    return;
+  }
+  if (g.cachesz == 0) {
+    p->dir = open_dir(p->rank);
+    return;
+  }
+
+  snprintf(key, sizeof(key), "d%d", p->rank);
+  p->ent = cache_lookup(key, CACHE_DIR, 1);
+  if (p->ent != NULL) { /* only count io done from now on */
+    p->dir = p->ent->dir;
+    p->io0[0] = io_prop(p->dir, "io.total_bytes_read");
+    p->io0[1] = io_prop(p->dir, "io.total_read_open");
+    p->io0[2] = io_prop(p->dir, "io.total_seeks");
+    return;
+  }
+
+  p->dir = open_dir(p->rank);
+  p->ent = new cache_ent;
+  p->ent->key = key;
+  p->ent->kind = CACHE_DIR;
+  p->ent->dir = p->dir;
+  p->ent->charge = sizeof(*p->ent) + io_prop(p->dir, "io.total_bytes_read");
+  cache_insert(p->ent);
+}
+
+/*
+ * open_part_main: open_part() as a thread (for prefetching)
+ */
+static void* open_part_main(void* arg) {
+  open_part(static_cast<struct part*>(arg));
+  return NULL;
+}
+
+/*
+ * query_part: read names from an opened partition.  if batching is on,
+ * each batch of names is sorted so that lookups sweep the partition's
+ * tables in key order rather than seeking back and forth.
+ */
+static void query_part(struct part* p, struct ms* m) {
+  std::vector<std::string>::iterator it;
+  size_t n;
+
   if (g.v)
-    info("rank %d (%d reads) ...\t\t(%d samples available)", rank,
-         std::min(g.d, int(names.size())), int(names.size()));
-  for (int i = 0; i < g.d && i < int(names.size()); i++) {
-    do_read(dir, names[i].c_str());
+    info("rank %d (%d reads) ...\t\t(%d samples available)", p->rank,
+         int(p->names.size()), p->navail);
+  if (g.b != 0) {
+    for (it = p->names.begin(); it != p->names.end(); it += n) {
+      n = std::min(size_t(g.b), size_t(p->names.end() - it));
+      std::sort(it, it + n);
+    }
+  }
+  for (it = p->names.begin(); it != p->names.end(); ++it) {
+    if (!preds.empty() && !p->summ.epochs.empty() &&
+        !is_moved(p, it->c_str())) {
+      const uint32_t b = summary_bucket(&p->summ, it->c_str());
+      if (!summary_may_match(&p->summ, 0, p->summ.epochs.size(), b, b + 1)) {
+        m->pruned++; /* none of its records can match */
+        continue;
+      }
+    }
+    do_read(p, it->c_str(), m);
+  }
+}
+
+/*
+ * close_part: collect io stats and close an opened partition.
+ */
+static void close_part(struct part* p, struct ms* m) {
+  if (p->log != NULL) {
+    m->under_bytes += p->log->bytes;
+    m->under_files += p->log->files;
+    m->under_seeks += p->log->seeks;
+    close_logs(p->log);
+    p->log = NULL;
+    p->names.clear();
+    m->partitions++;
+    return;
+  }
+  m->under_bytes += io_prop(p->dir, "io.total_bytes_read") - p->io0[0];
+  m->under_files += io_prop(p->dir, "io.total_read_open") - p->io0[1];
+  m->under_seeks += io_prop(p->dir, "io.total_seeks") - p->io0[2];
+  if (p->ent != NULL) {
+    cache_release(p->ent);
+    p->ent = NULL;
+  } else {
+    deltafs_plfsdir_free_handle(p->dir);
+  }
+  p->dir = NULL;
+  p->names.clear();
+
+  m->partitions++;
+}
+
+/*
+ * claim_rank: get the next rank to query, or -1 if there is none left.
+ */
+static int claim_rank() {
+  int i = __sync_fetch_and_add(&next_rank, 1);
+  return (i < nranks) ? ranks[i] : -1;
+}
+
+/*
+ * query_main: main loop of a query thread. ranks are claimed one at a
+ * time. unless disabled, the next rank is opened by a helper thread
+ * while the current one is queried so that its index loading overlaps
+ * with our reads.
+ */
+static void* query_main(void* arg) {
+  struct qthread* const t = static_cast<struct qthread*>(arg);
+  struct part cur, nxt;
+  pthread_t pf;
+  int r;
+
+  nxt.dir = cur.dir = NULL;
+  nxt.log = cur.log = NULL;
+  cur.rank = claim_rank();
+  if (cur.rank != -1) open_part(&cur);
+  while (cur.rank != -1) {
+    nxt.rank = claim_rank();
+    if (nxt.rank != -1 && !g.noprefetch) {
+      r = pthread_create(&pf, NULL, open_part_main, &nxt);
+      if (r != 0) complain("pthread_create: %s", strerror(r));
+    }
+    query_part(&cur, &t->m);
+    close_part(&cur, &t->m);
+    if (nxt.rank != -1) {
+      if (!g.noprefetch) {
+        pthread_join(pf, NULL);
+      } else {
+        open_part(&nxt);
+      }
+    }
+    cur.rank = nxt.rank;
+    cur.navail = nxt.navail;
+    cur.dir = nxt.dir;
+    cur.ent = nxt.ent;
+    cur.log = nxt.log;
+    memcpy(cur.io0, nxt.io0, sizeof(cur.io0));
+    cur.names.swap(nxt.names);
+    std::swap(cur.summ, nxt.summ);
+  }
+
+  return NULL;
+}
+
+/*
+ * scan/export mode.  every entry of an epoch is streamed out of a
+ * partition with deltafs_plfsdir_scan(), which walks the epoch's tables
+ * block by block instead of doing one lookup per key.  entries are
+ * grouped into columnar batches and written to one file per partition:
+ *
+ *   header: "PLFSCOL1", then uint32 epoch, uint32 partition
+ *   batch:  uint32 n, uint32 key_sz, uint32 value_sz,
+ *           n keys (key_sz bytes each), n values (value_sz bytes each)
+ *   end:    uint32 0
+ *
+ * all integers are in host byte order.  a new batch is started when it
+ * is full or when the key or value size changes.
+ */
+#define SCAN_BATCH 4096         /* max entries per batch */
+#define SCAN_OBUF (8 << 20)     /* stdio buffer used for exports */
+
+struct scanner {
+  FILE* out;           /* NULL if not exporting */
+  char* obuf;          /* stdio buffer for out */
+  std::string keys;    /* key column of the current batch */
+  std::string values;  /* value column of the current batch */
+  uint32_t n;          /* num of entries in the current batch */
+  uint32_t key_sz;     /* key size of the current batch */
+  uint32_t value_sz;   /* value size of the current batch */
+  uint64_t entries;    /* total num of entries scanned */
+  uint64_t bytes;      /* total key and value bytes scanned */
+  uint64_t batches;    /* total num of batches written */
+  uint64_t filtered;   /* total num of entries not matching preds */
+};
+
+static void scan_write(struct scanner* sc, const void* data, size_t sz) {
+  if (fwrite(data, 1, sz, sc->out) != sz)
+    complain("error exporting data: %s", strerror(errno));
+}
+
+/*
+ * scan_flush: write out the current batch (if any)
+ */
+static void scan_flush(struct scanner* sc) {
+  uint32_t hdr[3];
+
+  if (sc->n == 0) return;
+  if (sc->out != NULL) {
+    hdr[0] = sc->n;
+    hdr[1] = sc->key_sz;
+    hdr[2] = sc->value_sz;
+    scan_write(sc, hdr, sizeof(hdr));
+    scan_write(sc, sc->keys.data(), sc->keys.size());
+    scan_write(sc, sc->values.data(), sc->values.size());
+  }
+  sc->keys.clear();
+  sc->values.clear();
+  sc->batches++;
+  sc->n = 0;
+}
+
+/*
+ * scan_saver: callback from deltafs_plfsdir_scan() for each entry
+ */
+static int scan_saver(void* arg, const char* key, size_t key_sz,
+                      const char* value, size_t value_sz) {
+  struct scanner* const sc = static_cast<struct scanner*>(arg);
+
+  sc->bytes += key_sz + value_sz;
+  if (!preds.empty() && !value_match(value, value_sz)) {
+    sc->filtered++;
+    return 0;
+  }
+  if (sc->n != 0 && (key_sz != sc->key_sz || value_sz != sc->value_sz))
+    scan_flush(sc);
+  if (sc->n == 0) {
+    sc->key_sz = uint32_t(key_sz);
+    sc->value_sz = uint32_t(value_sz);
+  }
+  if (sc->out != NULL) {
+    sc->keys.append(key, key_sz);
+    sc->values.append(value, value_sz);
+  }
+  sc->entries++;
+  if (++sc->n >= SCAN_BATCH) scan_flush(sc);
+
+  return 0;
+}
+
+/*
+ * scan_part: scan an epoch of a specific rank.  with preds, the rank is
+ * skipped if its summary of the epoch shows that no records can match.
+ */
+static void scan_part(int rank, struct scanner* sc, struct ms* m) {
+  char fname[PATH_MAX];
+  struct summary summ;
+  deltafs_plfsdir_t* dir;
+  uint32_t hdr[2];
+  uint64_t start;
+  uint64_t n0;
+  int r;
+
+  if (g.out != NULL) {
+    snprintf(fname, sizeof(fname), "%s/epoch%d-%07d.col", g.out, g.epoch,
+             rank);
+    sc->out = fopen(fname, "w");
+    if (!sc->out) complain("error opening %s: %s", fname, strerror(errno));
+    setvbuf(sc->out, sc->obuf, _IOFBF, SCAN_OBUF);
+    scan_write(sc, "PLFSCOL1", 8);
+    hdr[0] = uint32_t(g.epoch);
+    hdr[1] = uint32_t(rank);
+    scan_write(sc, hdr, sizeof(hdr));
+  }
+
+  if (!preds.empty()) {
+    load_summary(rank, &summ);
+    r = summary_epoch(&summ, g.epoch);
+    if (r != -1 &&
+        !summary_may_match(&summ, size_t(r), size_t(r) + 1, 0, summ.nbuckets)) {
+      m->pruned++;
+      if (g.v) info("rank %d epoch %d: pruned", rank, g.epoch);
+      goto done;
+    }
   }
 
-  m.under_bytes +=
+  start = now();
+  n0 = sc->entries;
+  dir = open_dir(rank);
+  r = deltafs_plfsdir_scan(dir, g.epoch, scan_saver, sc);
+  if (r < 0) complain("error scanning rank %d: %s", rank, strerror(errno));
+  scan_flush(sc);
+  m->latencies->push_back(now() - start);
+
+  m->under_bytes +=
       deltafs_plfsdir_get_integer_property(dir, "io.total_bytes_read");
-  m.under_files +=
+  m->under_files +=
       deltafs_plfsdir_get_integer_property(dir, "io.total_read_open");
-  m.under_seeks += deltafs_plfsdir_get_integer_property(dir, "io.total_seeks");
+  m->under_seeks +=
+      deltafs_plfsdir_get_integer_property(dir, "io.total_seeks");
   deltafs_plfsdir_free_handle(dir);
+  m->partitions++;
+
+  if (g.v)
+    info("rank %d epoch %d: %llu entries", rank, g.epoch,
+         (unsigned long long)(sc->entries - n0));
+
+done:
+  if (sc->out != NULL) {
+    hdr[0] = 0;
+    scan_write(sc, hdr, sizeof(hdr[0]));
+    if (fclose(sc->out) != 0)
+      complain("error closing %s: %s", fname, strerror(errno));
+    sc->out = NULL;
+  }
+}
+
+/*
+ * run_scan: scan partitions [plo, phi) of an epoch.  under MPI the
+ * partitions are dealt out round-robin across ranks, and the results
+ * are summed up at rank 0.
+ */
+static void run_scan() {
+  unsigned long long local[8], total[8];
+  struct scanner sc;
+  uint64_t start;
+  double dura;
 
-  m.partitions++;
+  sc.out = NULL;
+  sc.obuf = NULL;
+  sc.n = sc.key_sz = sc.value_sz = 0;
+  sc.entries = sc.bytes = sc.batches = sc.filtered = 0;
+  if (g.out != NULL) {
+    sc.obuf = static_cast<char*>(malloc(SCAN_OBUF));
+    if (!sc.obuf) complain("malloc export buffer failed");
+  }
+  sc.keys.reserve(SCAN_BATCH * size_t(c.key_size));
+  if (c.value_size > 0) sc.values.reserve(SCAN_BATCH * size_t(c.value_size));
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  start = now();
+  for (int i = g.plo + myrank; i < g.phi; i += worldsz) {
+    scan_part(i, &sc, &m);
+  }
+  MPI_Barrier(MPI_COMM_WORLD);
+  dura = double(now() - start) / 1000000;
+
+  local[0] = sc.entries;
+  local[1] = sc.bytes;
+  local[2] = sc.batches;
+  local[3] = m.partitions;
+  local[4] = m.under_bytes;
+  local[5] = m.under_seeks;
+  local[6] = sc.filtered;
+  local[7] = m.pruned;
+  MPI_Reduce(local, total, 8, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  free(sc.obuf);
+
+  if (myrank != 0) return;
+  printf("\n");
+  printf("=== Scan Results ===\n");
+  printf("[S] Epoch: %d (of %d)\n", g.epoch, c.num_epochs);
+  printf("[S] Data Partitions Scanned: %llu (%d-%d, %d ranks)\n", total[3],
+         g.plo, g.phi - 1, worldsz);
+  if (!preds.empty())
+    printf("[S] Data Partitions Pruned By Summary: %llu\n", total[7]);
+  printf("[S] Total Entries: %llu (%llu batches)\n", total[0], total[2]);
+  if (!preds.empty())
+    printf("[S] Total Entries Filtered Out: %llu\n", total[6]);
+  printf("[S] Total Data Scanned: %llu bytes\n", total[1]);
+  printf("[S] Total Under Data Read: %llu bytes\n", total[4]);
+  printf("[S] Total Under Storage Seeks: %llu\n", total[5]);
+  printf("[S] Scan Time: %.3f s (%.3f MiB/s, %.0f entries/s)\n", dura,
+         dura > 0 ? double(total[1]) / (1 << 20) / dura : 0,
+         dura > 0 ? double(total[0]) / dura : 0);
+  if (g.out != NULL) printf("[S] Exported To: %s\n", g.out);
+  printf("\n");
+}
+
+/*
+ * print_options: print the options and the dir manifest
+ */
+static void print_options() {
+  printf("\n%s\n==options:\n", argv0);
+  printf("\tqueries: %d x %d (ranks x reads)\n", g.r, g.d);
+  printf("\tnum bg threads: %d (reader thread pool)\n", g.bg);
+  printf("\tnum query threads: %d\n", g.q);
+  printf("\tlookup batch size: %d\n", g.b);
+  printf("\tprefetch next partition: %d\n", g.q != 0 && !g.noprefetch);
+  if (g.scan) {
+    printf("\tscan epoch: %d (partitions %d-%d, %d ranks)\n", g.epoch, g.plo,
+           g.phi - 1, worldsz);
+    printf("\texport dir: %s\n", g.out ? g.out : "(none)");
+  }
+  for (size_t i = 0; i < preds.size(); i++) {
+    printf("\tpredicate: %g <= %c field at %u <= %g\n", preds[i].lo,
+           "fdi"[preds[i].type], preds[i].off, preds[i].hi);
+  }
+  printf("\tcache size: %lu bytes\n", g.cachesz);
+  printf("\tquery rounds: %d\n", g.rounds);
+  printf("\tanti-shuffle: %d\n", g.a);
+  printf("\tinfodir: %s\n", g.in);
+  printf("\tplfsdir: %s\n", g.dirname);
+  printf("\ttimeout: %d s\n", g.timeout);
+  printf("\tignore bloom filters: %d\n", g.nobf);
+  printf("\tverify crc32: %d\n", g.crc32c);
+  printf("\tparanoid checks: %d\n", g.paranoid);
+  printf("\tverbose: %d\n", g.v);
+  printf("\n==dir manifest\n");
+  printf("\tio engine: %d\n", c.io_engine);
+  printf("\tforce leveldb format: %d\n", c.force_leveldb_format);
+  printf("\tunordered storage: %d\n", c.unordered_storage);
+  printf("\tnum epochs: %d\n", c.num_epochs);
+  printf("\tkey size: %d bytes\n", c.key_size);
+  printf("\tvalue size: %d bytes\n", c.value_size);
+  printf("\tmemtable size: %s\n", c.memtable_size);
+  printf("\tfilter bits per key: %s\n", c.filter_bits_per_key);
+  printf("\tskip crc32c: %d\n", c.skip_crc32c);
+  printf("\tbypass shuffle: %d\n", c.bypass_shuffle);
+  printf("\tlg parts: %d\n", c.lg_parts);
+  printf("\tcomm sz: %d\n", c.comm_sz);
+  printf("\tlocal log lanes: %d\n", c.log_lanes);
+  printf("\tplacement tables: %d (%u buckets)\n", int(ptables.size()),
+         ptables.empty() ? 0u : unsigned(ptables[0].size()));
+  printf("\n");
 }
 
 /*
  * main program
  */
 int main(int argc, char* argv[]) {
-  std::vector<int> ranks;
-  int nranks;
+  std::vector<qthread> qts;
   int ch;
+  int r;
 
   argv0 = argv[0];
-  memset(cf, 0, sizeof(cf));
   tp = NULL;
 
   /* we want lines, even if we are writing to a pipe */
@@ -471,7 +1703,8 @@ int main(int argc, char* argv[]) {
   /* setup default to zero/null, except as noted below */
   memset(&g, 0, sizeof(g));
   g.timeout = DEF_TIMEOUT;
-  while ((ch = getopt(argc, argv, "ar:d:j:t:ickv")) != -1) {
+  g.rounds = 1;
+  while ((ch = getopt(argc, argv, "ar:d:j:q:b:ne:p:o:w:m:R:t:ickv")) != -1) {
     switch (ch) {
       case 'a':
         g.a = 1;
@@ -488,6 +1721,48 @@ int main(int argc, char* argv[]) {
         g.bg = atoi(optarg);
         if (g.bg < 0) usage("bad bg number");
         break;
+      case 'q':
+        g.q = atoi(optarg);
+        if (g.q < 0) usage("bad query thread number");
+        break;
+      case 'b':
+        g.b = atoi(optarg);
+        if (g.b < 0) usage("bad batch size");
+        break;
+      case 'n':
+        g.noprefetch = 1;
+        break;
+      case 'e':
+        g.scan = 1;
+        g.epoch = atoi(optarg);
+        if (g.epoch < 0) usage("bad epoch");
+        break;
+      case 'p':
+        if (sscanf(optarg, "%d:%d", &g.plo, &g.phi) != 2 || g.plo < 0 ||
+            g.phi <= g.plo)
+          usage("bad partition range");
+        break;
+      case 'o':
+        g.out = optarg;
+        break;
+      case 'w': {
+        struct pred p;
+        char t;
+        if (sscanf(optarg, "%u:%c:%lf:%lf", &p.off, &t, &p.lo, &p.hi) != 4 ||
+            strchr("fdi", t) == NULL || t == 0 || p.lo > p.hi)
+          usage("bad predicate");
+        p.type = t == 'f' ? ZM_F32 : (t == 'd' ? ZM_F64 : ZM_I32);
+        preds.push_back(p);
+        break;
+      }
+      case 'm':
+        if (atoi(optarg) < 0) usage("bad cache size");
+        g.cachesz = uint64_t(atoi(optarg)) << 20;
+        break;
+      case 'R':
+        g.rounds = atoi(optarg);
+        if (g.rounds < 1) usage("bad num of rounds");
+        break;
       case 't':
         g.timeout = atoi(optarg);
         if (g.timeout < 0) usage("bad timeout");
@@ -523,50 +1798,89 @@ int main(int argc, char* argv[]) {
 
   memset(&c, 0, sizeof(c));
   get_manifest();
+  get_placement();
 
-  printf("\n%s\n==options:\n", argv0);
-  printf("\tqueries: %d x %d (ranks x reads)\n", g.r, g.d);
-  printf("\tnum bg threads: %d (reader thread pool)\n", g.bg);
-  printf("\tanti-shuffle: %d\n", g.a);
-  printf("\tinfodir: %s\n", g.in);
-  printf("\tplfsdir: %s\n", g.dirname);
-  printf("\ttimeout: %d s\n", g.timeout);
-  printf("\tignore bloom filters: %d\n", g.nobf);
-  printf("\tverify crc32: %d\n", g.crc32c);
-  printf("\tparanoid checks: %d\n", g.paranoid);
-  printf("\tverbose: %d\n", g.v);
-  printf("\n==dir manifest\n");
-  printf("\tio engine: %d\n", c.io_engine);
-  printf("\tforce leveldb format: %d\n", c.force_leveldb_format);
-  printf("\tunordered storage: %d\n", c.unordered_storage);
-  printf("\tnum epochs: %d\n", c.num_epochs);
-  printf("\tkey size: %d bytes\n", c.key_size);
-  printf("\tvalue size: %d bytes\n", c.value_size);
-  printf("\tmemtable size: %s\n", c.memtable_size);
-  printf("\tfilter bits per key: %s\n", c.filter_bits_per_key);
-  printf("\tskip crc32c: %d\n", c.skip_crc32c);
-  printf("\tbypass shuffle: %d\n", c.bypass_shuffle);
-  printf("\tlg parts: %d\n", c.lg_parts);
-  printf("\tcomm sz: %d\n", c.comm_sz);
-  printf("\n");
+  worldsz = 1;
+  if (g.scan && c.log_lanes != 0)
+    complain("scan mode does not support local logs");
+  if (g.scan) {
+    if (MPI_Init(&argc, &argv) != MPI_SUCCESS) complain("MPI_Init failed");
+    MPI_Comm_rank(MPI_COMM_WORLD, &myrank);
+    MPI_Comm_size(MPI_COMM_WORLD, &worldsz);
+    if (g.epoch >= c.num_epochs) complain("bad epoch: %d", g.epoch);
+    if (g.phi == 0 || g.phi > c.comm_sz) g.phi = c.comm_sz;
+    if (g.plo >= g.phi) complain("bad partition range");
+    if (g.out != NULL && myrank == 0 && mkdir(g.out, 0777) != 0 &&
+        errno != EEXIST)
+      complain("cannot create %s: %s", g.out, strerror(errno));
+    MPI_Barrier(MPI_COMM_WORLD);
+  }
+
+  if (myrank == 0) print_options();
 
   signal(SIGALRM, sigalarm);
   alarm(g.timeout);
 
-  memset(&m, 0, sizeof(m));
-  m.latencies = new std::vector<uint64_t>;
-  m.table_seeks[MIN] = ULONG_LONG_MAX;
-  m.seeks[MIN] = ULONG_LONG_MAX;
+  if (g.bg) tp = deltafs_tp_init(g.bg);
+  if (g.bg && !tp) complain("fail to init thread pool");
+
+  ms_init(&m);
+  if (g.scan) {
+    run_scan();
+    if (tp) deltafs_tp_close(tp);
+    if (c.memtable_size) free(c.memtable_size);
+    if (c.filter_bits_per_key) free(c.filter_bits_per_key);
+    delete m.latencies;
+    MPI_Finalize();
+    if (g.v) info("all done!");
+    exit(0);
+  }
+
+  if (g.cachesz != 0) cache_init();
   for (int i = 0; i < c.comm_sz; i++) {
     ranks.push_back(i);
   }
   std::random_shuffle(ranks.begin(), ranks.end());
   nranks = (g.a || c.bypass_shuffle) ? c.comm_sz : g.r;
-  if (g.v) info("start queries (%d ranks) ...", std::min(nranks, c.comm_sz));
-  for (int i = 0; i < nranks && i < c.comm_sz; i++) {
-    run_queries(ranks[i]);
+  nranks = std::min(nranks, c.comm_sz);
+  ranks.resize(nranks);
+  /* repeated rounds query the same ranks again, each in a new order */
+  for (int i = 1; i < g.rounds; i++) {
+    std::vector<int> round(ranks.begin(), ranks.begin() + nranks);
+    std::random_shuffle(round.begin(), round.end());
+    ranks.insert(ranks.end(), round.begin(), round.end());
+  }
+  nranks = int(ranks.size());
+  next_rank = 0;
+  if (g.v) info("start queries (%d partition queries) ...", nranks);
+  if (g.q == 0) {
+    /* no query threads: query one partition at a time ourselves */
+    struct part p;
+    for (int i = 0; i < nranks; i++) {
+      p.rank = ranks[i];
+      open_part(&p);
+      query_part(&p, &m);
+      close_part(&p, &m);
+    }
+  } else {
+    qts.resize(g.q);
+    for (int i = 0; i < g.q; i++) {
+      qts[i].id = i;
+      ms_init(&qts[i].m);
+      r = pthread_create(&qts[i].tid, NULL, query_main, &qts[i]);
+      if (r != 0) complain("pthread_create: %s", strerror(r));
+    }
+    for (int i = 0; i < g.q; i++) {
+      pthread_join(qts[i].tid, NULL);
+      ms_merge(&m, &qts[i].m);
+    }
   }
   report();
+  if (m.ops == 0 && m.pruned != 0)
+    info("all %lu names pruned by summary", m.pruned);
+  if (!qts.empty()) report_threads(&qts);
+  for (size_t i = 0; i < qts.size(); i++) delete qts[i].m.latencies;
+  if (g.cachesz != 0) cache_destroy();
 
   if (tp) deltafs_tp_close(tp);
   if (c.memtable_size) free(c.memtable_size);
@@ -40,6 +40,8 @@
  */
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -50,11 +52,15 @@
 
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <mpi.h>
 
+#include <algorithm>
+#include <vector>
+
 /*
  * helper/utility functions, included inline here so we are self-contained
  * in one single source file...
@@ -96,6 +102,15 @@ static void fatal(const char* f, int d, const char* msg) {
   abort();
 }
 
+/*
+ * now: get current time in micros
+ */
+static uint64_t now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec * 1000000LLU + tv.tv_usec;
+}
+
 /*
  * default values
  */
@@ -105,6 +120,18 @@ static void fatal(const char* f, int d, const char* msg) {
 #define DEF_PARTICLESIZE 40 /* bytes per particle */
 #define DEF_NPARTICLES 16   /* total particles per rank */
 #define DEF_TIMEOUT 120     /* alarm timeout */
+#define DEF_NTHREADS 1      /* dumper threads per rank */
+#define DEF_ZIPF_THETA 0.99 /* zipf skew */
+#define DEF_HOT_IDS 0.1     /* hotspot: fraction of ids that are hot */
+#define DEF_HOT_OPS 0.9     /* hotspot: fraction of writes to hot ids */
+
+/*
+ * particle id distributions
+ */
+#define DIST_SEQ 0     /* each rank writes its own ids in order */
+#define DIST_UNIFORM 1 /* ids drawn uniformly from all ranks' ids */
+#define DIST_ZIPF 2    /* ids drawn with zipf skew */
+#define DIST_HOTSPOT 3 /* a fraction of writes go to a few hot ids */
 
 /*
  * gs: shared global data (e.g. from the command line)
@@ -123,6 +150,15 @@ static struct gs {
   int psize;          /* total state per vpic particle (bytes) */
   int nps;            /* number of particles per rank */
   int timeout;        /* alarm timeout */
+  int nthreads;       /* number of dumper threads per rank */
+  int dist;           /* particle id distribution (DIST_*) */
+  double theta;       /* zipf skew */
+  double hotids;      /* hotspot: fraction of ids that are hot */
+  double hotops;      /* hotspot: fraction of writes to hot ids */
+  double growth;      /* per-epoch particle count growth factor */
+  double jitter;      /* random per-rank, per-epoch count change (0-1) */
+  int busy;           /* spin instead of sleep during compute phases */
+  const char* mfile;  /* machine-readable results (rank 0) */
 } g;
 
 /*
@@ -155,6 +191,13 @@ static void usage(const char* msg) {
   fprintf(stderr, "\t-s step     number of steps to perform\n");
   fprintf(stderr, "\t-T time     step time in seconds\n");
   fprintf(stderr, "\t-t sec      timeout (alarm), in seconds\n");
+  fprintf(stderr, "\t-n threads  number of dumper threads per rank\n");
+  fprintf(stderr, "\t-k dist     particle ids: seq, uniform, zipf[:theta],\n");
+  fprintf(stderr, "\t            or hotspot[:hot_ids:hot_ops] (fractions)\n");
+  fprintf(stderr, "\t-g factor   particle count growth per epoch\n");
+  fprintf(stderr, "\t-j frac     random per-rank particle count jitter\n");
+  fprintf(stderr, "\t-B          busy-wait instead of sleeping\n");
+  fprintf(stderr, "\t-M file     write per-phase results as csv\n");
 
 skip_prints:
   MPI_Finalize();
@@ -174,7 +217,8 @@ static struct ps {
  * forward prototype decls.
  */
 static void run_vpic_app();
-static void do_dump();
+static void do_dump(int epoch);
+static void parse_dist(const char* spec);
 
 /*
  * main program.
@@ -210,8 +254,14 @@ int main(int argc, char* argv[]) {
   g.psize = DEF_PARTICLESIZE;
   g.nps = DEF_NPARTICLES;
   g.timeout = DEF_TIMEOUT;
-
-  while ((ch = getopt(argc, argv, "b:c:d:o:s:T:t:")) != -1) {
+  g.nthreads = DEF_NTHREADS;
+  g.dist = DIST_SEQ;
+  g.theta = DEF_ZIPF_THETA;
+  g.hotids = DEF_HOT_IDS;
+  g.hotops = DEF_HOT_OPS;
+  g.growth = 1.0;
+
+  while ((ch = getopt(argc, argv, "b:c:d:o:s:T:t:n:k:g:j:BM:")) != -1) {
     switch (ch) {
       case 'b':
         g.psize = atoi(optarg);
@@ -240,6 +290,27 @@ int main(int argc, char* argv[]) {
         g.timeout = atoi(optarg);
         if (g.timeout < 0) usage("bad timeout");
         break;
+      case 'n':
+        g.nthreads = atoi(optarg);
+        if (g.nthreads < 1) usage("bad num threads");
+        break;
+      case 'k':
+        parse_dist(optarg);
+        break;
+      case 'g':
+        g.growth = atof(optarg);
+        if (g.growth <= 0) usage("bad growth factor");
+        break;
+      case 'j':
+        g.jitter = atof(optarg);
+        if (g.jitter < 0 || g.jitter >= 1) usage("bad jitter");
+        break;
+      case 'B':
+        g.busy = 1;
+        break;
+      case 'M':
+        g.mfile = optarg;
+        break;
       default:
         usage(NULL);
     }
@@ -293,6 +364,18 @@ int main(int argc, char* argv[]) {
     printf(" > num_dumps  = %d\n", g.ndumps);
     printf(" > num_steps  = %d\n", g.nsteps);
     printf(" > timeout    = %d secs\n", g.timeout);
+    printf(" > dumper threads      = %d per rank\n", g.nthreads);
+    if (g.dist == DIST_ZIPF)
+      printf(" > particle ids        = zipf (theta=%.3f)\n", g.theta);
+    else if (g.dist == DIST_HOTSPOT)
+      printf(" > particle ids        = hotspot (%.3f ids get %.3f writes)\n",
+             g.hotids, g.hotops);
+    else
+      printf(" > particle ids        = %s\n",
+             g.dist == DIST_UNIFORM ? "uniform" : "seq");
+    printf(" > count growth/jitter = %.3f / %.3f\n", g.growth, g.jitter);
+    printf(" > compute phase       = %s\n", g.busy ? "busy" : "sleep");
+    printf(" > results csv         = %s\n", g.mfile ? g.mfile : "(none)");
     printf("\n");
   }
 
@@ -314,26 +397,10 @@ int main(int argc, char* argv[]) {
   return 0;
 }
 
-static void run_vpic_app() {
-  int rv = 0;
-  if (myrank == 0) {
-    rv = mkdir(g.pdir, 0777);
-  }
-  if (rv != 0) {
-    complain(EXIT_FAILURE, 0, "mkdir %s failed errno=%d", g.pdir, errno);
-  }
-  for (int epoch = 0; epoch < g.ndumps; epoch++) {
-    MPI_Barrier(MPI_COMM_WORLD);
-    if (myrank == 0) printf("\n== VPIC Epoch %d ...\n", epoch + 1);
-    int steps = g.nsteps / g.ndumps; /* vpic timesteps per epoch */
-    usleep(int(g.steptime * steps * 1000 * 1000));
-    do_dump();
-  }
-}
-
 namespace {
+/* url-safe alphabet: ids must never contain a '/' */
 const unsigned char base64_table[65] =
-    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
 
 /*
  * Base64 encoding/decoding (RFC1341)
@@ -357,24 +424,319 @@ void base64_encoding(char* dst, uint64_t input) {
 
   *dst = 0;
 }
+
+/*
+ * rng: per-thread xorshift64* generator
+ */
+inline uint64_t rng_next(uint64_t* x) {
+  *x ^= *x >> 12;
+  *x ^= *x << 25;
+  *x ^= *x >> 27;
+  return *x * 2685821657736338717ULL;
+}
+
+inline double rng_double(uint64_t* x) { /* [0, 1) */
+  return (rng_next(x) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * mix: splitmix64 finalizer.  a bijection, so distinct indexes are
+ * turned into distinct, scrambled particle ids.
+ */
+inline uint64_t mix(uint64_t z) {
+  z += 0x9e3779b97f4a7c15ULL;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/*
+ * latency histogram: 4 buckets per power of 2 microseconds
+ */
+#define LAT_BUCKETS 160
+
+inline int lat_bucket(uint64_t us) {
+  int b;
+  if (us < 2) return int(us);
+  b = int(floor(log2(double(us)) * 4));
+  return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+inline double lat_value(int b) { return b < 2 ? b : pow(2.0, b / 4.0); }
 }  // namespace
 
-static void do_dump() {
+/*
+ * zipf: draw indexes in [0, n) with zipf skew (the method used by ycsb,
+ * from gray et al. "quickly generating billion-record synthetic
+ * databases").  zeta(n) is approximated by an integral past 10M terms.
+ */
+static struct zipf {
+  uint64_t n;
+  double theta, alpha, zetan, eta, half;
+} z;
+
+static void zipf_init(uint64_t n, double theta) {
+  const uint64_t exact = std::min(n, uint64_t(10000000));
+  double zeta2 = 1 + pow(0.5, theta);
+  double sum = 0;
+
+  for (uint64_t i = 1; i <= exact; i++) sum += pow(double(i), -theta);
+  if (n > exact)
+    sum += (pow(double(n), 1 - theta) - pow(double(exact), 1 - theta)) /
+           (1 - theta);
+  z.n = n;
+  z.theta = theta;
+  z.zetan = sum;
+  z.alpha = 1 / (1 - theta);
+  z.eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / z.zetan);
+  z.half = 1 + pow(0.5, theta);
+}
+
+static uint64_t zipf_next(uint64_t* x) {
+  double u = rng_double(x);
+  double uz = u * z.zetan;
+  uint64_t k;
+
+  if (uz < 1) return 0;
+  if (uz < z.half) return 1;
+  k = uint64_t(z.n * pow(z.eta * u - z.eta + 1, z.alpha));
+  return k < z.n ? k : z.n - 1;
+}
+
+/*
+ * parse_dist: parse the -k option
+ */
+static void parse_dist(const char* spec) {
+  if (strcmp(spec, "seq") == 0) {
+    g.dist = DIST_SEQ;
+  } else if (strcmp(spec, "uniform") == 0) {
+    g.dist = DIST_UNIFORM;
+  } else if (strncmp(spec, "zipf", 4) == 0) {
+    g.dist = DIST_ZIPF;
+    if (spec[4] == ':') g.theta = atof(spec + 5);
+    if (spec[4] != 0 && spec[4] != ':') usage("bad key distribution");
+    if (g.theta <= 0 || g.theta >= 1) usage("bad zipf theta");
+  } else if (strncmp(spec, "hotspot", 7) == 0) {
+    g.dist = DIST_HOTSPOT;
+    if (spec[7] == ':' &&
+        sscanf(spec + 8, "%lf:%lf", &g.hotids, &g.hotops) != 2)
+      usage("bad hotspot spec");
+    if (spec[7] != 0 && spec[7] != ':') usage("bad key distribution");
+    if (g.hotids <= 0 || g.hotids >= 1 || g.hotops < 0 || g.hotops > 1)
+      usage("bad hotspot fractions");
+  } else {
+    usage("bad key distribution");
+  }
+}
+
+/*
+ * stats of one phase (summed over threads, and later over ranks)
+ */
+struct phase_stats {
+  uint64_t ops;
+  uint64_t bytes;
+  uint64_t hist[LAT_BUCKETS];
+};
+
+/*
+ * dumper: state of a dumper thread
+ */
+struct dumper {
+  pthread_t tid;
+  int epoch;
+  uint64_t first; /* DIST_SEQ: first particle index */
+  uint64_t n;     /* num of particles to write */
+  uint64_t rng;
+  struct phase_stats st;
+};
+
+static uint64_t next_id(struct dumper* d, uint64_t i) {
+  const uint64_t npop = uint64_t(g.nps) * g.size; /* id population */
+  const uint64_t nhot = std::max(uint64_t(1), uint64_t(npop * g.hotids));
+  uint64_t k;
+
+  switch (g.dist) {
+    case DIST_UNIFORM:
+      k = rng_next(&d->rng) % npop;
+      break;
+    case DIST_ZIPF:
+      k = zipf_next(&d->rng);
+      break;
+    case DIST_HOTSPOT:
+      if (rng_double(&d->rng) < g.hotops || nhot >= npop) {
+        k = rng_next(&d->rng) % nhot;
+      } else {
+        k = nhot + rng_next(&d->rng) % (npop - nhot);
+      }
+      break;
+    default: /* DIST_SEQ */
+      return (static_cast<uint64_t>(myrank) << 32) | (d->first + i);
+  }
+
+  return mix(k);
+}
+
+static void* dump_main(void* arg) {
+  struct dumper* const d = static_cast<struct dumper*>(arg);
+  char pname[256];
+  uint64_t t0;
   FILE* file;
+
+  const int prefix = snprintf(pname, sizeof(pname), "%s/", g.pdir);
+  for (uint64_t i = 0; i < d->n; i++) {
+    base64_encoding(pname + prefix, next_id(d, i));
+    t0 = now();
+    file = fopen(pname, "a");
+    if (!file) complain(EXIT_FAILURE, 0, "!fopen errno=%d", errno);
+    fwrite(p.pdata, 1, p.psz, file);
+    fclose(file);
+    d->st.hist[lat_bucket(now() - t0)]++;
+    d->st.bytes += p.psz;
+    d->st.ops++;
+  }
+
+  return NULL;
+}
+
+/*
+ * report_phase: sum up the stats of a phase at rank 0 and print them.
+ * dura is the time of the phase on this rank; the slowest rank counts.
+ */
+static void report_phase(int epoch, const char* phase, double dura,
+                         struct phase_stats* st) {
+  struct phase_stats sum;
+  double maxdura, lat[4], pct[3] = {50, 90, 99};
+  uint64_t cnt, want;
+  FILE* f;
+  int b, i;
+
+  MPI_Reduce(&dura, &maxdura, 1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+  MPI_Reduce(st, &sum, 2 + LAT_BUCKETS, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+             MPI_COMM_WORLD);
+  if (myrank != 0) return;
+
+  for (i = 0; i < 3; i++) {
+    want = uint64_t(ceil(sum.ops * pct[i] / 100));
+    for (b = 0, cnt = 0; b < LAT_BUCKETS - 1; b++) {
+      cnt += sum.hist[b];
+      if (cnt >= want) break;
+    }
+    lat[i] = sum.ops ? lat_value(b) : 0;
+  }
+  for (b = LAT_BUCKETS - 1; b > 0 && sum.hist[b] == 0; b--) {
+  }
+  lat[3] = sum.ops ? lat_value(b) : 0;
+
+  printf(" > %s: %.3f secs", phase, maxdura);
+  if (sum.ops != 0)
+    printf(", %llu ops, %.3f MB/s, %.0f ops/s, lat(us) p50/p90/p99/max: "
+           "%.0f/%.0f/%.0f/%.0f",
+           (unsigned long long)sum.ops, sum.bytes / maxdura / 1000000,
+           sum.ops / maxdura, lat[0], lat[1], lat[2], lat[3]);
+  printf("\n");
+
+  if (g.mfile == NULL) return;
+  f = fopen(g.mfile, epoch == 0 && strcmp(phase, "compute") == 0 ? "w" : "a");
+  if (!f) complain(EXIT_FAILURE, 0, "!fopen %s errno=%d", g.mfile, errno);
+  if (ftell(f) == 0)
+    fprintf(f,
+            "epoch,phase,ranks,threads,secs,ops,bytes,mb_per_sec,ops_per_sec,"
+            "lat_p50_us,lat_p90_us,lat_p99_us,lat_max_us\n");
+  fprintf(f, "%d,%s,%d,%d,%.6f,%llu,%llu,%.3f,%.1f,%.0f,%.0f,%.0f,%.0f\n",
+          epoch + 1, phase, g.size, g.nthreads, maxdura,
+          (unsigned long long)sum.ops, (unsigned long long)sum.bytes,
+          maxdura > 0 ? sum.bytes / maxdura / 1000000 : 0,
+          maxdura > 0 ? sum.ops / maxdura : 0, lat[0], lat[1], lat[2], lat[3]);
+  fclose(f);
+}
+
+/*
+ * compute: emulate the compute phase of an epoch.  with -B we spin
+ * instead of sleeping, so background threads have to compete with us
+ * for cpus as they would with a real vpic run.
+ */
+static void compute(uint64_t usecs) {
+  uint64_t t0;
+  volatile uint64_t x = 0;
+
+  if (!g.busy) {
+    usleep(useconds_t(usecs));
+  } else {
+    t0 = now();
+    while (now() - t0 < usecs) x++;
+  }
+}
+
+static void run_vpic_app() {
+  struct phase_stats st;
+  uint64_t t0;
+  int rv = 0;
+  if (myrank == 0) {
+    rv = mkdir(g.pdir, 0777);
+  }
+  if (rv != 0) {
+    complain(EXIT_FAILURE, 0, "mkdir %s failed errno=%d", g.pdir, errno);
+  }
+  if (g.dist == DIST_ZIPF) zipf_init(uint64_t(g.nps) * g.size, g.theta);
+  for (int epoch = 0; epoch < g.ndumps; epoch++) {
+    MPI_Barrier(MPI_COMM_WORLD);
+    if (myrank == 0) printf("\n== VPIC Epoch %d ...\n", epoch + 1);
+    int steps = g.nsteps / g.ndumps; /* vpic timesteps per epoch */
+    t0 = now();
+    compute(uint64_t(g.steptime * steps * 1000 * 1000));
+    memset(&st, 0, sizeof(st));
+    report_phase(epoch, "compute", double(now() - t0) / 1000000, &st);
+    do_dump(epoch);
+  }
+}
+
+/*
+ * do_dump: write an epoch's particles.  the count may change over
+ * epochs (-g) and across ranks (-j), and is split among the dumper
+ * threads.
+ */
+static void do_dump(int epoch) {
+  struct phase_stats st;
+  std::vector<dumper> ds(g.nthreads);
+  uint64_t seed, t0;
+  double count;
+  uint64_t n;
   DIR* dir;
+  int rv;
+
   dir = opendir(g.pdir);
   if (!dir) {
     complain(EXIT_FAILURE, 0, "!opendir errno=%d", errno);
   }
-  const int prefix = snprintf(p.pname, sizeof(p.pname), "%s/", g.pdir);
-  uint64_t highbits = (static_cast<uint64_t>(myrank) << 32);
-  for (int i = 0; i < g.nps; i++) {
-    base64_encoding(p.pname + prefix, (highbits | i));
-    file = fopen(p.pname, "a");
-    if (!file) complain(EXIT_FAILURE, 0, "!fopen errno=%d", errno);
-    fwrite(p.pdata, 1, p.psz, file);
-    fclose(file);
+
+  seed = mix((uint64_t(myrank) << 32) | uint64_t(epoch)) | 1;
+  count = g.nps * pow(g.growth, epoch);
+  if (g.jitter != 0) count *= 1 + g.jitter * (2 * rng_double(&seed) - 1);
+  n = uint64_t(count + 0.5);
+
+  MPI_Barrier(MPI_COMM_WORLD);
+  t0 = now();
+  for (int i = 0; i < g.nthreads; i++) {
+    memset(&ds[i].st, 0, sizeof(ds[i].st));
+    ds[i].epoch = epoch;
+    ds[i].first = n * i / g.nthreads;
+    ds[i].n = n * (i + 1) / g.nthreads - ds[i].first;
+    ds[i].rng = mix(seed + i + 1) | 1;
+    if (g.nthreads == 1) {
+      dump_main(&ds[i]);
+    } else {
+      rv = pthread_create(&ds[i].tid, NULL, dump_main, &ds[i]);
+      if (rv != 0) complain(EXIT_FAILURE, 0, "!pthread_create rv=%d", rv);
+    }
+  }
+  memset(&st, 0, sizeof(st));
+  for (int i = 0; i < g.nthreads; i++) {
+    if (g.nthreads != 1) pthread_join(ds[i].tid, NULL);
+    st.ops += ds[i].st.ops;
+    st.bytes += ds[i].st.bytes;
+    for (int b = 0; b < LAT_BUCKETS; b++) st.hist[b] += ds[i].st.hist[b];
   }
 
   closedir(dir);
+  report_phase(epoch, "dump", double(now() - t0) / 1000000, &st);
 }